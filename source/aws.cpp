@@ -3,15 +3,30 @@
 
 #include "aws.h"
 #include "image.h"
+#include "distance.h"
+#include "index.h"
+#include "server.h"
+#include "pipeline.h"
 
 #include "opencv/cvaux.h"
 #include "opencv/highgui.h"
 
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <map>
+#include <list>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
 #include <ctime>
+#include <stdexcept>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
@@ -29,6 +44,10 @@
 #define IMAGE_TABLE_ATTR_DOMAIN		"domain"
 #define IMAGE_TABLE_ATTR_NEXTID 	"nextid"
 #define IMAGE_TABLE_ATTR_EIGENSPACE "eigenspace"
+#define IMAGE_TABLE_ATTR_SHARDSIZE	"shardsize"
+#define IMAGE_TABLE_ATTR_ENCODING	"encoding"
+#define IMAGE_TABLE_ATTR_INDEX		"index"
+#define IMAGE_TABLE_ATTR_GRAPH		"graph"
 
 const char *IMAGE_ATTRS[] = {
 	IMAGE_ATTR_NAME,
@@ -44,22 +63,80 @@ const char *IMAGE_TABLE_ATTRS[] = {
 	IMAGE_TABLE_ATTR_DOMAIN,
 	IMAGE_TABLE_ATTR_NEXTID,
 	IMAGE_TABLE_ATTR_EIGENSPACE,
+	IMAGE_TABLE_ATTR_SHARDSIZE,
+	IMAGE_TABLE_ATTR_ENCODING,
+	IMAGE_TABLE_ATTR_INDEX,
+	IMAGE_TABLE_ATTR_GRAPH,
 	NULL
 };
 
 static const char *ACCESS_KEY_ENV = "AWS_ACCESS_KEY_ID";
 static const char *SECRET_ACCESS_KEY_ENV = "AWS_SECRET_ACCESS_KEY";
+static const char *POOL_SIZE_ENV = "CVDB_POOL_SIZE";
+static const size_t DEFAULT_POOL_SIZE = 8;
+static const char *CACHE_DIR_ENV = "CVDB_CACHE_DIR";
+static const char *DEFAULT_CACHE_DIR = "/tmp/cvdb-cache";
+static const char *CACHE_SIZE_ENV = "CVDB_CACHE_SIZE";
+static const size_t DEFAULT_CACHE_SIZE = 1024; // MB
+static const char *STORAGE_ENV = "CVDB_STORAGE";
+static const char *DEFAULT_STORAGE = "aws";
+static const char *LOCAL_STORAGE_PREFIX = "local:";
+static const char *STORAGE_LATENCY_ENV = "CVDB_STORAGE_LATENCY";
+static const char *STORAGE_BANDWIDTH_ENV = "CVDB_STORAGE_BANDWIDTH";
+static const char *QUEUE_ENV = "CVDB_QUEUE";
+static const char *DEFAULT_QUEUE = "sqs";
+static const char *SPOOL_QUEUE_PREFIX = "spool:";
+static const char *TASK_QUEUE_NAME = "tasks";
+static const char *RESULT_QUEUE_NAME = "results";
+static const size_t MAX_QUEUE_NAME = 80;	// characters, as SQS allows
 static const char *IMAGE_CATALOG_SUFFIX = "images";
 static const char *EIGEN_PREFIX = "eigen";
+static const char *SHARD_PREFIX = "shards";
+static const char *EIGENSPACE_FORMAT = "space-%d.peig";
+static const char *PARTIAL_FORMAT = "partial-%d-%d.psketch";
+static const char *INDEX_NAME = "features.pindex";
+static const char *GRAPH_NAME = "features.pgraph";
 static const char *SERIAL_DELIM = " ";
 
-static const char *EVENT_SDB_GET = "sdbget";
-static const char *EVENT_SDB_PUT = "sdbput";
-static const char *EVENT_S3_GET = "s3get";
-static const char *EVENT_S3_PUT = "s3put";
-static const char *EVENT_EIGEN_TRAIN = "eigentrain";
-static const char *EVENT_EIGEN_LEARN = "eigenlearn";
-static const char *EVENT_TOTAL = "total";
+/* images scored per block by query when the table has no shards */
+static const int QUERY_BLOCK_SIZE = 1024;
+
+/* bytes read from an S3 response at a time by get_buffer */
+static const size_t S3_READ_BLOCK = 64*1024;
+
+/* seconds between receives from an empty SQS queue */
+static const double SQS_POLL = 0.5;
+
+/* SimpleDB allows at most 20 values in an in() comparison, and returns at
+ * most 2500 items per Select page */
+static const int SELECT_IN_SIZE = 20;
+static const int SELECT_LIMIT = 2500;
+
+/* images folded into the eigenspace by each step of an update */
+static const int UPDATE_BATCH = 64;
+
+/* defaults of index: 4 sqrt(n) lists, trained on 32 vectors per list,
+ * with a product quantizer slice for every 4 dimensions */
+static const double INDEX_LISTS_PER_ROOT = 4;
+static const int INDEX_SAMPLE_PER_LIST = 32;
+static const int INDEX_SLICE_WIDTH = 4;
+
+/* candidates re-ranked per neighbour by an indexed query, by default */
+static const int INDEX_SHORTLIST_FACTOR = 10;
+
+/* profiled events, with what their amounts count */
+static const int EVENT_SDB_GET = Profiler::event("sdbget");
+static const int EVENT_SDB_PUT = Profiler::event("sdbput");
+static const int EVENT_SDB_SELECT = Profiler::event("sdbselect", "images");
+static const int EVENT_S3_GET = Profiler::event("s3get", "bytes");
+static const int EVENT_S3_PUT = Profiler::event("s3put", "bytes");
+static const int EVENT_EIGEN_TRAIN = Profiler::event("eigentrain", "images");
+static const int EVENT_EIGEN_LEARN = Profiler::event("eigenlearn", "images");
+static const int EVENT_INDEX_TRAIN = Profiler::event("indextrain", "vectors");
+static const int EVENT_INDEX_SEARCH = Profiler::event("indexsearch", "lists");
+static const int EVENT_GRAPH_INSERT = Profiler::event("graphinsert", "images");
+static const int EVENT_GRAPH_SEARCH = Profiler::event("graphsearch", "candidates");
+static const int EVENT_TOTAL = Profiler::event("total");
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
@@ -71,53 +148,158 @@ static char*
 get_secret_key();
 
 static void
-upload_image_eigen(S3ConnectionPtr s3conn, ImageMetadata *meta);
+upload_image_eigen(ObjectStore& objstore, ImageMetadata *meta);
 
 static void
-load_image_eigen(S3ConnectionPtr s3conn, ImageMetadata *meta);
+load_image_eigen(ObjectStore& objstore, ImageMetadata *meta);
 
 static void
-upload_image_table_eigenspace(S3ConnectionPtr s3conn, ImageTableMetadata *meta);
+shard_range(ImageTableMetadata *meta, int shard, std::pair<int, int>& ids);
 
 static void
-load_image_table_eigenspace(S3ConnectionPtr s3conn, ImageTableMetadata *meta);
+upload_image_eigen_shard(ObjectStore& objstore, ImageTableMetadata *meta,
+		int shard, FeatureBlock *block);
+
+static FeatureBlock *
+load_image_eigen_shard(ObjectStore& objstore, ImageTableMetadata *meta, int shard);
+
+static FeatureBlock *
+new_feature_block(ImageTableMetadata *meta, int first, int last);
+
+static void
+load_image_features(ObjectStore& objstore, ImageMetadata *meta);
+
+static int
+block_last(ImageTableMetadata *meta, int first, std::pair<int, int> range);
+
+static void
+rerank_features(ObjectStore& objstore, ImageTableMetadata *meta,
+		const float *query, const Neighbors& shortlist, Neighbors& neighbors);
+
+static void
+upload_image_table_index(ObjectStore& objstore, ImageTableMetadata *meta,
+		FeatureIndex *index);
+
+static FeatureIndex *
+load_image_table_index(ObjectStore& objstore, ImageTableMetadata *meta);
+
+static void
+upload_image_table_graph(ObjectStore& objstore, ImageTableMetadata *meta,
+		GraphIndex *graph);
+
+static GraphIndex *
+load_image_table_graph(ObjectStore& objstore, ImageTableMetadata *meta);
 
 static void
-serial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::string& val);
+score_features(FeatureBlock *block, const float *query, Neighbors& neighbors,
+		int first=0);
 
 static void
-deserial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::string& val);
+upload_image_table_eigenspace(ObjectStore& objstore, ImageTableMetadata *meta);
 
 static void
-serial_image_meta(ImageMetadata *meta, const char* attr, std::string& val);
+load_image_table_eigenspace(ObjectStore& objstore, ImageTableMetadata *meta);
 
 static void
-deserial_image_meta(ImageMetadata *meta, const char* attr, std::string& val);
+load_image_table_eigenfaces(ObjectStore& objstore, ImageTableMetadata *meta);
+
+static std::string
+eigenspace_cache_key(ImageTableMetadata *meta, const std::string& key);
+
+static std::string
+eigenspace_tag(ImageTableMetadata *meta, bool sharded);
+
+static char *
+get_object_buffer(ObjectStore& objstore, const std::string& bucket,
+		const std::string& key, size_t& size);
 
 static IplImage*
-load_image(S3ConnectionPtr s3conn, ImageMetadata *meta);
+load_image(ObjectStore& objstore, ImageMetadata *meta, size_t resolution,
+		size_t& bytes);
 
 static IplImage*
-load_staged_image(S3ConnectionPtr s3conn, const std::string& key);
+fetch_image(ImageMetadata *meta, size_t resolution, size_t& bytes);
 
+static Eigenspace *
+train_in_memory(Profiler& profiler, std::vector<ImageMetadata*>& metas,
+		size_t resolution, size_t window, int ncomponents, double variance);
+
+static Eigenspace *
+train_streaming(Profiler& profiler, std::vector<ImageMetadata*>& metas,
+		size_t resolution, size_t window, int ncomponents, double variance,
+		int passes);
+
+static void
+sketch_images(Profiler& profiler, std::vector<ImageMetadata*>& metas,
+		size_t resolution, size_t window, EigenspaceSketch& sketch, int pass);
+
+static void
+publish_eigenspace(Profiler& profiler, MetadataStore& metastore,
+		ImageTableMetadata *tablemeta, Eigenspace *eigenspace);
+
+static std::string
+new_train_id();
+
+static FeatureRotation *
+load_feature_rotation(ObjectStore& objstore, ImageTableMetadata *meta,
+		int version);
+
+static FeatureBlock *
+reproject_image_eigen_shard(ObjectStore& objstore, ImageTableMetadata *meta,
+		int shard, std::map<int, FeatureRotation*>& rotations, int& last);
+
+static bool
+reproject_image_eigen(ObjectStore& objstore, ImageMetadata *meta,
+		std::map<int, FeatureRotation*>& rotations, int from);
+
+static bool
+read_image_eigen(const std::string& data, std::vector<float>& features,
+		int& version);
+
+/* One thread's share of a learn */
+typedef struct LearnTask
+{
+	std::vector<ImageMetadata*> metas;
+	std::pair<int, int> range;
+	size_t window;
+	size_t batch;
+	GraphIndex *graph;		// shared, or NULL
+	int graphfirst;			// first id to insert into it
+	long failures;
+	std::string error;
+	Profiler *profiler;		// shared
+} LearnTask;
+
+static void *
+run_learn_task(void *arg);
 
 static void
-upload_staged_image(S3ConnectionPtr s3conn, IplImage *image, const std::string& key);
+learn_images(Profiler& profiler, ImagePrefetcher& prefetcher,
+		Projector& projector, size_t nimages, float features[]);
+
+static IplImage*
+load_staged_image(ObjectStore& objstore, const std::string& key,
+		const std::string& tag);
+
 
 
 static void
-upload_image_table_meta(SDBConnectionPtr sdbconn,
+upload_image_table_meta(MetadataStore& metastore,
 		ImageTableMetadata *meta,
 		const char **attrs=NULL);
 
 static void
-load_image_table_meta(SDBConnectionPtr sdbconn, ImageTableMetadata *meta);
+load_image_table_meta(MetadataStore& metastore, ImageTableMetadata *meta);
 
 static void
-upload_image_meta(SDBConnectionPtr sdbconn, ImageMetadata *meta, const char **attrs=NULL);
+upload_image_meta(MetadataStore& metastore, ImageMetadata *meta, const char **attrs=NULL);
 
 static void
-load_image_meta(SDBConnectionPtr sdbconn, ImageMetadata *meta);
+load_image_meta(MetadataStore& metastore, ImageMetadata *meta);
+
+static void
+load_image_metas(MetadataStore& metastore, ImageTableMetadata *tablemeta,
+		std::pair<int, int> range, std::vector<ImageMetadata*>& metas);
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
@@ -138,392 +320,2183 @@ sdbconnect()
 	return sdbconn;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////
-
-#define USECS_PER_SEC 1000000LL
-
-static float
-timeval_diff(timeval &start, timeval &stop)
+SQSConnectionPtr
+sqsconnect()
 {
-	timeval diff;
-	diff.tv_sec = stop.tv_sec - start.tv_sec ;
-	diff.tv_usec = stop.tv_usec - start.tv_usec;
+	AWSConnectionFactory* factory = AWSConnectionFactory::getInstance();
+	SQSConnectionPtr sqsconn = factory->createSQSConnection(get_access_key(), get_secret_key());
+	return sqsconn;
+}
 
-	while (diff.tv_usec < 0) {
-		diff.tv_usec += USECS_PER_SEC;
-	    diff.tv_sec -= 1;
+static size_t
+default_pool_size()
+{
+	const char *size = getenv(POOL_SIZE_ENV);
+	if (size != NULL && atoi(size) > 0) {
+		return atoi(size);
 	}
-
-	float secs = (float)diff.tv_sec + (double)diff.tv_usec/(double)USECS_PER_SEC;
-	return secs;
+	return DEFAULT_POOL_SIZE;
 }
 
-const char *Profiler::DELIM = " ";
+static S3ConnectionPool S3_POOL(s3connect, default_pool_size());
+static SDBConnectionPool SDB_POOL(sdbconnect, default_pool_size());
 
-Profiler::Profiler()
+S3ConnectionPool&
+s3pool()
 {
-	// create a profile filename with a timestamp
-	time_t rawtime;
-	time (&rawtime);
-	struct tm * timeinfo = localtime(&rawtime);
-	char buf[128];
-	strftime(buf, 128, "%Y-%j_%H-%M-%S.prof", timeinfo);
-	filename.assign(buf);
+	return S3_POOL;
 }
 
-Profiler::~Profiler()
+SDBConnectionPool&
+sdbpool()
 {
-	flush();
+	return SDB_POOL;
 }
 
 void
-Profiler::start()
+set_pool_size(size_t size)
 {
-	Timer timer;
-	timeval t;
-	gettimeofday(&t,NULL);
-	timer.start = t;
-	timers.push_back(timer);
+	S3_POOL.resize(size);
+	SDB_POOL.resize(size);
 }
 
-void
-Profiler::stop(const std::string& val)
+/* Quotes a SimpleDB name (with `) or value (with ') */
+static std::string
+sdb_quote(const std::string& s, char quote)
 {
-	assert(timers.size() > 0);
-	timeval t;
-	gettimeofday(&t,NULL);
-	Timer timer = timers.back();
-	timer.stop = t;
-	float elapsed = timeval_diff(timer.start, timer.stop);
-	timers.pop_back();
-	events.push_back(std::pair<float, std::string>(elapsed, val));
+	std::string quoted(1, quote);
+	for (size_t i=0;  i<s.size();  ++i) {
+		quoted += s[i];
+		if (s[i] == quote) {
+			quoted += quote;
+		}
+	}
+	quoted += quote;
+	return quoted;
 }
 
-void
-Profiler::flush()
+/* S3, each request on a connection from the pool. A response reads from
+ * its connection, so it is copied out and dropped before the connection
+ * goes back to the pool, where another thread may take it. */
+class S3ObjectStore : public ObjectStore
 {
-	char buf[16];
-	std::ofstream outs;
-	outs.open(filename.c_str(), std::fstream::out | std::fstream::app);
-	for (size_t i=0;  i<events.size();  ++i) {
-		std::pair<float, std::string> event = events[i];
-		sprintf(buf, "%.9f", event.first);
-		outs << buf;
-		outs << Profiler::DELIM;
-		outs << event.second;
-		outs << std::endl;
+public:
+	virtual void get(const std::string& bucket, const std::string& key,
+			std::string& data)
+	{
+		PooledS3Connection s3conn(S3_POOL);
+		try {
+			GetResponsePtr res = s3conn->get(bucket, key);
+			std::stringstream outs;
+			outs << res->getInputStream().rdbuf();
+			data = outs.str();
+		} catch (GetException &e) {
+			throw ObjectNotFound(bucket, key);
+		}
 	}
-	events.clear();
-	outs.close();
-}
 
-///////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////
+	/* The response is read in blocks, since its size is not known up
+	 * front, then copied once into the buffer */
+	virtual char *get_buffer(const std::string& bucket, const std::string& key,
+			void *(*alloc)(size_t), size_t& size)
+	{
+		std::list< std::vector<char> > blocks;
+		size = 0;
+		PooledS3Connection s3conn(S3_POOL);
+		try {
+			GetResponsePtr res = s3conn->get(bucket, key);
+			std::istream& ins = res->getInputStream();
+			while (ins) {
+				blocks.push_back(std::vector<char>(S3_READ_BLOCK));
+				ins.read(&blocks.back()[0], S3_READ_BLOCK);
+				blocks.back().resize(ins.gcount());
+				size += ins.gcount();
+			}
+		} catch (GetException &e) {
+			throw ObjectNotFound(bucket, key);
+		}
+		char *data = (char*)alloc(std::max(size, (size_t)1));
+		char *to = data;
+		for (std::list< std::vector<char> >::const_iterator it=blocks.begin();
+				it!=blocks.end();  ++it) {
+			if (!it->empty()) {
+				memcpy(to, &(*it)[0], it->size());
+				to += it->size();
+			}
+		}
+		return data;
+	}
 
-const char *CVDB::BUCKET = "cloudvision";
-const char *CVDB::CATALOG = "cloudvision";
+	virtual void put(const std::string& bucket, const std::string& key,
+			const std::string& data)
+	{
+		PooledS3Connection s3conn(S3_POOL);
+		std::istringstream ins(data);
+		PutResponsePtr res = s3conn->put(bucket, key, ins, "binary/octet-stream");
+	}
 
+	virtual void del(const std::string& bucket, const std::string& key)
+	{
+		PooledS3Connection s3conn(S3_POOL);
+		DeleteResponsePtr res = s3conn->del(bucket, key);
+	}
+};
 
-int
-CVDB::train(const int table, size_t resolution, std::pair<int, int> range)
+/* SimpleDB, each request on a connection from the pool, whose responses
+ * (down to the next page token) are copied out as S3ObjectStore's are */
+class SimpleDBMetadataStore : public MetadataStore
 {
-	profiler.start(); // EVENT_TOTAL
-	SDBConnectionPtr sdbconn = sdbconnect();
-	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
-	profiler.start();
-	load_image_table_meta(sdbconn, tablemeta);
-	profiler.stop(EVENT_SDB_GET);
+public:
+	virtual void create_domain(const std::string& domain)
+	{
+		PooledSDBConnection sdbconn(SDB_POOL);
+		CreateDomainResponsePtr res = sdbconn->createDomain(domain);
+	}
 
-	// load image metadata
-	std::vector<ImageMetadata*> metas;
-	for (int i=range.first;  i<=range.second;  ++i) {
-		ImageMetadata *meta = new ImageMetadata(i);
-		meta->imagetable = tablemeta;
-		profiler.start();
-		load_image_meta(sdbconn, meta);
-		profiler.stop(EVENT_SDB_GET);
-		metas.push_back(meta);
+	virtual void put_attributes(const std::string& domain,
+			const std::string& item, const Attributes& attrs)
+	{
+		std::vector<Attribute> awsattrs;
+		for (size_t i=0;  i<attrs.size();  ++i) {
+			awsattrs.push_back(Attribute(attrs[i].first, attrs[i].second, true));
+		}
+		PooledSDBConnection sdbconn(SDB_POOL);
+		PutAttributesResponsePtr res = sdbconn->putAttributes(domain, item, awsattrs);
 	}
-	assert(metas.size() > 0);
 
-	// load images
-	S3ConnectionPtr s3conn = s3connect();
-	size_t nimages = metas.size();
-	IplImage **images = new IplImage*[nimages];
-	char buf[32];
-	for (size_t i=0;  i<nimages;  ++i) {
-		std::string key(tablemeta->prefix);
-		key += "/";
-		key += metas[i]->name;
-		profiler.start();
-		images[i] = load_image(s3conn, metas[i]);
-		sprintf(buf, "%d", (images[i]->imageSize)/1000);
-		std::string val(EVENT_S3_GET);
-		val += Profiler::DELIM;
-		val += buf;
-		profiler.stop(val);
+	virtual void get_attributes(const std::string& domain,
+			const std::string& item, Attributes& attrs)
+	{
+		attrs.clear();
+		PooledSDBConnection sdbconn(SDB_POOL);
+		GetAttributesResponsePtr res = sdbconn->getAttributes(domain, item, "");
+		res->open();
+		AttributePair attr;
+		while (res->next(attr)) {
+			attrs.push_back(attr);
+		}
+		res->close();
 	}
 
-	// initialize eigenspace
-	if (tablemeta->eigenspace != NULL) {
-		delete tablemeta->eigenspace;
-		tablemeta->eigenspace = NULL;
+	virtual bool select_between(const std::string& domain,
+			const std::string& first, const std::string& last,
+			Items& items)
+	{
+		char buf[32];
+		sprintf(buf, " limit %d", SELECT_LIMIT);
+		return select("select * from " + sdb_quote(domain, '`')
+				+ " where itemName() between " + sdb_quote(first, '\'')
+				+ " and " + sdb_quote(last, '\'') + buf, items);
 	}
-	sprintf(buf, "%u", nimages);
-	std::string val(EVENT_EIGEN_TRAIN);
-	val += Profiler::DELIM;
-	val += buf;
-	profiler.start();
-	tablemeta->eigenspace = create_eigen_space(nimages, images, resolution);
-	profiler.stop(val);
 
-	// upload eigenspace
-	const char *attrs[] = { IMAGE_TABLE_ATTR_EIGENSPACE, NULL };
-	profiler.start();
-	upload_image_table_meta(sdbconn, tablemeta, attrs);
-	profiler.stop(EVENT_SDB_PUT);
-	long total_size = 0;
-	for (int i=0;  i<tablemeta->eigenspace->dimension;  ++i) {
-		total_size += tablemeta->eigenspace->eigenfaces[i]->imageSize;
+	virtual bool select_in(const std::string& domain,
+			const std::vector<std::string>& names, Items& items)
+	{
+		char buf[32];
+		sprintf(buf, ") limit %d", SELECT_LIMIT);
+		bool selected = true;
+		for (size_t first=0;  first<names.size();  first+=SELECT_IN_SIZE) {
+			std::string expr("select * from " + sdb_quote(domain, '`')
+					+ " where itemName() in (");
+			size_t last = std::min(first + SELECT_IN_SIZE, names.size());
+			for (size_t i=first;  i<last;  ++i) {
+				if (i > first) {
+					expr += ", ";
+				}
+				expr += sdb_quote(names[i], '\'');
+			}
+			expr += buf;
+			selected = select(expr, items) && selected;
+		}
+		return selected;
 	}
-	sprintf(buf, "%lu", total_size/1000);
-	val.assign(EVENT_S3_PUT);
-	val += Profiler::DELIM;
-	val += buf;
-	profiler.start();
-	upload_image_table_eigenspace(s3conn, tablemeta);
-	profiler.stop(val);
 
-	// clean up
-	delete tablemeta;
-	for (size_t i=0;  i<nimages;  ++i) {
-		cvReleaseImage(&(images[i]));
+private:
+	/* Runs a paged Select, returning false if SimpleDB rejected it */
+	bool select(const std::string& expr, Items& items)
+	{
+		PooledSDBConnection sdbconn(SDB_POOL);
+		std::string token;
+		try {
+			do {
+				SelectResponsePtr res = sdbconn->select(expr, token);
+				res->open();
+				SelectResponse::Item item;
+				while (res->next(item)) {
+					items.push_back(std::make_pair(item.first,
+							Attributes(item.second.begin(), item.second.end())));
+				}
+				res->close();
+				token = res->hasNextToken() ? res->getNextToken() : "";
+			} while (token.size() > 0);
+		} catch (SDBException &e) {
+			return false;
+		}
+		return true;
 	}
-	delete[] images;
-	for (size_t i=0;  i<metas.size();  ++i) {
-		delete metas[i];
+};
+
+/* The queues of scheduler.py. libaws base64 encodes and decodes message
+ * bodies, as boto's JSONMessage does. Tasks for worker W are in the queue
+ * tasks-W, and the handle of a task is its queue's URL and its receipt
+ * handle. */
+class SQSTaskQueue : public TaskQueue
+{
+public:
+	SQSTaskQueue()
+	  : sqsconn(sqsconnect())
+	{
+		taskurls.push_back(sqsconn->createQueue(TASK_QUEUE_NAME, VISIBILITY)->getQueueURL());
+		resulturl = sqsconn->createQueue(RESULT_QUEUE_NAME, VISIBILITY)->getQueueURL();
 	}
 
-	profiler.stop(EVENT_TOTAL);
-	profiler.flush();
+	virtual void put_task(const std::string& body)
+	{
+		sqsconn->sendMessage(taskurls.back(), body);
+	}
 
-	return EXIT_SUCCESS;
+	virtual void listen(const std::string& worker)
+	{
+		std::string name(TASK_QUEUE_NAME);
+		name += "-" + worker;
+		if (name.size() > MAX_QUEUE_NAME) {
+			throw std::runtime_error("worker id too long for a queue: " + worker);
+		}
+		workerurl = sqsconn->createQueue(name, VISIBILITY)->getQueueURL();
+		taskurls.insert(taskurls.begin(), workerurl);
+	}
+
+	virtual void stop()
+	{
+		if (workerurl.empty()) {
+			return;
+		}
+		taskurls.erase(taskurls.begin());
+		try {
+			sqsconn->deleteQueue(workerurl);
+		} catch (SQSException &e) {
+			// the master deleted it first
+		}
+		workerurl.clear();
+	}
+
+	virtual bool next_task(std::string& body, std::string& handle, double timeout)
+	{
+		double waited = 0;
+		while (true) {
+			for (size_t i=0;  i<taskurls.size();  ++i) {
+				std::string receipt;
+				bool received;
+				try {
+					received = receive(taskurls[i], body, receipt);
+				} catch (SQSException &e) {
+					if (taskurls[i] != workerurl) {
+						throw;
+					}
+					// the master deleted it as it stopped, so only shared
+					// tasks are left to take
+					taskurls.erase(taskurls.begin() + i--);
+					workerurl.clear();
+					continue;
+				}
+				if (received) {
+					handle = taskurls[i] + HANDLE_SEPARATOR + receipt;
+					return true;
+				}
+			}
+			if (waited >= timeout) {
+				return false;
+			}
+			usleep((useconds_t)(SQS_POLL*1000000));
+			waited += SQS_POLL;
+		}
+	}
+
+	virtual void complete(const std::string& handle, const std::string& result)
+	{
+		if (!result.empty()) {
+			put_result(result);
+		}
+		size_t separator = handle.find(HANDLE_SEPARATOR);
+		assert(separator != std::string::npos);
+		sqsconn->deleteMessage(handle.substr(0, separator), handle.substr(separator + 1));
+	}
+
+	virtual void put_result(const std::string& body)
+	{
+		sqsconn->sendMessage(resulturl, body);
+	}
+
+	virtual bool get_result(std::string& body)
+	{
+		std::string handle;
+		if (!receive(resulturl, body, handle)) {
+			return false;
+		}
+		sqsconn->deleteMessage(resulturl, handle);
+		return true;
+	}
+
+private:
+	static const char HANDLE_SEPARATOR = ' ';
+
+	bool receive(const std::string& url, std::string& body, std::string& handle)
+	{
+		ReceiveMessageResponsePtr res = sqsconn->receiveMessage(url, 1);
+		res->open();
+		ReceiveMessageResponse::Message message;
+		bool received = res->next(message);
+		res->close();
+		if (received) {
+			body = message.message_body;
+			handle = message.receipt_handle;
+		}
+		return received;
+	}
+
+	SQSConnectionPtr sqsconn;
+	std::vector<std::string> taskurls;	// taken from in order, the shared one last
+	std::string workerurl;	// the first of them while listening
+	std::string resulturl;
+};
+
+static std::string
+storage_spec()
+{
+	const char *spec = getenv(STORAGE_ENV);
+	return std::string(spec != NULL ? spec : DEFAULT_STORAGE);
 }
 
-int
-CVDB::learn(const int table, std::pair<int, int> range)
+static double
+storage_env(const char *name)
 {
-	profiler.start(); // EVENT_TOTAL
-	// load table
-	SDBConnectionPtr sdbconn = sdbconnect();
-	S3ConnectionPtr s3conn = s3connect();
-	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
-	profiler.start();
-	load_image_table_meta(sdbconn, tablemeta);
-	profiler.stop(EVENT_SDB_GET);
-	profiler.start();
-	load_image_table_eigenspace(s3conn, tablemeta);
-	char buf[32];
-	long total_size = 0;
-	for (int i=0;  i<tablemeta->eigenspace->dimension;  ++i) {
-		total_size += tablemeta->eigenspace->eigenfaces[i]->imageSize;
-	}
-	sprintf(buf, "%lu", total_size/1000);
-	std::string val(EVENT_S3_GET);
-	val += Profiler::DELIM;
-	val += buf;
-	profiler.stop(val);
+	const char *value = getenv(name);
+	return (value != NULL && atof(value) > 0) ? atof(value) : 0;
+}
 
-	// to conserve memory, process one image at a time
-	for (int i=range.first;  i<=range.second;  ++i) {
+static ObjectStore *OBJECT_STORE = NULL;
+static MetadataStore *METADATA_STORE = NULL;
+static pthread_once_t STORES_ONCE = PTHREAD_ONCE_INIT;
 
-		// load image metadata
-		ImageMetadata meta(i);
-		meta.imagetable = tablemeta;
-		profiler.start();
-		load_image_meta(sdbconn, &meta);
-		profiler.stop(EVENT_SDB_GET);
+/* Leaves the stores NULL if the spec names no backend */
+static void
+open_stores()
+{
+	std::string spec(storage_spec());
+	size_t prefix = strlen(LOCAL_STORAGE_PREFIX);
+	if (spec == DEFAULT_STORAGE) {
+		OBJECT_STORE = new S3ObjectStore();
+		METADATA_STORE = new SimpleDBMetadataStore();
+	} else if (spec == "memory") {
+		OBJECT_STORE = new MemoryObjectStore();
+		METADATA_STORE = new MemoryMetadataStore();
+	} else if (spec.compare(0, prefix, LOCAL_STORAGE_PREFIX) == 0
+			&& spec.size() > prefix) {
+		OBJECT_STORE = new LocalObjectStore(spec.substr(prefix));
+		METADATA_STORE = new LocalMetadataStore(spec.substr(prefix));
+	} else {
+		return;
+	}
+	double latency = storage_env(STORAGE_LATENCY_ENV);
+	double bandwidth = storage_env(STORAGE_BANDWIDTH_ENV);
+	if (latency > 0 || bandwidth > 0) {
+		OBJECT_STORE = new ThrottledObjectStore(OBJECT_STORE, latency, bandwidth);
+		METADATA_STORE = new ThrottledMetadataStore(METADATA_STORE, latency, bandwidth);
+	}
+}
 
-		// load image
-		std::string key(tablemeta->prefix);
-		key += "/";
-		key += meta.name;
-		profiler.start();
-		IplImage *image = load_image(s3conn, &meta);
-		sprintf(buf, "%d", (image->imageSize)/1000);
-		std::string val(EVENT_S3_GET);
-		val += Profiler::DELIM;
-		val += buf;
-		profiler.stop(val);
-
-		// calculate features
-		sprintf(buf, "%d", tablemeta->eigenspace->dimension);
-		val.assign(EVENT_EIGEN_LEARN);
-		val += Profiler::DELIM;
-		val += buf;
-		meta.features = new float[tablemeta->eigenspace->dimension];
-		profiler.start();
-		decomposite(tablemeta->eigenspace, image, meta.features);
-		profiler.stop(val);
-
-		// upload features
-		sprintf(buf, "%d", sizeof(float)*tablemeta->eigenspace->dimension/1000);
-		val.assign(EVENT_S3_PUT);
-		val += Profiler::DELIM;
-		val += buf;
-		profiler.start();
-		upload_image_eigen(s3conn, &meta);
-		profiler.stop(val);
+ObjectStore&
+object_store()
+{
+	pthread_once(&STORES_ONCE, open_stores);
+	if (OBJECT_STORE == NULL) {
+		throw std::runtime_error("unknown storage " + storage_spec());
+	}
+	return *OBJECT_STORE;
+}
 
-		// clean up
-		cvReleaseImage(&image);
+MetadataStore&
+metadata_store()
+{
+	pthread_once(&STORES_ONCE, open_stores);
+	if (METADATA_STORE == NULL) {
+		throw std::runtime_error("unknown storage " + storage_spec());
 	}
+	return *METADATA_STORE;
+}
 
-	delete tablemeta;
-	profiler.stop(EVENT_TOTAL);
+static std::string
+queue_spec()
+{
+	const char *spec = getenv(QUEUE_ENV);
+	return std::string(spec != NULL ? spec : DEFAULT_QUEUE);
+}
 
-	return EXIT_SUCCESS;
+static TaskQueue *TASK_QUEUE = NULL;
+static pthread_once_t QUEUE_ONCE = PTHREAD_ONCE_INIT;
+
+/* Leaves the queue NULL if the spec names no backend */
+static void
+open_task_queue()
+{
+	std::string spec(queue_spec());
+	size_t prefix = strlen(SPOOL_QUEUE_PREFIX);
+	if (spec == DEFAULT_QUEUE) {
+		TASK_QUEUE = new SQSTaskQueue();
+	} else if (spec.compare(0, prefix, SPOOL_QUEUE_PREFIX) == 0
+			&& spec.size() > prefix) {
+		TASK_QUEUE = new SpoolTaskQueue(spec.substr(prefix));
+	}
 }
 
-int
-CVDB::query(int tableid, int imageid, std::pair<int, int> range, std::ostream& outs)
+TaskQueue&
+task_queue()
 {
-	profiler.start(); // EVENT_TOTAL
+	pthread_once(&QUEUE_ONCE, open_task_queue);
+	if (TASK_QUEUE == NULL) {
+		throw std::runtime_error("unknown queue " + queue_spec());
+	}
+	return *TASK_QUEUE;
+}
 
-	// load table
-	SDBConnectionPtr sdbconn = sdbconnect();
-	S3ConnectionPtr s3conn = s3connect();
-	ImageTableMetadata *tablemeta = new ImageTableMetadata(tableid);
-	load_image_table_meta(sdbconn, tablemeta);
+static std::string
+default_cache_dir()
+{
+	const char *dir = getenv(CACHE_DIR_ENV);
+	return std::string(dir != NULL ? dir : DEFAULT_CACHE_DIR);
+}
 
-	// load query image
-	int vector_size = sizeof(float)*tablemeta->eigenspace->dimension/1000;
-	ImageMetadata query_meta(imageid);
-	query_meta.imagetable = tablemeta;
-	profiler.start();
-	load_image_meta(sdbconn, &query_meta);
-	profiler.stop(EVENT_SDB_GET);
-	char buf[32];
-	sprintf(buf, "%d", vector_size);
-	std::string val;
-	val.assign(EVENT_S3_GET);
-	val += Profiler::DELIM;
-	val += buf;
-	profiler.start();
-	load_image_eigen(s3conn, &query_meta);
-	profiler.stop(val);
+/* Local stores are not cached unless asked, since the memory store does
+ * not outlive the process but the cache does */
+static size_t
+default_cache_size()
+{
+	const char *size = getenv(CACHE_SIZE_ENV);
+	if (size != NULL && atoi(size) >= 0) {
+		return (size_t)atoi(size)*1024*1024;
+	}
+	if (storage_spec() != DEFAULT_STORAGE) {
+		return 0;
+	}
+	return DEFAULT_CACHE_SIZE*1024*1024;
+}
 
-	double min_dist = 0;
-	double min_id = 0;
+static DiskCache *OBJECT_CACHE = NULL;
+static pthread_once_t CACHE_ONCE = PTHREAD_ONCE_INIT;
 
-	// to conserve memory, process one image at a time
-	for (int i=range.first;  i<=range.second;  ++i) {
+/* Opened on first use, so that a program can choose its storage first */
+static void
+open_object_cache()
+{
+	OBJECT_CACHE = new DiskCache(default_cache_dir(), default_cache_size());
+}
 
-		// load image metadata
-		ImageMetadata meta(i);
-		meta.imagetable = tablemeta;
-		profiler.start();
-		load_image_meta(sdbconn, &meta);
-		profiler.stop(EVENT_SDB_GET);
+DiskCache&
+object_cache()
+{
+	pthread_once(&CACHE_ONCE, open_object_cache);
+	return *OBJECT_CACHE;
+}
 
-		// load vector
-		profiler.start();
-		load_image_eigen(s3conn, &meta);
-		profiler.stop(val);
+void
+get_object(ObjectStore& objstore, const std::string& bucket,
+		const std::string& key, std::string& data, const std::string& tag)
+{
+	std::string cachekey(bucket);
+	cachekey += "/";
+	cachekey += key;
+	if (!tag.empty()) {
+		cachekey += "@";
+		cachekey += tag;
+	}
+	if (object_cache().get(cachekey, data)) {
+		return;
+	}
+	objstore.get(bucket, key, data);
+	object_cache().put(cachekey, data);
+}
 
-		double dist = vector_distance(tablemeta->eigenspace->dimension,
-				query_meta.features, meta.features);
-		if (i==range.first || dist < min_dist) {
-			min_dist = dist;
-			min_id = i;
+/* Reads the first size bytes of a file into a buffer from cvAlloc,
+ * returns NULL on error */
+static char *
+read_file_buffer(const std::string& path, size_t size)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	char *data = (char*)cvAlloc(std::max(size, (size_t)1));
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = read(fd, data + done, size - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
 		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
 	}
+	close(fd);
+	if (done < size) {
+		cvFree(&data);
+		return NULL;
+	}
+	return data;
+}
 
-	// output
-	sprintf(buf, "%.6lf", min_dist);
-	outs << "{";
-	outs << imageid;
-	outs << " : ";
-	outs << "[ [";
-	outs << min_id;
-	outs << ", ";
-	outs << buf;
-	outs << "] ]";
-	outs << "}";
-	outs << std::endl;
-
-	// clean up
-	delete tablemeta;
+/* As get_object, into size bytes from cvAlloc for decode_image. A cached
+ * object is read straight from its file into the buffer, and any other
+ * goes into it by ObjectStore::get_buffer. */
+static char *
+get_object_buffer(ObjectStore& objstore, const std::string& bucket,
+		const std::string& key, size_t& size)
+{
+	std::string cachekey(bucket);
+	cachekey += "/";
+	cachekey += key;
+	std::string path;
+	if (object_cache().lookup(cachekey, path, size)) {
+		char *data = read_file_buffer(path, size);
+		if (data != NULL) {
+			return data;
+		}
+	}
+	char *data = objstore.get_buffer(bucket, key, cvAlloc, size);
+	object_cache().put(cachekey, data, size);
+	return data;
+}
 
-	profiler.stop(EVENT_TOTAL);
+/* Features and eigenfaces are rewritten in place by every train (and
+ * shards whenever the layout changes), so their cache entries are tagged
+ * with the version they belong to, and its train id since versions start
+ * again when a table is uploaded again */
+static std::string
+eigenspace_tag(ImageTableMetadata *meta, bool sharded)
+{
+	char buf[64];
+	if (sharded) {
+		sprintf(buf, "v%d.%d", meta->eigenspace->version, meta->shardsize);
+	} else {
+		sprintf(buf, "v%d", meta->eigenspace->version);
+	}
+	std::string tag(buf);
+	if (!meta->eigenspace->trainid.empty()) {
+		tag += "-";
+		tag += meta->eigenspace->trainid;
+	}
+	return tag;
+}
 
-	return EXIT_SUCCESS;
+void
+write_pool_stats(std::ostream& outs)
+{
+	outs << "s3pool" << Profiler::DELIM
+		<< S3_POOL.hits() << Profiler::DELIM
+		<< S3_POOL.misses() << std::endl;
+	outs << "sdbpool" << Profiler::DELIM
+		<< SDB_POOL.hits() << Profiler::DELIM
+		<< SDB_POOL.misses() << std::endl;
 }
 
-int
-CVDB::upload(ImageScanner *scanner,
-		const int id,
-		const std::string& s3prefix)
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Uploads the features of one image, then frees them */
+class EigenUploadJob: public Job
 {
-	SDBConnectionPtr sdbconn = sdbconnect();
-	// initialize table meta data
-	ImageTableMetadata tablemeta(id);
-	std::string domain;
-	serial_image_table_meta(&tablemeta, IMAGE_TABLE_ITEM_ID, domain);
-	std::string imgdomain(domain);
-	imgdomain += IMAGE_CATALOG_SUFFIX;
-	tablemeta.bucket = CVDB::BUCKET;
-	tablemeta.prefix = s3prefix;
-	tablemeta.imagedomain = imgdomain;
-	tablemeta.nextimageid = 1;
+public:
+	EigenUploadJob(ImageMetadata *meta) : meta(meta) { }
+
+	void run()
+	{
+		ObjectStore& objstore = object_store();
+		try {
+			upload_image_eigen(objstore, meta);
+		} catch (...) {
+			release();
+			throw;
+		}
+		release();
+	}
 
-	std::cout << "Creating: " << imgdomain << std::endl;
-	CreateDomainResponsePtr res = sdbconn->createDomain(imgdomain);
+private:
+	void release()
+	{
+		delete[] meta->features;
+		meta->features = NULL;
+	}
+
+	ImageMetadata *meta;
+};
+
+/* Uploads a shard of features, then frees it */
+class ShardUploadJob: public Job
+{
+public:
+	ShardUploadJob(ImageTableMetadata *tablemeta, int shard, FeatureBlock *block)
+	  : tablemeta(tablemeta), shard(shard), block(block) { }
+
+	~ShardUploadJob()
+	{
+		delete block;
+	}
+
+	void run()
+	{
+		ObjectStore& objstore = object_store();
+		upload_image_eigen_shard(objstore, tablemeta, shard, block);
+	}
+
+private:
+	ImageTableMetadata *tablemeta;
+	int shard;
+	FeatureBlock *block;
+};
+
+/* Inserts a block of features into a graph, concurrently with other
+ * jobs, then frees it */
+class GraphInsertJob: public Job
+{
+public:
+	GraphInsertJob(GraphIndex *graph, FeatureBlock *block)
+	  : graph(graph), block(block) { }
+
+	~GraphInsertJob()
+	{
+		delete block;
+	}
+
+	void run()
+	{
+		std::vector<float> row(block->dimension);
+		for (int id=block->first;  id<=block->last;  ++id) {
+			block->get(id, &row[0]);
+			graph->insert(id, &row[0]);
+		}
+	}
+
+private:
+	GraphIndex *graph;
+	FeatureBlock *block;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Answers query requests from a resident block of feature vectors:
+ *
+ * query IMAGEID [K [THRESHOLD]]
+ * stats
+ * shutdown
+ */
+class QueryHandler: public FrameHandler
+{
+public:
+	QueryHandler(ImageTableMetadata *tablemeta, FeatureBlock *block,
+			ObjectStore& objstore, GraphIndex *graph=NULL, size_t ef=0)
+	  : tablemeta(tablemeta), block(block), objstore(objstore), graph(graph),
+	    ef(ef), nqueries(0) { }
+
+	bool handle(const std::string& request, std::string& response);
+
+private:
+	ImageTableMetadata *tablemeta;
+	FeatureBlock *block;
+	ObjectStore& objstore;
+	GraphIndex *graph;		// searched instead of the block, if not NULL
+	size_t ef;
+	long nqueries;
+};
+
+bool
+QueryHandler::handle(const std::string& request, std::string& response)
+{
+	std::istringstream ins(request);
+	std::ostringstream outs;
+	std::string cmd;
+	ins >> cmd;
+
+	if (cmd == "query") {
+		int imageid;
+		int k = 1;
+		double threshold = -1;
+		if (!(ins >> imageid)) {
+			response.assign("error: missing image id");
+			return true;
+		}
+		ins >> k >> threshold;
+		if (k < 1) {
+			response.assign("error: k must be positive");
+			return true;
+		}
+
+		// images outside the resident range are fetched
+		ImageMetadata meta(imageid);
+		meta.imagetable = tablemeta;
+		const float *features;
+		if (imageid >= block->first && imageid <= block->last) {
+			meta.features = new float[block->dimension];
+			block->get(imageid, meta.features);
+			features = meta.features;
+		} else {
+			try {
+				load_image_features(objstore, &meta);
+			} catch (ObjectNotFound& e) {
+				response.assign("error: no features for image");
+				return true;
+			}
+			features = meta.features;
+		}
+
+		// images the graph does not hold yet are scanned
+		Neighbors neighbors(k, threshold);
+		if (graph != NULL) {
+			graph->search(features, std::max(ef, (size_t)k),
+					std::pair<int, int>(block->first, block->last), neighbors);
+			score_features(block, features, neighbors, graph->last + 1);
+		} else {
+			score_features(block, features, neighbors);
+		}
+		neighbors.write(outs, imageid);
+		++nqueries;
+	} else if (cmd == "stats") {
+		outs << "{\"first\" : " << block->first
+			<< ", \"last\" : " << block->last
+			<< ", \"dimension\" : " << block->dimension
+			<< ", \"version\" : " << block->version
+			<< ", \"encoding\" : \"" << encoding_name(block->encoding) << "\""
+			<< ", \"graph\" : " << (graph != NULL ? graph->size() : 0)
+			<< ", \"queries\" : " << nqueries << "}";
+	} else if (cmd == "shutdown") {
+		response.assign("ok");
+		return false;
+	} else {
+		outs << "error: unknown request (" << cmd << ")";
+	}
+
+	response.assign(outs.str());
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+const char *CVDB::BUCKET = "cloudvision";
+const char *CVDB::CATALOG = "cloudvision";
+
+CVDB::CVDB()
+  : warm(false)
+{
+}
+
+CVDB::~CVDB()
+{
+	std::map<int, Eigenspace*>::iterator it;
+	for (it=eigenspaces.begin();  it!=eigenspaces.end();  ++it) {
+		delete it->second;
+	}
+}
+
+void
+CVDB::keep_warm()
+{
+	warm = true;
+}
+
+void
+CVDB::abandon_events()
+{
+	profiler.abandon();
+}
+
+/* A warm eigenspace is copied, since the table metadata owns its own */
+void
+CVDB::load_eigenspace(ObjectStore& objstore, ImageTableMetadata *tablemeta)
+{
+	if (!warm) {
+		load_image_table_eigenspace(objstore, tablemeta);
+		return;
+	}
+	// versions start again when a table is uploaded again, so only the
+	// train id tells two trains of one version apart
+	Eigenspace *&eigenspace = eigenspaces[tablemeta->id];
+	if (eigenspace != NULL && eigenspace->version == tablemeta->eigenspace->version
+			&& eigenspace->trainid == tablemeta->eigenspace->trainid) {
+		delete tablemeta->eigenspace;
+		tablemeta->eigenspace = copy_eigen_space(eigenspace);
+		return;
+	}
+	load_image_table_eigenspace(objstore, tablemeta);
+	delete eigenspace;
+	eigenspace = copy_eigen_space(tablemeta->eigenspace);
+}
+
+int
+CVDB::train(const int table, size_t resolution, std::pair<int, int> range,
+		size_t window, int ncomponents, double variance, int passes)
+{
+	profiler.start(); // EVENT_TOTAL
+	MetadataStore& metastore = metadata_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+
+	// load image metadata
+	std::vector<ImageMetadata*> metas;
+	profiler.start();
+	load_image_metas(metastore, tablemeta, range, metas);
+	profiler.stop(EVENT_SDB_SELECT, range.second - range.first + 1);
+	assert(metas.size() > 0);
+
+	Eigenspace *eigenspace;
+	if (passes > 0) {
+		eigenspace = train_streaming(profiler, metas, resolution, window,
+				ncomponents, variance, passes);
+	} else {
+		eigenspace = train_in_memory(profiler, metas, resolution, window,
+				ncomponents, variance);
+	}
+	publish_eigenspace(profiler, metastore, tablemeta, eigenspace);
+
+	// clean up
+	delete tablemeta;
+	for (size_t i=0;  i<metas.size();  ++i) {
+		delete metas[i];
+	}
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return EXIT_SUCCESS;
+}
+
+int
+CVDB::train_partial(const int table, size_t resolution, std::pair<int, int> range,
+		std::ostream& outs, size_t window, int ncomponents)
+{
+	profiler.start(); // EVENT_TOTAL
+	MetadataStore& metastore = metadata_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+
+	// load image metadata
+	std::vector<ImageMetadata*> metas;
+	char buf[64];
+	profiler.start();
+	load_image_metas(metastore, tablemeta, range, metas);
+	profiler.stop(EVENT_SDB_SELECT, range.second - range.first + 1);
+	assert(metas.size() > 0);
+
+	EigenspaceSketch sketch(resolution, ncomponents);
+	sketch_images(profiler, metas, resolution, window, sketch, 0);
+
+	// upload the statistics for train-merge
+	sprintf(buf, PARTIAL_FORMAT, range.first, range.second);
+	std::string key(tablemeta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += buf;
+	std::stringstream ins;
+	sketch.write(ins);
+	ObjectStore& objstore = object_store();
+	profiler.start();
+	objstore.put(CVDB::BUCKET, key, ins.str());
+	profiler.stop(EVENT_S3_PUT, ins.str().size());
+	outs << key << std::endl;
+
+	// clean up
+	delete tablemeta;
+	for (size_t i=0;  i<metas.size();  ++i) {
+		delete metas[i];
+	}
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return EXIT_SUCCESS;
+}
+
+int
+CVDB::train_merge(const int table, const std::vector<std::string>& partials,
+		double variance)
+{
+	profiler.start(); // EVENT_TOTAL
+	MetadataStore& metastore = metadata_store();
+	ObjectStore& objstore = object_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+
+	// sum the partial statistics, one at a time; they are read once, so
+	// they bypass the object cache
+	EigenspaceSketch *sketch = NULL;
+	std::vector<std::string> keys;
+	for (size_t i=0;  i<partials.size();  ++i) {
+		if (std::find(keys.begin(), keys.end(), partials[i]) != keys.end()) {
+			continue; // a rescheduled chunk
+		}
+		keys.push_back(partials[i]);
+		profiler.start();
+		std::string data;
+		objstore.get(CVDB::BUCKET, partials[i], data);
+		profiler.stop(EVENT_S3_GET, data.size());
+		std::istringstream ins(data);
+		EigenspaceSketch *partial = EigenspaceSketch::read(ins);
+		if (partial == NULL) {
+			delete sketch;
+			delete tablemeta;
+			throw std::runtime_error("invalid partial statistics: " + partials[i]);
+		}
+		if (sketch == NULL) {
+			sketch = partial;
+		} else {
+			bool merged = sketch->merge(*partial);
+			delete partial;
+			if (!merged) {
+				delete sketch;
+				delete tablemeta;
+				throw std::runtime_error("mismatched partial statistics: " + partials[i]);
+			}
+		}
+	}
+	assert(sketch != NULL && sketch->size() > 0);
+
+	profiler.start();
+	Eigenspace *eigenspace = sketch->create(variance);
+	profiler.stop(EVENT_EIGEN_TRAIN, sketch->size());
+	delete sketch;
+	publish_eigenspace(profiler, metastore, tablemeta, eigenspace);
+
+	// the partials are only removed once the eigenspace is in place
+	for (size_t i=0;  i<keys.size();  ++i) {
+		objstore.del(CVDB::BUCKET, keys[i]);
+	}
+
+	// clean up
+	delete tablemeta;
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return EXIT_SUCCESS;
+}
+
+int
+CVDB::update(const int table, std::pair<int, int> range, size_t window,
+		int ncomponents, double variance)
+{
+	profiler.start(); // EVENT_TOTAL
+	MetadataStore& metastore = metadata_store();
+	ObjectStore& objstore = object_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+	if (tablemeta->eigenspace == NULL) {
+		delete tablemeta;
+		throw std::runtime_error("no eigenspace to update, train the table first");
+	}
+	profiler.start();
+	load_image_table_eigenspace(objstore, tablemeta);
+	profiler.stop(EVENT_S3_GET);
+
+	// load image metadata
+	std::vector<ImageMetadata*> metas;
+	profiler.start();
+	load_image_metas(metastore, tablemeta, range, metas);
+	profiler.stop(EVENT_SDB_SELECT, range.second - range.first + 1);
+	assert(metas.size() > 0);
+
+	// fold the images in a batch at a time, so that the work only grows
+	// with the number of new images
+	Eigenspace *eigenspace = tablemeta->eigenspace;
+	std::vector<IplImage*> images;
+	try {
+		ImagePrefetcher prefetcher(metas, fetch_image, window, eigenspace->resolution);
+		for (size_t i=0;  i<metas.size();  ++i) {
+			profiler.start();
+			size_t bytes;
+			IplImage *image = prefetcher.next(bytes);
+			profiler.stop(EVENT_S3_GET, bytes);
+			images.push_back(image);
+			if (images.size() < (size_t)UPDATE_BATCH && i + 1 < metas.size()) {
+				continue;
+			}
+
+			profiler.start();
+			Eigenspace *next = update_eigen_space(eigenspace, images.size(),
+					&images[0], ncomponents, variance);
+			profiler.stop(EVENT_EIGEN_TRAIN, images.size());
+			for (size_t j=0;  j<images.size();  ++j) {
+				cvReleaseImage(&images[j]);
+			}
+			images.clear();
+			if (next == NULL) {
+				throw std::runtime_error("eigenspace has no eigenvalues or image count, retrain the table");
+			}
+			if (eigenspace != tablemeta->eigenspace) {
+				delete eigenspace;
+			}
+			eigenspace = next;
+		}
+
+		// which replaces (and frees) the table's eigenspace
+		publish_eigenspace(profiler, metastore, tablemeta, eigenspace);
+	} catch (...) {
+		for (size_t j=0;  j<images.size();  ++j) {
+			cvReleaseImage(&images[j]);
+		}
+		if (eigenspace != tablemeta->eigenspace) {
+			delete eigenspace;
+		}
+		for (size_t i=0;  i<metas.size();  ++i) {
+			delete metas[i];
+		}
+		delete tablemeta;
+		throw;
+	}
+
+	// clean up
+	delete tablemeta;
+	for (size_t i=0;  i<metas.size();  ++i) {
+		delete metas[i];
+	}
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return EXIT_SUCCESS;
+}
+
+int
+CVDB::reproject(const int table, std::pair<int, int> range, int from,
+		size_t window)
+{
+	profiler.start(); // EVENT_TOTAL
+	MetadataStore& metastore = metadata_store();
+	ObjectStore& objstore = object_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+	if (tablemeta->eigenspace == NULL) {
+		delete tablemeta;
+		throw std::runtime_error("no eigenspace to reproject into");
+	}
+	profiler.start();
+	load_image_table_eigenspace(objstore, tablemeta);
+	profiler.stop(EVENT_S3_GET);
+	if (from <= 0) {
+		from = tablemeta->eigenspace->version - 1;
+	}
+
+	// one rotation per older version found, which is the only state that
+	// depends on the images
+	std::map<int, FeatureRotation*> rotations;
+	std::vector<ImageMetadata*> metas;
+	BackgroundQueue uploads(window, window);
+	long count = 0;
+	int i = range.first;
+	try {
+		while (i <= range.second) {
+
+			// shards carry their version, and those starting in the range
+			// are rotated whole; ids left over at the start, or added after
+			// their shard was written, were learned one image at a time
+			if (tablemeta->shardsize > 0 && (i - 1) % tablemeta->shardsize == 0) {
+				int shard = (i - 1) / tablemeta->shardsize;
+				std::pair<int, int> ids;
+				shard_range(tablemeta, shard, ids);
+				if (ids.first >= range.first) {
+					int last;
+					profiler.start();
+					FeatureBlock *block = reproject_image_eigen_shard(objstore,
+							tablemeta, shard, rotations, last);
+					profiler.stop(EVENT_EIGEN_LEARN, last - ids.first + 1);
+					if (block != NULL) {
+						uploads.submit(new ShardUploadJob(tablemeta, shard, block));
+						count += last - ids.first + 1;
+					}
+					if (last >= ids.first) {
+						i = last + 1;
+						continue;
+					}
+				}
+			}
+
+			// per image features written before they carried a version
+			// are taken to be of the given one
+			ImageMetadata *meta = new ImageMetadata(i);
+			meta->imagetable = tablemeta;
+			metas.push_back(meta);
+			profiler.start();
+			bool rotated = reproject_image_eigen(objstore, meta, rotations, from);
+			profiler.stop(EVENT_EIGEN_LEARN, 1);
+			if (rotated) {
+				uploads.submit(new EigenUploadJob(meta));
+				++count;
+			}
+			++i;
+		}
+	} catch (...) {
+		uploads.drain();
+		for (std::map<int, FeatureRotation*>::iterator it=rotations.begin();
+				it!=rotations.end();  ++it) {
+			delete it->second;
+		}
+		for (size_t j=0;  j<metas.size();  ++j) {
+			delete metas[j];
+		}
+		delete tablemeta;
+		throw;
+	}
+	long failures = uploads.drain();
+	if (failures > 0) {
+		std::cerr << "Failed uploads: " << failures << std::endl;
+	}
+	std::cerr << "Reprojected " << count << " feature vectors into version "
+			<< tablemeta->eigenspace->version << std::endl;
+
+	// clean up
+	for (std::map<int, FeatureRotation*>::iterator it=rotations.begin();
+			it!=rotations.end();  ++it) {
+		delete it->second;
+	}
+	for (size_t j=0;  j<metas.size();  ++j) {
+		delete metas[j];
+	}
+	delete tablemeta;
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int
+CVDB::learn(const int table, std::pair<int, int> range, int shardsize,
+		size_t window, int nthreads, int encoding, bool graph, size_t batch)
+{
+	profiler.start(); // EVENT_TOTAL
+	// load table
+	MetadataStore& metastore = metadata_store();
+	ObjectStore& objstore = object_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+	profiler.start();
+	load_eigenspace(objstore, tablemeta);
+	long total_size = 0;
+	for (int i=0;  i<tablemeta->eigenspace->dimension;  ++i) {
+		total_size += tablemeta->eigenspace->eigenfaces[i]->imageSize;
+	}
+	profiler.stop(EVENT_S3_GET, total_size);
+
+	// switch the table to a new shard layout; shards of the old one are
+	// unreadable once it changes, so they must all be learned again
+	if (shardsize > 0 && shardsize != tablemeta->shardsize) {
+		if (tablemeta->shardsize > 0
+				&& (range.first > 1 || range.second < tablemeta->nextimageid - 1)) {
+			char buf[128];
+			sprintf(buf, "the table is sharded by %d, learn 1 to %d to reshard it",
+					tablemeta->shardsize, tablemeta->nextimageid - 1);
+			delete tablemeta;
+			throw std::runtime_error(buf);
+		}
+		tablemeta->shardsize = shardsize;
+		const char *attrs[] = { IMAGE_TABLE_ATTR_SHARDSIZE, NULL };
+		profiler.start();
+		upload_image_table_meta(metastore, tablemeta, attrs);
+		profiler.stop(EVENT_SDB_PUT);
+	}
+
+	// and to a new encoding, which shards written before keep until
+	// they are learned again
+	if (encoding >= 0 && encoding != tablemeta->encoding) {
+		tablemeta->encoding = encoding;
+		const char *attrs[] = { IMAGE_TABLE_ATTR_ENCODING, NULL };
+		profiler.start();
+		upload_image_table_meta(metastore, tablemeta, attrs);
+		profiler.stop(EVENT_SDB_PUT);
+	}
+	if (tablemeta->encoding != ENCODING_F32 && tablemeta->shardsize <= 0) {
+		std::cerr << "Features are only quantized in shards, see --shard" << std::endl;
+	}
+
+	// new images join the table's graph as they are learned; it must
+	// already hold every image before the range
+	GraphIndex *extended = NULL;
+	int graphfirst = range.first;
+	if (graph) {
+		profiler.start();
+		extended = load_image_table_graph(objstore, tablemeta);
+		profiler.stop(EVENT_S3_GET);
+		if (extended == NULL && range.first == 1) {
+			extended = new GraphIndex(tablemeta->eigenspace->dimension);
+			extended->version = tablemeta->eigenspace->version;
+		}
+		if (extended == NULL || range.first > extended->last + 1) {
+			delete extended;
+			delete tablemeta;
+			throw std::runtime_error("the graph does not reach the range, build it first");
+		}
+		graphfirst = extended->last + 1;
+		extended->reserve(extended->size() + std::max(range.second - graphfirst + 1, 0));
+	}
+
+	// load image metadata
+	std::vector<ImageMetadata*> metas;
+	profiler.start();
+	load_image_metas(metastore, tablemeta, range, metas);
+	profiler.stop(EVENT_SDB_SELECT, range.second - range.first + 1);
+
+	// split the range into one part per thread, at shard boundaries so
+	// that every shard is written by a single thread, unless there are
+	// fewer shards than threads: then the shards cut by the split are
+	// written one image at a time instead of leaving threads idle
+	std::vector< std::pair<int, int> > parts;
+	int step = (range.second - range.first + nthreads) / nthreads;
+	bool aligned = tablemeta->shardsize > 0
+			&& range.second - range.first + 1 >= nthreads*tablemeta->shardsize;
+	int first = range.first;
+	while (first <= range.second) {
+		int next = first + step;
+		if (aligned) {
+			int size = tablemeta->shardsize;
+			next = ((next - 1 + size - 1) / size)*size + 1;
+		}
+		parts.push_back(std::pair<int, int>(first, std::min(next - 1, range.second)));
+		first = next;
+	}
+
+	// every thread fetches and uploads window images at a time
+	s3pool().grow(parts.size()*window*2);
+
+	// the eigenspace and metadata are shared read-only and the profiler
+	// keeps a buffer per thread, everything else (connections, buffers)
+	// belongs to a single thread
+	std::vector<LearnTask> tasks(parts.size());
+	std::vector<pthread_t> threads(parts.size());
+	for (size_t j=0;  j<parts.size();  ++j) {
+		tasks[j].metas.assign(metas.begin() + (parts[j].first - range.first),
+				metas.begin() + (parts[j].second - range.first + 1));
+		tasks[j].range = parts[j];
+		tasks[j].window = window;
+		tasks[j].batch = batch;
+		tasks[j].graph = extended;
+		tasks[j].graphfirst = graphfirst;
+		tasks[j].failures = 0;
+		tasks[j].profiler = &profiler;
+		if (parts.size() > 1) {
+			pthread_create(&threads[j], NULL, run_learn_task, &tasks[j]);
+		}
+	}
+	if (parts.size() == 1) {
+		run_learn_task(&tasks[0]);
+	}
+	long failures = 0;
+	for (size_t j=0;  j<parts.size();  ++j) {
+		if (parts.size() > 1) {
+			pthread_join(threads[j], NULL);
+		}
+		failures += tasks[j].failures;
+	}
+	for (size_t j=0;  j<parts.size();  ++j) {
+		if (!tasks[j].error.empty()) {
+			delete extended;
+			for (size_t k=0;  k<metas.size();  ++k) {
+				delete metas[k];
+			}
+			delete tablemeta;
+			throw std::runtime_error(tasks[j].error);
+		}
+	}
+	if (failures > 0) {
+		std::cerr << "Failed uploads: " << failures << std::endl;
+	}
+
+	if (extended != NULL) {
+		++tablemeta->graph;
+		profiler.start();
+		upload_image_table_graph(objstore, tablemeta, extended);
+		profiler.stop(EVENT_S3_PUT);
+		const char *attrs[] = { IMAGE_TABLE_ATTR_GRAPH, NULL };
+		profiler.start();
+		upload_image_table_meta(metastore, tablemeta, attrs);
+		profiler.stop(EVENT_SDB_PUT);
+		delete extended;
+	}
+
+	// clean up
+	for (size_t j=0;  j<metas.size();  ++j) {
+		delete metas[j];
+	}
+	delete tablemeta;
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int
+CVDB::index(const int table, int nlists, int nsubspaces, size_t nsample)
+{
+	profiler.start(); // EVENT_TOTAL
+	MetadataStore& metastore = metadata_store();
+	ObjectStore& objstore = object_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+	if (tablemeta->eigenspace == NULL || tablemeta->nextimageid <= 1) {
+		delete tablemeta;
+		throw std::runtime_error("nothing to index, train and learn the table first");
+	}
+
+	// every image of the table
+	std::pair<int, int> range(1, tablemeta->nextimageid - 1);
+	int n = range.second;
+	int dimension = tablemeta->eigenspace->dimension;
+	if (nlists <= 0) {
+		nlists = (int)(INDEX_LISTS_PER_ROOT*sqrt((double)n));
+	}
+	nlists = std::max(1, std::min(nlists, n));
+	if (nsubspaces <= 0) {
+		nsubspaces = (dimension + INDEX_SLICE_WIDTH - 1) / INDEX_SLICE_WIDTH;
+	}
+	nsubspaces = std::min(nsubspaces, dimension);
+	if (nsample == 0) {
+		nsample = (size_t)INDEX_SAMPLE_PER_LIST*nlists;
+	}
+	nsample = std::min(nsample, (size_t)n);
+
+	// first pass: a uniform sample of the features to train on, drawn
+	// one block at a time (reservoir sampling)
+	std::vector<float> sample(nsample*dimension);
+	unsigned int seed = 1;
+	size_t seen = 0;
+	int i = range.first;
+	while (i <= range.second) {
+		int last = block_last(tablemeta, i, range);
+		FeatureBlock *block = load_features(metastore, objstore, tablemeta,
+				std::pair<int, int>(i, last));
+		for (int id=i;  id<=last;  ++id, ++seen) {
+			size_t slot = seen < nsample ? seen : rand_r(&seed) % (seen + 1);
+			if (slot < nsample) {
+				block->get(id, &sample[slot*dimension]);
+			}
+		}
+		delete block;
+		i = last + 1;
+	}
+
+	profiler.start();
+	FeatureIndex *index = new FeatureIndex(dimension, nlists, nsubspaces);
+	index->train(&sample[0], nsample);
+	profiler.stop(EVENT_INDEX_TRAIN, nsample);
+	sample.clear();
+
+	// second pass: every feature vector (mostly from the object cache)
+	std::vector<float> row(dimension);
+	i = range.first;
+	while (i <= range.second) {
+		int last = block_last(tablemeta, i, range);
+		FeatureBlock *block = load_features(metastore, objstore, tablemeta,
+				std::pair<int, int>(i, last));
+		for (int id=i;  id<=last;  ++id) {
+			block->get(id, &row[0]);
+			index->add(id, &row[0]);
+		}
+		delete block;
+		i = last + 1;
+	}
+	index->version = tablemeta->eigenspace->version;
+
+	// upload the index, then point the table at it
+	++tablemeta->index;
+	profiler.start();
+	upload_image_table_index(objstore, tablemeta, index);
+	profiler.stop(EVENT_S3_PUT);
+	const char *attrs[] = { IMAGE_TABLE_ATTR_INDEX, NULL };
+	profiler.start();
+	upload_image_table_meta(metastore, tablemeta, attrs);
+	profiler.stop(EVENT_SDB_PUT);
+	std::cerr << "Indexed " << index->size() << " images of table " << table
+			<< " in " << nlists << " lists of " << nsubspaces << " byte codes"
+			<< std::endl;
+
+	// clean up
+	delete index;
+	delete tablemeta;
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return EXIT_SUCCESS;
+}
+
+int
+CVDB::graph(const int table, int m, int efconstruction, int nthreads)
+{
+	profiler.start(); // EVENT_TOTAL
+	MetadataStore& metastore = metadata_store();
+	ObjectStore& objstore = object_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(table);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+	if (tablemeta->eigenspace == NULL || tablemeta->nextimageid <= 1) {
+		delete tablemeta;
+		throw std::runtime_error("nothing to index, train and learn the table first");
+	}
+
+	// every image of the table, loaded a block at a time while earlier
+	// blocks are inserted by nthreads threads at once
+	std::pair<int, int> range(1, tablemeta->nextimageid - 1);
+	GraphIndex *graph = new GraphIndex(tablemeta->eigenspace->dimension, m,
+			efconstruction);
+	graph->reserve(range.second);
+	graph->version = tablemeta->eigenspace->version;
+	BackgroundQueue inserts(nthreads, nthreads);
+	profiler.start();
+	int i = range.first;
+	while (i <= range.second) {
+		int last = block_last(tablemeta, i, range);
+		FeatureBlock *block = load_features(metastore, objstore, tablemeta,
+				std::pair<int, int>(i, last));
+		inserts.submit(new GraphInsertJob(graph, block));
+		i = last + 1;
+	}
+	long failures = inserts.drain();
+	profiler.stop(EVENT_GRAPH_INSERT, range.second - range.first + 1);
+	if (failures > 0) {
+		delete graph;
+		delete tablemeta;
+		throw std::runtime_error("failed to insert features into the graph");
+	}
+
+	// upload the graph, then point the table at it
+	++tablemeta->graph;
+	profiler.start();
+	upload_image_table_graph(objstore, tablemeta, graph);
+	profiler.stop(EVENT_S3_PUT);
+	const char *attrs[] = { IMAGE_TABLE_ATTR_GRAPH, NULL };
+	profiler.start();
+	upload_image_table_meta(metastore, tablemeta, attrs);
+	profiler.stop(EVENT_SDB_PUT);
+	std::cerr << "Linked " << graph->size() << " images of table " << table
+			<< " into a graph of degree " << m << std::endl;
+
+	// clean up
+	delete graph;
+	delete tablemeta;
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return EXIT_SUCCESS;
+}
+
+int
+CVDB::query(int tableid, int imageid, std::pair<int, int> range, std::ostream& outs,
+		size_t k, double threshold, int nprobe, size_t shortlist, size_t ef)
+{
+	profiler.start(); // EVENT_TOTAL
+
+	// load table
+	MetadataStore& metastore = metadata_store();
+	ObjectStore& objstore = object_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(tableid);
+	load_image_table_meta(metastore, tablemeta);
+
+	// load query image
+	int dimension = tablemeta->eigenspace->dimension;
+	ImageMetadata query_meta(imageid);
+	query_meta.imagetable = tablemeta;
+	profiler.start();
+	load_image_meta(metastore, &query_meta);
+	profiler.stop(EVENT_SDB_GET);
+	profiler.start();
+	load_image_features(objstore, &query_meta);
+	profiler.stop(EVENT_S3_GET, sizeof(float)*dimension);
+
+	Neighbors neighbors(k, threshold);
+	int i = range.first;
+
+	// the graph gives exact distances, but may miss some neighbours
+	if (ef > 0) {
+		profiler.start();
+		GraphIndex *graph = load_image_table_graph(objstore, tablemeta);
+		profiler.stop(EVENT_S3_GET);
+		if (graph == NULL) {
+			std::cerr << "Warning: table " << tableid
+					<< " has no graph for its eigenspace, scanning" << std::endl;
+		} else {
+			profiler.start();
+			graph->search(query_meta.features, std::max(ef, k), range, neighbors);
+			profiler.stop(EVENT_GRAPH_SEARCH, ef);
+			i = std::max(i, graph->last + 1);
+			delete graph;
+		}
+	}
+
+	// with an index, only a shortlist from the nearest lists is scored
+	// against the stored features, and only images added since the index
+	// was built are scanned
+	if (nprobe > 0 && ef == 0) {
+		profiler.start();
+		FeatureIndex *index = load_image_table_index(objstore, tablemeta);
+		profiler.stop(EVENT_S3_GET);
+		if (index == NULL) {
+			std::cerr << "Warning: table " << tableid
+					<< " has no index for its eigenspace, scanning" << std::endl;
+		} else {
+			Neighbors candidates(shortlist > 0 ? shortlist : k*INDEX_SHORTLIST_FACTOR);
+			profiler.start();
+			index->search(query_meta.features, nprobe, range, candidates);
+			profiler.stop(EVENT_INDEX_SEARCH, nprobe);
+			rerank_features(objstore, tablemeta, query_meta.features, candidates,
+					neighbors);
+			i = std::max(i, index->last + 1);
+			delete index;
+		}
+	}
+
+	// to conserve memory, process one shard (or a bounded block of
+	// images) at a time
+	while (i <= range.second) {
+		int last = block_last(tablemeta, i, range);
+		FeatureBlock *block = load_features(metastore, objstore, tablemeta,
+				std::pair<int, int>(i, last));
+		score_features(block, query_meta.features, neighbors);
+		delete block;
+		i = last + 1;
+	}
+
+	// output
+	neighbors.write(outs, imageid);
+	outs << std::endl;
+
+	// clean up
+	delete tablemeta;
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return EXIT_SUCCESS;
+}
+
+int
+CVDB::serve(int tableid, std::pair<int, int> range, const std::string& path,
+		size_t ef)
+{
+	profiler.start(); // EVENT_TOTAL
+
+	// load table
+	MetadataStore& metastore = metadata_store();
+	ObjectStore& objstore = object_store();
+	ImageTableMetadata *tablemeta = new ImageTableMetadata(tableid);
+	profiler.start();
+	load_image_table_meta(metastore, tablemeta);
+	profiler.stop(EVENT_SDB_GET);
+
+	// keep every feature vector of the range resident, and the graph of
+	// the table if it is to be searched
+	FeatureBlock *block = load_features(metastore, objstore, tablemeta, range);
+	GraphIndex *graph = NULL;
+	if (ef > 0) {
+		profiler.start();
+		graph = load_image_table_graph(objstore, tablemeta);
+		profiler.stop(EVENT_S3_GET);
+		if (graph == NULL) {
+			std::cerr << "Warning: table " << tableid
+					<< " has no graph for its eigenspace, scanning" << std::endl;
+		}
+	}
+	std::cerr << "Serving " << range.first << "-" << range.second
+			<< " of table " << tableid << " on " << path << std::endl;
+	profiler.flush();
+
+	QueryHandler handler(tablemeta, block, objstore, graph, ef);
+	int rc = serve_frames(path, &handler);
+
+	// clean up
+	delete graph;
+	delete block;
+	delete tablemeta;
+
+	profiler.stop(EVENT_TOTAL);
+	profiler.flush();
+
+	return rc;
+}
+
+FeatureBlock *
+CVDB::load_features(MetadataStore& metastore,
+		ObjectStore& objstore,
+		ImageTableMetadata *tablemeta,
+		std::pair<int, int> range)
+{
+	// the ranges of i8 codes come from the eigenspace
+	if (tablemeta->encoding == ENCODING_I8
+			&& tablemeta->eigenspace->eigenfaces == NULL) {
+		load_image_table_eigenspace(objstore, tablemeta);
+	}
+	int dimension = tablemeta->eigenspace->dimension;
+	FeatureBlock *block = new_feature_block(tablemeta, range.first, range.second);
+	std::vector<float> row(dimension);
+
+	int i = range.first;
+	while (i <= range.second) {
+
+		// fetch a whole shard with a single GET, and fall back to the
+		// per-image objects for whatever it does not hold
+		int last = range.second;
+		if (tablemeta->shardsize > 0) {
+			int shard = (i - 1) / tablemeta->shardsize;
+			std::pair<int, int> ids;
+			shard_range(tablemeta, shard, ids);
+			last = std::min(ids.second, range.second);
+			profiler.start();
+			FeatureBlock *shardblock = load_image_eigen_shard(objstore, tablemeta, shard);
+			profiler.stop(EVENT_S3_GET, shardblock != NULL
+					? block->rowsize()*(shardblock->last - shardblock->first + 1) : 0);
+			if (shardblock != NULL && i > shardblock->last) {
+				delete shardblock;
+				shardblock = NULL;
+			}
+			if (shardblock != NULL) {
+				last = std::min(shardblock->last, range.second);
+				if (block->same_codes(*shardblock)) {
+					memcpy(block->code(i), shardblock->code(i),
+							block->rowsize()*(last - i + 1));
+				} else {
+					// written before the table's encoding changed
+					for (int id=i;  id<=last;  ++id) {
+						shardblock->get(id, &row[0]);
+						block->set(id, &row[0]);
+					}
+				}
+				delete shardblock;
+				i = last + 1;
+				continue;
+			}
+		}
+
+		for (;  i<=last;  ++i) {
+
+			// the key of a vector only depends on its id, so there is no
+			// metadata to load
+			ImageMetadata meta(i);
+			meta.imagetable = tablemeta;
+
+			// load vector
+			profiler.start();
+			load_image_eigen(objstore, &meta);
+			profiler.stop(EVENT_S3_GET, sizeof(float)*dimension);
+			block->set(i, meta.features);
+		}
+	}
+
+	return block;
+}
+
+int
+CVDB::upload(ImageScanner *scanner,
+		const int id,
+		const std::string& s3prefix)
+{
+	MetadataStore& metastore = metadata_store();
+	// initialize table meta data
+	ImageTableMetadata tablemeta(id);
+	std::string domain;
+	serial_image_table_meta(&tablemeta, IMAGE_TABLE_ITEM_ID, domain);
+	std::string imgdomain(domain);
+	imgdomain += IMAGE_CATALOG_SUFFIX;
+	tablemeta.bucket = CVDB::BUCKET;
+	tablemeta.prefix = s3prefix;
+	tablemeta.imagedomain = imgdomain;
+	tablemeta.nextimageid = 1;
+
+	std::cout << "Creating: " << imgdomain << std::endl;
+	metastore.create_domain(imgdomain);
+
+	// initialize all image meta data
+	scanner->open();
+	ImageMetadata meta;
+	meta.imagetable = &tablemeta;
+	while (scanner->next(meta)) {
+		meta.id = tablemeta.nextimageid;
+		tablemeta.nextimageid++;
+		std::cout << "Uploading image: " << meta.id << ", " << meta.name
+				<< ", " << meta.subjectid << ", " << meta.poseid << ", "
+				<< meta.format << ", " << meta.dimensions.width << ", "
+				<< meta.dimensions.height << ", " << meta.dimensions.depth
+				<< std::endl;
+		upload_image_meta(metastore, &meta);
+	}
+	scanner->close();
+
+	std::cout << "Uploading table: " << tablemeta.id << ", "
+			<< tablemeta.bucket << ", " << tablemeta.prefix << ", "
+			<< tablemeta.nextimageid << std::endl;
+	upload_image_table_meta(metastore, &tablemeta);
+
+	return EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static IplImage*
+load_image(ObjectStore& objstore, ImageMetadata *meta, size_t resolution,
+		size_t& bytes)
+{
+	std::string key(meta->imagetable->prefix);
+	key += "/" + meta->name;
+	char *data = get_object_buffer(objstore, CVDB::BUCKET, key, bytes);
+	IplImage *image;
+	int error = read_image(meta, data, bytes, &image, resolution);
+	if (error != IMAGE_OK) {
+		throw std::runtime_error(key + ": " + image_error(error));
+	}
+	return image;
+}
+
+static void *
+run_learn_task(void *arg)
+{
+	LearnTask *task = (LearnTask*)arg;
+	std::vector<ImageMetadata*>& metas = task->metas;
+	std::pair<int, int> range = task->range;
+	Profiler& profiler = *task->profiler;
+	ImageTableMetadata *tablemeta = metas[0]->imagetable;
+
+	// to conserve memory, process one batch of images (or one shard) at a
+	// time, while up to window images are fetched and window uploads are
+	// sent in the background
+	ImagePrefetcher prefetcher(metas, fetch_image, task->window,
+			tablemeta->eigenspace->resolution);
+	BackgroundQueue uploads(task->window, task->window);
+	Projector projector(tablemeta->eigenspace, task->batch);
+	int dimension = tablemeta->eigenspace->dimension;
+	std::vector<float> rows;
+	int i = range.first;
+	try {
+		while (i <= range.second) {
+
+			// shards that lie entirely inside the range are written whole,
+			// anything left over at the ends is written one image at a time
+			int stop = range.second;
+			if (tablemeta->shardsize > 0) {
+				int shard = (i - 1) / tablemeta->shardsize;
+				std::pair<int, int> ids;
+				shard_range(tablemeta, shard, ids);
+				if (ids.first >= range.first && ids.second <= range.second) {
+					FeatureBlock *block = new_feature_block(tablemeta, ids.first, ids.second);
+					try {
+						rows.resize((size_t)(ids.second - ids.first + 1)*dimension);
+						learn_images(profiler, prefetcher, projector,
+								ids.second - ids.first + 1, &rows[0]);
+						for (int id=ids.first;  id<=ids.second;  ++id) {
+							float *row = &rows[(size_t)(id - ids.first)*dimension];
+							block->set(id, row);
+							if (task->graph != NULL && id >= task->graphfirst) {
+								profiler.start();
+								task->graph->insert(id, row);
+								profiler.stop(EVENT_GRAPH_INSERT);
+							}
+						}
+					} catch (...) {
+						delete block;
+						throw;
+					}
+
+					// upload features
+					profiler.start();
+					uploads.submit(new ShardUploadJob(tablemeta, shard, block));
+					profiler.stop(EVENT_S3_PUT, block->rowsize()*(ids.second - ids.first + 1));
+
+					i = ids.second + 1;
+					continue;
+				}
+				stop = std::min(stop, ids.second);
+			}
+
+			// the images left over in this shard, a batch at a time
+			int n = std::min(stop - i + 1, (int)task->batch);
+			rows.resize((size_t)n*dimension);
+			learn_images(profiler, prefetcher, projector, n, &rows[0]);
+			for (int id=i;  id<i+n;  ++id) {
+				ImageMetadata *meta = metas[id - range.first];
+				meta->features = new float[dimension];
+				std::copy(&rows[(size_t)(id - i)*dimension],
+						&rows[(size_t)(id - i + 1)*dimension], meta->features);
+				if (task->graph != NULL && id >= task->graphfirst) {
+					profiler.start();
+					task->graph->insert(id, meta->features);
+					profiler.stop(EVENT_GRAPH_INSERT);
+				}
+
+				// upload features
+				profiler.start();
+				uploads.submit(new EigenUploadJob(meta));
+				profiler.stop(EVENT_S3_PUT, sizeof(float)*dimension);
+			}
+			i += n;
+		}
+	} catch (std::exception& e) {
+		// rethrown by the calling thread
+		task->error = e.what();
+	}
+	task->failures = uploads.drain();
+	return NULL;
+}
+
+/* Learns the features of the next nimages prefetched images, a batch at
+ * a time, into rows of dimension floats */
+static void
+learn_images(Profiler& profiler,
+		ImagePrefetcher& prefetcher,
+		Projector& projector,
+		size_t nimages,
+		float features[])
+{
+	Eigenspace *eigenspace = projector.eigenspace;
+	size_t done = 0;
+	while (done < nimages) {
+		size_t n = std::min(nimages - done, projector.batch);
+		for (size_t j=0;  j<n;  ++j) {
+			// wait for the prefetched image
+			profiler.start();
+			size_t bytes;
+			IplImage *image = prefetcher.next(bytes);
+			profiler.stop(EVENT_S3_GET, bytes);
+
+			projector.add(image);
+			cvReleaseImage(&image);
+		}
+
+		// calculate features, one event per batch
+		profiler.start();
+		projector.project(features + done*eigenspace->dimension);
+		profiler.stop(EVENT_EIGEN_LEARN, n);
+		done += n;
+	}
+}
+
+/* Loads every image, up to window at a time, and solves for the
+ * eigenspace at once */
+static Eigenspace *
+train_in_memory(Profiler& profiler, std::vector<ImageMetadata*>& metas,
+		size_t resolution, size_t window, int ncomponents, double variance)
+{
+	size_t nimages = metas.size();
+	IplImage **images = new IplImage*[nimages];
+	ImagePrefetcher prefetcher(metas, fetch_image, window, resolution);
+	for (size_t i=0;  i<nimages;  ++i) {
+		profiler.start();
+		size_t bytes;
+		images[i] = prefetcher.next(bytes);
+		profiler.stop(EVENT_S3_GET, bytes);
+	}
+
+	profiler.start();
+	Eigenspace *eigenspace = create_eigen_space(nimages, images, resolution,
+			ncomponents, variance);
+	profiler.stop(EVENT_EIGEN_TRAIN, nimages);
+
+	// clean up
+	for (size_t i=0;  i<nimages;  ++i) {
+		cvReleaseImage(&(images[i]));
+	}
+	delete[] images;
+
+	return eigenspace;
+}
+
+/* Streams the images through a sketch of the covariance once or twice,
+ * holding only one image (plus up to window prefetched) at a time */
+static Eigenspace *
+train_streaming(Profiler& profiler, std::vector<ImageMetadata*>& metas,
+		size_t resolution, size_t window, int ncomponents, double variance,
+		int passes)
+{
+	EigenspaceSketch sketch(resolution, ncomponents);
+	for (int pass=0;  pass<passes;  ++pass) {
+		sketch_images(profiler, metas, resolution, window, sketch, pass);
+	}
+
+	profiler.start();
+	Eigenspace *eigenspace = sketch.create(variance);
+	profiler.stop(EVENT_EIGEN_TRAIN, metas.size());
+	return eigenspace;
+}
+
+static void
+sketch_images(Profiler& profiler, std::vector<ImageMetadata*>& metas,
+		size_t resolution, size_t window, EigenspaceSketch& sketch, int pass)
+{
+	ImagePrefetcher prefetcher(metas, fetch_image, window, resolution);
+	for (size_t i=0;  i<metas.size();  ++i) {
+		profiler.start();
+		size_t bytes;
+		IplImage *image = prefetcher.next(bytes);
+		profiler.stop(EVENT_S3_GET, bytes);
+
+		profiler.start();
+		if (pass == 0) {
+			sketch.add(image);
+		} else {
+			sketch.refine(image);
+		}
+		profiler.stop(EVENT_EIGEN_TRAIN, 1);
+		cvReleaseImage(&image);
+	}
+}
+
+/* Makes eigenspace the next version of the table's and uploads it */
+static void
+publish_eigenspace(Profiler& profiler, MetadataStore& metastore,
+		ImageTableMetadata *tablemeta, Eigenspace *eigenspace)
+{
+	int version = 1;
+	if (tablemeta->eigenspace != NULL) {
+		version = tablemeta->eigenspace->version + 1;
+		delete tablemeta->eigenspace;
+		tablemeta->eigenspace = NULL;
+	}
+	eigenspace->version = version;
+	eigenspace->trainid = new_train_id();
+	tablemeta->eigenspace = eigenspace;
+
+	ObjectStore& objstore = object_store();
+	const char *attrs[] = { IMAGE_TABLE_ATTR_EIGENSPACE, NULL };
+	profiler.start();
+	upload_image_table_meta(metastore, tablemeta, attrs);
+	profiler.stop(EVENT_SDB_PUT);
+	long total_size = 0;
+	for (int i=0;  i<tablemeta->eigenspace->dimension;  ++i) {
+		total_size += tablemeta->eigenspace->eigenfaces[i]->imageSize;
+	}
+	profiler.start();
+	upload_image_table_eigenspace(objstore, tablemeta);
+	profiler.stop(EVENT_S3_PUT, total_size);
+}
+
+/* Versions start again from 1 when a table is uploaded again, so each
+ * published version is also told apart by the time and process that
+ * published it */
+static std::string
+new_train_id()
+{
+	timeval now;
+	gettimeofday(&now, NULL);
+	char buf[64];
+	sprintf(buf, "%lx%05lx%x", (unsigned long)now.tv_sec,
+			(unsigned long)now.tv_usec, (unsigned int)getpid() & 0xfff);
+	return std::string(buf);
+}
+
+/* The rotation from an older version of the table's eigenspace into the
+ * current one. Only eigenspaces stored in a single file keep their old
+ * versions. */
+static FeatureRotation *
+load_feature_rotation(ObjectStore& objstore, ImageTableMetadata *meta,
+		int version)
+{
+	char buf[32];
+	sprintf(buf, EIGENSPACE_FORMAT, version);
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += buf;
+	// read past the cache, since only the version of an older eigenspace
+	// is known, not its train id
+	std::string data;
+	try {
+		objstore.get(CVDB::BUCKET, key, data);
+	} catch (ObjectNotFound& e) {
+		throw std::runtime_error("no eigenspace " + key + " to reproject from");
+	}
+	std::istringstream ins(data);
+	Eigenspace old;
+	old.version = version;
+	old.resolution = meta->eigenspace->resolution;
+	if (!read_eigenspace(ins, &old)) {
+		throw std::runtime_error("invalid eigenspace " + key);
+	}
+	return new FeatureRotation(&old, meta->eigenspace);
+}
+
+/* Reads a shard as it was learned, rotated into the current eigenspace,
+ * or NULL if it is missing or already current, setting last to the last
+ * id it holds (before the shard if it is missing). Old shards are read
+ * past the cache, whose entries are tagged with the current version, and
+ * the entry of this one is dropped. */
+static FeatureBlock *
+reproject_image_eigen_shard(ObjectStore& objstore, ImageTableMetadata *meta,
+		int shard, std::map<int, FeatureRotation*>& rotations, int& last)
+{
+	std::pair<int, int> ids;
+	shard_range(meta, shard, ids);
+	last = ids.first - 1;
+
+	char buf[32];
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += SHARD_PREFIX;
+	key += "/";
+	sprintf(buf, "%d.shard", shard);
+	key += buf;
+	object_cache().erase(std::string(CVDB::BUCKET) + "/" + key + "@"
+			+ eigenspace_tag(meta, true));
+
+	std::string data;
+	try {
+		objstore.get(CVDB::BUCKET, key, data);
+	} catch (ObjectNotFound& e) {
+		return NULL;
+	}
+	std::istringstream ins(data);
+	FeatureBlock *block = read_feature_block(ins);
+	if (block == NULL) {
+		return NULL;
+	}
+	// a shard written before images were added holds only the front of
+	// its range
+	if (block->first != ids.first || block->last > ids.second
+			|| block->last < block->first) {
+		delete block;
+		return NULL;
+	}
+	last = block->last;
+	if (block->version == meta->eigenspace->version) {
+		delete block;
+		return NULL;
+	}
 
-	// initialize all image meta data
-	scanner->open();
-	ImageMetadata meta;
-	meta.imagetable = &tablemeta;
-	while (scanner->next(meta)) {
-		meta.id = tablemeta.nextimageid;
-		tablemeta.nextimageid++;
-		std::cout << "Uploading image: " << meta.id << ", " << meta.name
-				<< ", " << meta.subjectid << ", " << meta.poseid << ", "
-				<< meta.format << ", " << meta.dimensions.width << ", "
-				<< meta.dimensions.height << ", " << meta.dimensions.depth
-				<< std::endl;
-		upload_image_meta(sdbconn, &meta);
+	if (rotations.count(block->version) == 0) {
+		rotations[block->version] = load_feature_rotation(objstore, meta,
+				block->version);
 	}
-	scanner->close();
+	FeatureRotation *rotation = rotations[block->version];
+	if (block->dimension != rotation->fromdimension) {
+		delete block;
+		throw std::runtime_error("shard " + key + " does not match its eigenspace");
+	}
+	FeatureBlock *rotated;
+	try {
+		rotated = new_feature_block(meta, block->first, block->last);
+	} catch (...) {
+		delete block;
+		throw;
+	}
+	std::vector<float> from(block->dimension);
+	std::vector<float> to(rotated->dimension);
+	for (int id=block->first;  id<=block->last;  ++id) {
+		block->get(id, &from[0]);
+		rotation->apply(&from[0], &to[0]);
+		rotated->set(id, &to[0]);
+	}
+	delete block;
+	return rotated;
+}
 
-	std::cout << "Uploading table: " << tablemeta.id << ", "
-			<< tablemeta.bucket << ", " << tablemeta.prefix << ", "
-			<< tablemeta.nextimageid << std::endl;
-	upload_image_table_meta(sdbconn, &tablemeta);
+/* Rotates the features of an image into meta->features from the version
+ * they are in, or from the given one if they carry none, returning false
+ * if they are missing, already current or not of their eigenspace's
+ * dimension, so that a task run again rotates nothing twice */
+static bool
+reproject_image_eigen(ObjectStore& objstore, ImageMetadata *meta,
+		std::map<int, FeatureRotation*>& rotations, int from)
+{
+	char buf[32];
+	std::string key(meta->imagetable->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	sprintf(buf, "%d.eigen", meta->id);
+	key += buf;
+	object_cache().erase(std::string(CVDB::BUCKET) + "/" + key + "@"
+			+ eigenspace_tag(meta->imagetable, false));
+
+	std::string data;
+	try {
+		objstore.get(CVDB::BUCKET, key, data);
+	} catch (ObjectNotFound& e) {
+		return false;
+	}
+	std::vector<float> features;
+	int version;
+	if (!read_image_eigen(data, features, version)) {
+		return false;
+	}
+	if (version < 0) {
+		version = from;
+	}
+	if (version == meta->imagetable->eigenspace->version) {
+		return false;
+	}
 
-	return EXIT_SUCCESS;
+	if (rotations.count(version) == 0) {
+		rotations[version] = load_feature_rotation(objstore, meta->imagetable,
+				version);
+	}
+	FeatureRotation *rotation = rotations[version];
+	if (features.size() != (size_t)rotation->fromdimension) {
+		return false;
+	}
+	if (meta->features == NULL) {
+		meta->features = new float[rotation->todimension];
+	}
+	rotation->apply(&features[0], meta->features);
+	return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////
+/* The features of an image and the version they are in, which is -1 if
+ * they were written before features carried one */
+static bool
+read_image_eigen(const std::string& data, std::vector<float>& features,
+		int& version)
+{
+	std::istringstream ins(data);
+	if (read_features(ins, features, version)) {
+		return true;
+	}
+	if (data.empty() || data.size() % sizeof(float) != 0) {
+		return false;
+	}
+	features.resize(data.size() / sizeof(float));
+	memcpy(&features[0], data.data(), data.size());
+	version = -1;
+	return true;
+}
 
 static IplImage*
-load_image(S3ConnectionPtr s3conn, ImageMetadata *meta)
+fetch_image(ImageMetadata *meta, size_t resolution, size_t& bytes)
 {
-	std::string key(meta->imagetable->prefix);
-	key += "/" + meta->name;
-    GetResponsePtr res = s3conn->get(CVDB::BUCKET, key);
-    std::istream& ins = res->getInputStream();
-    IplImage *image = read_image(meta, ins);
-    return image;
+	ObjectStore& objstore = object_store();
+	return load_image(objstore, meta, resolution, bytes);
 }
 
 static IplImage*
-load_staged_image(S3ConnectionPtr s3conn, const std::string& key)
+load_staged_image(ObjectStore& objstore, const std::string& key,
+		const std::string& tag)
 {
-    GetResponsePtr res = s3conn->get(CVDB::BUCKET, key);
-    std::istream& ins = res->getInputStream();
+	std::string data;
+	get_object(objstore, CVDB::BUCKET, key, data, tag);
+	std::istringstream ins(data);
     int fmt;
 	ins >> fmt;
 	assert(fmt == PS3M);
@@ -543,24 +2516,7 @@ load_staged_image(S3ConnectionPtr s3conn, const std::string& key)
 }
 
 static void
-upload_staged_image(S3ConnectionPtr s3conn, IplImage *image, const std::string& key)
-{
-	assert(image->imageData != NULL);
-	std::stringstream ins;
-	ins << PS3M << SERIAL_DELIM
-		<< image->nChannels << SERIAL_DELIM
-		<< image->width << SERIAL_DELIM
-		<< image->height << SERIAL_DELIM
-		<< image->depth << std::endl;
-	ins.write(image->imageData, image->imageSize);
-//	int count = ins.gcount();
-//	std::cout << count << " " << image->imageData << " " << image->imageSize;
-//	assert(count == image->imageSize);
-    PutResponsePtr res = s3conn->put(CVDB::BUCKET, key, ins, "binary/octet-stream");
-}
-
-static void
-upload_image_table_meta(SDBConnectionPtr sdbconn,
+upload_image_table_meta(MetadataStore& metastore,
 		ImageTableMetadata *meta,
 			const char **attrs)
 {
@@ -568,67 +2524,115 @@ upload_image_table_meta(SDBConnectionPtr sdbconn,
 		attrs = IMAGE_TABLE_ATTRS;
 	}
 	const char **attr = attrs;
-    std::vector<Attribute> awsattrs;
+	Attributes values;
 	while (*attr != NULL) {
-		std::string key(*attr);
 		std::string value;
 		serial_image_table_meta(meta, *attr, value);
-  aws::Attribute awsattr(key, value, true);
-	    awsattrs.push_back(awsattr);
+		values.push_back(std::make_pair(std::string(*attr), value));
 		attr++;
 	}
-	std::string value;
-	serial_image_table_meta(meta, IMAGE_TABLE_ITEM_ID, value);
-	    PutAttributesResponsePtr res = sdbconn->putAttributes(CVDB::CATALOG,
-	value, awsattrs);
+	std::string item;
+	serial_image_table_meta(meta, IMAGE_TABLE_ITEM_ID, item);
+	metastore.put_attributes(CVDB::CATALOG, item, values);
+}
+
+static void
+load_image_table_meta(MetadataStore& metastore, ImageTableMetadata *meta)
+{
+	std::string item;
+	serial_image_table_meta(meta, IMAGE_TABLE_ITEM_ID, item);
+	Attributes attrs;
+	metastore.get_attributes(CVDB::CATALOG, item, attrs);
+	for (size_t i=0;  i<attrs.size();  ++i) {
+		deserial_image_table_meta(meta, attrs[i].first.c_str(), attrs[i].second);
+	}
+}
+
+/* The file name only holds the version, which starts again from 1 when a
+ * table is uploaded again, so cached copies are also keyed on the train
+ * id (which the file must match as well) */
+static std::string
+eigenspace_cache_key(ImageTableMetadata *meta, const std::string& key)
+{
+	std::string cachekey(CVDB::BUCKET);
+	cachekey += "/";
+	cachekey += key;
+	if (!meta->eigenspace->trainid.empty()) {
+		cachekey += "@";
+		cachekey += meta->eigenspace->trainid;
+	}
+	return cachekey;
 }
 
 static void
-load_image_table_meta(SDBConnectionPtr sdbconn, ImageTableMetadata *meta)
+upload_image_table_eigenspace(ObjectStore& objstore, ImageTableMetadata *meta)
 {
-	std::string value;
-	serial_image_table_meta(meta, IMAGE_TABLE_ITEM_ID, value);
-    GetAttributesResponsePtr res = sdbconn->getAttributes(CVDB::CATALOG,
-    		value, "");
-    res->open();
-    AttributePair attr;
-    while (res->next(attr)) {
-    	deserial_image_table_meta(meta, attr.first.c_str(), attr.second);
-    }
-    res->close();
+	assert(meta->eigenspace != NULL);
+	char buf[32];
+	sprintf(buf, EIGENSPACE_FORMAT, meta->eigenspace->version);
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += buf;
+	std::stringstream ins;
+	write_eigenspace(ins, meta->eigenspace);
+	objstore.put(CVDB::BUCKET, key, ins.str());
+
+	// a learn on this host usually follows
+	object_cache().put(eigenspace_cache_key(meta, key), ins.str());
 }
 
 static void
-upload_image_table_eigenspace(S3ConnectionPtr s3conn, ImageTableMetadata *meta)
+load_image_table_eigenspace(ObjectStore& objstore, ImageTableMetadata *meta)
 {
 	assert(meta->eigenspace != NULL);
 	char buf[32];
+	sprintf(buf, EIGENSPACE_FORMAT, meta->eigenspace->version);
 	std::string key(meta->prefix);
 	key += "/";
 	key += EIGEN_PREFIX;
-	key +=+ "/average.ps3m";
-	upload_staged_image(s3conn, meta->eigenspace->avgface, key);
-	for (int i=0;  i<meta->eigenspace->dimension;  ++i) {
-		sprintf(buf, "%d.ps3m", i);
-		key.assign(meta->prefix);
-		key += "/";
-		key += EIGEN_PREFIX;
-		key += "/";
-		key += buf;
-		upload_staged_image(s3conn, meta->eigenspace->eigenfaces[i], key);
+	key += "/";
+	key += buf;
+
+	// map the eigenspace file from the cache, fetching it if needed
+	std::string cachekey(eigenspace_cache_key(meta, key));
+	std::string path;
+	size_t size;
+	if (!object_cache().lookup(cachekey, path, size)) {
+		std::string data;
+		try {
+			objstore.get(CVDB::BUCKET, key, data);
+		} catch (ObjectNotFound& e) {
+			load_image_table_eigenfaces(objstore, meta);
+			return;
+		}
+		if (!object_cache().put(cachekey, data, path)) {
+			// no room on disk, so read it into memory instead
+			std::istringstream ins(data);
+			if (!read_eigenspace(ins, meta->eigenspace)) {
+				throw std::runtime_error("invalid eigenspace " + key);
+			}
+			return;
+		}
+	}
+	if (!map_eigenspace(path, meta->eigenspace)) {
+		object_cache().erase(cachekey);
+		throw std::runtime_error("invalid eigenspace " + key);
 	}
 }
 
+/* Tables trained before the eigenspace file have one object per image */
 static void
-load_image_table_eigenspace(S3ConnectionPtr s3conn, ImageTableMetadata *meta)
+load_image_table_eigenfaces(ObjectStore& objstore, ImageTableMetadata *meta)
 {
-	assert(meta->eigenspace != NULL);
 	char buf[32];
+	std::string tag(eigenspace_tag(meta, false));
 	std::string key(meta->prefix);
 	key += "/";
 	key += EIGEN_PREFIX;
 	key += "/average.ps3m";
-	meta->eigenspace->avgface = load_staged_image(s3conn, key);
+	meta->eigenspace->avgface = load_staged_image(objstore, key, tag);
 	meta->eigenspace->eigenfaces = new IplImage*[meta->eigenspace->dimension];
 	for (int i=0;  i<meta->eigenspace->dimension;  ++i) {
 		sprintf(buf, "%d.ps3m", i);
@@ -637,50 +2641,193 @@ load_image_table_eigenspace(S3ConnectionPtr s3conn, ImageTableMetadata *meta)
 		key += EIGEN_PREFIX;
 		key += "/";
 		key += buf;
-		meta->eigenspace->eigenfaces[i] = load_staged_image(s3conn, key);
+		meta->eigenspace->eigenfaces[i] = load_staged_image(objstore, key, tag);
 	}
 }
 
 static void
-upload_image_meta(SDBConnectionPtr sdbconn, ImageMetadata *meta, const char **attrs)
+upload_image_meta(MetadataStore& metastore, ImageMetadata *meta, const char **attrs)
 {
 	assert(meta->imagetable != NULL);
 	if (attrs == NULL) {
 		attrs = IMAGE_ATTRS;
 	}
 	const char **attr = attrs;
-    std::vector<Attribute> awsattrs;
+	Attributes values;
 	while (*attr != NULL) {
-		std::string key(*attr);
 		std::string value;
 		serial_image_meta(meta, *attr, value);
-	    Attribute awsattr(key, value, true);
-	    awsattrs.push_back (awsattr);
+		values.push_back(std::make_pair(std::string(*attr), value));
 		attr++;
 	}
 	std::string item;
 	serial_image_meta(meta, IMAGE_ITEM_ID, item);
-	    PutAttributesResponsePtr res = sdbconn->putAttributes(meta->imagetable->imagedomain,
-	item, awsattrs);
+	metastore.put_attributes(meta->imagetable->imagedomain, item, values);
 }
 
 static void
-load_image_meta(SDBConnectionPtr sdbconn, ImageMetadata *meta)
+load_image_meta(MetadataStore& metastore, ImageMetadata *meta)
 {
 	std::string item;
 	serial_image_meta(meta, IMAGE_ITEM_ID, item);
-    GetAttributesResponsePtr res = sdbconnect()->getAttributes(meta->imagetable->imagedomain,
-    		item, "");
-    res->open();
-    AttributePair attr;
-    while (res->next(attr)) {
-    	deserial_image_meta(meta, attr.first.c_str(), attr.second);
-    }
-    res->close();
+	Attributes attrs;
+	metastore.get_attributes(meta->imagetable->imagedomain, item, attrs);
+	for (size_t i=0;  i<attrs.size();  ++i) {
+		deserial_image_meta(meta, attrs[i].first.c_str(), attrs[i].second);
+	}
+}
+
+static int
+count_digits(int id)
+{
+	int digits = 1;
+	while (id >= 10) {
+		id /= 10;
+		++digits;
+	}
+	return digits;
+}
+
+static long
+power_of_ten(int n)
+{
+	long power = 1;
+	for (int i=0;  i<n;  ++i) {
+		power *= 10;
+	}
+	return power;
+}
+
+/* Counts the ids up to maxid whose names sort between those of lo and hi,
+ * which both have the given number of digits: that is, how many items a
+ * range comparison between them returns. A longer name sorts between them
+ * if it starts with a name from lo up to (but not including) hi, and a
+ * shorter one if it is a prefix of a name after lo up to hi. */
+static long
+count_between(int lo, int hi, int digits, int maxid)
+{
+	long count = 0;
+	int longest = count_digits(maxid);
+	for (int length=1;  length<=longest;  ++length) {
+		long first, last;
+		if (length < digits) {
+			long scale = power_of_ten(digits - length);
+			first = lo / scale + 1;
+			last = hi / scale;
+		} else {
+			long scale = power_of_ten(length - digits);
+			first = lo * scale;
+			last = (length == digits) ? hi : hi * scale - 1;
+		}
+		first = std::max(first, power_of_ten(length - 1));
+		last = std::min(last, std::min((long)maxid, power_of_ten(length) - 1));
+		if (last >= first) {
+			count += last - first + 1;
+		}
+	}
+	return count;
+}
+
+/* Deserializes every selected item whose id falls in the range */
+static void
+select_image_metas(Items& items,
+		std::pair<int, int> range,
+		std::vector<ImageMetadata*>& metas,
+		std::vector<bool>& found)
+{
+	for (size_t i=0;  i<items.size();  ++i) {
+		int id;
+		if (sscanf(items[i].first.c_str(), "%d", &id) != 1
+				|| id < range.first || id > range.second) {
+			continue;
+		}
+		ImageMetadata *meta = metas[id - range.first];
+		Attributes& attrs = items[i].second;
+		for (size_t j=0;  j<attrs.size();  ++j) {
+			deserial_image_meta(meta, attrs[j].first.c_str(), attrs[j].second);
+		}
+		found[id - range.first] = true;
+	}
+}
+
+static void
+load_image_metas(MetadataStore& metastore,
+		ImageTableMetadata *tablemeta,
+		std::pair<int, int> range,
+		std::vector<ImageMetadata*>& metas)
+{
+	size_t nimages = range.second - range.first + 1;
+	metas.reserve(nimages);
+	for (int i=range.first;  i<=range.second;  ++i) {
+		ImageMetadata *meta = new ImageMetadata(i);
+		meta->imagetable = tablemeta;
+		metas.push_back(meta);
+	}
+	std::vector<bool> found(nimages, false);
+
+	// Item names are unpadded ids, which only sort numerically among ids
+	// of the same length. Ids of the longest length in the table can be
+	// selected with one range comparison. Shorter ones are selected by
+	// their explicit names, unless a range comparison takes fewer pages
+	// for all the longer ids it also returns (which are then not asked
+	// for again).
+	char buf[32];
+	int maxid = std::max(tablemeta->nextimageid - 1, range.second);
+	int longest = count_digits(maxid);
+	int lo = range.first;
+	while (lo <= range.second) {
+		int digits = count_digits(lo);
+		int hi = range.second;
+		if (digits < longest) {
+			int bound = 1;
+			for (int d=0;  d<digits;  ++d) {
+				bound *= 10;
+			}
+			hi = std::min(range.second, bound - 1);
+		}
+		int first = lo;
+		int last = hi;
+		lo = hi + 1;
+		while (first <= last && found[first - range.first]) {
+			++first;
+		}
+		while (last >= first && found[last - range.first]) {
+			--last;
+		}
+		if (first > last) {
+			continue;
+		}
+
+		Items items;
+		long pages = (count_between(first, last, digits, maxid) + SELECT_LIMIT - 1)
+				/ SELECT_LIMIT;
+		long lists = (last - first + SELECT_IN_SIZE) / SELECT_IN_SIZE;
+		if (digits == longest || pages <= lists) {
+			sprintf(buf, "%d", first);
+			std::string firstname(buf);
+			sprintf(buf, "%d", last);
+			metastore.select_between(tablemeta->imagedomain, firstname, buf, items);
+		} else {
+			std::vector<std::string> names;
+			for (int id=first;  id<=last;  ++id) {
+				sprintf(buf, "%d", id);
+				names.push_back(buf);
+			}
+			metastore.select_in(tablemeta->imagedomain, names, items);
+		}
+		select_image_metas(items, range, metas, found);
+	}
+
+	// anything the selects did not return is fetched one item at a time
+	for (size_t i=0;  i<nimages;  ++i) {
+		if (!found[i]) {
+			load_image_meta(metastore, metas[i]);
+		}
+	}
 }
 
 static void
-upload_image_eigen(S3ConnectionPtr s3conn, ImageMetadata *meta)
+upload_image_eigen(ObjectStore& objstore, ImageMetadata *meta)
 {
 	assert(meta->features != NULL);
 
@@ -691,14 +2838,15 @@ upload_image_eigen(S3ConnectionPtr s3conn, ImageMetadata *meta)
 	key += "/";
 	sprintf(buf, "%d.eigen", meta->id);
 	key += buf;
-	std::stringstream ins;
-	ins.write((char*)(meta->features), sizeof(float)*meta->imagetable->eigenspace->dimension);
-	PutResponsePtr res = s3conn->put(meta->imagetable->bucket,
-			 key, ins, "binary/octet-stream");
+	Eigenspace *eigenspace = meta->imagetable->eigenspace;
+	std::ostringstream outs;
+	write_features(outs, meta->features, eigenspace->dimension,
+			eigenspace->version);
+	objstore.put(meta->imagetable->bucket, key, outs.str());
 }
 
 static void
-load_image_eigen(S3ConnectionPtr s3conn, ImageMetadata *meta)
+load_image_eigen(ObjectStore& objstore, ImageMetadata *meta)
 {
 
 	char buf[32];
@@ -709,15 +2857,308 @@ load_image_eigen(S3ConnectionPtr s3conn, ImageMetadata *meta)
 	sprintf(buf, "%d.eigen", meta->id);
 	key += buf;
 
+	// features of another version would be cached as this one, so they
+	// are dropped, as are any of another dimension
+	Eigenspace *eigenspace = meta->imagetable->eigenspace;
+	std::string tag(eigenspace_tag(meta->imagetable, false));
+	std::string data;
+	get_object(objstore, CVDB::BUCKET, key, data, tag);
+	std::vector<float> features;
+	int version;
+	if (!read_image_eigen(data, features, version)
+			|| features.size() != (size_t)eigenspace->dimension
+			|| (version >= 0 && version != eigenspace->version)) {
+		object_cache().erase(std::string(CVDB::BUCKET) + "/" + key + "@" + tag);
+		throw std::runtime_error("features " + key
+				+ " are not of the eigenspace, reproject the table");
+	}
 	if (meta->features == NULL) {
-		meta->features = new float[meta->imagetable->eigenspace->dimension];
+		meta->features = new float[eigenspace->dimension];
+	}
+	std::copy(features.begin(), features.end(), meta->features);
+}
+
+/* Scores the rows of a block from first (by default, all of them) */
+static void
+score_features(FeatureBlock *block, const float *query, Neighbors& neighbors,
+		int first)
+{
+	// score in bounded pieces to keep the distance buffer small
+	double dists[QUERY_BLOCK_SIZE];
+	for (int i=std::max(first, block->first);  i<=block->last;  i+=QUERY_BLOCK_SIZE) {
+		int n = std::min(QUERY_BLOCK_SIZE, block->last - i + 1);
+		if (block->encoding == ENCODING_F16) {
+			vector_distances_f16(block->dimension, query,
+					(const unsigned short*)block->code(i), n, dists);
+		} else if (block->encoding == ENCODING_I8) {
+			vector_distances_i8(block->dimension, query, block->code(i),
+					block->scale, block->offset, n, dists);
+		} else {
+			vector_distances(block->dimension, query, block->row(i), n, dists);
+		}
+		for (int j=0;  j<n;  ++j) {
+			neighbors.offer(i + j, dists[j]);
+		}
+	}
+}
+
+static void
+shard_range(ImageTableMetadata *meta, int shard, std::pair<int, int>& ids)
+{
+	// image ids start at 1, and the last shard stops at the last image
+	assert(meta->shardsize > 0);
+	ids.first = shard*meta->shardsize + 1;
+	ids.second = ids.first + meta->shardsize - 1;
+	if (meta->nextimageid > ids.first && ids.second >= meta->nextimageid) {
+		ids.second = meta->nextimageid - 1;
+	}
+}
+
+static void
+upload_image_eigen_shard(ObjectStore& objstore,
+		ImageTableMetadata *meta,
+		int shard,
+		FeatureBlock *block)
+{
+	char buf[32];
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += SHARD_PREFIX;
+	key += "/";
+	sprintf(buf, "%d.shard", shard);
+	key += buf;
+	std::stringstream ins;
+	write_feature_block(ins, block);
+	objstore.put(meta->bucket, key, ins.str());
+}
+
+static FeatureBlock *
+load_image_eigen_shard(ObjectStore& objstore, ImageTableMetadata *meta, int shard)
+{
+	char buf[32];
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += SHARD_PREFIX;
+	key += "/";
+	sprintf(buf, "%d.shard", shard);
+	key += buf;
+
+	std::string data;
+	try {
+		get_object(objstore, CVDB::BUCKET, key, data, eigenspace_tag(meta, true));
+	} catch (ObjectNotFound& e) {
+		return NULL;
+	}
+	std::istringstream ins(data);
+	FeatureBlock *block = read_feature_block(ins);
+	if (block == NULL) {
+		return NULL;
+	}
+
+	// ignore shards of another layout or of an older eigenspace; a shard
+	// written before images were added holds only the front of its range
+	std::pair<int, int> ids;
+	shard_range(meta, shard, ids);
+	if (block->first != ids.first || block->last > ids.second
+			|| block->last < block->first
+			|| block->dimension != meta->eigenspace->dimension
+			|| block->version != meta->eigenspace->version) {
+		delete block;
+		return NULL;
+	}
+	return block;
+}
+
+/* An empty block in the table's encoding, for its current eigenspace */
+static FeatureBlock *
+new_feature_block(ImageTableMetadata *meta, int first, int last)
+{
+	Eigenspace *eigenspace = meta->eigenspace;
+	FeatureBlock *block = new FeatureBlock(first, last, eigenspace->dimension,
+			meta->encoding);
+	block->version = eigenspace->version;
+	if (meta->encoding == ENCODING_I8) {
+		if (eigenspace->eigenvalues == NULL) {
+			delete block;
+			throw std::runtime_error("i8 features need an eigenspace with eigenvalues, retrain the table");
+		}
+		// the eigenvalues are the variances of the features
+		block->calibrate(eigenspace->eigenvalues);
+	}
+	return block;
+}
+
+static void
+load_image_features(ObjectStore& objstore, ImageMetadata *meta)
+{
+	ImageTableMetadata *tablemeta = meta->imagetable;
+	if (tablemeta->shardsize > 0) {
+		FeatureBlock *block = load_image_eigen_shard(objstore, tablemeta,
+				(meta->id - 1) / tablemeta->shardsize);
+		if (block != NULL && meta->id > block->last) {
+			delete block;
+			block = NULL;
+		}
+		if (block != NULL) {
+			if (meta->features == NULL) {
+				meta->features = new float[block->dimension];
+			}
+			block->get(meta->id, meta->features);
+			delete block;
+			return;
+		}
 	}
-    GetResponsePtr res = s3conn->get(CVDB::BUCKET, key);
-    std::istream& ins = res->getInputStream();
-    ins.read((char*)(meta->features), sizeof(float)*meta->imagetable->eigenspace->dimension);
+	load_image_eigen(objstore, meta);
+}
+
+/* The last id of the block of features starting at first that is loaded
+ * at once: the rest of its shard, or QUERY_BLOCK_SIZE images */
+static int
+block_last(ImageTableMetadata *meta, int first, std::pair<int, int> range)
+{
+	if (meta->shardsize > 0) {
+		std::pair<int, int> ids;
+		shard_range(meta, (first - 1) / meta->shardsize, ids);
+		return std::min(ids.second, range.second);
+	}
+	return std::min(first + QUERY_BLOCK_SIZE - 1, range.second);
+}
+
+/* Scores a shortlist again against the stored features (decoded, if the
+ * shards are quantized), fetching every shard it touches once */
+static void
+rerank_features(ObjectStore& objstore, ImageTableMetadata *meta,
+		const float *query, const Neighbors& shortlist, Neighbors& neighbors)
+{
+	std::vector<Neighbors::Neighbor> candidates;
+	shortlist.sorted(candidates);
+	std::vector<int> ids;
+	for (size_t j=0;  j<candidates.size();  ++j) {
+		ids.push_back(candidates[j].second);
+	}
+	std::sort(ids.begin(), ids.end());
+
+	int dimension = meta->eigenspace->dimension;
+	std::vector<float> row(dimension);
+	FeatureBlock *block = NULL;
+	int shard = -1;
+	for (size_t j=0;  j<ids.size();  ++j) {
+		int id = ids[j];
+		if (meta->shardsize > 0 && (id - 1) / meta->shardsize != shard) {
+			delete block;
+			shard = (id - 1) / meta->shardsize;
+			block = load_image_eigen_shard(objstore, meta, shard);
+		}
+		if (block != NULL && id <= block->last) {
+			block->get(id, &row[0]);
+		} else {
+			ImageMetadata imagemeta(id);
+			imagemeta.imagetable = meta;
+			load_image_eigen(objstore, &imagemeta);
+			memcpy(&row[0], imagemeta.features, sizeof(float)*dimension);
+		}
+		neighbors.offer(id, vector_distance_simd(dimension, query, &row[0]));
+	}
+	delete block;
+}
+
+static void
+upload_image_table_index(ObjectStore& objstore, ImageTableMetadata *meta,
+		FeatureIndex *index)
+{
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += INDEX_NAME;
+	std::stringstream ins;
+	index->write(ins);
+	objstore.put(meta->bucket, key, ins.str());
+}
+
+/* The table's index, or NULL if it has none for the current eigenspace */
+static FeatureIndex *
+load_image_table_index(ObjectStore& objstore, ImageTableMetadata *meta)
+{
+	if (meta->index <= 0) {
+		return NULL;
+	}
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += INDEX_NAME;
+
+	// the index is rewritten in place by every build
+	char buf[32];
+	sprintf(buf, "i%d", meta->index);
+	std::string data;
+	try {
+		get_object(objstore, CVDB::BUCKET, key, data, buf);
+	} catch (ObjectNotFound& e) {
+		return NULL;
+	}
+	std::istringstream ins(data);
+	FeatureIndex *index = FeatureIndex::read(ins);
+	if (index != NULL && (index->dimension != meta->eigenspace->dimension
+			|| index->version != meta->eigenspace->version)) {
+		delete index;
+		return NULL;
+	}
+	return index;
 }
 
 static void
+upload_image_table_graph(ObjectStore& objstore, ImageTableMetadata *meta,
+		GraphIndex *graph)
+{
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += GRAPH_NAME;
+	std::stringstream ins;
+	graph->write(ins);
+	objstore.put(meta->bucket, key, ins.str());
+}
+
+/* The table's graph, or NULL if it has none for the current eigenspace */
+static GraphIndex *
+load_image_table_graph(ObjectStore& objstore, ImageTableMetadata *meta)
+{
+	if (meta->graph <= 0) {
+		return NULL;
+	}
+	std::string key(meta->prefix);
+	key += "/";
+	key += EIGEN_PREFIX;
+	key += "/";
+	key += GRAPH_NAME;
+
+	// the graph is rewritten in place by every build or extension
+	char buf[32];
+	sprintf(buf, "g%d", meta->graph);
+	std::string data;
+	try {
+		get_object(objstore, CVDB::BUCKET, key, data, buf);
+	} catch (ObjectNotFound& e) {
+		return NULL;
+	}
+	std::istringstream ins(data);
+	GraphIndex *graph = GraphIndex::read(ins);
+	if (graph != NULL && (graph->dimension != meta->eigenspace->dimension
+			|| graph->version != meta->eigenspace->version)) {
+		delete graph;
+		return NULL;
+	}
+	return graph;
+}
+
+void
 serial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::string& val)
 {
 	std::stringstream str;
@@ -737,7 +3178,21 @@ serial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::string&
 			str << meta->eigenspace->dimension;
 			str << SERIAL_DELIM;
 			str << meta->eigenspace->resolution;
+			str << SERIAL_DELIM;
+			str << meta->eigenspace->version;
+			if (!meta->eigenspace->trainid.empty()) {
+				str << SERIAL_DELIM;
+				str << meta->eigenspace->trainid;
+			}
 		}
+	} else if (!strcmp(attr, IMAGE_TABLE_ATTR_SHARDSIZE)) {
+		str << meta->shardsize;
+	} else if (!strcmp(attr, IMAGE_TABLE_ATTR_ENCODING)) {
+		str << encoding_name(meta->encoding);
+	} else if (!strcmp(attr, IMAGE_TABLE_ATTR_INDEX)) {
+		str << meta->index;
+	} else if (!strcmp(attr, IMAGE_TABLE_ATTR_GRAPH)) {
+		str << meta->graph;
 	} else {
 		std::cout << attr << std::endl;
 		assert(0);
@@ -746,7 +3201,7 @@ serial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::string&
 	val.assign(str.str());
 }
 
-static void
+void
 deserial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::string& val)
 {
 	std::stringstream str(val);
@@ -768,13 +3223,29 @@ deserial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::strin
 			}
 			str >> meta->eigenspace->dimension;
 			str >> meta->eigenspace->resolution;
+			// tables trained before versioning have no version, and
+			// those trained before train ids no train id
+			if (!(str >> meta->eigenspace->version)) {
+				meta->eigenspace->version = 0;
+			}
+			if (!(str >> meta->eigenspace->trainid)) {
+				meta->eigenspace->trainid.clear();
+			}
 		}
+	} else if (!strcmp(attr, IMAGE_TABLE_ATTR_SHARDSIZE)) {
+		str >> meta->shardsize;
+	} else if (!strcmp(attr, IMAGE_TABLE_ATTR_ENCODING)) {
+		meta->encoding = std::max(encoding_from_name(val.c_str()), (int)ENCODING_F32);
+	} else if (!strcmp(attr, IMAGE_TABLE_ATTR_INDEX)) {
+		str >> meta->index;
+	} else if (!strcmp(attr, IMAGE_TABLE_ATTR_GRAPH)) {
+		str >> meta->graph;
 	} else {
 		assert(0);
 	}
 }
 
-static void
+void
 serial_image_meta(ImageMetadata *meta, const char* attr, std::string& val)
 {
 	std::stringstream str;
@@ -800,7 +3271,7 @@ serial_image_meta(ImageMetadata *meta, const char* attr, std::string& val)
 	val.assign(str.str());
 }
 
-static void
+void
 deserial_image_meta(ImageMetadata *meta, const char* attr, std::string& val)
 {
 	std::stringstream str(val);
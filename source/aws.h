@@ -5,14 +5,18 @@
 #define CLOUDVISION_AWS_H
 
 #include "image.h"
+#include "index.h"
+#include "pool.h"
+#include "cache.h"
+#include "store.h"
+#include "pipeline.h"
+#include "profiler.h"
 
 #include <opencv/cv.h>
 #include <libaws/aws.h>
 
 #include <string>
-
-// for profiling on Linux
-#include <sys/time.h>
+#include <map>
 
 using namespace aws;
 
@@ -26,35 +30,80 @@ s3connect();
 SDBConnectionPtr
 sdbconnect();
 
+SQSConnectionPtr
+sqsconnect();
+
+typedef ConnectionPool<S3ConnectionPtr> S3ConnectionPool;
+typedef ConnectionPool<SDBConnectionPtr> SDBConnectionPool;
+typedef PooledConnection<S3ConnectionPtr> PooledS3Connection;
+typedef PooledConnection<SDBConnectionPtr> PooledSDBConnection;
+
+/* Process-wide connection pools, sized by CVDB_POOL_SIZE (default 8) */
+S3ConnectionPool&
+s3pool();
+
+SDBConnectionPool&
+sdbpool();
+
+void
+set_pool_size(size_t size);
+
+/* Writes the hits and misses of each pool, one pool per line */
+void
+write_pool_stats(std::ostream& outs);
+
+/* Process-wide stores, chosen by CVDB_STORAGE: "aws" (the default) for
+ * S3 and SimpleDB through the pools above, "local:DIR" for a directory
+ * (see LocalObjectStore), or "memory" for the life of the process. With
+ * CVDB_STORAGE_LATENCY (milliseconds per request) or
+ * CVDB_STORAGE_BANDWIDTH (megabytes per second) every request is slowed
+ * down to match (see ThrottledObjectStore). Throws for an unknown
+ * CVDB_STORAGE. */
+ObjectStore&
+object_store();
+
+MetadataStore&
+metadata_store();
+
+/* The process-wide queue of distributed runs, chosen by CVDB_QUEUE: "sqs"
+ * (the default) for the SQS queues of scheduler.py, or "spool:DIR" for
+ * a directory (see SpoolTaskQueue). Throws for an unknown CVDB_QUEUE. */
+TaskQueue&
+task_queue();
+
+/* Process-wide cache of stored objects in CVDB_CACHE_DIR (default
+ * /tmp/cvdb-cache), bounded by CVDB_CACHE_SIZE megabytes (default 1024
+ * for aws storage and 0 otherwise, 0 disables it) */
+DiskCache&
+object_cache();
+
+/* Reads an object through the object cache, throws ObjectNotFound if it
+ * does not exist. Objects that are rewritten in place must pass a tag
+ * naming the version expected. */
+void
+get_object(ObjectStore& objstore, const std::string& bucket,
+		const std::string& key, std::string& data, const std::string& tag="");
+
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-typedef struct Timer
-{
-	timeval start;
-	timeval stop;
-} Timer;
+/* The attributes stored for each image and each table, NULL terminated */
+extern const char *IMAGE_ATTRS[];
+extern const char *IMAGE_TABLE_ATTRS[];
 
-class Profiler
-{
-public:
-	static const char *DELIM;
+/* Convert one attribute of a table's or an image's metadata to and from
+ * its stored value */
+void
+serial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::string& val);
 
-	Profiler();
-	~Profiler();
+void
+deserial_image_table_meta(ImageTableMetadata *meta, const char* attr, std::string& val);
 
-	void start();
-	void stop(const std::string& val);
-	void flush();
+void
+serial_image_meta(ImageMetadata *meta, const char* attr, std::string& val);
 
-private:
-	std::string filename;
-	std::vector< std::pair<float, std::string> > events;
-	std::vector<Timer> timers;
-};
-
-///////////////////////////////////////////////////////////////////////////////
-///////////////////////////////////////////////////////////////////////////////
+void
+deserial_image_meta(ImageMetadata *meta, const char* attr, std::string& val);
 
 class CVDB
 {
@@ -63,20 +112,123 @@ public:
 	static const char *BUCKET;
 	static const char *CATALOG;
 
-	/* Creates an eigenspace for an image table */
-	int train(int tableid, size_t resolution, std::pair<int, int> range);
-
-	/* Learns feature vectors for a subset of images */
-	int learn(int tableid, std::pair<int, int> range);
-
-	/* Calculates the minimum vector distance for a subset of images */
-	int query(int tableid, int imageid, std::pair<int, int> range, std::ostream& outs);
+	static const size_t WINDOW = 4;
+	static const size_t BATCH = 16;
+
+	CVDB();
+	~CVDB();
+
+	/* Keeps the eigenspaces learn loads in memory from then on, for a
+	 * worker running one command after another. A table's is loaded
+	 * again once its version or train id changes. */
+	void keep_warm();
+
+	/* Drops the profiled events that a command which threw left started on
+	 * the calling thread, before a worker runs the next one */
+	void abandon_events();
+
+	/* Creates an eigenspace for an image table, fetching up to window
+	 * images at a time, and keeping at most ncomponents eigenfaces (if
+	 * positive) or those retaining the given fraction of the variance
+	 * (if in (0, 1)). With passes of 1 or 2 the images are streamed
+	 * through a sketch of ncomponents (see EigenspaceSketch) instead of
+	 * all being held in memory. */
+	int train(int tableid, size_t resolution, std::pair<int, int> range,
+			size_t window=WINDOW, int ncomponents=0, double variance=0,
+			int passes=0);
+
+	/* Sketches a subset of images for a distributed train (see
+	 * EigenspaceSketch), uploading the statistics under the table's eigen
+	 * prefix and writing their key to outs. Every chunk of one train must
+	 * use the same resolution and ncomponents. */
+	int train_partial(int tableid, size_t resolution, std::pair<int, int> range,
+			std::ostream& outs, size_t window=WINDOW, int ncomponents=0);
+
+	/* Sums the statistics of train_partial over disjoint chunks and
+	 * creates the next version of the table's eigenspace from them, as
+	 * train does, then removes the partials */
+	int train_merge(int tableid, const std::vector<std::string>& partials,
+			double variance=0);
+
+	/* Folds a range of new images into the table's eigenspace as its next
+	 * version, at a cost that grows with the new images only. At most
+	 * ncomponents eigenfaces are kept (by default as many as before), or
+	 * those retaining the given fraction of the variance. */
+	int update(int tableid, std::pair<int, int> range, size_t window=WINDOW,
+			int ncomponents=0, double variance=0);
+
+	/* Rotates the stored feature vectors of a range into the current
+	 * eigenspace (see FeatureRotation) instead of learning them again from
+	 * their images. Shards know their version, and those starting in the
+	 * range are rotated whole; features stored one image at a time are
+	 * taken to be of version from, by default the previous one. */
+	int reproject(int tableid, std::pair<int, int> range, int from=0,
+			size_t window=WINDOW);
+
+	/* Learns feature vectors for a subset of images, optionally
+	 * packing them into shards of shardsize ids, stored in the given
+	 * encoding (if not negative) from then on. The range is split
+	 * between nthreads threads (at shard boundaries, if it holds a shard
+	 * per thread), each of which has up to window images fetched ahead
+	 * and up to window uploads in flight. With graph, the threads also
+	 * insert the images the table's graph does not hold yet into it as
+	 * they go; the graph must reach the start of the range, and only one
+	 * learn may extend it at once. Features are projected batch images at
+	 * a time (see Projector). A table already in shards of another size
+	 * is only resharded by a learn of every image, since its old shards
+	 * become unreadable. */
+	int learn(int tableid, std::pair<int, int> range, int shardsize=0,
+			size_t window=WINDOW, int nthreads=1, int encoding=-1,
+			bool graph=false, size_t batch=BATCH);
+
+	/* Builds an approximate nearest neighbour index (see FeatureIndex)
+	 * over the learned feature vectors of every image, with nlists lists
+	 * (by default 4 sqrt(images)) and nsubspaces bytes per image (by
+	 * default one per 4 dimensions), trained on a sample of nsample
+	 * vectors (by default 32 per list). It is stored beside the
+	 * eigenspace, and only used while that is current. */
+	int index(int tableid, int nlists=0, int nsubspaces=0, size_t nsample=0);
+
+	/* Links the learned feature vectors of every image into a graph (see
+	 * GraphIndex) of degree m, built with efconstruction candidates per
+	 * image by nthreads threads at once. It is stored beside the
+	 * eigenspace, and only used while that is current. */
+	int graph(int tableid, int m=GRAPH_M, int efconstruction=GRAPH_EF_CONSTRUCTION,
+			int nthreads=1);
+
+	/* Finds the k nearest images in a subset of images, ignoring those
+	 * farther than threshold (squared distance) if it is non-negative.
+	 * With ef, the table's graph is searched for ef candidates instead
+	 * of scanning the subset. Otherwise, with nprobe, the table's index
+	 * is searched in the nprobe lists nearest the image, and a shortlist
+	 * of shortlist candidates (by default 10 k) is re-ranked by their
+	 * stored features. Images learned after the graph or index was
+	 * built are still scanned. */
+	int query(int tableid, int imageid, std::pair<int, int> range, std::ostream& outs,
+			size_t k=1, double threshold=-1, int nprobe=0, size_t shortlist=0,
+			size_t ef=0);
+
+	/* Keeps the feature vectors of a subset of images resident and
+	 * answers queries for them on a local socket, searching the table's
+	 * graph for ef candidates if ef is positive */
+	int serve(int tableid, std::pair<int, int> range, const std::string& path,
+			size_t ef=0);
 
 	/* Extracts and uploads image database metadata in bulk */
 	int upload(ImageScanner *scanner, int tableid, const std::string& s3prefix);
 
 private:
+	CVDB(const CVDB&);
+	CVDB& operator=(const CVDB&);
+
+	void load_eigenspace(ObjectStore& objstore, ImageTableMetadata *tablemeta);
+
+	FeatureBlock *load_features(MetadataStore& metastore, ObjectStore& objstore,
+			ImageTableMetadata *tablemeta, std::pair<int, int> range);
+
 	Profiler profiler;
+	bool warm;
+	std::map<int, Eigenspace*> eigenspaces;	// by table, while warm
 
 };
 
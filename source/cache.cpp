@@ -0,0 +1,369 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "cache.h"
+
+#include <algorithm>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* files that are not entries start with a dot */
+static const char *LOCK_FILE = ".lock";
+static const char *TEMP_PREFIX = ".tmp.";
+
+/* scan once a process has written this fraction of the capacity */
+static const long long SCAN_FRACTION = 16;
+
+/* evict down to this fraction of the capacity, so that a full cache is
+ * not scanned on every write */
+static const double LOW_WATER = 0.9;
+
+/* temporary files older than this were left by a writer that died */
+static const time_t STALE_SECS = 3600;
+
+/* hex digits of the key length that ends every entry */
+static const size_t KEY_LENGTH_DIGITS = 8;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* What follows the object in the entry of key */
+static std::string
+entry_trailer(const std::string& key)
+{
+	char buf[16];
+	sprintf(buf, "%0*lx", (int)KEY_LENGTH_DIGITS, (unsigned long)key.size());
+	return key + buf;
+}
+
+/* Writes all len bytes, returns false on an error */
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+DiskCache::DiskCache(const std::string& dir, size_t capacity)
+  : dir(dir), capacity(capacity), nhits(0), nmisses(0), nsaved(0),
+    used(0), unscanned(capacity), scanning(false) // scan on the first write
+{
+	pthread_mutex_init(&mutex, NULL);
+	if (capacity > 0 && mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+		this->capacity = 0;
+	}
+}
+
+DiskCache::~DiskCache()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+bool
+DiskCache::get(const std::string& key, std::string& data)
+{
+	if (capacity == 0) {
+		return false;
+	}
+	std::string path;
+	entry_path(key, path);
+	std::ifstream ins(path.c_str(), std::fstream::in | std::fstream::binary);
+	if (!ins) {
+		count(false, 0);
+		return false;
+	}
+	ins.seekg(0, std::ios::end);
+	std::streamsize size = ins.tellg();
+	ins.seekg(0, std::ios::beg);
+	data.resize(size);
+	if (size > 0) {
+		ins.read(&data[0], size);
+	}
+	// an entry of another key whose hash is the same is a miss too
+	std::string trailer(entry_trailer(key));
+	if (!ins || ins.gcount() != size || data.size() < trailer.size()
+			|| data.compare(data.size() - trailer.size(), trailer.size(),
+					trailer) != 0) {
+		count(false, 0);
+		return false;
+	}
+	data.resize(data.size() - trailer.size());
+	utimes(path.c_str(), NULL);
+	count(true, data.size());
+	return true;
+}
+
+bool
+DiskCache::lookup(const std::string& key, std::string& path, size_t& size)
+{
+	if (capacity == 0) {
+		return false;
+	}
+	entry_path(key, path);
+	std::string trailer(entry_trailer(key));
+	std::vector<char> tail(trailer.size());
+	bool hit = false;
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+		hit = fstat(fd, &st) == 0 && (size_t)st.st_size >= trailer.size()
+				&& pread(fd, &tail[0], tail.size(), st.st_size - tail.size())
+						== (ssize_t)tail.size()
+				&& std::equal(tail.begin(), tail.end(), trailer.begin());
+		if (hit) {
+			size = st.st_size - tail.size();
+		}
+		close(fd);
+	}
+	if (!hit) {
+		count(false, 0);
+		return false;
+	}
+	utimes(path.c_str(), NULL);
+	count(true, size);
+	return true;
+}
+
+bool
+DiskCache::put(const std::string& key, const std::string& data)
+{
+	std::string path;
+	return put(key, data, path);
+}
+
+bool
+DiskCache::put(const std::string& key, const std::string& data, std::string& path)
+{
+	return write_entry(key, data.data(), data.size(), path);
+}
+
+bool
+DiskCache::put(const std::string& key, const char *data, size_t size)
+{
+	std::string path;
+	return write_entry(key, data, size, path);
+}
+
+bool
+DiskCache::write_entry(const std::string& key, const char *data, size_t size,
+		std::string& path)
+{
+	std::string trailer(entry_trailer(key));
+	if (capacity == 0 || size + trailer.size() > capacity) {
+		return false;
+	}
+
+	// write to a temporary file and rename, so that concurrent readers
+	// never see a partial entry
+	std::string tmppath(dir);
+	tmppath += "/";
+	tmppath += TEMP_PREFIX;
+	tmppath += "XXXXXX";
+	std::vector<char> tmpname(tmppath.begin(), tmppath.end());
+	tmpname.push_back('\0');
+	int fd = mkstemp(&tmpname[0]);
+	if (fd < 0) {
+		return false;
+	}
+	bool written = write_all(fd, data, size)
+			&& write_all(fd, trailer.data(), trailer.size());
+	close(fd);
+	entry_path(key, path);
+	if (!written || rename(&tmpname[0], path.c_str()) < 0) {
+		unlink(&tmpname[0]);
+		return false;
+	}
+	added(size + trailer.size());
+	return true;
+}
+
+void
+DiskCache::erase(const std::string& key)
+{
+	if (capacity == 0) {
+		return;
+	}
+	std::string path;
+	entry_path(key, path);
+	unlink(path.c_str());
+}
+
+long
+DiskCache::hits()
+{
+	pthread_mutex_lock(&mutex);
+	long n = nhits;
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+long
+DiskCache::misses()
+{
+	pthread_mutex_lock(&mutex);
+	long n = nmisses;
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+long long
+DiskCache::saved()
+{
+	pthread_mutex_lock(&mutex);
+	long long n = nsaved;
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+void
+DiskCache::write_stats(std::ostream& outs)
+{
+	pthread_mutex_lock(&mutex);
+	long n = nhits + nmisses;
+	char buf[128];
+	sprintf(buf, "cache %ld %ld %.3f %lld", nhits, nmisses,
+			n > 0 ? (double)nhits / n : 0.0, nsaved);
+	pthread_mutex_unlock(&mutex);
+	outs << buf << std::endl;
+}
+
+void
+DiskCache::entry_path(const std::string& key, std::string& path) const
+{
+	// 64 bit FNV-1a
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i=0;  i<key.size();  ++i) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+	char buf[32];
+	sprintf(buf, "/%016llx", hash);
+	path.assign(dir);
+	path += buf;
+}
+
+void
+DiskCache::count(bool hit, long long size)
+{
+	pthread_mutex_lock(&mutex);
+	if (hit) {
+		++nhits;
+		nsaved += size;
+	} else {
+		++nmisses;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void
+DiskCache::added(long long size)
+{
+	pthread_mutex_lock(&mutex);
+	used += size;
+	unscanned += size;
+	bool scan = !scanning && (used > (long long)capacity
+			|| unscanned >= (long long)capacity / SCAN_FRACTION);
+	if (scan) {
+		// one thread scans, the others carry on writing
+		scanning = true;
+		unscanned = 0;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (scan) {
+		evict();
+	}
+}
+
+void
+DiskCache::evict()
+{
+	// the lock serializes scans between processes
+	std::string lockpath(dir);
+	lockpath += "/";
+	lockpath += LOCK_FILE;
+	int lockfd = open(lockpath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (lockfd >= 0) {
+		flock(lockfd, LOCK_EX);
+	}
+
+	std::vector< std::pair<time_t, std::string> > entries;
+	long long total = 0;
+	time_t now = time(NULL);
+	DIR *d = opendir(dir.c_str());
+	if (d != NULL) {
+		struct dirent *ent;
+		while ((ent = readdir(d)) != NULL) {
+			std::string path(dir);
+			path += "/";
+			path += ent->d_name;
+			struct stat st;
+			if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+				continue;
+			}
+			if (ent->d_name[0] == '.') {
+				if (!strncmp(ent->d_name, TEMP_PREFIX, strlen(TEMP_PREFIX))
+						&& now - st.st_mtime > STALE_SECS) {
+					unlink(path.c_str());
+				}
+				continue;
+			}
+			entries.push_back(std::pair<time_t, std::string>(st.st_mtime, path));
+			total += st.st_size;
+		}
+		closedir(d);
+	}
+
+	// least recently used first
+	if (total > (long long)capacity) {
+		std::sort(entries.begin(), entries.end());
+		long long target = (long long)(capacity*LOW_WATER);
+		for (size_t i=0;  i<entries.size() && total>target;  ++i) {
+			struct stat st;
+			if (stat(entries[i].second.c_str(), &st) == 0
+					&& unlink(entries[i].second.c_str()) == 0) {
+				total -= st.st_size;
+			}
+		}
+	}
+
+	if (lockfd >= 0) {
+		flock(lockfd, LOCK_UN);
+		close(lockfd);
+	}
+
+	pthread_mutex_lock(&mutex);
+	used = total + unscanned;
+	scanning = false;
+	pthread_mutex_unlock(&mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,91 @@
+/****************************************************************************
+ *
+ * A size-bounded, least recently used cache of objects on local disk,
+ * shared by every process on the host that uses the same directory.
+ *
+ * Each entry is a plain file named by a hash of its key, holding the
+ * object followed by the key and its length, so that a hit is checked
+ * against its key and the object still starts the file for those who map
+ * it. Entries are written to a temporary file and renamed into place, so
+ * readers only ever see whole entries, and a hit refreshes the
+ * modification time of its file. Once the bytes written since the last
+ * scan could have pushed the directory over capacity, it is scanned under
+ * an exclusive flock and the least recently used entries are removed.
+ * Processes only see each other's writes when they scan, so the directory
+ * may briefly exceed its capacity by a fraction of it per process.
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_CACHE_H
+#define CLOUDVISION_CACHE_H
+
+
+#include <string>
+#include <ostream>
+#include <pthread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+class DiskCache
+{
+public:
+	/* A capacity of 0 bytes disables the cache */
+	DiskCache(const std::string& dir, size_t capacity);
+	~DiskCache();
+
+	/* Reads the entry for key, returns false on a miss */
+	bool get(const std::string& key, std::string& data);
+
+	/* Finds the file of the entry for key, whose first size bytes are
+	 * the object, returns false on a miss. The file may be evicted at any
+	 * time, but stays readable once opened or mapped. */
+	bool lookup(const std::string& key, std::string& path, size_t& size);
+
+	/* Adds or replaces the entry for key, returns false if it could not
+	 * be written (or the cache is disabled). The second form takes the
+	 * size bytes at data, and the third also returns the file of the new
+	 * entry. */
+	bool put(const std::string& key, const std::string& data);
+	bool put(const std::string& key, const char *data, size_t size);
+	bool put(const std::string& key, const std::string& data, std::string& path);
+
+	void erase(const std::string& key);
+
+	long hits();
+	long misses();
+
+	/* Bytes served from disk rather than fetched */
+	long long saved();
+
+	/* Writes "cache HITS MISSES HITRATIO SAVEDBYTES" on one line */
+	void write_stats(std::ostream& outs);
+
+private:
+	DiskCache(const DiskCache&);
+	DiskCache& operator=(const DiskCache&);
+
+	void entry_path(const std::string& key, std::string& path) const;
+	bool write_entry(const std::string& key, const char *data, size_t size,
+			std::string& path);
+	void count(bool hit, long long size);
+	void added(long long size);
+	void evict();
+
+	std::string dir;
+	size_t capacity;
+
+	pthread_mutex_t mutex;
+	long nhits;
+	long nmisses;
+	long long nsaved;
+	long long used;			// bytes at the last scan plus those added since
+	long long unscanned;	// bytes added since the last scan
+	bool scanning;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_CACHE_H
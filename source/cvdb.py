@@ -2,7 +2,22 @@
 # Usage:
 #
 # master NWORKERS NCHUNKS START STOP COMMAND ARGS
-# worker
+# worker [--tasks N] [--idle SECONDS]
+#
+# The master deals the range START..STOP out to workers as they ask for it,
+# in grains of 1/NCHUNKS of it (see scheduler.GuidedSchedule), and
+# NWORKERS sizes what each worker is allotted. With --shard SIZE among the
+# ARGS, NCHUNKS counts chunks of whole shards, and every task is whole
+# shards but for the ends of the range, so that none is learned an image
+# at a time.
+#
+# With COMMAND train-partial, the master merges the partial statistics of
+# every chunk with train-merge once they are all uploaded. If any chunk
+# fails, the master lists the failed chunks and exits 1 without merging
+# or printing a result.
+#
+# A worker is faces worker, which takes tasks from the queue named by
+# CVDB_QUEUE (see scheduler.task_queue) and runs them in process.
 #
 
 
@@ -10,7 +25,7 @@ import scheduler
 
 import simplejson as json
 
-import socket
+import os
 import subprocess
 import sys
 import time
@@ -28,99 +43,127 @@ def master(argv):
     command = argv[4]
     command_args = argv[5:]
     cumulative_result = None
-    
-    master = scheduler.TaskMaster()
-    
-    # create tasks
-    tasks = [ ]
-    step = (partition[1] - partition[0] + 1) / nchunks
-    for i in range(nchunks):
-        chunk = [partition[0] + i*step]
-        chunk.append(partition[1] if i==nchunks-1 else chunk[0]+step-1)
-        task = { 'id' : i,
+
+    # workers are handed the range a grain at a time, a grain being what
+    # one of nchunks equal chunks used to be, in whole shards if sharded
+    grain = (partition[1] - partition[0] + nchunks) // nchunks
+    shard = int(get_option(command_args, 'shard', 1))
+    schedule = scheduler.GuidedSchedule(partition[0], partition[1], grain,
+                                        nworkers, unit=shard)
+
+    def make_task(taskid, chunk):
+        task = { 'id' : taskid,
                  'tag' : TASK_TAG,
-                'command' : command, 
-                'command_args' : command_args,
-                'chunk' : chunk }
+                 'command' : command,
+                 'command_args' : command_args,
+                 'chunk' : chunk }
         print "Task: ", task
-        tasks.append(master.new_task(task))
-    master.start(tasks)
-    
-    # wait for workers to register
+        return task
+
+    master = scheduler.TaskMaster(schedule, make_task)
+    master.start()
+
+    # main loop, work goes to each worker as soon as it registers
     workers = set()
-    while len(workers) < nworkers:
-        msg = master.poll()
-        if msg is None:
-            time.sleep(0.5)
-            continue
-        if msg['tag'] == REGISTER_TAG and msg['id'] not in workers:
-            workers.add(msg['id'])
-    print "Workers: ", workers
-    
-    # main loop
+    failed = [ ]
     start = time.time()
     while not master.done():
         result = master.next()
         if result is None:
             time.sleep(0.001)
             continue
-        if result['tag'] == TASK_TAG:
-            cumulative_result = execute_result(result, master, cumulative_result)
+        if result['tag'] == REGISTER_TAG:
+            workers.add(result['id'])
+            print "Workers: ", workers
+        elif result['tag'] == TASK_TAG:
             print "Result: ", result.get_body()
-            print "Cumulative: ", cumulative_result
+            if result.get('status', 0) != 0:
+                # the output of a failed chunk is its error, not a result
+                failed.append(result['chunk'])
+                print "Failed: ", result['chunk'], result['output']
+                continue
+            cumulative_result = execute_result(result, master, cumulative_result)
+            if not failed:
+                print "Cumulative: ", cumulative_result
     master.stop()
 
+    # what the other chunks give is only part of the answer
+    if failed:
+        print "Failed chunks: ", sorted(failed)
+        sys.exit(1)
+
+    if command == 'train-partial':
+        cumulative_result = merge_partials(command_args, cumulative_result)
+
     stop = time.time()
     elapsed = stop - start
+    print "Steals: ", schedule.steals
     print elapsed
     print cumulative_result
 
 
 def execute_result(result, master, cumulative_result):
-    if result['command'] == 'learn':
+    if result['command'] in ('learn', 'reproject'):
         return None
+    elif result['command'] == 'train-partial':
+        # the key of the chunk's statistics, once even if it was rescheduled
+        if cumulative_result is None:
+            cumulative_result = [ ]
+        key = result['output'].strip()
+        if key and key not in cumulative_result:
+            cumulative_result.append(key)
+        return cumulative_result
     else:
-        # query
-        result = json.loads(result['output'])
-        for queryid in result:
-            min = result[queryid][0]
-            if cumulative_result is None or min[1] < cumulative_result[1]:
-                return min
-            return cumulative_result
+        # query: merge the k nearest [id, dist] pairs of every chunk
+        k = int(get_option(result['command_args'], 'k', 1))
+        output = json.loads(result['output'])
+        if cumulative_result is None:
+            cumulative_result = { }
+        for queryid in output:
+            neighbors = cumulative_result.get(queryid, [ ]) + output[queryid]
+            neighbors.sort(key=lambda neighbor: neighbor[1])
+            cumulative_result[queryid] = neighbors[:k]
+        return cumulative_result
+
+
+def merge_partials(command_args, partials):
+    tableid = positional_args(command_args)[0]
+    args = [EXE, 'train-merge', tableid] + partials
+    variance = get_option(command_args, 'variance')
+    if variance is not None:
+        args += ['--variance', variance]
+    print "Merging: ", args
+    return subprocess.call(args)
+
+
+def positional_args(args):
+    positional = [ ]
+    i = 0
+    while i < len(args):
+        if args[i].startswith('--'):
+            i += 2
+        else:
+            positional.append(args[i])
+            i += 1
+    return positional
+
+
+def get_option(args, name, default=None):
+    option = '--' + name
+    for i in range(len(args) - 1):
+        if args[i] == option:
+            return args[i + 1]
+    return default
 
 #############################################################################
 #############################################################################
 
 def worker(argv):
-    worker = scheduler.TaskWorker()
-    worker.start()
-    
-    # register
-    workerid = socket.gethostname()
-    msg = worker.new_result({ 'tag' : REGISTER_TAG, 'id' : workerid })
-    worker.put_result(msg)
-    
-    # main polling loop
-    while True:
-        task = worker.next()
-        result = execute_task(task)
-        msg = worker.new_result(result)
-        worker.complete(task, msg)
-
-
-def execute_task(task):
-    args = [EXE, task['command']] 
-    args += task['command_args']
-    args += [str(c) for c in task['chunk']]
-    print "Executing: ", task.get_body(), " as ", args
-    child = subprocess.Popen(args, stdout=subprocess.PIPE)
-    output = child.communicate()
-    
-    result = { }
-    result.update(task.get_body())
-    result['output'] = output[0][:-1]
-    print "Result: ", result
-    return result
+    # faces worker registers and runs every task in one process, keeping
+    # its connections and eigenspace warm from one task to the next
+    args = [EXE, 'worker'] + argv
+    print "Executing: ", args
+    os.execv(EXE, args)
 
 #############################################################################
 #############################################################################
@@ -0,0 +1,901 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "distance.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DISTANCE_X86
+#include <immintrin.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static const char *ISA_ENV = "CVDB_DISTANCE_ISA";
+
+typedef double (*DistanceKernel)(size_t, const float*, const float*);
+typedef void (*DistancesKernel)(size_t, const float*, const float*, size_t, double*);
+typedef void (*F16Kernel)(size_t, const float*, const unsigned short*, size_t, double*);
+
+/* takes the query less the offsets, which are the same for every row */
+typedef void (*I8Kernel)(size_t, const float*, const unsigned char*, const float*,
+		size_t, double*);
+
+/* adds the dot products of up to rows rows of a with up to DOT_COLUMNS
+ * rows of b, over length floats of rows stride floats apart */
+typedef void (*DotKernel)(size_t, const float*, size_t, const float*, size_t,
+		size_t, float*, size_t);
+
+typedef struct DistanceDispatch
+{
+	const char *isa;
+	DistanceKernel one;
+	DistancesKernel many;
+	F16Kernel f16;
+	I8Kernel i8;
+	DotKernel dot;
+	size_t dotrows;		// rows of a per tile
+} DistanceDispatch;
+
+static const char *ENCODING_NAMES[] = { "f32", "f16", "i8" };
+
+/* dot_products works through tiles of dotrows rows of a by DOT_COLUMNS
+ * rows of b, DOT_BLOCK floats of each row at a time: a tile of b (16 KB)
+ * stays in L1 while every row of a passes it, and the rows of a (4 KB
+ * each) stay in L2 while every tile of b passes them */
+static const size_t DOT_COLUMNS = 4;
+static const size_t DOT_BLOCK = 1024;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+double
+vector_distance_scalar(const size_t dimension, const float *a, const float *b)
+{
+	double distSq = 0;
+	for (size_t i=0;  i<dimension;  ++i) {
+		float d_i =	a[i] -	b[i];
+		distSq += d_i*d_i;
+	}
+
+	return distSq;
+}
+
+static void
+vector_distances_scalar(const size_t dimension, const float *query,
+		const float *candidates, const size_t n, double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		distances[j] = vector_distance_scalar(dimension, query,
+				candidates + j*dimension);
+	}
+}
+
+static void
+vector_distances_f16_scalar(const size_t dimension, const float *query,
+		const unsigned short *candidates, const size_t n, double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		const unsigned short *c = candidates + j*dimension;
+		double distSq = 0;
+		for (size_t i=0;  i<dimension;  ++i) {
+			float d_i = query[i] - half_to_float(c[i]);
+			distSq += d_i*d_i;
+		}
+		distances[j] = distSq;
+	}
+}
+
+static void
+vector_distances_i8_scalar(const size_t dimension, const float *shifted,
+		const unsigned char *candidates, const float *scale, const size_t n,
+		double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		const unsigned char *c = candidates + j*dimension;
+		double distSq = 0;
+		for (size_t i=0;  i<dimension;  ++i) {
+			float d_i = shifted[i] - scale[i]*c[i];
+			distSq += d_i*d_i;
+		}
+		distances[j] = distSq;
+	}
+}
+
+static void
+dot_tile_scalar(const size_t length, const float *a, const size_t rows,
+		const float *b, const size_t columns, const size_t stride,
+		float *products, const size_t pstride)
+{
+	for (size_t r=0;  r<rows;  ++r) {
+		for (size_t c=0;  c<columns;  ++c) {
+			const float *ar = a + r*stride;
+			const float *bc = b + c*stride;
+			double dot = 0;
+			for (size_t i=0;  i<length;  ++i) {
+				dot += (double)ar[i]*bc[i];
+			}
+			products[r*pstride + c] += dot;
+		}
+	}
+}
+
+#ifdef DISTANCE_X86
+
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((target("sse2")))
+static double
+vector_distance_sse2(const size_t dimension, const float *a, const float *b)
+{
+	__m128 acc0 = _mm_setzero_ps();
+	__m128 acc1 = _mm_setzero_ps();
+	size_t i = 0;
+	for (;  i+8<=dimension;  i+=8) {
+		__m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+		__m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+	double distSq = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (;  i<dimension;  ++i) {
+		float d_i = a[i] - b[i];
+		distSq += d_i*d_i;
+	}
+	return distSq;
+}
+
+__attribute__((target("sse2")))
+static void
+vector_distances_sse2(const size_t dimension, const float *query,
+		const float *candidates, const size_t n, double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		distances[j] = vector_distance_sse2(dimension, query,
+				candidates + j*dimension);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((target("avx2,fma")))
+static double
+vector_distance_avx2(const size_t dimension, const float *a, const float *b)
+{
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	__m256 acc2 = _mm256_setzero_ps();
+	__m256 acc3 = _mm256_setzero_ps();
+	size_t i = 0;
+	for (;  i+32<=dimension;  i+=32) {
+		__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		__m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+		__m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16));
+		__m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24));
+		acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+		acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+		acc2 = _mm256_fmadd_ps(d2, d2, acc2);
+		acc3 = _mm256_fmadd_ps(d3, d3, acc3);
+	}
+	for (;  i+8<=dimension;  i+=8) {
+		__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+		acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+	}
+	__m256 acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	float lanes[4];
+	_mm_storeu_ps(lanes, sum);
+	double distSq = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	for (;  i<dimension;  ++i) {
+		float d_i = a[i] - b[i];
+		distSq += d_i*d_i;
+	}
+	return distSq;
+}
+
+__attribute__((target("avx2,fma")))
+static void
+vector_distances_avx2(const size_t dimension, const float *query,
+		const float *candidates, const size_t n, double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		distances[j] = vector_distance_avx2(dimension, query,
+				candidates + j*dimension);
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static inline float
+sum_lanes_avx2(__m256 acc)
+{
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+
+/* 3 rows of a by 4 of b take 12 accumulators, and with the 3 rows of a
+ * and a row of b in flight that is all 16 registers */
+__attribute__((target("avx2,fma")))
+static void
+dot_tile_avx2(const size_t length, const float *a, const size_t rows,
+		const float *b, const size_t columns, const size_t stride,
+		float *products, const size_t pstride)
+{
+	// missing columns repeat the last one, and are not stored
+	const float *b0 = b;
+	const float *b1 = b + std::min((size_t)1, columns - 1)*stride;
+	const float *b2 = b + std::min((size_t)2, columns - 1)*stride;
+	const float *b3 = b + std::min((size_t)3, columns - 1)*stride;
+	size_t r = 0;
+	for (;  r+3<=rows;  r+=3) {
+		const float *a0 = a + r*stride;
+		const float *a1 = a0 + stride;
+		const float *a2 = a1 + stride;
+		__m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+		__m256 c02 = _mm256_setzero_ps(), c03 = _mm256_setzero_ps();
+		__m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+		__m256 c12 = _mm256_setzero_ps(), c13 = _mm256_setzero_ps();
+		__m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+		__m256 c22 = _mm256_setzero_ps(), c23 = _mm256_setzero_ps();
+		size_t i = 0;
+		for (;  i+8<=length;  i+=8) {
+			__m256 x0 = _mm256_loadu_ps(a0 + i);
+			__m256 x1 = _mm256_loadu_ps(a1 + i);
+			__m256 x2 = _mm256_loadu_ps(a2 + i);
+			__m256 y = _mm256_loadu_ps(b0 + i);
+			c00 = _mm256_fmadd_ps(x0, y, c00);
+			c10 = _mm256_fmadd_ps(x1, y, c10);
+			c20 = _mm256_fmadd_ps(x2, y, c20);
+			y = _mm256_loadu_ps(b1 + i);
+			c01 = _mm256_fmadd_ps(x0, y, c01);
+			c11 = _mm256_fmadd_ps(x1, y, c11);
+			c21 = _mm256_fmadd_ps(x2, y, c21);
+			y = _mm256_loadu_ps(b2 + i);
+			c02 = _mm256_fmadd_ps(x0, y, c02);
+			c12 = _mm256_fmadd_ps(x1, y, c12);
+			c22 = _mm256_fmadd_ps(x2, y, c22);
+			y = _mm256_loadu_ps(b3 + i);
+			c03 = _mm256_fmadd_ps(x0, y, c03);
+			c13 = _mm256_fmadd_ps(x1, y, c13);
+			c23 = _mm256_fmadd_ps(x2, y, c23);
+		}
+		float dots[3][4] = {
+			{ sum_lanes_avx2(c00), sum_lanes_avx2(c01), sum_lanes_avx2(c02), sum_lanes_avx2(c03) },
+			{ sum_lanes_avx2(c10), sum_lanes_avx2(c11), sum_lanes_avx2(c12), sum_lanes_avx2(c13) },
+			{ sum_lanes_avx2(c20), sum_lanes_avx2(c21), sum_lanes_avx2(c22), sum_lanes_avx2(c23) }
+		};
+		const float *bs[4] = { b0, b1, b2, b3 };
+		for (size_t k=0;  k<3;  ++k) {
+			const float *ak = a + (r + k)*stride;
+			for (size_t c=0;  c<columns;  ++c) {
+				float dot = dots[k][c];
+				for (size_t j=i;  j<length;  ++j) {
+					dot += ak[j]*bs[c][j];
+				}
+				products[(r + k)*pstride + c] += dot;
+			}
+		}
+	}
+
+	// the rows left over go one at a time
+	for (;  r<rows;  ++r) {
+		const float *a0 = a + r*stride;
+		__m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps();
+		__m256 c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+		size_t i = 0;
+		for (;  i+8<=length;  i+=8) {
+			__m256 x0 = _mm256_loadu_ps(a0 + i);
+			c0 = _mm256_fmadd_ps(x0, _mm256_loadu_ps(b0 + i), c0);
+			c1 = _mm256_fmadd_ps(x0, _mm256_loadu_ps(b1 + i), c1);
+			c2 = _mm256_fmadd_ps(x0, _mm256_loadu_ps(b2 + i), c2);
+			c3 = _mm256_fmadd_ps(x0, _mm256_loadu_ps(b3 + i), c3);
+		}
+		float dots[4] = { sum_lanes_avx2(c0), sum_lanes_avx2(c1),
+				sum_lanes_avx2(c2), sum_lanes_avx2(c3) };
+		const float *bs[4] = { b0, b1, b2, b3 };
+		for (size_t c=0;  c<columns;  ++c) {
+			float dot = dots[c];
+			for (size_t j=i;  j<length;  ++j) {
+				dot += a0[j]*bs[c][j];
+			}
+			products[r*pstride + c] += dot;
+		}
+	}
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void
+vector_distances_f16_avx2(const size_t dimension, const float *query,
+		const unsigned short *candidates, const size_t n, double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		const unsigned short *c = candidates + j*dimension;
+		__m256 acc0 = _mm256_setzero_ps();
+		__m256 acc1 = _mm256_setzero_ps();
+		size_t i = 0;
+		for (;  i+16<=dimension;  i+=16) {
+			__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(query + i),
+					_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(c + i))));
+			__m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(query + i + 8),
+					_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(c + i + 8))));
+			acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+			acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+		}
+		for (;  i+8<=dimension;  i+=8) {
+			__m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(query + i),
+					_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(c + i))));
+			acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+		}
+		__m256 acc = _mm256_add_ps(acc0, acc1);
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+		float lanes[4];
+		_mm_storeu_ps(lanes, sum);
+		double distSq = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		for (;  i<dimension;  ++i) {
+			float d_i = query[i] - _cvtsh_ss(c[i]);
+			distSq += d_i*d_i;
+		}
+		distances[j] = distSq;
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void
+vector_distances_i8_avx2(const size_t dimension, const float *shifted,
+		const unsigned char *candidates, const float *scale, const size_t n,
+		double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		const unsigned char *c = candidates + j*dimension;
+		__m256 acc0 = _mm256_setzero_ps();
+		__m256 acc1 = _mm256_setzero_ps();
+		size_t i = 0;
+		for (;  i+16<=dimension;  i+=16) {
+			// widen 8 bytes at a time to floats, d = (q - offset) - scale*c
+			__m256 c0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+					_mm_loadl_epi64((const __m128i*)(c + i))));
+			__m256 c1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+					_mm_loadl_epi64((const __m128i*)(c + i + 8))));
+			__m256 d0 = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i), c0,
+					_mm256_loadu_ps(shifted + i));
+			__m256 d1 = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i + 8), c1,
+					_mm256_loadu_ps(shifted + i + 8));
+			acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+			acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+		}
+		for (;  i+8<=dimension;  i+=8) {
+			__m256 c0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+					_mm_loadl_epi64((const __m128i*)(c + i))));
+			__m256 d0 = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i), c0,
+					_mm256_loadu_ps(shifted + i));
+			acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+		}
+		__m256 acc = _mm256_add_ps(acc0, acc1);
+		__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+		float lanes[4];
+		_mm_storeu_ps(lanes, sum);
+		double distSq = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		for (;  i<dimension;  ++i) {
+			float d_i = shifted[i] - scale[i]*c[i];
+			distSq += d_i*d_i;
+		}
+		distances[j] = distSq;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+__attribute__((target("avx512f")))
+static double
+vector_distance_avx512(const size_t dimension, const float *a, const float *b)
+{
+	__m512 acc0 = _mm512_setzero_ps();
+	__m512 acc1 = _mm512_setzero_ps();
+	size_t i = 0;
+	for (;  i+32<=dimension;  i+=32) {
+		__m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+		__m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+		acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+		acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+	}
+	for (;  i<dimension;  i+=16) {
+		// the masked loads cover the tail without reading past the end
+		__mmask16 mask = (dimension - i >= 16) ? 0xffff
+				: (__mmask16)((1u << (dimension - i)) - 1);
+		__m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i),
+				_mm512_maskz_loadu_ps(mask, b + i));
+		acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+	}
+	// reduced in registers: storing 16 lanes to sum them in double costs
+	// more than the whole loop for short vectors
+	return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+static void
+vector_distances_avx512(const size_t dimension, const float *query,
+		const float *candidates, const size_t n, double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		distances[j] = vector_distance_avx512(dimension, query,
+				candidates + j*dimension);
+	}
+}
+
+__attribute__((target("avx512f,f16c")))
+static void
+vector_distances_f16_avx512(const size_t dimension, const float *query,
+		const unsigned short *candidates, const size_t n, double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		const unsigned short *c = candidates + j*dimension;
+		__m512 acc0 = _mm512_setzero_ps();
+		size_t i = 0;
+		for (;  i+16<=dimension;  i+=16) {
+			__m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(query + i),
+					_mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(c + i))));
+			acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+		}
+		float lanes[16];
+		_mm512_storeu_ps(lanes, acc0);
+		double distSq = 0;
+		for (int l=0;  l<16;  ++l) {
+			distSq += lanes[l];
+		}
+		for (;  i<dimension;  ++i) {
+			float d_i = query[i] - _cvtsh_ss(c[i]);
+			distSq += d_i*d_i;
+		}
+		distances[j] = distSq;
+	}
+}
+
+__attribute__((target("avx512f")))
+static void
+vector_distances_i8_avx512(const size_t dimension, const float *shifted,
+		const unsigned char *candidates, const float *scale, const size_t n,
+		double distances[])
+{
+	for (size_t j=0;  j<n;  ++j) {
+		const unsigned char *c = candidates + j*dimension;
+		__m512 acc0 = _mm512_setzero_ps();
+		size_t i = 0;
+		for (;  i+16<=dimension;  i+=16) {
+			__m512 c0 = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(
+					_mm_loadu_si128((const __m128i*)(c + i))));
+			__m512 d0 = _mm512_fnmadd_ps(_mm512_loadu_ps(scale + i), c0,
+					_mm512_loadu_ps(shifted + i));
+			acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+		}
+		float lanes[16];
+		_mm512_storeu_ps(lanes, acc0);
+		double distSq = 0;
+		for (int l=0;  l<16;  ++l) {
+			distSq += lanes[l];
+		}
+		for (;  i<dimension;  ++i) {
+			float d_i = shifted[i] - scale[i]*c[i];
+			distSq += d_i*d_i;
+		}
+		distances[j] = distSq;
+	}
+}
+
+/* 4 rows of a by 4 of b, with 32 registers to spare for it */
+__attribute__((target("avx512f")))
+static void
+dot_tile_avx512(const size_t length, const float *a, const size_t rows,
+		const float *b, const size_t columns, const size_t stride,
+		float *products, const size_t pstride)
+{
+	// missing columns repeat the last one, and are not stored
+	const float *b0 = b;
+	const float *b1 = b + std::min((size_t)1, columns - 1)*stride;
+	const float *b2 = b + std::min((size_t)2, columns - 1)*stride;
+	const float *b3 = b + std::min((size_t)3, columns - 1)*stride;
+	size_t r = 0;
+	for (;  r+4<=rows;  r+=4) {
+		const float *a0 = a + r*stride;
+		const float *a1 = a0 + stride;
+		const float *a2 = a1 + stride;
+		const float *a3 = a2 + stride;
+		__m512 c[4][4];
+		for (int k=0;  k<4;  ++k) {
+			c[k][0] = c[k][1] = c[k][2] = c[k][3] = _mm512_setzero_ps();
+		}
+		for (size_t i=0;  i<length;  i+=16) {
+			// the masked loads cover the tail without reading past the end
+			__mmask16 mask = (length - i >= 16) ? 0xffff
+					: (__mmask16)((1u << (length - i)) - 1);
+			__m512 x0 = _mm512_maskz_loadu_ps(mask, a0 + i);
+			__m512 x1 = _mm512_maskz_loadu_ps(mask, a1 + i);
+			__m512 x2 = _mm512_maskz_loadu_ps(mask, a2 + i);
+			__m512 x3 = _mm512_maskz_loadu_ps(mask, a3 + i);
+			__m512 y = _mm512_maskz_loadu_ps(mask, b0 + i);
+			c[0][0] = _mm512_fmadd_ps(x0, y, c[0][0]);
+			c[1][0] = _mm512_fmadd_ps(x1, y, c[1][0]);
+			c[2][0] = _mm512_fmadd_ps(x2, y, c[2][0]);
+			c[3][0] = _mm512_fmadd_ps(x3, y, c[3][0]);
+			y = _mm512_maskz_loadu_ps(mask, b1 + i);
+			c[0][1] = _mm512_fmadd_ps(x0, y, c[0][1]);
+			c[1][1] = _mm512_fmadd_ps(x1, y, c[1][1]);
+			c[2][1] = _mm512_fmadd_ps(x2, y, c[2][1]);
+			c[3][1] = _mm512_fmadd_ps(x3, y, c[3][1]);
+			y = _mm512_maskz_loadu_ps(mask, b2 + i);
+			c[0][2] = _mm512_fmadd_ps(x0, y, c[0][2]);
+			c[1][2] = _mm512_fmadd_ps(x1, y, c[1][2]);
+			c[2][2] = _mm512_fmadd_ps(x2, y, c[2][2]);
+			c[3][2] = _mm512_fmadd_ps(x3, y, c[3][2]);
+			y = _mm512_maskz_loadu_ps(mask, b3 + i);
+			c[0][3] = _mm512_fmadd_ps(x0, y, c[0][3]);
+			c[1][3] = _mm512_fmadd_ps(x1, y, c[1][3]);
+			c[2][3] = _mm512_fmadd_ps(x2, y, c[2][3]);
+			c[3][3] = _mm512_fmadd_ps(x3, y, c[3][3]);
+		}
+		for (int k=0;  k<4;  ++k) {
+			for (size_t j=0;  j<columns;  ++j) {
+				products[(r + k)*pstride + j] += _mm512_reduce_add_ps(c[k][j]);
+			}
+		}
+	}
+
+	// the rows left over go one at a time
+	for (;  r<rows;  ++r) {
+		const float *a0 = a + r*stride;
+		__m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps();
+		__m512 c2 = _mm512_setzero_ps(), c3 = _mm512_setzero_ps();
+		for (size_t i=0;  i<length;  i+=16) {
+			__mmask16 mask = (length - i >= 16) ? 0xffff
+					: (__mmask16)((1u << (length - i)) - 1);
+			__m512 x0 = _mm512_maskz_loadu_ps(mask, a0 + i);
+			c0 = _mm512_fmadd_ps(x0, _mm512_maskz_loadu_ps(mask, b0 + i), c0);
+			c1 = _mm512_fmadd_ps(x0, _mm512_maskz_loadu_ps(mask, b1 + i), c1);
+			c2 = _mm512_fmadd_ps(x0, _mm512_maskz_loadu_ps(mask, b2 + i), c2);
+			c3 = _mm512_fmadd_ps(x0, _mm512_maskz_loadu_ps(mask, b3 + i), c3);
+		}
+		float dots[4] = { _mm512_reduce_add_ps(c0), _mm512_reduce_add_ps(c1),
+				_mm512_reduce_add_ps(c2), _mm512_reduce_add_ps(c3) };
+		for (size_t j=0;  j<columns;  ++j) {
+			products[r*pstride + j] += dots[j];
+		}
+	}
+}
+
+#endif // DISTANCE_X86
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static DistanceDispatch
+select_dispatch()
+{
+	DistanceDispatch dispatch = { "scalar",
+			vector_distance_scalar, vector_distances_scalar,
+			vector_distances_f16_scalar, vector_distances_i8_scalar,
+			dot_tile_scalar, 4 };
+	const char *forced = getenv(ISA_ENV);
+	if (forced != NULL && !strcmp(forced, "scalar")) {
+		return dispatch;
+	}
+#ifdef DISTANCE_X86
+	__builtin_cpu_init();
+	bool any = (forced == NULL);
+	if (__builtin_cpu_supports("sse2")
+			&& (any || !strcmp(forced, "sse2"))) {
+		dispatch.isa = "sse2";
+		dispatch.one = vector_distance_sse2;
+		dispatch.many = vector_distances_sse2;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+			&& (any || !strcmp(forced, "avx2"))) {
+		dispatch.isa = "avx2";
+		dispatch.one = vector_distance_avx2;
+		dispatch.many = vector_distances_avx2;
+		dispatch.i8 = vector_distances_i8_avx2;
+		dispatch.dot = dot_tile_avx2;
+		dispatch.dotrows = 3;
+		if (__builtin_cpu_supports("f16c")) {
+			dispatch.f16 = vector_distances_f16_avx2;
+		}
+	}
+	if (__builtin_cpu_supports("avx512f")
+			&& (any || !strcmp(forced, "avx512"))) {
+		dispatch.isa = "avx512";
+		dispatch.one = vector_distance_avx512;
+		dispatch.many = vector_distances_avx512;
+		if (__builtin_cpu_supports("f16c")) {
+			dispatch.f16 = vector_distances_f16_avx512;
+		}
+		dispatch.i8 = vector_distances_i8_avx512;
+		dispatch.dot = dot_tile_avx512;
+		dispatch.dotrows = 4;
+	}
+#endif
+	return dispatch;
+}
+
+/* The kernels, chosen on first use, so that callers running during
+ * static initialization (in any translation unit) find them chosen */
+static const DistanceDispatch&
+dispatch()
+{
+	static const DistanceDispatch chosen = select_dispatch();
+	return chosen;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+double
+vector_distance_simd(const size_t dimension, const float *a, const float *b)
+{
+	return dispatch().one(dimension, a, b);
+}
+
+void
+vector_distances(const size_t dimension, const float *query,
+		const float *candidates, const size_t n, double distances[])
+{
+	dispatch().many(dimension, query, candidates, n, distances);
+}
+
+const char *
+distance_isa()
+{
+	return dispatch().isa;
+}
+
+void
+vector_distances_f16(const size_t dimension, const float *query,
+		const unsigned short *candidates, const size_t n, double distances[])
+{
+	dispatch().f16(dimension, query, candidates, n, distances);
+}
+
+void
+vector_distances_i8(const size_t dimension, const float *query,
+		const unsigned char *candidates, const float *scale,
+		const float *offset, const size_t n, double distances[])
+{
+	// fold the offsets into the query once for all the candidates
+	std::vector<float> shifted(dimension);
+	for (size_t i=0;  i<dimension;  ++i) {
+		shifted[i] = query[i] - offset[i];
+	}
+	dispatch().i8(dimension, &shifted[0], candidates, scale, n, distances);
+}
+
+void
+dot_products(const size_t length, const float *a, const size_t na,
+		const float *b, const size_t nb, float products[])
+{
+	std::fill(products, products + na*nb, 0.0f);
+	const DistanceDispatch& kernels = dispatch();
+	const size_t rows = kernels.dotrows;
+	for (size_t i=0;  i<length;  i+=DOT_BLOCK) {
+		size_t block = std::min(DOT_BLOCK, length - i);
+		for (size_t j=0;  j<nb;  j+=DOT_COLUMNS) {
+			size_t columns = std::min(DOT_COLUMNS, nb - j);
+			for (size_t k=0;  k<na;  k+=rows) {
+				kernels.dot(block, a + k*length + i, std::min(rows, na - k),
+						b + j*length + i, columns, length,
+						products + k*nb + j, nb);
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+const char *
+encoding_name(const int encoding)
+{
+	assert(encoding >= 0 && encoding < NENCODINGS);
+	return ENCODING_NAMES[encoding];
+}
+
+int
+encoding_from_name(const char *name)
+{
+	for (int i=0;  i<NENCODINGS;  ++i) {
+		if (!strcmp(name, ENCODING_NAMES[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+size_t
+encoding_size(const int encoding)
+{
+	switch (encoding) {
+	case ENCODING_F16:
+		return sizeof(unsigned short);
+	case ENCODING_I8:
+		return sizeof(unsigned char);
+	default:
+		return sizeof(float);
+	}
+}
+
+unsigned short
+float_to_half(const float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	unsigned int sign = (bits >> 16) & 0x8000;
+	unsigned int mantissa = bits & 0x7fffff;
+	int exponent = (int)((bits >> 23) & 0xff);
+	if (exponent == 0xff) {
+		// infinity stays infinite, NaN stays NaN
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	}
+	exponent += 15 - 127;
+	if (exponent >= 31) {
+		return sign | 0x7c00;
+	}
+	if (exponent <= 0) {
+		// subnormal (or zero) halves
+		if (exponent < -10) {
+			return sign;
+		}
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		unsigned int rest = mantissa & ((1u << shift) - 1);
+		unsigned int middle = 1u << (shift - 1);
+		if (rest > middle || (rest == middle && (half & 1))) {
+			++half;
+		}
+		return sign | half;
+	}
+	unsigned int half = ((unsigned int)exponent << 10) | (mantissa >> 13);
+	unsigned int rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+		++half; // may carry into the exponent, up to infinity
+	}
+	return sign | half;
+}
+
+float
+half_to_float(const unsigned short value)
+{
+	unsigned int sign = (unsigned int)(value & 0x8000) << 16;
+	unsigned int exponent = (value >> 10) & 0x1f;
+	unsigned int mantissa = value & 0x3ff;
+	unsigned int bits;
+	if (exponent == 0) {
+		if (mantissa == 0) {
+			bits = sign;
+		} else {
+			// normalize a subnormal half
+			int e = 1;
+			while (!(mantissa & 0x400)) {
+				mantissa <<= 1;
+				--e;
+			}
+			mantissa &= 0x3ff;
+			bits = sign | ((unsigned int)(e + 127 - 15) << 23) | (mantissa << 13);
+		}
+	} else if (exponent == 0x1f) {
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	} else {
+		bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	}
+	float result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+void
+calibrate_i8(const size_t dimension, const float *variances, float *scale,
+		float *offset)
+{
+	for (size_t i=0;  i<dimension;  ++i) {
+		float sigma = sqrt(std::max(variances[i], 0.0f));
+		offset[i] = -I8_SIGMAS*sigma;
+		scale[i] = 2*I8_SIGMAS*sigma / 255;
+	}
+}
+
+void
+encode_i8(const size_t dimension, const float *features, const float *scale,
+		const float *offset, unsigned char *codes)
+{
+	for (size_t i=0;  i<dimension;  ++i) {
+		float code = (scale[i] > 0) ? (features[i] - offset[i]) / scale[i] : 0;
+		codes[i] = (unsigned char)std::min(std::max(code + 0.5f, 0.0f), 255.0f);
+	}
+}
+
+void
+decode_i8(const size_t dimension, const unsigned char *codes, const float *scale,
+		const float *offset, float *features)
+{
+	for (size_t i=0;  i<dimension;  ++i) {
+		features[i] = offset[i] + scale[i]*codes[i];
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+Neighbors::Neighbors(const size_t k, const double threshold)
+ : k(k), threshold(threshold)
+{
+	heap.reserve(k);
+}
+
+bool
+Neighbors::offer(const int id, const double dist)
+{
+	if (k == 0 || (threshold >= 0 && dist > threshold)) {
+		return false;
+	}
+	Neighbor neighbor(dist, id);
+	if (heap.size() < k) {
+		heap.push_back(neighbor);
+		std::push_heap(heap.begin(), heap.end());
+		return true;
+	}
+	if (!(neighbor < heap.front())) {
+		return false;
+	}
+	// replace the current farthest
+	std::pop_heap(heap.begin(), heap.end());
+	heap.back() = neighbor;
+	std::push_heap(heap.begin(), heap.end());
+	return true;
+}
+
+double
+Neighbors::bound() const
+{
+	if (heap.size() < k) {
+		return threshold;
+	}
+	return heap.front().first;
+}
+
+size_t
+Neighbors::size() const
+{
+	return heap.size();
+}
+
+void
+Neighbors::sorted(std::vector<Neighbor>& neighbors) const
+{
+	neighbors.assign(heap.begin(), heap.end());
+	std::sort_heap(neighbors.begin(), neighbors.end());
+}
+
+void
+Neighbors::write(std::ostream& outs, const int imageid) const
+{
+	std::vector<Neighbor> neighbors;
+	sorted(neighbors);
+
+	char buf[32];
+	outs << "{\"" << imageid << "\" : [";
+	for (size_t i=0;  i<neighbors.size();  ++i) {
+		sprintf(buf, "%.6lf", neighbors[i].first);
+		outs << (i > 0 ? ", [" : " [");
+		outs << neighbors[i].second << ", " << buf << "]";
+	}
+	outs << " ]}";
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
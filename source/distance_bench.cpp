@@ -0,0 +1,145 @@
+/****************************************************************************
+ *
+ * Checks the selected distance kernels against the scalar reference, and
+ * measures how much faster they are.
+ *
+ * distance_bench [DIMENSION [N]]
+ *
+ * Draws N random vectors of DIMENSION, and for every dimension from 1 to
+ * DIMENSION compares the distances from the first to the rest given by
+ * vector_distance_simd and vector_distances with vector_distance_scalar,
+ * so that every tail a kernel handles is covered. Then one line is
+ * written per kernel, the first being the reference:
+ *
+ * KERNEL ISA NS_PER_DISTANCE SPEEDUP MAX_RELATIVE_ERROR
+ *
+ * The exit status is 1 if any distance differs from the reference by
+ * more than the relative error distance.h allows.
+ *
+ ****************************************************************************/
+
+#include "distance.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include <sys/time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* the relative error allowed per dimension, a few single precision ulps */
+static const double ULP_ERROR = 4.0 / (1 << 24);
+
+/* passes over the vectors timed per kernel */
+static const int PASSES = 20;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static double
+elapsed_s(timeval& start, timeval& stop)
+{
+	return (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec)/1e6;
+}
+
+static double
+relative_error(double value, double reference)
+{
+	return fabs(value - reference) / std::max(reference, 1e-30);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+int
+main(const int argc, const char **argv)
+{
+	size_t dimension = (argc > 1) ? atoi(argv[1]) : 100;
+	size_t n = (argc > 2) ? atoi(argv[2]) : 10000;
+	if (dimension < 1 || n < 2) {
+		std::cerr << "Usage error" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	std::vector<float> vectors(n*dimension);
+	for (size_t i=0;  i<vectors.size();  ++i) {
+		vectors[i] = (rand() - RAND_MAX/2.0) / RAND_MAX;
+	}
+
+	// every length up to the dimension, against the reference
+	double oneerror = 0;
+	double manyerror = 0;
+	bool failed = false;
+	std::vector<double> distances(n);
+	for (size_t d=1;  d<=dimension;  ++d) {
+		const float *query = &vectors[0];
+		std::vector<float> rows(vectors.begin() + d, vectors.begin() + n*d);
+		vector_distances(d, query, &rows[0], n - 1, &distances[0]);
+		for (size_t j=0;  j<n-1;  ++j) {
+			double reference = vector_distance_scalar(d, query, &rows[j*d]);
+			double one = relative_error(vector_distance_simd(d, query, &rows[j*d]),
+					reference);
+			double many = relative_error(distances[j], reference);
+			oneerror = std::max(oneerror, one);
+			manyerror = std::max(manyerror, many);
+			if (one > d*ULP_ERROR || many > d*ULP_ERROR) {
+				failed = true;
+			}
+		}
+	}
+
+	// then the speed of each at the full dimension
+	char buf[256];
+	timeval start, stop;
+	const float *query = &vectors[0];
+	const float *rows = &vectors[dimension];
+	double sink = 0;
+	gettimeofday(&start, NULL);
+	for (int p=0;  p<PASSES;  ++p) {
+		for (size_t j=0;  j<n-1;  ++j) {
+			sink += vector_distance_scalar(dimension, query, rows + j*dimension);
+		}
+	}
+	gettimeofday(&stop, NULL);
+	double reference = elapsed_s(start, stop)*1e9 / (PASSES*(n - 1));
+	sprintf(buf, "scalar scalar %.2f 1.00 0", reference);
+	std::cout << buf << std::endl;
+
+	gettimeofday(&start, NULL);
+	for (int p=0;  p<PASSES;  ++p) {
+		for (size_t j=0;  j<n-1;  ++j) {
+			sink += vector_distance_simd(dimension, query, rows + j*dimension);
+		}
+	}
+	gettimeofday(&stop, NULL);
+	double ns = elapsed_s(start, stop)*1e9 / (PASSES*(n - 1));
+	sprintf(buf, "one %s %.2f %.2f %.3g", distance_isa(), ns, reference / ns,
+			oneerror);
+	std::cout << buf << std::endl;
+
+	gettimeofday(&start, NULL);
+	for (int p=0;  p<PASSES;  ++p) {
+		vector_distances(dimension, query, rows, n - 1, &distances[0]);
+		sink += distances[p % (n - 1)];
+	}
+	gettimeofday(&stop, NULL);
+	ns = elapsed_s(start, stop)*1e9 / (PASSES*(n - 1));
+	sprintf(buf, "many %s %.2f %.2f %.3g", distance_isa(), ns, reference / ns,
+			manyerror);
+	std::cout << buf << std::endl;
+
+	if (sink == 0) {
+		std::cerr << "All distances are zero" << std::endl;
+	}
+	if (failed) {
+		std::cerr << "Distances differ from the reference" << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,748 @@
+/****************************************************************************
+ *
+ * Benchmarks the image, distance and metadata primitives, and whole
+ * upload, train, learn and query runs, over a generated dataset.
+ *
+ * faces_bench [--subjects N] [--poses N] [--lights N] [--width W]
+ *		[--height H] [--resolution R] [--components K] [--queries N]
+ *		[--mintime SECONDS] [--output FILE]
+ *		[--baseline FILE [--tolerance FRACTION]]
+ *
+ * SUBJECTS x POSES x LIGHTS synthetic faces are generated as binary PGM
+ * images of W x H in the layout of the Yale Face Database B: a yaleB.info
+ * naming an info file per subject and pose, each naming a background
+ * image then the images of that pose under every light. They are stored
+ * under bench/yaleB in the store named by CVDB_STORAGE, which is memory
+ * unless set otherwise (see object_store), and copied under bench/added.
+ * With local:DIR the dataset and tables are left behind for the faces
+ * command.
+ *
+ * First, a few ASCII PGM images of 8 and 16 bits are decoded and checked
+ * sample by sample. Then each primitive is called over and over for at
+ * least SECONDS, three times, and the best time per call is kept. Next
+ * the dataset is uploaded as table 1, trained at RESOLUTION with K
+ * components and learned, and QUERIES images are queried against every
+ * image, each step timed once. Last, as table 2, the first three quarters of the dataset
+ * are trained and learned in shards, the rest are added, folded in and
+ * learned, and every image is queried, which must find itself nearest.
+ *
+ * The results are written to FILE (by default stdout) as JSON, one
+ * result per line:
+ *
+ * {"isa": "avx2", "results": [
+ *  {"name": "vector_distance", "unit": "ns", "value": 21.3},
+ *  ...
+ * ]}
+ *
+ * Every value is a time, so lower is better. With --baseline, each result
+ * is compared with the result of the same name in an earlier output, the
+ * ratios are written to stderr, and any more than FRACTION (by default
+ * 0.1) slower is flagged as a regression, making the exit status 2.
+ *
+ ****************************************************************************/
+
+#include "aws.h"
+#include "yale.h"
+#include "image.h"
+#include "distance.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <sys/time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static const char *PREFIX = "bench/yaleB";
+static const int TABLE_ID = 1;
+
+/* the table images are added to after it is learned, with a copy of the
+ * dataset of its own so that it shares no features with table 1 */
+static const char *ADDED_PREFIX = "bench/added";
+static const int ADDED_TABLE_ID = 2;
+
+/* timed runs of each primitive, of which the best is kept */
+static const int REPEATS = 3;
+
+/* blobs making up each synthetic face */
+static const int FACE_BLOBS = 12;
+
+static const int EXIT_REGRESSION = 2;
+
+static const int EVENT_BENCH = Profiler::event("bench");
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct Result
+{
+	std::string name;
+	std::string unit;
+	double value;
+} Result;
+
+/* What the primitives are called on */
+typedef struct Fixture
+{
+	std::vector<std::string> pgms;		// the encoded images
+	std::vector<IplImage*> images;		// resampled to the resolution
+	size_t resolution;
+	int components;
+	Eigenspace *eigenspace;
+	std::vector<float> features;
+	size_t next;						// image of the next call
+	ImageMetadata *meta;
+	ImageTableMetadata *tablemeta;
+	std::vector<std::string> values;	// of meta, by attribute
+	std::vector<std::string> tablevalues;
+	Profiler *profiler;
+	volatile double sink;				// keeps results alive
+} Fixture;
+
+typedef void (*Op)(Fixture& fixture);
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static double
+elapsed_s(timeval& start, timeval& stop)
+{
+	return (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec)/1e6;
+}
+
+static double
+uniform(double lo, double hi)
+{
+	return lo + (hi - lo)*rand()/(RAND_MAX + 1.0);
+}
+
+/* Calls op n times, doubling n until the calls take at least mintime
+ * seconds, REPEATS times over, and returns the best time per call in ns */
+static double
+time_op(Op op, Fixture& fixture, double mintime)
+{
+	double best = -1;
+	for (int r=0;  r<REPEATS;  ++r) {
+		for (size_t n=1;  ;  n*=2) {
+			timeval start, stop;
+			gettimeofday(&start, NULL);
+			for (size_t i=0;  i<n;  ++i) {
+				op(fixture);
+			}
+			gettimeofday(&stop, NULL);
+			double elapsed = elapsed_s(start, stop);
+			if (elapsed >= mintime) {
+				double ns = elapsed*1e9/n;
+				if (best < 0 || ns < best) {
+					best = ns;
+				}
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+static void
+add_result(std::vector<Result>& results, const std::string& name,
+		const std::string& unit, double value)
+{
+	Result result;
+	result.name = name;
+	result.unit = unit;
+	result.value = value;
+	results.push_back(result);
+	std::cerr << name << " " << value << " " << unit << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* A face of a subject in a pose under a light: the subject's blobs,
+ * shifted by the pose, lit from one side, plus noise, as a binary PGM */
+static std::string
+generate_face(int subject, int pose, int light, int nlights, int width,
+		int height)
+{
+	// the same blobs for every image of a subject
+	srand(subject*7919 + 1);
+	double blobs[FACE_BLOBS][4];	// x, y, radius, amplitude
+	for (int b=0;  b<FACE_BLOBS;  ++b) {
+		blobs[b][0] = uniform(0.25, 0.75)*width;
+		blobs[b][1] = uniform(0.2, 0.8)*height;
+		blobs[b][2] = uniform(0.05, 0.15)*std::min(width, height);
+		blobs[b][3] = uniform(-60, 60);
+	}
+	double dx = (pose % 3 - 1)*0.02*width;
+	double dy = (pose / 3 % 3 - 1)*0.02*height;
+	double angle = M_PI*light/std::max(nlights, 1);
+	srand(subject*7919 + pose*104729 + light*15485863 + 2);
+
+	char buf[64];
+	sprintf(buf, "P5\n%d %d\n255\n", width, height);
+	std::string pgm(buf);
+	size_t offset = pgm.size();
+	pgm.resize(offset + (size_t)width*height);
+	for (int y=0;  y<height;  ++y) {
+		for (int x=0;  x<width;  ++x) {
+			double v = 128;
+			for (int b=0;  b<FACE_BLOBS;  ++b) {
+				double rx = (x - blobs[b][0] - dx)/blobs[b][2];
+				double ry = (y - blobs[b][1] - dy)/blobs[b][2];
+				v += blobs[b][3]*exp(-0.5*(rx*rx + ry*ry));
+			}
+			double lx = (x - width/2.0)/width;
+			double ly = (y - height/2.0)/height;
+			v *= 1 + 0.5*(cos(angle)*lx + sin(angle)*ly);
+			v += uniform(-8, 8);
+			pgm[offset + (size_t)y*width + x] = (char)std::max(0, std::min(255, (int)v));
+		}
+	}
+	return pgm;
+}
+
+/* Stores the dataset under PREFIX and ADDED_PREFIX, keeping each image in
+ * pgms */
+static void
+generate_dataset(int nsubjects, int nposes, int nlights, int width,
+		int height, std::vector<std::string>& pgms)
+{
+	ObjectStore& objstore = object_store();
+	const char *prefixes[] = { PREFIX, ADDED_PREFIX };
+	char buf[128];
+	std::string root;
+	for (int s=1;  s<=nsubjects;  ++s) {
+		for (int p=0;  p<nposes;  ++p) {
+			sprintf(buf, "yaleB%02d_P%02d", s, p);
+			std::string pose(buf);
+			std::string dir("yaleB");
+			sprintf(buf, "%02d", s);
+			dir += buf;
+			root += dir + "/" + pose + ".info\n";
+
+			std::string info(pose + "_Ambient.pgm\n");
+			for (int l=0;  l<nlights;  ++l) {
+				sprintf(buf, "A%+04dE+00.pgm", l*180/std::max(nlights, 1) - 90);
+				std::string name(pose + buf);
+				info += name + "\n";
+				pgms.push_back(generate_face(s, p, l, nlights, width, height));
+				for (int x=0;  x<2;  ++x) {
+					objstore.put(CVDB::BUCKET, std::string(prefixes[x]) + "/"
+							+ dir + "/" + name, pgms.back());
+				}
+			}
+			for (int x=0;  x<2;  ++x) {
+				objstore.put(CVDB::BUCKET, std::string(prefixes[x]) + "/" + dir
+						+ "/" + pose + ".info", info);
+			}
+		}
+	}
+	for (int x=0;  x<2;  ++x) {
+		objstore.put(CVDB::BUCKET, std::string(prefixes[x]) + "/yaleB.info", root);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* A fresh buffer holding the next image, as read_image takes over */
+static char *
+next_buffer(Fixture& fixture, size_t& size)
+{
+	const std::string& pgm = fixture.pgms[fixture.next++ % fixture.pgms.size()];
+	size = pgm.size();
+	char *data = (char*)cvAlloc(size);
+	memcpy(data, pgm.data(), size);
+	return data;
+}
+
+/* Decodes ASCII images of 8 and 16 bits whose samples are as short as
+ * they can be, starting at odd and even offsets, and checks every sample */
+static void
+check_plain_images()
+{
+	const char *pgms[] = {
+		"P2\n10 1\n255\n0 1 2 3 4 5 6 7 8 9\n",
+		"P2\n10 1\n65535\n0 1 2 3 4 5 6 7 8 9\n",
+		"P2 10 1 65535\n0 1 2 3 4 5 6 7 8 9",
+		NULL
+	};
+	for (const char **pgm=pgms;  *pgm!=NULL;  ++pgm) {
+		size_t size = strlen(*pgm);
+		char *data = (char*)cvAlloc(size);
+		memcpy(data, *pgm, size);
+		IplImage *image;
+		if (decode_image(data, size, &image) != IMAGE_OK) {
+			throw std::runtime_error(std::string("cannot decode ") + *pgm);
+		}
+		for (int x=0;  x<image->width;  ++x) {
+			int value = (image->depth == IPL_DEPTH_8U)
+					? ((unsigned char*)image->imageData)[x]
+					: ((unsigned short*)image->imageData)[x];
+			if (value != x) {
+				cvReleaseImage(&image);
+				throw std::runtime_error(std::string("decoded the wrong samples of ") + *pgm);
+			}
+		}
+		cvReleaseImage(&image);
+	}
+}
+
+static void
+op_parse_header(Fixture& fixture)
+{
+	const std::string& pgm = fixture.pgms[fixture.next++ % fixture.pgms.size()];
+	Dimensions dimensions;
+	int format;
+	size_t offset;
+	parse_header(pgm.data(), pgm.size(), dimensions, format, offset);
+	fixture.sink += offset;
+}
+
+static void
+op_read_image(Fixture& fixture)
+{
+	size_t size;
+	char *data = next_buffer(fixture, size);
+	IplImage *image;
+	if (read_image(fixture.meta, data, size, &image) == IMAGE_OK) {
+		fixture.sink += image->width;
+		cvReleaseImage(&image);
+	}
+}
+
+static void
+op_read_image_resized(Fixture& fixture)
+{
+	size_t size;
+	char *data = next_buffer(fixture, size);
+	IplImage *image;
+	if (read_image(fixture.meta, data, size, &image, fixture.resolution) == IMAGE_OK) {
+		fixture.sink += image->width;
+		cvReleaseImage(&image);
+	}
+}
+
+static void
+op_create_eigen_space(Fixture& fixture)
+{
+	Eigenspace *eigenspace = create_eigen_space(fixture.images.size(),
+			&fixture.images[0], fixture.resolution, fixture.components);
+	fixture.sink += eigenspace->dimension;
+	delete eigenspace;
+}
+
+static void
+op_decomposite(Fixture& fixture)
+{
+	IplImage *image = fixture.images[fixture.next++ % fixture.images.size()];
+	decomposite(fixture.eigenspace, image, &fixture.features[0]);
+	fixture.sink += fixture.features[0];
+}
+
+static void
+op_vector_distance(Fixture& fixture)
+{
+	size_t dimension = fixture.eigenspace->dimension;
+	size_t i = fixture.next++ % fixture.images.size();
+	size_t j = (i + 1) % fixture.images.size();
+	fixture.sink += vector_distance(dimension, &fixture.features[i*dimension],
+			&fixture.features[j*dimension]);
+}
+
+static void
+op_serial_image_meta(Fixture& fixture)
+{
+	std::string value;
+	for (const char **attr=IMAGE_ATTRS;  *attr!=NULL;  ++attr) {
+		serial_image_meta(fixture.meta, *attr, value);
+		fixture.sink += value.size();
+	}
+}
+
+static void
+op_deserial_image_meta(Fixture& fixture)
+{
+	size_t i = 0;
+	for (const char **attr=IMAGE_ATTRS;  *attr!=NULL;  ++attr) {
+		deserial_image_meta(fixture.meta, *attr, fixture.values[i++]);
+	}
+	fixture.sink += fixture.meta->subjectid;
+}
+
+static void
+op_serial_image_table_meta(Fixture& fixture)
+{
+	std::string value;
+	for (const char **attr=IMAGE_TABLE_ATTRS;  *attr!=NULL;  ++attr) {
+		serial_image_table_meta(fixture.tablemeta, *attr, value);
+		fixture.sink += value.size();
+	}
+}
+
+static void
+op_deserial_image_table_meta(Fixture& fixture)
+{
+	size_t i = 0;
+	for (const char **attr=IMAGE_TABLE_ATTRS;  *attr!=NULL;  ++attr) {
+		deserial_image_table_meta(fixture.tablemeta, *attr, fixture.tablevalues[i++]);
+	}
+	fixture.sink += fixture.tablemeta->nextimageid;
+}
+
+static void
+op_profiler_event(Fixture& fixture)
+{
+	fixture.profiler->start();
+	fixture.profiler->stop(EVENT_BENCH, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static void
+run_primitives(Fixture& fixture, double mintime, std::vector<Result>& results)
+{
+	// the images at the training resolution, and an eigenspace of them
+	for (size_t i=0;  i<fixture.pgms.size();  ++i) {
+		size_t size;
+		char *data = next_buffer(fixture, size);
+		IplImage *image;
+		if (decode_image_resized(data, size, fixture.resolution, &image) != IMAGE_OK) {
+			throw std::runtime_error("generated an invalid image");
+		}
+		fixture.images.push_back(image);
+	}
+	fixture.eigenspace = create_eigen_space(fixture.images.size(),
+			&fixture.images[0], fixture.resolution, fixture.components);
+	size_t dimension = fixture.eigenspace->dimension;
+	fixture.features.resize(fixture.images.size()*dimension);
+	for (size_t i=0;  i<fixture.images.size();  ++i) {
+		decomposite(fixture.eigenspace, fixture.images[i],
+				&fixture.features[i*dimension]);
+	}
+
+	// metadata as the scanner finds it
+	fixture.meta = new ImageMetadata(1);
+	fixture.meta->name = "yaleB01/yaleB01_P00A+000E+00.pgm";
+	fixture.meta->subjectid = 1;
+	fixture.meta->poseid = 0;
+	int format;
+	size_t offset;
+	parse_header(fixture.pgms[0].data(), fixture.pgms[0].size(),
+			fixture.meta->dimensions, format, offset);
+	fixture.meta->format = format;
+	fixture.tablemeta = new ImageTableMetadata(TABLE_ID);
+	fixture.tablemeta->bucket = CVDB::BUCKET;
+	fixture.tablemeta->prefix = PREFIX;
+	fixture.tablemeta->imagedomain = "table1images";
+	fixture.tablemeta->nextimageid = fixture.pgms.size() + 1;
+	fixture.tablemeta->eigenspace = new Eigenspace;
+	fixture.tablemeta->eigenspace->dimension = dimension;
+	fixture.tablemeta->eigenspace->resolution = fixture.resolution;
+	fixture.tablemeta->eigenspace->version = 1;
+	std::string value;
+	for (const char **attr=IMAGE_ATTRS;  *attr!=NULL;  ++attr) {
+		serial_image_meta(fixture.meta, *attr, value);
+		fixture.values.push_back(value);
+	}
+	for (const char **attr=IMAGE_TABLE_ATTRS;  *attr!=NULL;  ++attr) {
+		serial_image_table_meta(fixture.tablemeta, *attr, value);
+		fixture.tablevalues.push_back(value);
+	}
+	fixture.meta->imagetable = fixture.tablemeta;
+
+	add_result(results, "parse_header", "ns",
+			time_op(op_parse_header, fixture, mintime));
+	add_result(results, "read_image", "ns",
+			time_op(op_read_image, fixture, mintime));
+	add_result(results, "read_image_resized", "ns",
+			time_op(op_read_image_resized, fixture, mintime));
+	add_result(results, "create_eigen_space", "ns",
+			time_op(op_create_eigen_space, fixture, mintime));
+	add_result(results, "decomposite", "ns",
+			time_op(op_decomposite, fixture, mintime));
+	add_result(results, "vector_distance", "ns",
+			time_op(op_vector_distance, fixture, mintime));
+	add_result(results, "serial_image_meta", "ns",
+			time_op(op_serial_image_meta, fixture, mintime));
+	add_result(results, "deserial_image_meta", "ns",
+			time_op(op_deserial_image_meta, fixture, mintime));
+	add_result(results, "serial_image_table_meta", "ns",
+			time_op(op_serial_image_table_meta, fixture, mintime));
+	add_result(results, "deserial_image_table_meta", "ns",
+			time_op(op_deserial_image_table_meta, fixture, mintime));
+
+	// what profiling adds to every timed event
+	fixture.profiler = new Profiler();
+	add_result(results, "profiler_event", "ns",
+			time_op(op_profiler_event, fixture, mintime));
+	delete fixture.profiler;
+
+	for (size_t i=0;  i<fixture.images.size();  ++i) {
+		cvReleaseImage(&fixture.images[i]);
+	}
+	fixture.images.clear();
+	delete fixture.eigenspace;
+	fixture.meta->imagetable = NULL;
+	delete fixture.meta;
+	delete fixture.tablemeta;
+}
+
+/* Uploads, trains, learns and queries table 1, timing each step */
+static void
+run_end_to_end(size_t nimages, size_t resolution, int components,
+		int nqueries, std::vector<Result>& results)
+{
+	CVDB cvdb;
+	std::pair<int, int> range(1, nimages);
+	timeval start, stop;
+
+	// upload reports every image on stdout
+	std::ostringstream quiet;
+	std::streambuf *cout = std::cout.rdbuf(quiet.rdbuf());
+	YaleS3Scanner scanner(PREFIX);
+	gettimeofday(&start, NULL);
+	int status = cvdb.upload(&scanner, TABLE_ID, PREFIX);
+	gettimeofday(&stop, NULL);
+	std::cout.rdbuf(cout);
+	if (status != EXIT_SUCCESS) {
+		throw std::runtime_error("upload failed");
+	}
+	add_result(results, "upload", "ms", elapsed_s(start, stop)*1000);
+
+	gettimeofday(&start, NULL);
+	status = cvdb.train(TABLE_ID, resolution, range, CVDB::WINDOW, components);
+	gettimeofday(&stop, NULL);
+	if (status != EXIT_SUCCESS) {
+		throw std::runtime_error("train failed");
+	}
+	add_result(results, "train", "ms", elapsed_s(start, stop)*1000);
+
+	gettimeofday(&start, NULL);
+	status = cvdb.learn(TABLE_ID, range);
+	gettimeofday(&stop, NULL);
+	if (status != EXIT_SUCCESS) {
+		throw std::runtime_error("learn failed");
+	}
+	add_result(results, "learn", "ms", elapsed_s(start, stop)*1000);
+
+	std::ostringstream outs;
+	gettimeofday(&start, NULL);
+	for (int q=0;  q<nqueries;  ++q) {
+		int imageid = 1 + (int)((size_t)q*nimages/nqueries);
+		if (cvdb.query(TABLE_ID, imageid, range, outs, 5) != EXIT_SUCCESS) {
+			throw std::runtime_error("query failed");
+		}
+	}
+	gettimeofday(&stop, NULL);
+	add_result(results, "query", "ms", elapsed_s(start, stop)*1000/nqueries);
+}
+
+/* Sets how many images a table holds, as an uploader appending images
+ * to it would */
+static void
+set_next_image_id(int table, int nextimageid)
+{
+	char buf[32];
+	Attributes attrs;
+	sprintf(buf, "%d", nextimageid);
+	attrs.push_back(std::make_pair(std::string("nextid"), std::string(buf)));
+	sprintf(buf, "%d", table);
+	metadata_store().put_attributes(CVDB::CATALOG, buf, attrs);
+}
+
+/* Learns table 2 in shards, the last cut short, then adds images to it,
+ * folds them in, reprojects the old and learns the new, and checks that
+ * every image is found nearest itself */
+static void
+run_added_images(size_t nimages, size_t resolution, int components)
+{
+	int added = nimages / 4;
+	int old = nimages - added;
+	if (added < 1 || old < 3) {
+		return;
+	}
+	int shardsize = old / 2 + 1;
+	CVDB cvdb;
+	std::pair<int, int> range(1, old);
+
+	std::ostringstream quiet;
+	std::streambuf *cout = std::cout.rdbuf(quiet.rdbuf());
+	YaleS3Scanner scanner(ADDED_PREFIX);
+	int status = cvdb.upload(&scanner, ADDED_TABLE_ID, ADDED_PREFIX);
+	std::cout.rdbuf(cout);
+	if (status != EXIT_SUCCESS) {
+		throw std::runtime_error("upload failed");
+	}
+	set_next_image_id(ADDED_TABLE_ID, old + 1);
+	if (cvdb.train(ADDED_TABLE_ID, resolution, range, CVDB::WINDOW, components) != EXIT_SUCCESS
+			|| cvdb.learn(ADDED_TABLE_ID, range, shardsize) != EXIT_SUCCESS) {
+		throw std::runtime_error("learn before adding images failed");
+	}
+
+	set_next_image_id(ADDED_TABLE_ID, nimages + 1);
+	std::pair<int, int> added_range(old + 1, nimages);
+	if (cvdb.update(ADDED_TABLE_ID, added_range) != EXIT_SUCCESS
+			|| cvdb.reproject(ADDED_TABLE_ID, range) != EXIT_SUCCESS
+			|| cvdb.learn(ADDED_TABLE_ID, added_range, shardsize) != EXIT_SUCCESS) {
+		throw std::runtime_error("learn after adding images failed");
+	}
+
+	range.second = nimages;
+	for (int imageid=1;  imageid<=(int)nimages;  ++imageid) {
+		std::ostringstream outs;
+		if (cvdb.query(ADDED_TABLE_ID, imageid, range, outs, 1) != EXIT_SUCCESS) {
+			throw std::runtime_error("query after adding images failed");
+		}
+		char buf[64];
+		sprintf(buf, "[ [%d, ", imageid);
+		if (outs.str().find(buf) == std::string::npos) {
+			throw std::runtime_error("image not nearest itself after adding images: "
+					+ outs.str());
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static void
+write_results(std::ostream& outs, const std::vector<Result>& results)
+{
+	char buf[64];
+	outs << "{\"isa\": \"" << distance_isa() << "\", \"results\": [" << std::endl;
+	for (size_t i=0;  i<results.size();  ++i) {
+		sprintf(buf, "%.6g", results[i].value);
+		outs << " {\"name\": \"" << results[i].name << "\", \"unit\": \""
+				<< results[i].unit << "\", \"value\": " << buf << "}"
+				<< (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	outs << "]}" << std::endl;
+}
+
+/* Reads the values of an output of write_results by name */
+static bool
+read_results(const std::string& path, std::map<std::string, double>& values)
+{
+	std::ifstream ins(path.c_str());
+	if (!ins) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(ins, line)) {
+		char name[128];
+		char unit[16];
+		double value;
+		if (sscanf(line.c_str(), " {\"name\": \"%127[^\"]\", \"unit\": \"%15[^\"]\", \"value\": %lf",
+				name, unit, &value) == 3) {
+			values[name] = value;
+		}
+	}
+	return true;
+}
+
+/* Writes "NAME BASELINE VALUE RATIO" per result found in the baseline,
+ * ending the line with REGRESSION if it is too slow, and returns the
+ * number of regressions */
+static int
+compare_results(const std::vector<Result>& results,
+		std::map<std::string, double>& baseline, double tolerance)
+{
+	int regressions = 0;
+	char buf[256];
+	for (size_t i=0;  i<results.size();  ++i) {
+		if (baseline.count(results[i].name) == 0 || baseline[results[i].name] <= 0) {
+			continue;
+		}
+		double base = baseline[results[i].name];
+		double ratio = results[i].value / base;
+		bool regressed = ratio > 1 + tolerance;
+		sprintf(buf, "%s %.6g %.6g %.3f%s", results[i].name.c_str(), base,
+				results[i].value, ratio, regressed ? " REGRESSION" : "");
+		std::cerr << buf << std::endl;
+		if (regressed) {
+			++regressions;
+		}
+	}
+	return regressions;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+int
+main(const int argc, const char **argv)
+{
+	std::map<std::string, std::string> options;
+	for (int i=1;  i<argc;  i+=2) {
+		if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc) {
+			std::cerr << "Usage error" << std::endl;
+			return EXIT_FAILURE;
+		}
+		options[argv[i] + 2] = argv[i+1];
+	}
+	int nsubjects = options.count("subjects") ? atoi(options["subjects"].c_str()) : 10;
+	int nposes = options.count("poses") ? atoi(options["poses"].c_str()) : 3;
+	int nlights = options.count("lights") ? atoi(options["lights"].c_str()) : 8;
+	int width = options.count("width") ? atoi(options["width"].c_str()) : 168;
+	int height = options.count("height") ? atoi(options["height"].c_str()) : 192;
+	int resolution = options.count("resolution") ? atoi(options["resolution"].c_str()) : 64;
+	int components = options.count("components") ? atoi(options["components"].c_str()) : 40;
+	int nqueries = options.count("queries") ? atoi(options["queries"].c_str()) : 20;
+	double mintime = options.count("mintime") ? atof(options["mintime"].c_str()) : 0.2;
+	double tolerance = options.count("tolerance") ? atof(options["tolerance"].c_str()) : 0.1;
+	if (nsubjects < 1 || nposes < 1 || nlights < 1 || width < 1 || height < 1
+			|| resolution < 1 || components < 1 || nqueries < 1
+			|| mintime <= 0 || tolerance < 0) {
+		std::cerr << "Usage error" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::map<std::string, double> baseline;
+	if (options.count("baseline") && !read_results(options["baseline"], baseline)) {
+		std::cerr << "Cannot read " << options["baseline"] << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// before the stores are first used
+	setenv("CVDB_STORAGE", "memory", 0);
+
+	Fixture fixture;
+	fixture.resolution = resolution;
+	fixture.components = components;
+	fixture.next = 0;
+	fixture.sink = 0;
+	generate_dataset(nsubjects, nposes, nlights, width, height, fixture.pgms);
+
+	std::vector<Result> results;
+	check_plain_images();
+	run_primitives(fixture, mintime, results);
+	run_end_to_end(fixture.pgms.size(), resolution, components, nqueries, results);
+	run_added_images(fixture.pgms.size(), resolution, components);
+
+	if (options.count("output")) {
+		std::ofstream outs(options["output"].c_str());
+		write_results(outs, results);
+		if (!outs) {
+			std::cerr << "Cannot write " << options["output"] << std::endl;
+			return EXIT_FAILURE;
+		}
+	} else {
+		write_results(std::cout, results);
+	}
+
+	if (options.count("baseline")
+			&& compare_results(results, baseline, tolerance) > 0) {
+		return EXIT_REGRESSION;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/****************************************************************************
+ *
+ * Measures the recall of the graph index against an exact scan.
+ *
+ * graph_bench [N [DIMENSION [QUERIES [K [THREADS]]]]]
+ *
+ * Draws N gaussian feature vectors whose variances fall off as 1/i, like
+ * those of an eigenspace, and QUERIES more from the same distribution,
+ * then inserts the N into a GraphIndex from THREADS threads at once, as
+ * faces index does, and writes
+ *
+ * build THREADS MS
+ *
+ * Every query is then searched for its K nearest at a range of ef, and
+ * one line is written per ef:
+ *
+ * EF MS_PER_QUERY RECALL
+ *
+ * where RECALL is the fraction of the exact K nearest the search found.
+ * The exit status is 1 if the recall at the largest ef is below
+ * MIN_RECALL.
+ *
+ ****************************************************************************/
+
+#include "index.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include <pthread.h>
+#include <sys/time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* the ef searched at, each at least K */
+static const size_t EFS[] = { 10, 20, 40, 80, 160 };
+static const size_t NEFS = sizeof(EFS) / sizeof(EFS[0]);
+
+/* the recall the largest ef must reach */
+static const double MIN_RECALL = 0.95;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct InsertArgs
+{
+	GraphIndex *graph;
+	const float *vectors;
+	size_t first;
+	size_t n;
+	size_t stride;
+};
+
+static double
+gaussian()
+{
+	double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	return sqrt(-2*log(u1))*cos(2*M_PI*u2);
+}
+
+static double
+elapsed_ms(timeval& start, timeval& stop)
+{
+	return (stop.tv_sec - start.tv_sec)*1000.0
+			+ (stop.tv_usec - start.tv_usec)/1000.0;
+}
+
+/* Inserts every stride'th vector from first */
+static void *
+insert_vectors(void *arg)
+{
+	InsertArgs *args = (InsertArgs*)arg;
+	size_t dimension = args->graph->dimension;
+	for (size_t j=args->first;  j<args->n;  j+=args->stride) {
+		args->graph->insert(j, args->vectors + j*dimension);
+	}
+	return NULL;
+}
+
+/* The ids of the neighbours, nearest first */
+static void
+neighbor_ids(const Neighbors& neighbors, std::vector<int>& ids)
+{
+	std::vector<Neighbors::Neighbor> sorted;
+	neighbors.sorted(sorted);
+	ids.clear();
+	for (size_t j=0;  j<sorted.size();  ++j) {
+		ids.push_back(sorted[j].second);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+int
+main(const int argc, const char **argv)
+{
+	size_t n = (argc > 1) ? atoi(argv[1]) : 20000;
+	size_t dimension = (argc > 2) ? atoi(argv[2]) : 32;
+	size_t nqueries = (argc > 3) ? atoi(argv[3]) : 100;
+	size_t k = (argc > 4) ? atoi(argv[4]) : 10;
+	int nthreads = (argc > 5) ? atoi(argv[5]) : 4;
+	if (n < 1 || dimension < 1 || nqueries < 1 || k < 1 || k > EFS[0]
+			|| nthreads < 1) {
+		std::cerr << "Usage error" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// features and queries
+	srand(1);
+	std::vector<float> vectors(n*dimension);
+	for (size_t j=0;  j<n;  ++j) {
+		for (size_t i=0;  i<dimension;  ++i) {
+			vectors[j*dimension + i] = gaussian()*sqrt(1.0 / (i + 1));
+		}
+	}
+	std::vector<float> queries(nqueries*dimension);
+	for (size_t j=0;  j<nqueries;  ++j) {
+		for (size_t i=0;  i<dimension;  ++i) {
+			queries[j*dimension + i] = gaussian()*sqrt(1.0 / (i + 1));
+		}
+	}
+
+	// the exact answers, against which the searches are scored
+	std::pair<int, int> all(0, n - 1);
+	std::vector< std::vector<int> > exact(nqueries);
+	std::vector<double> dists(n);
+	for (size_t q=0;  q<nqueries;  ++q) {
+		vector_distances(dimension, &queries[q*dimension], &vectors[0], n,
+				&dists[0]);
+		Neighbors neighbors(k);
+		for (size_t j=0;  j<n;  ++j) {
+			neighbors.offer(j, dists[j]);
+		}
+		neighbor_ids(neighbors, exact[q]);
+	}
+
+	// the graph, built concurrently
+	char buf[256];
+	timeval start, stop;
+	GraphIndex graph(dimension);
+	graph.reserve(n);
+	std::vector<pthread_t> threads(nthreads);
+	std::vector<InsertArgs> args(nthreads);
+	gettimeofday(&start, NULL);
+	for (int t=0;  t<nthreads;  ++t) {
+		InsertArgs a = { &graph, &vectors[0], (size_t)t, n, (size_t)nthreads };
+		args[t] = a;
+		pthread_create(&threads[t], NULL, insert_vectors, &args[t]);
+	}
+	for (int t=0;  t<nthreads;  ++t) {
+		pthread_join(threads[t], NULL);
+	}
+	gettimeofday(&stop, NULL);
+	sprintf(buf, "build %d %.3f", nthreads, elapsed_ms(start, stop));
+	std::cout << buf << std::endl;
+
+	double recall = 0;
+	for (size_t e=0;  e<NEFS;  ++e) {
+		std::vector<int> nearest;
+		size_t found = 0;
+		gettimeofday(&start, NULL);
+		for (size_t q=0;  q<nqueries;  ++q) {
+			Neighbors neighbors(k);
+			graph.search(&queries[q*dimension], EFS[e], all, neighbors);
+			neighbor_ids(neighbors, nearest);
+			for (size_t j=0;  j<nearest.size();  ++j) {
+				if (std::find(exact[q].begin(), exact[q].end(), nearest[j])
+						!= exact[q].end()) {
+					++found;
+				}
+			}
+		}
+		gettimeofday(&stop, NULL);
+		recall = (double)found / (nqueries*k);
+		sprintf(buf, "%lu %.3f %.4f", (unsigned long)EFS[e],
+				elapsed_ms(start, stop) / nqueries, recall);
+		std::cout << buf << std::endl;
+	}
+
+	if (recall < MIN_RECALL) {
+		std::cerr << "Recall is below the minimum" << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
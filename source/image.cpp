@@ -2,14 +2,45 @@
  ****************************************************************************/
 
 #include "image.h"
+#include "distance.h"
 #include "opencv/cvaux.h"
 
+#include <algorithm>
+#include <sstream>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* eigenvalues this small relative to the largest are numerically zero */
+static const double RANK_EPSILON = 1e-10;
+
+/* The leading k eigenvectors of an m x m Gram matrix are found by
+ * subspace iteration over k + SUBSPACE_OVERSAMPLING vectors, when that is
+ * at most m / SUBSPACE_CROSSOVER, until the Ritz values change by less
+ * than SUBSPACE_TOLERANCE of the largest */
+static const int SUBSPACE_OVERSAMPLING = 10;
+static const int SUBSPACE_CROSSOVER = 4;
+static const int SUBSPACE_ITERATIONS = 200;
+static const double SUBSPACE_TOLERANCE = 1e-10;
 
 Eigenspace::Eigenspace()
- : resolution(0), dimension(0), eigenfaces(NULL), avgface(NULL) { }
+ : resolution(0), dimension(0), version(0), eigenfaces(NULL), avgface(NULL),
+   eigenvalues(NULL), nimages(0), views(NULL), mapping(NULL), mapsize(0) { }
 
 Eigenspace::~Eigenspace()
 {
+	if (mapping != NULL) {
+		// the images are views, which own nothing
+		delete[] eigenfaces;
+		delete[] views;
+		munmap(mapping, mapsize);
+		return;
+	}
 	if (eigenfaces != NULL) {
 		for (int i=0;  i<dimension;  ++i) {
 			cvReleaseImage(&(eigenfaces[i]));
@@ -19,10 +50,14 @@ Eigenspace::~Eigenspace()
 	if (avgface != NULL) {
 		cvReleaseImage(&avgface);
 	}
+	if (eigenvalues != NULL) {
+		delete[] eigenvalues;
+	}
 }
 
 ImageTableMetadata::ImageTableMetadata(const int id)
-  : id(id), eigenspace(NULL) { }
+  : id(id), nextimageid(0), shardsize(0), encoding(ENCODING_F32), index(0),
+    graph(0), eigenspace(NULL) { }
 
 ImageTableMetadata::~ImageTableMetadata()
 {
@@ -43,132 +78,1667 @@ ImageMetadata::~ImageMetadata()
 	}
 }
 
+FeatureBlock::FeatureBlock(const int first, const int last, const int dimension,
+		const int encoding)
+ : first(first), last(last), dimension(dimension), version(0),
+   encoding(encoding), features(NULL), codes(NULL), scale(NULL), offset(NULL)
+{
+	assert(last >= first);
+	assert(encoding >= 0 && encoding < NENCODINGS);
+	if (encoding == ENCODING_F32) {
+		features = new float[(last - first + 1)*dimension];
+	} else {
+		codes = new unsigned char[(last - first + 1)*rowsize()];
+	}
+	if (encoding == ENCODING_I8) {
+		scale = new float[dimension];
+		offset = new float[dimension];
+		std::fill(scale, scale + dimension, 0.0f);
+		std::fill(offset, offset + dimension, 0.0f);
+	}
+}
+
+FeatureBlock::~FeatureBlock()
+{
+	if (features != NULL) {
+		delete[] features;
+	}
+	delete[] codes;
+	delete[] scale;
+	delete[] offset;
+}
+
+float *
+FeatureBlock::row(const int id)
+{
+	assert(id >= first && id <= last);
+	assert(encoding == ENCODING_F32);
+	return features + (size_t)(id - first)*dimension;
+}
+
+unsigned char *
+FeatureBlock::code(const int id)
+{
+	assert(id >= first && id <= last);
+	if (encoding == ENCODING_F32) {
+		return (unsigned char*)row(id);
+	}
+	return codes + (size_t)(id - first)*rowsize();
+}
+
+size_t
+FeatureBlock::rowsize() const
+{
+	return encoding_size(encoding)*dimension;
+}
+
+void
+FeatureBlock::set(const int id, const float *values)
+{
+	unsigned char *c = code(id);
+	if (encoding == ENCODING_F16) {
+		for (int i=0;  i<dimension;  ++i) {
+			((unsigned short*)c)[i] = float_to_half(values[i]);
+		}
+	} else if (encoding == ENCODING_I8) {
+		encode_i8(dimension, values, scale, offset, c);
+	} else {
+		memcpy(c, values, rowsize());
+	}
+}
+
+void
+FeatureBlock::get(const int id, float *values)
+{
+	unsigned char *c = code(id);
+	if (encoding == ENCODING_F16) {
+		for (int i=0;  i<dimension;  ++i) {
+			values[i] = half_to_float(((unsigned short*)c)[i]);
+		}
+	} else if (encoding == ENCODING_I8) {
+		decode_i8(dimension, c, scale, offset, values);
+	} else {
+		memcpy(values, c, rowsize());
+	}
+}
+
+void
+FeatureBlock::calibrate(const float *variances)
+{
+	assert(encoding == ENCODING_I8);
+	calibrate_i8(dimension, variances, scale, offset);
+}
+
+bool
+FeatureBlock::same_codes(const FeatureBlock& other) const
+{
+	if (other.encoding != encoding || other.dimension != dimension) {
+		return false;
+	}
+	return encoding != ENCODING_I8
+			|| (!memcmp(scale, other.scale, sizeof(float)*dimension)
+				&& !memcmp(offset, other.offset, sizeof(float)*dimension));
+}
+
+FeatureRotation::FeatureRotation(Eigenspace *from, Eigenspace *to)
+ : fromdimension(from->dimension), todimension(to->dimension),
+   rotation((size_t)to->dimension*from->dimension), offset(to->dimension)
+{
+	assert(from->resolution == to->resolution);
+	int npixels = to->resolution*to->resolution;
+	const float *fromavg = (float*)(from->avgface->imageData);
+	const float *toavg = (float*)(to->avgface->imageData);
+	for (int i=0;  i<todimension;  ++i) {
+		const float *u = (float*)(to->eigenfaces[i]->imageData);
+		for (int j=0;  j<fromdimension;  ++j) {
+			const float *v = (float*)(from->eigenfaces[j]->imageData);
+			double dot = 0;
+			for (int p=0;  p<npixels;  ++p) {
+				dot += (double)u[p]*v[p];
+			}
+			rotation[(size_t)i*fromdimension + j] = dot;
+		}
+		double dot = 0;
+		for (int p=0;  p<npixels;  ++p) {
+			dot += (double)u[p]*(fromavg[p] - toavg[p]);
+		}
+		offset[i] = dot;
+	}
+}
+
+void
+FeatureRotation::apply(const float *from, float *to) const
+{
+	for (int i=0;  i<todimension;  ++i) {
+		const float *r = &rotation[(size_t)i*fromdimension];
+		double sum = offset[i];
+		for (int j=0;  j<fromdimension;  ++j) {
+			sum += (double)r[j]*from[j];
+		}
+		to[i] = sum;
+	}
+}
+
 ImageScanner::ImageScanner() { }
 
 
+static size_t
+eigenspace_align(size_t size)
+{
+	return (size + EIGENSPACE_ALIGN - 1) / EIGENSPACE_ALIGN * EIGENSPACE_ALIGN;
+}
+
+static void
+write_padding(std::ostream& outs, size_t size)
+{
+	static const char zeros[EIGENSPACE_ALIGN] = { 0 };
+	outs.write(zeros, eigenspace_align(size) - size);
+}
+
+static void
+write_eigenspace_image(std::ostream& outs, IplImage *image)
+{
+	for (int y=0;  y<image->height;  ++y) {
+		outs.write(image->imageData + y*image->widthStep,
+				sizeof(float)*image->width);
+	}
+}
+
+void
+write_eigenspace(std::ostream& outs, Eigenspace *eigenspace)
+{
+	// fixed size text header, so that the data that follows is aligned
+	std::stringstream header;
+	int nvalues = (eigenspace->eigenvalues != NULL) ? eigenspace->dimension : 0;
+	header << PEIG << " "
+		<< eigenspace->version << " "
+		<< eigenspace->resolution << " "
+		<< eigenspace->dimension << " "
+		<< nvalues << " "
+		<< eigenspace->nimages;
+	if (!eigenspace->trainid.empty()) {
+		header << " " << eigenspace->trainid;
+	}
+	std::string line(header.str());
+	assert(line.size() < EIGENSPACE_ALIGN);
+	line.resize(EIGENSPACE_ALIGN - 1, ' ');
+	outs << line << std::endl;
+
+	size_t facesize = sizeof(float)*eigenspace->resolution*eigenspace->resolution;
+	write_eigenspace_image(outs, eigenspace->avgface);
+	write_padding(outs, facesize);
+	for (int i=0;  i<eigenspace->dimension;  ++i) {
+		write_eigenspace_image(outs, eigenspace->eigenfaces[i]);
+	}
+	if (nvalues > 0) {
+		write_padding(outs, facesize*eigenspace->dimension);
+		outs.write((char*)(eigenspace->eigenvalues), sizeof(float)*nvalues);
+	}
+}
+
+bool
+map_eigenspace(const std::string& path, Eigenspace *eigenspace)
+{
+	assert(eigenspace->eigenfaces == NULL && eigenspace->avgface == NULL);
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < EIGENSPACE_ALIGN) {
+		close(fd);
+		return false;
+	}
+	size_t size = st.st_size;
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		return false;
+	}
+
+	// check the header against the table
+	std::string line((char*)mapping, EIGENSPACE_ALIGN);
+	int fmt = -1, version = -1, dimension = -1;
+	size_t resolution = 0;
+	std::stringstream header(line);
+	header >> fmt >> version >> resolution >> dimension;
+	int nvalues = 0, nimages = 0;
+	if (header && !(header >> nvalues >> nimages)) {
+		// written before eigenvalues (or the image count) were kept
+		header.clear();
+	}
+	std::string trainid;
+	if (header && !(header >> trainid)) {
+		// or before train ids
+		header.clear();
+	}
+	size_t facesize = sizeof(float)*resolution*resolution;
+	size_t valuesoffset = EIGENSPACE_ALIGN + eigenspace_align(facesize)
+			+ eigenspace_align(facesize*dimension);
+	if (!header || fmt != PEIG
+			|| version != eigenspace->version
+			|| (!eigenspace->trainid.empty() && trainid != eigenspace->trainid)
+			|| resolution != eigenspace->resolution
+			|| (eigenspace->dimension != 0 && dimension != eigenspace->dimension)
+			|| dimension <= 0
+			|| (nvalues != 0 && nvalues != dimension)
+			|| size < EIGENSPACE_ALIGN + eigenspace_align(facesize)
+					+ facesize*dimension
+			|| (nvalues > 0 && size < valuesoffset + sizeof(float)*nvalues)) {
+		munmap(mapping, size);
+		return false;
+	}
+
+	// one header per image, all pointing into the mapping
+	char *data = (char*)mapping + EIGENSPACE_ALIGN;
+	IplImage *views = new IplImage[dimension + 1];
+	for (int i=0;  i<=dimension;  ++i) {
+		cvInitImageHeader(&views[i], cvSize(resolution, resolution),
+				IPL_DEPTH_32F, 1);
+		cvSetData(&views[i], data, sizeof(float)*resolution);
+		data += (i == 0) ? eigenspace_align(facesize) : facesize;
+	}
+	eigenspace->dimension = dimension;
+	eigenspace->nimages = nimages;
+	eigenspace->views = views;
+	eigenspace->mapping = mapping;
+	eigenspace->mapsize = size;
+	eigenspace->avgface = &views[0];
+	eigenspace->eigenfaces = new IplImage*[dimension];
+	for (int i=0;  i<dimension;  ++i) {
+		eigenspace->eigenfaces[i] = &views[i + 1];
+	}
+	if (nvalues > 0) {
+		eigenspace->eigenvalues = (float*)((char*)mapping + valuesoffset);
+	}
+	return true;
+}
+
+bool
+read_eigenspace(std::istream& ins, Eigenspace *eigenspace)
+{
+	assert(eigenspace->eigenfaces == NULL && eigenspace->avgface == NULL);
+
+	// check the header against the table
+	std::vector<char> line(EIGENSPACE_ALIGN);
+	ins.read(&line[0], EIGENSPACE_ALIGN);
+	if (ins.gcount() != (std::streamsize)EIGENSPACE_ALIGN) {
+		return false;
+	}
+	int fmt = -1, version = -1, dimension = -1;
+	size_t resolution = 0;
+	std::stringstream header(std::string(line.begin(), line.end()));
+	header >> fmt >> version >> resolution >> dimension;
+	int nvalues = 0, nimages = 0;
+	if (header && !(header >> nvalues >> nimages)) {
+		header.clear();
+	}
+	std::string trainid;
+	if (header && !(header >> trainid)) {
+		header.clear();
+	}
+	if (!header || fmt != PEIG
+			|| version != eigenspace->version
+			|| (!eigenspace->trainid.empty() && trainid != eigenspace->trainid)
+			|| resolution != eigenspace->resolution
+			|| (eigenspace->dimension != 0 && dimension != eigenspace->dimension)
+			|| dimension <= 0
+			|| (nvalues != 0 && nvalues != dimension)) {
+		return false;
+	}
+
+	size_t facesize = sizeof(float)*resolution*resolution;
+	std::vector<char> padding(eigenspace_align(facesize) - facesize);
+	IplImage *avgface = cvCreateImage(cvSize(resolution, resolution),
+			IPL_DEPTH_32F, 1);
+	IplImage **eigenfaces = new IplImage*[dimension];
+	for (int i=0;  i<dimension;  ++i) {
+		eigenfaces[i] = cvCreateImage(cvSize(resolution, resolution),
+				IPL_DEPTH_32F, 1);
+	}
+	for (int i=-1;  i<dimension;  ++i) {
+		IplImage *image = (i < 0) ? avgface : eigenfaces[i];
+		for (int y=0;  y<image->height;  ++y) {
+			ins.read(image->imageData + y*image->widthStep,
+					sizeof(float)*image->width);
+		}
+		if (i < 0 && !padding.empty()) {
+			ins.read(&padding[0], padding.size());
+		}
+	}
+	float *eigenvalues = NULL;
+	if (nvalues > 0) {
+		padding.resize(eigenspace_align(facesize*dimension) - facesize*dimension);
+		if (!padding.empty()) {
+			ins.read(&padding[0], padding.size());
+		}
+		eigenvalues = new float[nvalues];
+		ins.read((char*)eigenvalues, sizeof(float)*nvalues);
+	}
+	if (!ins) {
+		for (int i=0;  i<dimension;  ++i) {
+			cvReleaseImage(&(eigenfaces[i]));
+		}
+		delete[] eigenfaces;
+		cvReleaseImage(&avgface);
+		delete[] eigenvalues;
+		return false;
+	}
+	eigenspace->dimension = dimension;
+	eigenspace->nimages = nimages;
+	eigenspace->avgface = avgface;
+	eigenspace->eigenfaces = eigenfaces;
+	eigenspace->eigenvalues = eigenvalues;
+	return true;
+}
+
+static IplImage *
+copy_eigenspace_image(IplImage *image)
+{
+	IplImage *copy = cvCreateImage(cvSize(image->width, image->height),
+			IPL_DEPTH_32F, 1);
+	for (int y=0;  y<image->height;  ++y) {
+		memcpy(copy->imageData + y*copy->widthStep,
+				image->imageData + y*image->widthStep,
+				sizeof(float)*image->width);
+	}
+	return copy;
+}
+
+Eigenspace *
+copy_eigen_space(Eigenspace *eigenspace)
+{
+	Eigenspace *copy = new Eigenspace;
+	copy->resolution = eigenspace->resolution;
+	copy->dimension = eigenspace->dimension;
+	copy->version = eigenspace->version;
+	copy->trainid = eigenspace->trainid;
+	copy->nimages = eigenspace->nimages;
+	copy->avgface = copy_eigenspace_image(eigenspace->avgface);
+	copy->eigenfaces = new IplImage*[eigenspace->dimension];
+	for (int i=0;  i<eigenspace->dimension;  ++i) {
+		copy->eigenfaces[i] = copy_eigenspace_image(eigenspace->eigenfaces[i]);
+	}
+	if (eigenspace->eigenvalues != NULL) {
+		copy->eigenvalues = new float[eigenspace->dimension];
+		memcpy(copy->eigenvalues, eigenspace->eigenvalues,
+				sizeof(float)*eigenspace->dimension);
+	}
+	return copy;
+}
+
+/* Number of the k leading eigenvalues (in decreasing order) needed to
+ * retain the given fraction of the total variance, at least one */
+static int
+retained_components(const double *lambda, int k, double total, double variance)
+{
+	if (variance > 0 && variance < 1) {
+		double retained = 0;
+		int j = 0;
+		while (j < k && retained < variance*total) {
+			retained += lambda[j];
+			++j;
+		}
+		k = j;
+	}
+	return std::max(k, 1);
+}
+
+/* Eigenvectors (as rows, by decreasing eigenvalue) of a symmetric m x m
+ * matrix, which is destroyed */
+static void
+symmetric_eigen(int m, std::vector<double>& matrix,
+		std::vector<double>& vectors, std::vector<double>& values)
+{
+	vectors.resize((size_t)m*m);
+	values.resize(m);
+	CvMat a = cvMat(m, m, CV_64FC1, &matrix[0]);
+	CvMat v = cvMat(m, m, CV_64FC1, &vectors[0]);
+	CvMat e = cvMat(m, 1, CV_64FC1, &values[0]);
+	cvEigenVV(&a, &v, &e, DBL_EPSILON);
+}
+
+/* Makes the p rows of m doubles orthonormal, in order (modified
+ * Gram-Schmidt, twice over for accuracy), zeroing any that depend on the
+ * rows before them */
+static void
+orthonormalize_rows(int p, int m, std::vector<double>& rows)
+{
+	for (int i=0;  i<p;  ++i) {
+		double *r = &rows[(size_t)i*m];
+		double before = 0;
+		for (int j=0;  j<m;  ++j) {
+			before += r[j]*r[j];
+		}
+		for (int pass=0;  pass<2;  ++pass) {
+			for (int h=0;  h<i;  ++h) {
+				const double *q = &rows[(size_t)h*m];
+				double dot = 0;
+				for (int j=0;  j<m;  ++j) {
+					dot += q[j]*r[j];
+				}
+				for (int j=0;  j<m;  ++j) {
+					r[j] -= dot*q[j];
+				}
+			}
+		}
+		double norm = 0;
+		for (int j=0;  j<m;  ++j) {
+			norm += r[j]*r[j];
+		}
+		double scale = (norm > RANK_EPSILON*before && norm > 0) ? 1.0 / sqrt(norm) : 0.0;
+		for (int j=0;  j<m;  ++j) {
+			r[j] *= scale;
+		}
+	}
+}
+
+/* The leading k eigenvectors (as the rows of vectors, by decreasing
+ * eigenvalue) and eigenvalues of a symmetric positive semi-definite m x m
+ * matrix, by subspace iteration over p > k vectors: O(m^2 p) per
+ * iteration, instead of the O(m^3) of a full solve */
+static void
+subspace_eigen(const CvMat *matrix, int k, int p, std::vector<double>& vectors,
+		std::vector<double>& values)
+{
+	int m = matrix->rows;
+	std::vector<double> basis((size_t)p*m);
+	CvMat q = cvMat(p, m, CV_64FC1, &basis[0]);
+	CvRNG rng = cvRNG(1);
+	cvRandArr(&rng, &q, CV_RAND_NORMAL, cvRealScalar(0), cvRealScalar(1));
+	orthonormalize_rows(p, m, basis);
+
+	std::vector<double> product((size_t)p*m);
+	CvMat z = cvMat(p, m, CV_64FC1, &product[0]);
+	std::vector<double> ritz;
+	std::vector<double> rotation;
+	std::vector<double> previous;
+	for (int iteration=0;  ;  ++iteration) {
+		// Z = Q A, and the Rayleigh quotient Q A Q^T of the basis
+		cvGEMM(&q, matrix, 1, NULL, 0, &z);
+		ritz.resize((size_t)p*p);
+		CvMat t = cvMat(p, p, CV_64FC1, &ritz[0]);
+		cvGEMM(&z, &q, 1, NULL, 0, &t, CV_GEMM_B_T);
+		symmetric_eigen(p, ritz, rotation, values);
+
+		// done when the leading k Ritz values settle
+		bool settled = !previous.empty();
+		for (int i=0;  i<k && settled;  ++i) {
+			settled = fabs(values[i] - previous[i])
+					<= SUBSPACE_TOLERANCE*std::max(values[0], DBL_MIN);
+		}
+		if (settled || iteration + 1 >= SUBSPACE_ITERATIONS) {
+			break;
+		}
+		previous = values;
+		basis.swap(product);
+		q = cvMat(p, m, CV_64FC1, &basis[0]);
+		z = cvMat(p, m, CV_64FC1, &product[0]);
+		orthonormalize_rows(p, m, basis);
+	}
+
+	// the Ritz vectors W Q
+	vectors.resize((size_t)p*m);
+	CvMat w = cvMat(p, p, CV_64FC1, &rotation[0]);
+	CvMat v = cvMat(p, m, CV_64FC1, &vectors[0]);
+	cvGEMM(&w, &q, 1, NULL, 0, &v);
+}
+
+/* Fills in the leading eigenfaces of the scatter X^T X of the m x npixels
+ * data matrix X (with at most maxrank non-zero eigenvalues), dividing the
+ * eigenvalues by nimages for the variance */
+static void
+gram_eigenfaces(CvMat *data, int maxrank, int ncomponents, double variance,
+		int nimages, Eigenspace *eigenspace)
+{
+	int m = data->rows;
+	int npixels = data->cols;
+	size_t resolution = eigenspace->resolution;
+
+	// the eigenvectors v of the m x m Gram matrix X X^T give the
+	// eigenfaces X^T v / sqrt(lambda), without ever forming the much
+	// larger npixels x npixels covariance matrix
+	CvMat *gram = cvCreateMat(m, m, CV_64FC1);
+	cvMulTransposed(data, gram, 0);
+
+	// only the leading ncomponents are needed, if they are few, and the
+	// total variance is the trace; otherwise every eigenvalue is found
+	std::vector<double> vectors;
+	std::vector<double> values;
+	double total = 0;
+	int nfound = m;
+	int width = ncomponents + SUBSPACE_OVERSAMPLING;
+	if (ncomponents > 0 && width*SUBSPACE_CROSSOVER <= m) {
+		for (int i=0;  i<m;  ++i) {
+			total += ((double*)(gram->data.ptr + i*gram->step))[i];
+		}
+		subspace_eigen(gram, ncomponents, width, vectors, values);
+		nfound = width;
+	} else {
+		std::vector<double> matrix(gram->data.db, gram->data.db + (size_t)m*m);
+		symmetric_eigen(m, matrix, vectors, values);
+	}
+	cvReleaseMat(&gram);
+	double *lambda = &values[0];
+
+	// keep the leading non-zero eigenvalues, in decreasing order
+	int k = 0;
+	double sum = 0;
+	while (k < std::min(maxrank, nfound) && lambda[k] > RANK_EPSILON*lambda[0]) {
+		sum += lambda[k];
+		++k;
+	}
+	if (nfound == m) {
+		total = sum;
+	}
+	if (ncomponents > 0) {
+		k = std::min(k, ncomponents);
+	}
+	k = retained_components(lambda, k, total, variance);
+
+	// project the data onto the leading eigenvectors
+	CvMat *basis = cvCreateMat(k, m, CV_32FC1);
+	for (int i=0;  i<k;  ++i) {
+		const double *v = &vectors[(size_t)i*m];
+		float *b = (float*)(basis->data.ptr + i*basis->step);
+		double scale = (lambda[i] > 0) ? 1.0 / sqrt(lambda[i]) : 0.0;
+		for (int j=0;  j<m;  ++j) {
+			b[j] = v[j]*scale;
+		}
+	}
+	CvMat *faces = cvCreateMat(k, npixels, CV_32FC1);
+	cvGEMM(basis, data, 1, NULL, 0, faces);
+	cvReleaseMat(&basis);
+
+	eigenspace->dimension = k;
+	eigenspace->eigenfaces = new IplImage*[k];
+	eigenspace->eigenvalues = new float[k];
+	for (int i=0;  i<k;  ++i) {
+		eigenspace->eigenfaces[i] = cvCreateImage(cvSize(resolution, resolution),
+				IPL_DEPTH_32F, 1);
+		memcpy(eigenspace->eigenfaces[i]->imageData,
+				faces->data.ptr + i*faces->step, sizeof(float)*npixels);
+		eigenspace->eigenvalues[i] = lambda[i] / nimages;
+	}
+
+	// clean up
+	cvReleaseMat(&faces);
+}
+
+/* True for images decoded at the resolution already (see
+ * decode_image_resized), which need no resizing */
+static bool
+is_resized(IplImage *image, size_t resolution)
+{
+	return image->width == (int)resolution && image->height == (int)resolution
+			&& image->nChannels == 1;
+}
+
+/* Resizes an image into a row of floats */
+static void
+image_row(IplImage *image, size_t resolution, float *row)
+{
+	IplImage header;
+	cvInitImageHeader(&header, cvSize(resolution, resolution), IPL_DEPTH_32F, 1);
+	cvSetData(&header, row, sizeof(float)*resolution);
+	if (is_resized(image, resolution)) {
+		cvConvertScale(image, &header);
+		return;
+	}
+	IplImage *input_image = cvCreateImage(cvSize(resolution, resolution),
+			image->depth, image->nChannels);
+	cvResize(image, input_image);
+	cvConvertScale(input_image, &header);
+	cvReleaseImage(&input_image);
+}
+
 Eigenspace *
-create_eigen_space(size_t nimages, IplImage* images[], size_t resolution)
+create_eigen_space(size_t nimages, IplImage* images[], size_t resolution,
+		int ncomponents, double variance)
 {
 	assert(images != NULL);
+	assert(nimages > 1);
+	int n = nimages;
+	int npixels = resolution*resolution;
 
-	// resize images
-	IplImage **input_images = new IplImage*[nimages];
-	for (size_t i=0;  i<nimages;  ++i) {
-		input_images[i] = cvCreateImage(cvSize(resolution, resolution),
-				images[i]->depth, images[i]->nChannels);
-		cvResize(images[i], input_images[i]);
+	// resize images into the rows of a data matrix
+	CvMat *data = cvCreateMat(n, npixels, CV_32FC1);
+	for (int i=0;  i<n;  ++i) {
+		image_row(images[i], resolution, (float*)(data->data.ptr + i*data->step));
 	}
 
-	// initialize space
+	// center the rows on the mean face
 	Eigenspace *eigenspace = new Eigenspace;
+	eigenspace->resolution = resolution;
 	eigenspace->avgface = cvCreateImage(cvSize(resolution, resolution),
 			IPL_DEPTH_32F, 1);
-	eigenspace->resolution = resolution;
-	eigenspace->dimension = nimages - 1;
-	eigenspace->eigenfaces = new IplImage*[eigenspace->dimension];
-	for (int i=0;  i<eigenspace->dimension;  ++i) {
-		eigenspace->eigenfaces[i] = cvCreateImage(cvSize(resolution, resolution),
-									  IPL_DEPTH_32F,
-									  1);
+	std::vector<double> sums(npixels, 0.0);
+	for (int i=0;  i<n;  ++i) {
+		float *row = (float*)(data->data.ptr + i*data->step);
+		for (int j=0;  j<npixels;  ++j) {
+			sums[j] += row[j];
+		}
+	}
+	float *avg = (float*)(eigenspace->avgface->imageData);
+	for (int j=0;  j<npixels;  ++j) {
+		avg[j] = sums[j] / n;
+	}
+	for (int i=0;  i<n;  ++i) {
+		float *row = (float*)(data->data.ptr + i*data->step);
+		for (int j=0;  j<npixels;  ++j) {
+			row[j] -= avg[j];
+		}
 	}
 
-	// calculate
-	CvTermCriteria termCond = cvTermCriteria(CV_TERMCRIT_ITER,
-			eigenspace->dimension, 1);
-	cvCalcEigenObjects(nimages,
-			input_images,
-			eigenspace->eigenfaces,
-			0, 0, 0,
-			&termCond, 
-			eigenspace->avgface, NULL);
+	// centering leaves at most n - 1 non-zero eigenvalues
+	gram_eigenfaces(data, n - 1, ncomponents, variance, n, eigenspace);
+	cvReleaseMat(&data);
+	eigenspace->nimages = n;
 
-	// clean up
-	for (size_t i=0;  i<nimages;  ++i) {
-		cvReleaseImage(&(input_images[i]));
+	return eigenspace;
+}
+
+Eigenspace *
+update_eigen_space(Eigenspace *eigenspace, size_t nimages, IplImage* images[],
+		int ncomponents, double variance)
+{
+	assert(images != NULL);
+	assert(nimages > 0);
+	if (eigenspace->eigenvalues == NULL || eigenspace->nimages <= 0) {
+		return NULL;
+	}
+	int k = eigenspace->dimension;
+	int n = eigenspace->nimages;
+	int m = nimages;
+	size_t resolution = eigenspace->resolution;
+	int npixels = resolution*resolution;
+
+	// rows of a matrix X whose scatter X^T X is that of all n + m images
+	// about their combined mean: the old eigenfaces scaled by the root of
+	// their scatter, the new images about their own mean, and the shift
+	// between the two means
+	CvMat *data = cvCreateMat(k + m + 1, npixels, CV_32FC1);
+	for (int i=0;  i<k;  ++i) {
+		const float *face = (float*)(eigenspace->eigenfaces[i]->imageData);
+		float *row = (float*)(data->data.ptr + i*data->step);
+		double scale = sqrt(std::max((double)eigenspace->eigenvalues[i], 0.0)*n);
+		for (int j=0;  j<npixels;  ++j) {
+			row[j] = face[j]*scale;
+		}
+	}
+	std::vector<double> sums(npixels, 0.0);
+	for (int i=0;  i<m;  ++i) {
+		float *row = (float*)(data->data.ptr + (k + i)*data->step);
+		image_row(images[i], resolution, row);
+		for (int j=0;  j<npixels;  ++j) {
+			sums[j] += row[j];
+		}
+	}
+	for (int i=0;  i<m;  ++i) {
+		float *row = (float*)(data->data.ptr + (k + i)*data->step);
+		for (int j=0;  j<npixels;  ++j) {
+			row[j] -= sums[j] / m;
+		}
+	}
+
+	Eigenspace *updated = new Eigenspace;
+	updated->resolution = resolution;
+	updated->avgface = cvCreateImage(cvSize(resolution, resolution),
+			IPL_DEPTH_32F, 1);
+	const float *oldavg = (float*)(eigenspace->avgface->imageData);
+	float *avg = (float*)(updated->avgface->imageData);
+	float *shift = (float*)(data->data.ptr + (k + m)*data->step);
+	double scale = sqrt((double)n*m / (n + m));
+	for (int j=0;  j<npixels;  ++j) {
+		double mean = sums[j] / m;
+		avg[j] = (n*(double)oldavg[j] + sums[j]) / (n + m);
+		shift[j] = (mean - oldavg[j])*scale;
+	}
+
+	gram_eigenfaces(data, k + m + 1, (ncomponents > 0) ? ncomponents : k,
+			variance, n + m, updated);
+	cvReleaseMat(&data);
+	updated->nimages = n + m;
+	return updated;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* extra sketch columns, which make the leading components accurate */
+static const int SKETCH_OVERSAMPLING = 10;
+
+EigenspaceSketch::EigenspaceSketch(size_t resolution, int ncomponents,
+		unsigned int seed)
+  : resolution(resolution), npixels(resolution*resolution),
+    ncomponents(ncomponents), width(ncomponents + SKETCH_OVERSAMPLING),
+    seed(seed), nimages(0), nrefined(0), sumsquares(0), centered(false), rank(0),
+    scratch(NULL)
+{
+	assert(ncomponents > 0);
+	sums.assign(npixels, 0.0);
+	sketch.assign((size_t)npixels*width, 0.0);
+	omega.resize((size_t)npixels*width);
+	CvMat w = cvMat(npixels, width, CV_64FC1, &omega[0]);
+	CvRNG rng = cvRNG(seed);
+	cvRandArr(&rng, &w, CV_RAND_NORMAL, cvRealScalar(0), cvRealScalar(1));
+	pixels.resize(npixels);
+	projection.resize(width);
+}
+
+EigenspaceSketch::~EigenspaceSketch()
+{
+	if (scratch != NULL) {
+		cvReleaseImage(&scratch);
+	}
+}
+
+void
+EigenspaceSketch::convert(IplImage *image)
+{
+	IplImage row;
+	cvInitImageHeader(&row, cvSize(resolution, resolution), IPL_DEPTH_64F, 1);
+	cvSetData(&row, &pixels[0], sizeof(double)*resolution);
+	if (is_resized(image, resolution)) {
+		cvConvertScale(image, &row);
+		return;
 	}
-	delete[] input_images;
 
+	// the resize buffer is reused for every image of the same format
+	if (scratch != NULL && (scratch->depth != image->depth
+			|| scratch->nChannels != image->nChannels)) {
+		cvReleaseImage(&scratch);
+	}
+	if (scratch == NULL) {
+		scratch = cvCreateImage(cvSize(resolution, resolution),
+				image->depth, image->nChannels);
+	}
+	cvResize(image, scratch);
+	cvConvertScale(scratch, &row);
+}
+
+void
+EigenspaceSketch::add(IplImage *image)
+{
+	assert(!centered);
+	convert(image);
+	++nimages;
+
+	// Y += x (x^T W)
+	std::fill(projection.begin(), projection.end(), 0.0);
+	for (int j=0;  j<npixels;  ++j) {
+		double x = pixels[j];
+		sums[j] += x;
+		sumsquares += x*x;
+		const double *w = &omega[(size_t)j*width];
+		for (int c=0;  c<width;  ++c) {
+			projection[c] += x*w[c];
+		}
+	}
+	for (int j=0;  j<npixels;  ++j) {
+		double x = pixels[j];
+		double *y = &sketch[(size_t)j*width];
+		for (int c=0;  c<width;  ++c) {
+			y[c] += x*projection[c];
+		}
+	}
+}
+
+void
+EigenspaceSketch::center()
+{
+	// sum (x - m)(x - m)^T W = sum x x^T W - n m m^T W
+	assert(nimages > 0);
+	std::fill(projection.begin(), projection.end(), 0.0);
+	for (int j=0;  j<npixels;  ++j) {
+		double m = sums[j] / nimages;
+		const double *w = &omega[(size_t)j*width];
+		for (int c=0;  c<width;  ++c) {
+			projection[c] += m*w[c];
+		}
+	}
+	for (int j=0;  j<npixels;  ++j) {
+		double m = sums[j];		// n m
+		double *y = &sketch[(size_t)j*width];
+		for (int c=0;  c<width;  ++c) {
+			y[c] -= m*projection[c];
+		}
+	}
+	centered = true;
+}
+
+void
+EigenspaceSketch::refine(IplImage *image)
+{
+	if (!centered) {
+		center();
+
+		// replace the sketch by an orthonormal basis Q = Y V L^-1/2 of its
+		// span, from the eigenvectors of Y^T Y, dropping null directions
+		std::vector<double> a((size_t)width*width, 0.0);
+		for (int j=0;  j<npixels;  ++j) {
+			const double *y = &sketch[(size_t)j*width];
+			for (int c=0;  c<width;  ++c) {
+				for (int d=0;  d<=c;  ++d) {
+					a[(size_t)c*width + d] += y[c]*y[d];
+				}
+			}
+		}
+		for (int c=0;  c<width;  ++c) {
+			for (int d=0;  d<c;  ++d) {
+				a[(size_t)d*width + c] = a[(size_t)c*width + d];
+			}
+		}
+		std::vector<double> vectors, values;
+		symmetric_eigen(width, a, vectors, values);
+		rank = 1;
+		while (rank < width && values[rank] > RANK_EPSILON*values[0]) {
+			++rank;
+		}
+		std::vector<double>().swap(omega);
+		std::vector<double> basis((size_t)npixels*rank, 0.0);
+		for (int j=0;  j<npixels;  ++j) {
+			const double *y = &sketch[(size_t)j*width];
+			double *q = &basis[(size_t)j*rank];
+			for (int i=0;  i<rank;  ++i) {
+				const double *v = &vectors[(size_t)i*width];
+				double dot = 0;
+				for (int c=0;  c<width;  ++c) {
+					dot += y[c]*v[c];
+				}
+				q[i] = (values[i] > 0) ? dot / sqrt(values[i]) : 0.0;
+			}
+		}
+		sketch.swap(basis);
+		gram.assign((size_t)rank*rank, 0.0);
+		projection.assign(rank, 0.0);
+	}
+
+	// T += z z^T, where z = Q^T (x - m)
+	convert(image);
+	++nrefined;
+	std::fill(projection.begin(), projection.end(), 0.0);
+	for (int j=0;  j<npixels;  ++j) {
+		double x = pixels[j] - sums[j] / nimages;
+		const double *q = &sketch[(size_t)j*rank];
+		for (int i=0;  i<rank;  ++i) {
+			projection[i] += x*q[i];
+		}
+	}
+	for (int i=0;  i<rank;  ++i) {
+		for (int c=0;  c<=i;  ++c) {
+			gram[(size_t)i*rank + c] += projection[i]*projection[c];
+		}
+	}
+}
+
+int
+EigenspaceSketch::size() const
+{
+	return nimages;
+}
+
+bool
+EigenspaceSketch::merge(const EigenspaceSketch& other)
+{
+	assert(!centered && !other.centered);
+	if (other.resolution != resolution || other.ncomponents != ncomponents
+			|| other.seed != seed) {
+		return false;
+	}
+	nimages += other.nimages;
+	sumsquares += other.sumsquares;
+	for (int j=0;  j<npixels;  ++j) {
+		sums[j] += other.sums[j];
+	}
+	for (size_t i=0;  i<sketch.size();  ++i) {
+		sketch[i] += other.sketch[i];
+	}
+	return true;
+}
+
+void
+EigenspaceSketch::write(std::ostream& outs) const
+{
+	assert(!centered);
+	outs << PSKETCH << " "
+		<< resolution << " "
+		<< ncomponents << " "
+		<< seed << " "
+		<< nimages << std::endl;
+	outs.write((char*)&sumsquares, sizeof(double));
+	outs.write((char*)&sums[0], sizeof(double)*sums.size());
+	outs.write((char*)&sketch[0], sizeof(double)*sketch.size());
+}
+
+EigenspaceSketch *
+EigenspaceSketch::read(std::istream& ins)
+{
+	int fmt, ncomponents, nimages;
+	size_t resolution;
+	unsigned int seed;
+	ins >> fmt;
+	if (!ins || fmt != PSKETCH) {
+		return NULL;
+	}
+	ins >> resolution >> ncomponents >> seed >> nimages;
+	ins.ignore();
+	if (!ins || resolution == 0 || ncomponents <= 0 || nimages < 0) {
+		return NULL;
+	}
+	EigenspaceSketch *sketch = new EigenspaceSketch(resolution, ncomponents, seed);
+	sketch->nimages = nimages;
+	ins.read((char*)&(sketch->sumsquares), sizeof(double));
+	ins.read((char*)&(sketch->sums[0]), sizeof(double)*sketch->sums.size());
+	ins.read((char*)&(sketch->sketch[0]), sizeof(double)*sketch->sketch.size());
+	if (!ins) {
+		delete sketch;
+		return NULL;
+	}
+	return sketch;
+}
+
+Eigenspace *
+EigenspaceSketch::create(double variance)
+{
+	assert(nimages > 0);
+	std::vector<double> vectors, values;
+	std::vector<double> faces;	// npixels x rank, one eigenface per column
+
+	if (nrefined > 0) {
+		// Rayleigh-Ritz: eigenvectors V of T = Q^T C Q give eigenfaces Q V
+		assert(nrefined == nimages);
+		for (int i=0;  i<rank;  ++i) {
+			for (int c=0;  c<i;  ++c) {
+				gram[(size_t)c*rank + i] = gram[(size_t)i*rank + c];
+			}
+		}
+		symmetric_eigen(rank, gram, vectors, values);
+		faces.assign((size_t)npixels*rank, 0.0);
+		for (int j=0;  j<npixels;  ++j) {
+			const double *q = &sketch[(size_t)j*rank];
+			double *f = &faces[(size_t)j*rank];
+			for (int i=0;  i<rank;  ++i) {
+				const double *v = &vectors[(size_t)i*rank];
+				double dot = 0;
+				for (int c=0;  c<rank;  ++c) {
+					dot += q[c]*v[c];
+				}
+				f[i] = dot;
+			}
+		}
+	} else {
+		// Nystrom: with W^T Y = U L U^T and F = Y U L^-1/2, C ~ F F^T, so
+		// the eigenfaces and eigenvalues are the left singular vectors
+		// and squared singular values of F, found from F^T F
+		if (!centered) {
+			center();
+		}
+		std::vector<double> b((size_t)width*width, 0.0);
+		for (int j=0;  j<npixels;  ++j) {
+			const double *w = &omega[(size_t)j*width];
+			const double *y = &sketch[(size_t)j*width];
+			for (int c=0;  c<width;  ++c) {
+				for (int d=0;  d<width;  ++d) {
+					b[(size_t)c*width + d] += w[c]*y[d];
+				}
+			}
+		}
+		for (int c=0;  c<width;  ++c) {
+			for (int d=0;  d<c;  ++d) {
+				double avg = (b[(size_t)c*width + d] + b[(size_t)d*width + c]) / 2;
+				b[(size_t)c*width + d] = b[(size_t)d*width + c] = avg;
+			}
+		}
+		std::vector<double> u, l;
+		symmetric_eigen(width, b, u, l);
+		rank = 1;
+		while (rank < width && l[rank] > RANK_EPSILON*l[0]) {
+			++rank;
+		}
+		std::vector<double>().swap(omega);
+		std::vector<double> f((size_t)npixels*rank, 0.0);
+		for (int j=0;  j<npixels;  ++j) {
+			const double *y = &sketch[(size_t)j*width];
+			for (int i=0;  i<rank;  ++i) {
+				const double *v = &u[(size_t)i*width];
+				double dot = 0;
+				for (int c=0;  c<width;  ++c) {
+					dot += y[c]*v[c];
+				}
+				f[(size_t)j*rank + i] = (l[i] > 0) ? dot / sqrt(l[i]) : 0.0;
+			}
+		}
+		std::vector<double>().swap(sketch);
+		std::vector<double> h((size_t)rank*rank, 0.0);
+		for (int j=0;  j<npixels;  ++j) {
+			const double *row = &f[(size_t)j*rank];
+			for (int c=0;  c<rank;  ++c) {
+				for (int d=0;  d<=c;  ++d) {
+					h[(size_t)c*rank + d] += row[c]*row[d];
+				}
+			}
+		}
+		for (int c=0;  c<rank;  ++c) {
+			for (int d=0;  d<c;  ++d) {
+				h[(size_t)d*rank + c] = h[(size_t)c*rank + d];
+			}
+		}
+		symmetric_eigen(rank, h, vectors, values);
+		faces.assign((size_t)npixels*rank, 0.0);
+		for (int j=0;  j<npixels;  ++j) {
+			const double *row = &f[(size_t)j*rank];
+			for (int i=0;  i<rank;  ++i) {
+				if (values[i] <= 0) {
+					continue;
+				}
+				const double *v = &vectors[(size_t)i*rank];
+				double dot = 0;
+				for (int c=0;  c<rank;  ++c) {
+					dot += row[c]*v[c];
+				}
+				faces[(size_t)j*rank + i] = dot / sqrt(values[i]);
+			}
+		}
+	}
+
+	// the total variance is known exactly, whatever the sketch captured
+	double total = sumsquares;
+	for (int j=0;  j<npixels;  ++j) {
+		total -= sums[j]*sums[j] / nimages;
+	}
+	int k = std::min(ncomponents, rank);
+	k = retained_components(&values[0], k, total, variance);
+
+	Eigenspace *eigenspace = new Eigenspace;
+	eigenspace->resolution = resolution;
+	eigenspace->dimension = k;
+	eigenspace->avgface = cvCreateImage(cvSize(resolution, resolution),
+			IPL_DEPTH_32F, 1);
+	float *avg = (float*)(eigenspace->avgface->imageData);
+	for (int j=0;  j<npixels;  ++j) {
+		avg[j] = sums[j] / nimages;
+	}
+	eigenspace->eigenfaces = new IplImage*[k];
+	eigenspace->eigenvalues = new float[k];
+	for (int i=0;  i<k;  ++i) {
+		eigenspace->eigenfaces[i] = cvCreateImage(cvSize(resolution, resolution),
+				IPL_DEPTH_32F, 1);
+		float *face = (float*)(eigenspace->eigenfaces[i]->imageData);
+		for (int j=0;  j<npixels;  ++j) {
+			face[j] = faces[(size_t)j*rank + i];
+		}
+		eigenspace->eigenvalues[i] = std::max(values[i], 0.0) / nimages;
+	}
+	eigenspace->nimages = nimages;
 	return eigenspace;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
 void
 decomposite(Eigenspace *eigenspace, IplImage *image, float features[])
 {
-	assert(eigenspace != NULL);
 	assert(image != NULL);
 
-	// resize image
 	IplImage *input_image = cvCreateImage(cvSize(eigenspace->resolution,
 												 eigenspace->resolution),
 				image->depth, image->nChannels);
-		cvResize(image, input_image);
+	decomposite(eigenspace, image, features, input_image);
+    cvReleaseImage(&input_image);
+}
+
+void
+decomposite(Eigenspace *eigenspace, IplImage *image, float features[],
+		IplImage *scratch)
+{
+	assert(eigenspace != NULL);
+	assert(image != NULL);
+	assert(scratch->width == (int)eigenspace->resolution);
+	assert(scratch->height == (int)eigenspace->resolution);
+
+	// resize image
+	cvResize(image, scratch);
+
+	// cvEigenDecomposite only takes 8 bit images
+	if (scratch->depth != IPL_DEPTH_8U) {
+		size_t npixels = eigenspace->resolution*eigenspace->resolution;
+		std::vector<float> row(npixels);
+		IplImage header;
+		cvInitImageHeader(&header, cvSize(eigenspace->resolution,
+				eigenspace->resolution), IPL_DEPTH_32F, 1);
+		cvSetData(&header, &row[0], sizeof(float)*eigenspace->resolution);
+		cvConvertScale(scratch, &header);
+		const float *avg = (const float*)(eigenspace->avgface->imageData);
+		for (int i=0;  i<eigenspace->dimension;  ++i) {
+			const float *face = (const float*)(eigenspace->eigenfaces[i]->imageData);
+			double dot = 0;
+			for (size_t p=0;  p<npixels;  ++p) {
+				dot += (double)face[p]*(row[p] - avg[p]);
+			}
+			features[i] = dot;
+		}
+		return;
+	}
 
-    cvEigenDecomposite(input_image,
+    cvEigenDecomposite(scratch,
             eigenspace->dimension,
             eigenspace->eigenfaces,
             0, 0,
             eigenspace->avgface,
             features);
-    cvReleaseImage(&input_image);
+}
+
+Projector::Projector(Eigenspace *eigenspace, size_t batch)
+ : eigenspace(eigenspace), batch(batch),
+   npixels(eigenspace->resolution*eigenspace->resolution), components(NULL),
+   rows(batch*npixels), count(0), scratch(NULL)
+{
+	assert(batch > 0);
+	int dimension = eigenspace->dimension;
+	if (eigenspace->mapping != NULL) {
+		// the eigenfaces follow each other in the file
+		components = (const float*)(eigenspace->eigenfaces[0]->imageData);
+	} else {
+		copy.resize(dimension*npixels);
+		for (int i=0;  i<dimension;  ++i) {
+			const float *face = (const float*)(eigenspace->eigenfaces[i]->imageData);
+			std::copy(face, face + npixels, &copy[i*npixels]);
+		}
+		components = &copy[0];
+	}
+}
+
+Projector::~Projector()
+{
+	if (scratch != NULL) {
+		cvReleaseImage(&scratch);
+	}
+}
+
+void
+Projector::add(IplImage *image)
+{
+	assert(image != NULL);
+	assert(count < batch);
+	size_t resolution = eigenspace->resolution;
+	float *row = &rows[count*npixels];
+	IplImage header;
+	cvInitImageHeader(&header, cvSize(resolution, resolution), IPL_DEPTH_32F, 1);
+	cvSetData(&header, row, sizeof(float)*resolution);
+	if (is_resized(image, resolution)) {
+		cvConvertScale(image, &header);
+	} else {
+		// the resize buffer is reused for every image of the same format
+		if (scratch != NULL && (scratch->depth != image->depth
+				|| scratch->nChannels != image->nChannels)) {
+			cvReleaseImage(&scratch);
+		}
+		if (scratch == NULL) {
+			scratch = cvCreateImage(cvSize(resolution, resolution),
+					image->depth, image->nChannels);
+		}
+		cvResize(image, scratch);
+		cvConvertScale(scratch, &header);
+	}
+
+	// centred before the product, which then sums small terms only
+	const float *avg = (const float*)(eigenspace->avgface->imageData);
+	for (size_t p=0;  p<npixels;  ++p) {
+		row[p] -= avg[p];
+	}
+	++count;
+}
+
+size_t
+Projector::size() const
+{
+	return count;
+}
+
+bool
+Projector::full() const
+{
+	return count == batch;
+}
+
+void
+Projector::project(float features[])
+{
+	if (count > 0) {
+		dot_products(npixels, &rows[0], count, components,
+				eigenspace->dimension, features);
+	}
+	count = 0;
 }
 
 double
 vector_distance(const size_t dimension, float * const a, float * const b)
 {
-	double distSq = 0;
-	for (size_t i=0;  i<dimension;  ++i) {
-		float d_i =	a[i] -	b[i];
-		distSq += d_i*d_i;
+	return vector_distance_simd(dimension, a, b);
+}
+
+static const char *IMAGE_ERRORS[] = { "ok", "unknown format",
+		"invalid header", "invalid maximum value", "truncated pixels",
+		"invalid pixel", "dimensions differ from the metadata" };
+
+const char *
+image_error(const int error)
+{
+	assert(error >= 0 && error < (int)(sizeof(IMAGE_ERRORS)/sizeof(IMAGE_ERRORS[0])));
+	return IMAGE_ERRORS[error];
+}
+
+static inline bool
+is_space(const char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* Skips whitespace and comments, which run from # to the end of the line */
+static size_t
+skip_space(const char *data, size_t size, size_t at)
+{
+	while (at < size) {
+		if (data[at] == '#') {
+			while (at < size && data[at] != '\n' && data[at] != '\r') {
+				++at;
+			}
+		} else if (is_space(data[at])) {
+			++at;
+		} else {
+			break;
+		}
 	}
+	return at;
+}
 
-	return distSq;
+/* Parses a decimal number no greater than limit, returns false if there
+ * is none or it is too large */
+static bool
+parse_number(const char *data, size_t size, size_t& at, size_t limit,
+		size_t& value)
+{
+	size_t start = at;
+	value = 0;
+	while (at < size && data[at] >= '0' && data[at] <= '9') {
+		value = value*10 + (data[at] - '0');
+		if (value > limit) {
+			return false;
+		}
+		++at;
+	}
+	return at > start;
 }
 
-IplImage*
-read_image(ImageMetadata *meta, std::istream& ins)
+int
+parse_header(const char *data, const size_t size, Dimensions& dimensions,
+		int& format, size_t& offset)
 {
-	if (meta->format == PGM) {
-		Dimensions dim;
-		int fmt;
-		read_header(ins, dim, fmt);
+	if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '2')) {
+		return IMAGE_UNKNOWN_FORMAT;
+	}
+	format = PGM;
 
-		assert(dim.width == meta->dimensions.width);
-		assert(dim.height == meta->dimensions.height);
-		assert(dim.depth == meta->dimensions.depth);
-		assert(fmt == meta->format);
-		IplImage *image = cvCreateImage(cvSize(meta->dimensions.width,
-							meta->dimensions.height),
-							meta->dimensions.depth,
-							1);
-		ins.read(image->imageData, image->imageSize);
-		int count = ins.gcount();
-		assert(count == image->imageSize);
-		return image;
-	} else {
-		assert(0);
+	// the fields are separated by whitespace and comments, and the last
+	// by a single whitespace character from the pixels
+	size_t width, height, maxval;
+	size_t at = 2;
+	if (at >= size || !(is_space(data[at]) || data[at] == '#')) {
+		return IMAGE_BAD_HEADER;
+	}
+	at = skip_space(data, size, at);
+	if (!parse_number(data, size, at, INT_MAX, width) || width == 0) {
+		return IMAGE_BAD_HEADER;
+	}
+	at = skip_space(data, size, at);
+	if (!parse_number(data, size, at, INT_MAX, height) || height == 0) {
+		return IMAGE_BAD_HEADER;
+	}
+	at = skip_space(data, size, at);
+	if (!parse_number(data, size, at, 65535, maxval) || maxval == 0) {
+		return IMAGE_BAD_MAXVAL;
+	}
+	if (at >= size || !is_space(data[at])) {
+		return IMAGE_BAD_HEADER;
+	}
+	if (width > INT_MAX / height / 2) {
+		return IMAGE_BAD_HEADER;
 	}
-	return NULL;
+	dimensions.width = width;
+	dimensions.height = height;
+	dimensions.depth = (maxval < 256) ? IPL_DEPTH_8U : IPL_DEPTH_16U;
+	offset = at + 1;
+	return IMAGE_OK;
+}
+
+/* Parses the ASCII sample at (or after whitespace from) at */
+static int
+next_sample(const char *data, const size_t size, size_t& at, int depth,
+		size_t& value)
+{
+	size_t maxval = (depth == IPL_DEPTH_8U) ? 255 : 65535;
+	at = skip_space(data, size, at);
+	if (at >= size) {
+		return IMAGE_TRUNCATED;
+	}
+	if (!parse_number(data, size, at, maxval, value)
+			|| (at < size && !is_space(data[at]) && data[at] != '#')) {
+		return IMAGE_BAD_PIXEL;
+	}
+	return IMAGE_OK;
+}
+
+/* Converts the ASCII samples that start at offset into binary ones in
+ * pixels, which may be the data itself from offset on for 8-bit samples:
+ * every sample takes at least two characters, so nothing is overwritten
+ * before it is read. Two bytes a sample would overwrite the separators. */
+static int
+decode_plain(const char *data, const size_t size, size_t offset, char *pixels,
+		size_t npixels, int depth)
+{
+	unsigned char *bytes = (unsigned char*)pixels;
+	unsigned short *shorts = (unsigned short*)pixels;
+	size_t at = offset;
+	for (size_t i=0;  i<npixels;  ++i) {
+		size_t value;
+		int error = next_sample(data, size, at, depth, value);
+		if (error != IMAGE_OK) {
+			return error;
+		}
+		if (depth == IPL_DEPTH_8U) {
+			bytes[i] = value;
+		} else {
+			shorts[i] = value;
+		}
+	}
+	return IMAGE_OK;
+}
+
+int
+decode_image(char *data, const size_t size, IplImage **image)
+{
+	*image = NULL;
+	Dimensions dim;
+	int format;
+	size_t offset;
+	int error = parse_header(data, size, dim, format, offset);
+	size_t samplesize = (dim.depth == IPL_DEPTH_8U) ? 1 : 2;
+	size_t npixels = (size_t)dim.width*dim.height;
+	size_t pixels = offset;
+	if (error == IMAGE_OK && data[1] == '2' && size - offset < 2*npixels - 1) {
+		error = IMAGE_TRUNCATED;
+	} else if (error == IMAGE_OK && data[1] == '2' && samplesize == 1) {
+		error = decode_plain(data, size, offset, data + pixels, npixels, dim.depth);
+	} else if (error == IMAGE_OK && data[1] == '2') {
+		// 16-bit samples get a buffer of their own
+		char *samples = (char*)cvAlloc(npixels*samplesize);
+		error = decode_plain(data, size, offset, samples, npixels, dim.depth);
+		cvFree(&data);
+		data = samples;
+		pixels = 0;
+	} else if (error == IMAGE_OK && size - offset < npixels*samplesize) {
+		error = IMAGE_TRUNCATED;
+	} else if (error == IMAGE_OK && samplesize == 2) {
+		// big-endian samples, swapped onto an aligned start
+		pixels = offset / 2 * 2;
+		const unsigned char *from = (const unsigned char*)(data + offset);
+		unsigned short *to = (unsigned short*)(data + pixels);
+		for (size_t i=0;  i<npixels;  ++i) {
+			to[i] = (from[2*i] << 8) | from[2*i + 1];
+		}
+	}
+	if (error != IMAGE_OK) {
+		cvFree(&data);
+		return error;
+	}
+
+	// the pixels stay where they are, and go with the image
+	*image = cvCreateImageHeader(cvSize(dim.width, dim.height), dim.depth, 1);
+	cvSetData(*image, data + pixels, samplesize*dim.width);
+	(*image)->imageDataOrigin = data;
+	return IMAGE_OK;
+}
+
+/* Which of to target pixels (along one axis) each of from source pixels
+ * falls in when shrinking, from >= to: a fraction weight[i] of source
+ * pixel i is added to target[i], and the rest to target[i] + 1 */
+static void
+area_weights(size_t from, size_t to, std::vector<size_t>& target,
+		std::vector<float>& weight)
+{
+	target.resize(from);
+	weight.resize(from);
+	for (size_t i=0;  i<from;  ++i) {
+		// target t covers [t from/to, (t + 1) from/to) of the source
+		size_t t = i*to / from;
+		target[i] = t;
+		size_t end = (t + 1)*from;
+		weight[i] = ((i + 1)*to <= end) ? 1.0f : (float)(end - i*to) / to;
+	}
+}
+
+/* Adds a row of source pixels to a row of target pixels */
+static void
+area_row(const float *row, size_t width, const std::vector<size_t>& target,
+		const std::vector<float>& weight, float *sums)
+{
+	for (size_t x=0;  x<width;  ++x) {
+		float w = weight[x];
+		sums[target[x]] += w*row[x];
+		if (w < 1.0f) {
+			sums[target[x] + 1] += (1.0f - w)*row[x];
+		}
+	}
+}
+
+int
+decode_image_resized(char *data, const size_t size, const size_t resolution,
+		IplImage **image)
+{
+	*image = NULL;
+	Dimensions dim;
+	int format;
+	size_t offset;
+	int error = parse_header(data, size, dim, format, offset);
+	size_t width = dim.width;
+	size_t height = dim.height;
+	if (error == IMAGE_OK && (width < resolution || height < resolution)) {
+		// nothing to average, so interpolate from the whole image
+		IplImage *whole;
+		error = decode_image(data, size, &whole);
+		if (error != IMAGE_OK) {
+			return error;
+		}
+		IplImage *resized = cvCreateImage(cvSize(resolution, resolution),
+				whole->depth, 1);
+		cvResize(whole, resized);
+		cvReleaseImage(&whole);
+		*image = cvCreateImage(cvSize(resolution, resolution), IPL_DEPTH_32F, 1);
+		cvConvertScale(resized, *image);
+		cvReleaseImage(&resized);
+		return IMAGE_OK;
+	}
+	size_t samplesize = (dim.depth == IPL_DEPTH_8U) ? 1 : 2;
+	bool plain = (error == IMAGE_OK && data[1] == '2');
+	if (error == IMAGE_OK && !plain && size - offset < width*height*samplesize) {
+		error = IMAGE_TRUNCATED;
+	}
+	if (error != IMAGE_OK) {
+		cvFree(&data);
+		return error;
+	}
+
+	// one source row at a time is summed across into a row of sums, which
+	// is added to the one or two target rows it overlaps
+	std::vector<size_t> xtarget, ytarget;
+	std::vector<float> xweight, yweight;
+	area_weights(width, resolution, xtarget, xweight);
+	area_weights(height, resolution, ytarget, yweight);
+	std::vector<float> row(width);
+	std::vector<float> sums(resolution);
+	*image = cvCreateImage(cvSize(resolution, resolution), IPL_DEPTH_32F, 1);
+	cvSetZero(*image);
+	const unsigned char *pixels = (const unsigned char*)(data + offset);
+	size_t at = offset;
+	for (size_t y=0;  y<height && error == IMAGE_OK;  ++y) {
+		if (plain) {
+			for (size_t x=0;  x<width && error == IMAGE_OK;  ++x) {
+				size_t value;
+				error = next_sample(data, size, at, dim.depth, value);
+				row[x] = value;
+			}
+		} else if (samplesize == 1) {
+			const unsigned char *from = pixels + y*width;
+			for (size_t x=0;  x<width;  ++x) {
+				row[x] = from[x];
+			}
+		} else {
+			const unsigned char *from = pixels + 2*y*width;
+			for (size_t x=0;  x<width;  ++x) {
+				row[x] = (from[2*x] << 8) | from[2*x + 1];
+			}
+		}
+		std::fill(sums.begin(), sums.end(), 0.0f);
+		area_row(&row[0], width, xtarget, xweight, &sums[0]);
+		float w = yweight[y];
+		float *to = (float*)((*image)->imageData + ytarget[y]*(*image)->widthStep);
+		for (size_t x=0;  x<resolution;  ++x) {
+			to[x] += w*sums[x];
+		}
+		if (w < 1.0f) {
+			to = (float*)((char*)to + (*image)->widthStep);
+			for (size_t x=0;  x<resolution;  ++x) {
+				to[x] += (1.0f - w)*sums[x];
+			}
+		}
+	}
+	cvFree(&data);
+	if (error != IMAGE_OK) {
+		cvReleaseImage(image);
+		return error;
+	}
+
+	// sums to means
+	cvConvertScale(*image, *image, (double)resolution*resolution / (width*height));
+	return IMAGE_OK;
+}
+
+int
+read_image(ImageMetadata *meta, char *data, const size_t size, IplImage **image,
+		const size_t resolution)
+{
+	if (meta->format != PGM) {
+		cvFree(&data);
+		*image = NULL;
+		return IMAGE_UNKNOWN_FORMAT;
+	}
+	Dimensions dim;
+	int format;
+	size_t offset;
+	int error = parse_header(data, size, dim, format, offset);
+	if (error == IMAGE_OK && (dim.width != meta->dimensions.width
+			|| dim.height != meta->dimensions.height
+			|| dim.depth != meta->dimensions.depth)) {
+		error = IMAGE_MISMATCH;
+	}
+	if (error != IMAGE_OK) {
+		cvFree(&data);
+		*image = NULL;
+		return error;
+	}
+	if (resolution > 0) {
+		return decode_image_resized(data, size, resolution, image);
+	}
+	return decode_image(data, size, image);
 }
 
 void
-read_header(std::istream& ins, Dimensions& dimensions, int& format)
+write_feature_block(std::ostream& outs, FeatureBlock *block)
 {
-	// header
-	std::string type;
-	ins >> type;
-	if (!strcmp(type.c_str(), "P5")) {
-		format = PGM;
-	} else {
-		assert(0);
-	}
-	ins >> dimensions.width;
-	ins >> dimensions.height;
-	int maxval;
-	ins >> maxval;
-	if (maxval < 256) {
-		dimensions.depth = IPL_DEPTH_8U;
-	} else {
-		assert(0);
+	// text header, the ENCODING_I8 ranges, then the raw row-major matrix
+	outs << PSHARD << " "
+		<< block->dimension << " "
+		<< block->first << " "
+		<< block->last << " "
+		<< block->version << " "
+		<< block->encoding << std::endl;
+	if (block->encoding == ENCODING_I8) {
+		outs.write((char*)(block->scale), sizeof(float)*block->dimension);
+		outs.write((char*)(block->offset), sizeof(float)*block->dimension);
 	}
-	ins.ignore();
+	outs.write((char*)(block->code(block->first)),
+			block->rowsize()*(block->last - block->first + 1));
+}
+
+FeatureBlock *
+read_feature_block(std::istream& ins)
+{
+	int fmt, dimension, first, last, version;
+	ins >> fmt;
+	if (!ins || fmt != PSHARD) {
+		return NULL;
+	}
+	std::string line;
+	std::getline(ins, line);
+	std::istringstream header(line);
+	header >> dimension >> first >> last >> version;
+	if (!header || dimension <= 0 || last < first) {
+		return NULL;
+	}
+	int encoding;
+	if (!(header >> encoding)) {
+		// written before shards were quantized
+		encoding = ENCODING_F32;
+	}
+	if (encoding < 0 || encoding >= NENCODINGS) {
+		return NULL;
+	}
+	FeatureBlock *block = new FeatureBlock(first, last, dimension, encoding);
+	block->version = version;
+	if (encoding == ENCODING_I8) {
+		ins.read((char*)(block->scale), sizeof(float)*dimension);
+		ins.read((char*)(block->offset), sizeof(float)*dimension);
+	}
+	std::streamsize size = block->rowsize()*(last - first + 1);
+	ins.read((char*)(block->code(first)), size);
+	if (!ins || ins.gcount() != size) {
+		delete block;
+		return NULL;
+	}
+	return block;
+}
+
+void
+write_features(std::ostream& outs, const float *features, int dimension,
+		int version)
+{
+	// text header, then the raw vector
+	outs << PFEATURES << " "
+		<< dimension << " "
+		<< version << std::endl;
+	outs.write((const char*)features, sizeof(float)*dimension);
+}
+
+bool
+read_features(std::istream& ins, std::vector<float>& features, int& version)
+{
+	int fmt, dimension;
+	ins >> fmt;
+	if (!ins || fmt != PFEATURES) {
+		return false;
+	}
+	std::string line;
+	std::getline(ins, line);
+	std::istringstream header(line);
+	header >> dimension >> version;
+	if (!header || dimension <= 0) {
+		return false;
+	}
+	features.resize(dimension);
+	std::streamsize size = sizeof(float)*dimension;
+	ins.read((char*)&features[0], size);
+	return ins && ins.gcount() == size;
 }
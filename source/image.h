@@ -10,12 +10,16 @@
 
 #include "opencv/cv.h"
 
+#include "distance.h"
+
 using namespace cv;
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-enum { PGM, PS3M };
+enum { PGM, PS3M, PSHARD, PEIG, PSKETCH, PINDEX, PGRAPH, PFEATURES };
+
+static const size_t EIGENSPACE_ALIGN = 64;
 
 typedef struct Dimensions
 {
@@ -34,8 +38,17 @@ typedef struct Eigenspace
 
 	size_t resolution;
 	int dimension;
+	int version;
+	std::string trainid;	// unique to each version published, empty if older
 	IplImage **eigenfaces;
 	IplImage *avgface;
+	float *eigenvalues;		// variance along each eigenface, may be NULL
+	int nimages;			// images it was trained on, 0 if unknown
+
+	// set when the images are views into a mapped eigenspace file
+	IplImage *views;
+	void *mapping;
+	size_t mapsize;
 } Eigenspace;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -51,6 +64,10 @@ typedef struct ImageTableMetadata
     std::string prefix;
     std::string imagedomain;
 	int nextimageid;
+	int shardsize;
+	int encoding;		// of shards, ENCODING_F32 by default
+	int index;			// builds of the feature index, 0 if none
+	int graph;			// builds or extensions of the feature graph, 0 if none
 	Eigenspace *eigenspace;
 private:
 	ImageTableMetadata();
@@ -78,6 +95,67 @@ typedef struct ImageMetadata
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
+/* The map f -> R f + t that takes features of one eigenspace to those of
+ * another, where R = U'^T U and t = U'^T (mean - mean') for eigenfaces U
+ * and U'. Features only hold the part of an image inside the span of U,
+ * so this is exact for that part; what U' has outside it comes out 0. */
+typedef struct FeatureRotation
+{
+	FeatureRotation(Eigenspace *from, Eigenspace *to);
+
+	void apply(const float *from, float *to) const;
+
+	int fromdimension;
+	int todimension;
+	std::vector<float> rotation;	// todimension x fromdimension
+	std::vector<float> offset;
+} FeatureRotation;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* A dense, row-major block of feature vectors for the ids [first, last],
+ * stored as floats or quantized (see distance.h). ENCODING_I8 blocks must
+ * be calibrated before rows are set. */
+typedef struct FeatureBlock
+{
+	FeatureBlock(int first, int last, int dimension, int encoding=ENCODING_F32);
+	~FeatureBlock();
+
+	/* The row of an ENCODING_F32 block */
+	float *row(int id);
+
+	/* The row as stored, of rowsize() bytes, whatever the encoding */
+	unsigned char *code(int id);
+	size_t rowsize() const;
+
+	/* Encodes or decodes a row of floats */
+	void set(int id, const float *features);
+	void get(int id, float *features);
+
+	/* Sets the range of each ENCODING_I8 dimension from its variance */
+	void calibrate(const float *variances);
+
+	/* True if rows of the other block can be copied as they are */
+	bool same_codes(const FeatureBlock& other) const;
+
+	int first;
+	int last;
+	int dimension;
+	int version;
+	int encoding;
+	float *features;		// ENCODING_F32 rows, or NULL
+	unsigned char *codes;	// quantized rows, or NULL
+	float *scale;			// ENCODING_I8 code to feature, or NULL
+	float *offset;
+private:
+	FeatureBlock();
+
+} FeatureBlock;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
 class ImageScanner
 {
 public:
@@ -91,18 +169,219 @@ protected:
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-IplImage*
-read_image(ImageMetadata *meta, std::istream& ins);
+/* Finds the leading principal components of images streamed one at a
+ * time, holding only the mean and a random sketch Y = C W of the
+ * covariance C, where W is a resolution^2 x (ncomponents + 10) gaussian
+ * matrix. After one pass (add), create() takes the eigenfaces from the
+ * Nystrom approximation C ~ Y (W^T Y)^+ Y^T. An optional second pass
+ * (refine) projects the images onto an orthonormal basis of Y instead,
+ * which is exact within the span of Y. Either way memory is bounded by
+ * resolution^2 x ncomponents, whatever the number of images.
+ *
+ * The first pass statistics are sums, so sketches of disjoint sets of
+ * images made with the same parameters (and seed) can be written out,
+ * merged and finished as if one sketch had seen every image. */
+class EigenspaceSketch
+{
+public:
+	EigenspaceSketch(size_t resolution, int ncomponents, unsigned int seed=1);
+	~EigenspaceSketch();
+
+	/* First pass */
+	void add(IplImage *image);
+
+	/* Second pass over the same images, after the first */
+	void refine(IplImage *image);
+
+	/* Keeps at most ncomponents eigenfaces, and only as many as are
+	 * needed to retain the given fraction of the variance (if in (0, 1)) */
+	Eigenspace *create(double variance=0);
+
+	/* Adds the first pass of another sketch, returns false if it was made
+	 * with other parameters */
+	bool merge(const EigenspaceSketch& other);
+
+	/* Writes a text header followed by the raw first pass statistics */
+	void write(std::ostream& outs) const;
+
+	/* Reads a sketch written by write(), returns NULL on error */
+	static EigenspaceSketch *read(std::istream& ins);
+
+	int size() const;
+
+private:
+	EigenspaceSketch(const EigenspaceSketch&);
+	EigenspaceSketch& operator=(const EigenspaceSketch&);
+
+	void convert(IplImage *image);
+	void center();
+
+	size_t resolution;
+	int npixels;
+	int ncomponents;
+	int width;
+	unsigned int seed;
+	int nimages;
+	int nrefined;
+	double sumsquares;
+	bool centered;
+
+	std::vector<double> sums;
+	std::vector<double> omega;		// npixels x width
+	std::vector<double> sketch;		// npixels x width, then the basis
+	std::vector<double> pixels;
+	std::vector<double> projection;
+	std::vector<double> gram;		// second pass, rank x rank
+	int rank;
+	IplImage *scratch;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* What decoding an image found wrong with it, IMAGE_OK if nothing */
+enum { IMAGE_OK, IMAGE_UNKNOWN_FORMAT, IMAGE_BAD_HEADER, IMAGE_BAD_MAXVAL,
+	IMAGE_TRUNCATED, IMAGE_BAD_PIXEL, IMAGE_MISMATCH };
+
+const char *
+image_error(int error);
+
+/* Parses the header of a PGM image (binary P5 or ASCII P2, of 8 or 16
+ * bits, with # comments) at the start of size bytes, setting its
+ * dimensions and format and the offset of its pixels */
+int
+parse_header(const char *data, size_t size, Dimensions& dimensions,
+		int& format, size_t& offset);
+
+/* Decodes an image in place from size bytes allocated by cvAlloc, which
+ * the image takes over (they are freed on error). Binary 8 bit pixels are
+ * used where they lie; binary 16 bit and ASCII 8 bit samples are
+ * converted over the bytes they came from, and ASCII 16 bit samples into
+ * a buffer of their own. Release the image with cvReleaseImage. */
+int
+decode_image(char *data, size_t size, IplImage **image);
+
+/* As decode_image, resampling the image to resolution x resolution
+ * floats while it is decoded, one source row at a time: each target
+ * pixel is the mean of the source pixels it covers (an area filter), so
+ * the image is never held at full size. Images smaller than that either
+ * way are decoded whole and interpolated instead. */
+int
+decode_image_resized(char *data, size_t size, size_t resolution,
+		IplImage **image);
+
+/* As decode_image, or decode_image_resized for a positive resolution,
+ * checking the image against its metadata too */
+int
+read_image(ImageMetadata *meta, char *data, size_t size, IplImage **image,
+		size_t resolution=0);
+
+void
+write_feature_block(std::ostream& outs, FeatureBlock *block);
+
+FeatureBlock *
+read_feature_block(std::istream& ins);
+
+/* Writes the features of one image with the version of the eigenspace
+ * they are in */
+void
+write_features(std::ostream& outs, const float *features, int dimension,
+		int version);
+
+/* Reads features written by write_features, returning false if the
+ * stream holds none */
+bool
+read_features(std::istream& ins, std::vector<float>& features, int& version);
 
+/* Writes a text header padded to EIGENSPACE_ALIGN bytes, the mean face,
+ * the row-major component matrix and the eigenvalues (if any), each
+ * starting on an EIGENSPACE_ALIGN byte boundary */
 void
-read_header(std::istream& ins, Dimensions& dimensions, int& format);
+write_eigenspace(std::ostream& outs, Eigenspace *eigenspace);
 
+/* Maps an eigenspace file written by write_eigenspace into an eigenspace
+ * without images, whose version, resolution, dimension (unless 0) and
+ * train id (unless empty) it must match. The images are views into the
+ * read-only mapping. Returns false if the file is missing or does not
+ * match. */
+bool
+map_eigenspace(const std::string& path, Eigenspace *eigenspace);
+
+/* As map_eigenspace, but reads the file into newly created images */
+bool
+read_eigenspace(std::istream& ins, Eigenspace *eigenspace);
+
+/* Copies an eigenspace into newly created images, mapped or not */
 Eigenspace *
-create_eigen_space(size_t nimages, IplImage* images[], size_t resolution);
+copy_eigen_space(Eigenspace *eigenspace);
+
+/* Finds the principal components of the images by solving the
+ * nimages x nimages Gram matrix eigenproblem, keeping at most ncomponents
+ * of them (if positive) and only as many as are needed to retain the
+ * given fraction of the variance (if in (0, 1)). By default every
+ * component with a non-zero eigenvalue is kept. With few enough
+ * ncomponents (about nimages / 4 at most), only the leading ones are
+ * solved for, by subspace iteration, in O(nimages^2 ncomponents) rather
+ * than O(nimages^3). */
+Eigenspace *
+create_eigen_space(size_t nimages, IplImage* images[], size_t resolution,
+		int ncomponents=0, double variance=0);
+
+/* Folds more images into an eigenspace that has eigenvalues and an image
+ * count, returning a new eigenspace with the combined mean and leading
+ * components (at most ncomponents, by default as many as before). Costs
+ * O(resolution^2 (dimension + nimages)^2), whatever the images trained on
+ * so far. Returns NULL if the eigenspace cannot be updated. */
+Eigenspace *
+update_eigen_space(Eigenspace *eigenspace, size_t nimages, IplImage* images[],
+		int ncomponents=0, double variance=0);
 
 void
 decomposite(Eigenspace *eigenspace, IplImage *image, float features[]);
 
+/* As above, resizing into a caller owned resolution x resolution image of
+ * the same depth, so that repeated calls do not allocate */
+void
+decomposite(Eigenspace *eigenspace, IplImage *image, float features[],
+		IplImage *scratch);
+
+/* Projects images onto an eigenspace up to batch at a time, as
+ * decomposite does one at a time. Each image is resized into a row of a
+ * batch x resolution^2 matrix, less the average face, and the rows are
+ * multiplied by the dimension x resolution^2 matrix of eigenfaces at
+ * once (see dot_products), so that the eigenfaces are read once per
+ * batch rather than once per image. The eigenfaces of a mapped eigenspace
+ * are used in place, those of others are copied. */
+typedef struct Projector
+{
+	Projector(Eigenspace *eigenspace, size_t batch);
+	~Projector();
+
+	/* Stacks an image, which the caller still owns */
+	void add(IplImage *image);
+
+	size_t size() const;
+	bool full() const;
+
+	/* Writes the features of every image stacked, dimension floats each
+	 * in the order they were added, and empties the batch */
+	void project(float features[]);
+
+	Eigenspace *eigenspace;
+	size_t batch;
+
+private:
+	Projector(const Projector&);
+	Projector& operator=(const Projector&);
+
+	size_t npixels;
+	const float *components;		// dimension x npixels
+	std::vector<float> copy;		// of the eigenfaces, unless mapped
+	std::vector<float> rows;		// batch x npixels
+	size_t count;
+	IplImage *scratch;
+} Projector;
+
 double
 vector_distance(size_t dimension, float *a,  float *b);
 
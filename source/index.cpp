@@ -0,0 +1,845 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "index.h"
+#include "image.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Lloyd iterations of each k-means */
+static const int KMEANS_ITERATIONS = 16;
+
+/* Slices narrower than this are scored without the vector kernels, whose
+ * per candidate overhead would dominate */
+static const size_t SHORT_DIMENSION = 16;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static size_t
+nearest(const std::vector<double>& dists)
+{
+	return std::min_element(dists.begin(), dists.end()) - dists.begin();
+}
+
+static void
+distances(size_t dimension, const float *query, const float *candidates,
+		size_t n, double dists[])
+{
+	if (dimension >= SHORT_DIMENSION) {
+		vector_distances(dimension, query, candidates, n, dists);
+		return;
+	}
+	for (size_t j=0;  j<n;  ++j) {
+		const float *c = candidates + j*dimension;
+		float distSq = 0;
+		for (size_t i=0;  i<dimension;  ++i) {
+			float d_i = query[i] - c[i];
+			distSq += d_i*d_i;
+		}
+		dists[j] = distSq;
+	}
+}
+
+/* Bytes from the read position to the end of the stream */
+static size_t
+remaining(std::istream& ins)
+{
+	std::streampos here = ins.tellg();
+	ins.seekg(0, std::ios::end);
+	std::streampos end = ins.tellg();
+	ins.seekg(here);
+	return (here < 0 || end < here) ? 0 : (size_t)(end - here);
+}
+
+/* Whether a list of links on a level read from a stream holds at most
+ * limit links, each to one of the n nodes that reaches the level */
+static bool
+valid_links(const int *list, int limit, const int *levels, int n, int level)
+{
+	if (list[0] < 0 || list[0] > limit) {
+		return false;
+	}
+	for (int j=1;  j<=list[0];  ++j) {
+		if (list[j] < 0 || list[j] >= n || levels[list[j]] < level) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Clusters n row-major points into k centroids, starting from k of the
+ * points chosen at random (repeated if there are fewer than k) */
+static void
+kmeans(size_t dimension, const float *points, size_t n, int k,
+		unsigned int& seed, float *centroids)
+{
+	assert(n > 0 && k > 0);
+	std::vector<size_t> order(n);
+	for (size_t j=0;  j<n;  ++j) {
+		order[j] = j;
+	}
+	for (size_t j=0;  j<n && j<(size_t)k;  ++j) {
+		std::swap(order[j], order[j + rand_r(&seed) % (n - j)]);
+	}
+	for (int c=0;  c<k;  ++c) {
+		memcpy(centroids + c*dimension, points + order[c % n]*dimension,
+				sizeof(float)*dimension);
+	}
+
+	std::vector<int> assignments(n);
+	std::vector<double> farness(n);
+	std::vector<double> dists(k);
+	std::vector<double> sums((size_t)k*dimension);
+	std::vector<size_t> counts(k);
+	for (int it=0;  it<KMEANS_ITERATIONS;  ++it) {
+		for (size_t j=0;  j<n;  ++j) {
+			distances(dimension, points + j*dimension, centroids, k, &dists[0]);
+			assignments[j] = nearest(dists);
+			farness[j] = dists[assignments[j]];
+		}
+
+		std::fill(sums.begin(), sums.end(), 0.0);
+		std::fill(counts.begin(), counts.end(), 0);
+		for (size_t j=0;  j<n;  ++j) {
+			double *sum = &sums[(size_t)assignments[j]*dimension];
+			const float *point = points + j*dimension;
+			for (size_t i=0;  i<dimension;  ++i) {
+				sum[i] += point[i];
+			}
+			++counts[assignments[j]];
+		}
+		for (int c=0;  c<k;  ++c) {
+			float *centroid = centroids + c*dimension;
+			if (counts[c] > 0) {
+				for (size_t i=0;  i<dimension;  ++i) {
+					centroid[i] = sums[c*dimension + i] / counts[c];
+				}
+			} else {
+				// an empty cluster restarts from the worst placed point
+				size_t far = std::max_element(farness.begin(), farness.end())
+						- farness.begin();
+				memcpy(centroid, points + far*dimension, sizeof(float)*dimension);
+				farness[far] = 0;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+FeatureIndex::FeatureIndex(int dimension, int nlists, int nsubspaces)
+ : dimension(dimension), nlists(nlists), nsubspaces(nsubspaces), version(0),
+   last(0), slices(nsubspaces + 1), centroids((size_t)nlists*dimension),
+   codebooks((size_t)PQ_CENTROIDS*dimension), ids(nlists), codes(nlists)
+{
+	assert(dimension > 0 && nlists > 0);
+	assert(nsubspaces > 0 && nsubspaces <= dimension);
+	for (int s=0;  s<=nsubspaces;  ++s) {
+		slices[s] = s*dimension / nsubspaces;
+	}
+}
+
+void
+FeatureIndex::train(const float *features, size_t n, unsigned int seed)
+{
+	kmeans(dimension, features, n, nlists, seed, &centroids[0]);
+
+	// the slices code residuals, so they are learned from residuals
+	std::vector<float> residuals(n*dimension);
+	for (size_t j=0;  j<n;  ++j) {
+		const float *centroid = &centroids[(size_t)nearest_list(features + j*dimension)*dimension];
+		for (int i=0;  i<dimension;  ++i) {
+			residuals[j*dimension + i] = features[j*dimension + i] - centroid[i];
+		}
+	}
+	std::vector<float> slice;
+	for (int s=0;  s<nsubspaces;  ++s) {
+		int width = slices[s + 1] - slices[s];
+		slice.resize(n*width);
+		for (size_t j=0;  j<n;  ++j) {
+			memcpy(&slice[j*width], &residuals[j*dimension + slices[s]],
+					sizeof(float)*width);
+		}
+		kmeans(width, &slice[0], n, PQ_CENTROIDS, seed,
+				&codebooks[(size_t)PQ_CENTROIDS*slices[s]]);
+	}
+}
+
+void
+FeatureIndex::add(int id, const float *features)
+{
+	int list = nearest_list(features);
+	const float *centroid = &centroids[(size_t)list*dimension];
+	std::vector<float> residual(dimension);
+	for (int i=0;  i<dimension;  ++i) {
+		residual[i] = features[i] - centroid[i];
+	}
+	std::vector<unsigned char>& listcodes = codes[list];
+	listcodes.resize(listcodes.size() + nsubspaces);
+	encode(&residual[0], &listcodes[listcodes.size() - nsubspaces]);
+	ids[list].push_back(id);
+	last = std::max(last, id);
+}
+
+void
+FeatureIndex::search(const float *query, int nprobe, std::pair<int, int> range,
+		Neighbors& shortlist) const
+{
+	std::vector<double> dists(nlists);
+	distances(dimension, query, &centroids[0], nlists, &dists[0]);
+	std::vector< std::pair<double, int> > lists(nlists);
+	for (int l=0;  l<nlists;  ++l) {
+		lists[l] = std::make_pair(dists[l], l);
+	}
+	nprobe = std::min(std::max(nprobe, 1), nlists);
+	std::partial_sort(lists.begin(), lists.begin() + nprobe, lists.end());
+
+	std::vector<float> residual(dimension);
+	std::vector<double> table((size_t)nsubspaces*PQ_CENTROIDS);
+	for (int p=0;  p<nprobe;  ++p) {
+		int list = lists[p].second;
+		if (ids[list].empty()) {
+			continue;
+		}
+
+		// distances from each slice of the query residual to every
+		// centroid of the slice, summed by code below
+		const float *centroid = &centroids[(size_t)list*dimension];
+		for (int i=0;  i<dimension;  ++i) {
+			residual[i] = query[i] - centroid[i];
+		}
+		for (int s=0;  s<nsubspaces;  ++s) {
+			distances(slices[s + 1] - slices[s], &residual[slices[s]],
+					&codebooks[(size_t)PQ_CENTROIDS*slices[s]], PQ_CENTROIDS,
+					&table[(size_t)s*PQ_CENTROIDS]);
+		}
+
+		const unsigned char *code = &codes[list][0];
+		for (size_t j=0;  j<ids[list].size();  ++j, code+=nsubspaces) {
+			int id = ids[list][j];
+			if (id < range.first || id > range.second) {
+				continue;
+			}
+			double dist = 0;
+			for (int s=0;  s<nsubspaces;  ++s) {
+				dist += table[s*PQ_CENTROIDS + code[s]];
+			}
+			shortlist.offer(id, dist);
+		}
+	}
+}
+
+void
+FeatureIndex::write(std::ostream& outs) const
+{
+	outs << PINDEX << " "
+		<< dimension << " "
+		<< nlists << " "
+		<< nsubspaces << " "
+		<< version << " "
+		<< last << std::endl;
+	outs.write((char*)&centroids[0], sizeof(float)*centroids.size());
+	outs.write((char*)&codebooks[0], sizeof(float)*codebooks.size());
+	for (int l=0;  l<nlists;  ++l) {
+		int count = ids[l].size();
+		outs.write((char*)&count, sizeof(int));
+		if (count > 0) {
+			outs.write((char*)&ids[l][0], sizeof(int)*count);
+			outs.write((char*)&codes[l][0], codes[l].size());
+		}
+	}
+}
+
+FeatureIndex *
+FeatureIndex::read(std::istream& ins)
+{
+	int fmt, dimension, nlists, nsubspaces, version, last;
+	ins >> fmt;
+	if (!ins || fmt != PINDEX) {
+		return NULL;
+	}
+	ins >> dimension >> nlists >> nsubspaces >> version >> last;
+	ins.ignore();
+	if (!ins || dimension <= 0 || nlists <= 0 || nsubspaces <= 0
+			|| nsubspaces > dimension) {
+		throw std::runtime_error("feature index header is corrupt");
+	}
+
+	// every size is checked against what is left of the stream before it
+	// is allocated, so a corrupt index cannot ask for more
+	size_t left = remaining(ins);
+	size_t tables = sizeof(float)*((size_t)nlists + PQ_CENTROIDS)*dimension;
+	if (tables > left) {
+		throw std::runtime_error("feature index is truncated in its centroids");
+	}
+	left -= tables;
+	FeatureIndex *index = new FeatureIndex(dimension, nlists, nsubspaces);
+	index->version = version;
+	index->last = last;
+	ins.read((char*)&(index->centroids[0]), sizeof(float)*index->centroids.size());
+	ins.read((char*)&(index->codebooks[0]), sizeof(float)*index->codebooks.size());
+	for (int l=0;  l<nlists && ins;  ++l) {
+		int count = -1;
+		ins.read((char*)&count, sizeof(int));
+		left -= std::min(left, sizeof(int));
+		if (!ins || count < 0
+				|| (size_t)count > left / (sizeof(int) + nsubspaces)) {
+			delete index;
+			throw std::runtime_error("feature index list is longer than the index");
+		}
+		if (count > 0) {
+			index->ids[l].resize(count);
+			index->codes[l].resize((size_t)count*nsubspaces);
+			ins.read((char*)&(index->ids[l][0]), sizeof(int)*count);
+			ins.read((char*)&(index->codes[l][0]), index->codes[l].size());
+			left -= (sizeof(int) + nsubspaces)*count;
+		}
+	}
+	if (!ins) {
+		delete index;
+		throw std::runtime_error("feature index is truncated in its lists");
+	}
+	return index;
+}
+
+size_t
+FeatureIndex::size() const
+{
+	size_t n = 0;
+	for (int l=0;  l<nlists;  ++l) {
+		n += ids[l].size();
+	}
+	return n;
+}
+
+int
+FeatureIndex::nearest_list(const float *features) const
+{
+	std::vector<double> dists(nlists);
+	distances(dimension, features, &centroids[0], nlists, &dists[0]);
+	return nearest(dists);
+}
+
+void
+FeatureIndex::encode(const float *residual, unsigned char *code) const
+{
+	std::vector<double> dists(PQ_CENTROIDS);
+	for (int s=0;  s<nsubspaces;  ++s) {
+		distances(slices[s + 1] - slices[s], residual + slices[s],
+				&codebooks[(size_t)PQ_CENTROIDS*slices[s]], PQ_CENTROIDS, &dists[0]);
+		code[s] = nearest(dists);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* The nodes seen by one search, in an open addressing hash set, so that a
+ * search costs nothing in the size of the graph and shares no state */
+class VisitedSet
+{
+public:
+	VisitedSet(size_t expected) : size(0)
+	{
+		size_t n = 64;
+		while (n < 2*expected) {
+			n *= 2;
+		}
+		slots.assign(n, -1);
+	}
+
+	/* Returns false if the node was already in the set */
+	bool insert(int node)
+	{
+		if (2*(size + 1) > slots.size()) {
+			grow();
+		}
+		size_t mask = slots.size() - 1;
+		size_t i = ((unsigned int)node*2654435761u) & mask;
+		while (slots[i] >= 0) {
+			if (slots[i] == node) {
+				return false;
+			}
+			i = (i + 1) & mask;
+		}
+		slots[i] = node;
+		++size;
+		return true;
+	}
+
+private:
+	void grow()
+	{
+		std::vector<int> old;
+		old.swap(slots);
+		slots.assign(2*old.size(), -1);
+		size = 0;
+		for (size_t i=0;  i<old.size();  ++i) {
+			if (old[i] >= 0) {
+				insert(old[i]);
+			}
+		}
+	}
+
+	size_t size;
+	std::vector<int> slots;
+};
+
+/* Levels come from a hash of the id rather than a shared generator, so
+ * that concurrent inserts need no random state, and a rebuild gives every
+ * image the same level */
+static int
+random_level(int id, int m)
+{
+	unsigned long long h = (unsigned int)id + 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (h >> 30))*0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27))*0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	double u = ((h >> 11) + 0.5) / 9007199254740992.0;	// in (0, 1)
+	int level = (int)(-log(u) / log((double)m));
+	return std::min(level, GRAPH_MAX_LEVEL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+GraphIndex::GraphIndex(int dimension, int m, int efconstruction)
+ : dimension(dimension), m(m), efconstruction(efconstruction), version(0),
+   last(0), capacity(0), count(0), entry(-1), toplevel(-1)
+{
+	assert(dimension > 0 && m > 1 && efconstruction > 0);
+	pthread_mutex_init(&mutex, NULL);
+}
+
+GraphIndex::~GraphIndex()
+{
+	for (size_t i=0;  i<upper.size();  ++i) {
+		delete[] upper[i];
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+void
+GraphIndex::reserve(size_t newcapacity)
+{
+	if (newcapacity <= capacity) {
+		return;
+	}
+	ids.resize(newcapacity);
+	levels.resize(newcapacity);
+	vectors.resize(newcapacity*dimension);
+	links0.resize(newcapacity*(1 + 2*m), 0);
+	upper.resize(newcapacity, NULL);
+	locks.resize(newcapacity, 0);
+	capacity = newcapacity;
+}
+
+void
+GraphIndex::insert(int id, const float *features)
+{
+	int node = __sync_fetch_and_add(&count, 1);
+	assert((size_t)node < capacity);
+	int level = random_level(id, m);
+	memcpy(&vectors[(size_t)node*dimension], features, sizeof(float)*dimension);
+	ids[node] = id;
+	levels[node] = level;
+	if (level > 0) {
+		upper[node] = new int[level*(1 + m)];
+		for (int l=0;  l<level;  ++l) {
+			upper[node][l*(1 + m)] = 0;
+		}
+	}
+	// the node is in place before anything can link to it
+	__sync_synchronize();
+
+	pthread_mutex_lock(&mutex);
+	last = std::max(last, id);
+	int start = entry;
+	int top = toplevel;
+	if (start < 0) {
+		__atomic_store_n(&toplevel, level, __ATOMIC_RELEASE);
+		__atomic_store_n(&entry, node, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	if (level <= top) {
+		pthread_mutex_unlock(&mutex);
+	}
+
+	const float *query = &vectors[(size_t)node*dimension];
+	int nearest = start;
+	for (int l=top;  l>level;  --l) {
+		nearest = greedy(query, nearest, l, true);
+	}
+	std::vector<Candidate> candidates;
+	for (int l=std::min(level, top);  l>=0;  --l) {
+		search_level(query, nearest, l, efconstruction, true, candidates);
+		// a concurrent insert may have found and linked this node already,
+		// and it must not be the start of the next level's search
+		for (size_t j=0;  j<candidates.size();  ++j) {
+			if (candidates[j].second == node) {
+				candidates.erase(candidates.begin() + j);
+				break;
+			}
+		}
+		if (!candidates.empty()) {
+			nearest = candidates[0].second;
+		}
+		select(candidates, m);
+
+		// the links concurrent inserts made to this node are kept among
+		// its own, selected from both
+		int *list = links(node, l);
+		std::vector<Candidate> merged(candidates);
+		lock(node);
+		for (int j=0;  j<list[0];  ++j) {
+			int other = list[1 + j];
+			bool known = false;
+			for (size_t i=0;  i<merged.size() && !known;  ++i) {
+				known = merged[i].second == other;
+			}
+			if (!known) {
+				merged.push_back(Candidate(distance(query, other), other));
+			}
+		}
+		std::sort(merged.begin(), merged.end());
+		select(merged, max_links(l));
+		for (size_t j=0;  j<merged.size();  ++j) {
+			__atomic_store_n(list + 1 + j, merged[j].second, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(list, (int)merged.size(), __ATOMIC_RELEASE);
+		unlock(node);
+		for (size_t j=0;  j<candidates.size();  ++j) {
+			connect(candidates[j].second, node, l);
+		}
+	}
+
+	if (level > top) {
+		__atomic_store_n(&toplevel, level, __ATOMIC_RELEASE);
+		__atomic_store_n(&entry, node, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+void
+GraphIndex::search(const float *query, size_t ef, std::pair<int, int> range,
+		Neighbors& neighbors) const
+{
+	int start = __atomic_load_n(&entry, __ATOMIC_ACQUIRE);
+	if (start < 0) {
+		return;
+	}
+	// the entry may be replaced meanwhile, so descend from its own level
+	int nearest = start;
+	for (int l=levels[start];  l>0;  --l) {
+		nearest = greedy(query, nearest, l, false);
+	}
+	std::vector<Candidate> candidates;
+	search_level(query, nearest, 0, std::max(ef, (size_t)1), false, candidates);
+	for (size_t j=0;  j<candidates.size();  ++j) {
+		int id = ids[candidates[j].second];
+		if (id >= range.first && id <= range.second) {
+			neighbors.offer(id, candidates[j].first);
+		}
+	}
+}
+
+void
+GraphIndex::write(std::ostream& outs) const
+{
+	int n = size();
+	outs << PGRAPH << " "
+		<< dimension << " "
+		<< m << " "
+		<< efconstruction << " "
+		<< version << " "
+		<< last << " "
+		<< n << " "
+		<< entry << std::endl;
+	if (n == 0) {
+		return;
+	}
+	outs.write((char*)&ids[0], sizeof(int)*n);
+	outs.write((char*)&levels[0], sizeof(int)*n);
+	outs.write((char*)&vectors[0], sizeof(float)*n*dimension);
+	outs.write((char*)&links0[0], sizeof(int)*n*(1 + 2*m));
+	for (int node=0;  node<n;  ++node) {
+		if (levels[node] > 0) {
+			outs.write((char*)upper[node], sizeof(int)*levels[node]*(1 + m));
+		}
+	}
+}
+
+GraphIndex *
+GraphIndex::read(std::istream& ins)
+{
+	int fmt, dimension, m, efconstruction, version, last, n, entry;
+	ins >> fmt;
+	if (!ins || fmt != PGRAPH) {
+		return NULL;
+	}
+	ins >> dimension >> m >> efconstruction >> version >> last >> n >> entry;
+	ins.ignore();
+	if (!ins || dimension <= 0 || m <= 1 || efconstruction <= 0 || n < 0
+			|| entry < -1 || entry >= n || (n > 0 && entry < 0)) {
+		throw std::runtime_error("graph index header is corrupt");
+	}
+	GraphIndex *graph = new GraphIndex(dimension, m, efconstruction);
+	graph->version = version;
+	graph->last = last;
+	if (n == 0) {
+		return graph;
+	}
+
+	// as for FeatureIndex, every size is checked against what is left of
+	// the stream before it is allocated, and every link is checked to be
+	// to a node, so that a corrupt graph cannot lead a search astray
+	size_t left = remaining(ins);
+	size_t nodesize = sizeof(int)*2 + sizeof(float)*dimension
+			+ sizeof(int)*(1 + 2*m);
+	if ((size_t)n > left / nodesize) {
+		delete graph;
+		throw std::runtime_error("graph index is truncated in its nodes");
+	}
+	left -= nodesize*n;
+	graph->reserve(n);
+	ins.read((char*)&(graph->ids[0]), sizeof(int)*n);
+	ins.read((char*)&(graph->levels[0]), sizeof(int)*n);
+	ins.read((char*)&(graph->vectors[0]), sizeof(float)*n*dimension);
+	ins.read((char*)&(graph->links0[0]), sizeof(int)*n*(1 + 2*m));
+	if (!ins) {
+		delete graph;
+		throw std::runtime_error("graph index is truncated in its nodes");
+	}
+	for (int node=0;  node<n;  ++node) {
+		int level = graph->levels[node];
+		if (level < 0 || level > GRAPH_MAX_LEVEL
+				|| !valid_links(graph->links(node, 0), 2*m,
+						&graph->levels[0], n, 0)) {
+			delete graph;
+			throw std::runtime_error("graph index node is corrupt");
+		}
+		if (level == 0) {
+			continue;
+		}
+		size_t uppersize = sizeof(int)*level*(1 + m);
+		if (uppersize > left) {
+			delete graph;
+			throw std::runtime_error("graph index is truncated in its upper levels");
+		}
+		left -= uppersize;
+		graph->upper[node] = new int[level*(1 + m)];
+		ins.read((char*)graph->upper[node], uppersize);
+		if (!ins) {
+			delete graph;
+			throw std::runtime_error("graph index is truncated in its upper levels");
+		}
+		for (int l=1;  l<=level;  ++l) {
+			if (!valid_links(graph->links(node, l), m,
+					&graph->levels[0], n, l)) {
+				delete graph;
+				throw std::runtime_error("graph index node is corrupt");
+			}
+		}
+	}
+	graph->count = n;
+	graph->entry = entry;
+	graph->toplevel = graph->levels[entry];
+	return graph;
+}
+
+size_t
+GraphIndex::size() const
+{
+	return std::min((size_t)__atomic_load_n(&count, __ATOMIC_ACQUIRE), capacity);
+}
+
+int *
+GraphIndex::links(int node, int level) const
+{
+	if (level == 0) {
+		return const_cast<int*>(&links0[(size_t)node*(1 + 2*m)]);
+	}
+	return upper[node] + (level - 1)*(1 + m);
+}
+
+int
+GraphIndex::max_links(int level) const
+{
+	return level == 0 ? 2*m : m;
+}
+
+double
+GraphIndex::distance(const float *query, int node) const
+{
+	return vector_distance_simd(dimension, query, &vectors[(size_t)node*dimension]);
+}
+
+/* Copies out the neighbours of a node, under its lock if inserting */
+void
+GraphIndex::neighbours(int node, int level, bool locked,
+		std::vector<int>& out) const
+{
+	const int *list = links(node, level);
+	if (locked) {
+		lock(node);
+	}
+	int n = std::min(__atomic_load_n(list, __ATOMIC_ACQUIRE), max_links(level));
+	out.resize(n);
+	for (int j=0;  j<n;  ++j) {
+		out[j] = __atomic_load_n(list + 1 + j, __ATOMIC_RELAXED);
+	}
+	if (locked) {
+		unlock(node);
+	}
+}
+
+/* The node nearest the query reached by moving to nearer neighbours */
+int
+GraphIndex::greedy(const float *query, int node, int level, bool locked) const
+{
+	double best = distance(query, node);
+	std::vector<int> adjacent;
+	bool moved = true;
+	while (moved) {
+		moved = false;
+		neighbours(node, level, locked, adjacent);
+		for (size_t j=0;  j<adjacent.size();  ++j) {
+			double dist = distance(query, adjacent[j]);
+			if (dist < best) {
+				best = dist;
+				node = adjacent[j];
+				moved = true;
+			}
+		}
+	}
+	return node;
+}
+
+/* The (up to) ef nearest nodes to the query found on a level by a best
+ * first search from entry, nearest first */
+void
+GraphIndex::search_level(const float *query, int entry, int level, size_t ef,
+		bool locked, std::vector<Candidate>& nearest) const
+{
+	std::priority_queue< Candidate, std::vector<Candidate>,
+			std::greater<Candidate> > frontier;
+	std::priority_queue<Candidate> found;
+	VisitedSet visited(ef*max_links(level));
+	std::vector<int> adjacent;
+
+	double dist = distance(query, entry);
+	frontier.push(Candidate(dist, entry));
+	found.push(Candidate(dist, entry));
+	visited.insert(entry);
+	while (!frontier.empty()) {
+		Candidate nearest = frontier.top();
+		if (nearest.first > found.top().first && found.size() >= ef) {
+			break;
+		}
+		frontier.pop();
+		neighbours(nearest.second, level, locked, adjacent);
+		for (size_t j=0;  j<adjacent.size();  ++j) {
+			int node = adjacent[j];
+			if (!visited.insert(node)) {
+				continue;
+			}
+			dist = distance(query, node);
+			if (found.size() < ef || dist < found.top().first) {
+				frontier.push(Candidate(dist, node));
+				found.push(Candidate(dist, node));
+				if (found.size() > ef) {
+					found.pop();
+				}
+			}
+		}
+	}
+
+	nearest.resize(found.size());
+	for (size_t j=nearest.size();  j>0;  --j) {
+		nearest[j - 1] = found.top();
+		found.pop();
+	}
+}
+
+/* Keeps at most n of the candidates (sorted nearest first), skipping any
+ * nearer to one already kept than to the node they would be linked to,
+ * so that links spread out in every direction */
+void
+GraphIndex::select(std::vector<Candidate>& candidates, int n) const
+{
+	if ((int)candidates.size() <= n) {
+		return;
+	}
+	std::vector<Candidate> kept;
+	for (size_t j=0;  j<candidates.size() && (int)kept.size()<n;  ++j) {
+		const float *candidate = &vectors[(size_t)candidates[j].second*dimension];
+		bool diverse = true;
+		for (size_t i=0;  i<kept.size() && diverse;  ++i) {
+			diverse = distance(candidate, kept[i].second) >= candidates[j].first;
+		}
+		if (diverse) {
+			kept.push_back(candidates[j]);
+		}
+	}
+	candidates.swap(kept);
+}
+
+/* Links a new neighbour to a node, dropping the least useful link if the
+ * node already has as many as it may */
+void
+GraphIndex::connect(int node, int neighbour, int level)
+{
+	int *list = links(node, level);
+	int limit = max_links(level);
+	lock(node);
+	int n = list[0];
+	if (n < limit) {
+		list[1 + n] = neighbour;
+		__atomic_store_n(list, n + 1, __ATOMIC_RELEASE);
+	} else {
+		const float *base = &vectors[(size_t)node*dimension];
+		std::vector<Candidate> candidates;
+		candidates.push_back(Candidate(distance(base, neighbour), neighbour));
+		for (int j=0;  j<n;  ++j) {
+			candidates.push_back(Candidate(distance(base, list[1 + j]), list[1 + j]));
+		}
+		std::sort(candidates.begin(), candidates.end());
+		select(candidates, limit);
+		for (size_t j=0;  j<candidates.size();  ++j) {
+			__atomic_store_n(list + 1 + j, candidates[j].second, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(list, (int)candidates.size(), __ATOMIC_RELEASE);
+	}
+	unlock(node);
+}
+
+void
+GraphIndex::lock(int node) const
+{
+	while (__sync_lock_test_and_set(&locks[node], 1)) {
+		while (__atomic_load_n(&locks[node], __ATOMIC_RELAXED)) {
+#if defined(__i386__) || defined(__x86_64__)
+			__builtin_ia32_pause();
+#endif
+		}
+	}
+}
+
+void
+GraphIndex::unlock(int node) const
+{
+	__sync_lock_release(&locks[node]);
+}
@@ -0,0 +1,172 @@
+/****************************************************************************
+ *
+ * Approximate nearest neighbour indexes over feature vectors.
+ *
+ * FeatureIndex (IVF-PQ) is compact, and meant to be loaded per query.
+ *
+ * A coarse k-means quantizer assigns every vector to the inverted list of
+ * its nearest of nlists centroids. The residual from that centroid is
+ * split into nsubspaces slices of consecutive dimensions, and each slice
+ * is stored as the byte naming the nearest of 256 centroids learned for
+ * it (product quantization), so a vector costs nsubspaces bytes plus its
+ * id. A search only visits the nprobe lists nearest the query, and
+ * scores each code by summing nsubspaces entries of a table of distances
+ * from the query residual to every slice centroid. The distances are
+ * approximate; callers re-rank the shortlist against exact features.
+ *
+ * GraphIndex (HNSW) holds every vector as floats, and is meant to stay
+ * resident. Each vector is a node linked to up to 2 m near neighbours on
+ * level 0, and to up to m on each level up to its own, drawn at random
+ * with probability m^-level. A search descends greedily from the node on
+ * the top level, then explores the ef nearest nodes it can find on level
+ * 0, so it visits O(ef m log n) nodes.
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_INDEX_H
+#define CLOUDVISION_INDEX_H
+
+
+#include "distance.h"
+
+#include <vector>
+#include <utility>
+#include <istream>
+#include <ostream>
+#include <pthread.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Centroids learned per slice, so that a slice is coded in one byte */
+static const int PQ_CENTROIDS = 256;
+
+class FeatureIndex
+{
+public:
+	FeatureIndex(int dimension, int nlists, int nsubspaces);
+
+	/* Learns the coarse centroids and the slice centroids from a sample
+	 * of n row-major vectors, by k-means */
+	void train(const float *features, size_t n, unsigned int seed=1);
+
+	/* Adds a vector, after train */
+	void add(int id, const float *features);
+
+	/* Offers the vectors with ids in range, from the nprobe lists nearest
+	 * the query, with their approximate (squared) distances */
+	void search(const float *query, int nprobe, std::pair<int, int> range,
+			Neighbors& shortlist) const;
+
+	/* Writes a text header followed by the raw centroids and lists */
+	void write(std::ostream& outs) const;
+
+	/* Reads an index written by write(), returns NULL if the stream holds
+	 * no index, and throws std::runtime_error if it is corrupt. The stream
+	 * must be seekable */
+	static FeatureIndex *read(std::istream& ins);
+
+	size_t size() const;
+
+	int dimension;
+	int nlists;
+	int nsubspaces;
+	int version;		// of the eigenspace of the features
+	int last;			// largest id added
+
+private:
+	FeatureIndex();
+
+	int nearest_list(const float *features) const;
+	void encode(const float *residual, unsigned char *code) const;
+
+	std::vector<int> slices;		// first dimension of each slice, then dimension
+	std::vector<float> centroids;	// nlists x dimension
+	std::vector<float> codebooks;	// PQ_CENTROIDS per slice, slice after slice
+	std::vector< std::vector<int> > ids;
+	std::vector< std::vector<unsigned char> > codes;	// nsubspaces per id
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Defaults of GraphIndex, and the level no node goes above */
+static const int GRAPH_M = 16;
+static const int GRAPH_EF_CONSTRUCTION = 200;
+static const int GRAPH_MAX_LEVEL = 16;
+
+/* insert() may run on any number of threads at once: each claims a slot,
+ * then links its node under per-node spin locks, and inserts that raise
+ * the top level are serialized. search() takes no locks at all. It may
+ * read a neighbour list while an insert rewrites it, which can cost
+ * recall but nothing else, since a node is only ever linked once it is
+ * in place. reserve(), read() and write() must not race with anything. */
+class GraphIndex
+{
+public:
+	GraphIndex(int dimension, int m=GRAPH_M, int efconstruction=GRAPH_EF_CONSTRUCTION);
+	~GraphIndex();
+
+	/* Makes room for capacity nodes in all */
+	void reserve(size_t capacity);
+
+	/* Links a vector into the graph; there must be room for it */
+	void insert(int id, const float *features);
+
+	/* Offers the vectors with ids in range among the ef nearest the query
+	 * that the search finds, with their (squared) distances */
+	void search(const float *query, size_t ef, std::pair<int, int> range,
+			Neighbors& neighbors) const;
+
+	/* Writes a text header followed by the raw nodes, vectors and links */
+	void write(std::ostream& outs) const;
+
+	/* Reads a graph written by write(), returns NULL if the stream holds
+	 * no graph, and throws std::runtime_error if it is corrupt. The stream
+	 * must be seekable */
+	static GraphIndex *read(std::istream& ins);
+
+	size_t size() const;
+
+	int dimension;
+	int m;
+	int efconstruction;
+	int version;		// of the eigenspace of the features
+	int last;			// largest id inserted
+
+private:
+	typedef std::pair<double, int> Candidate;
+
+	GraphIndex();
+	GraphIndex(const GraphIndex&);
+	GraphIndex& operator=(const GraphIndex&);
+
+	int *links(int node, int level) const;
+	int max_links(int level) const;
+	double distance(const float *query, int node) const;
+	void neighbours(int node, int level, bool locked, std::vector<int>& out) const;
+	int greedy(const float *query, int node, int level, bool locked) const;
+	void search_level(const float *query, int entry, int level, size_t ef,
+			bool locked, std::vector<Candidate>& nearest) const;
+	void select(std::vector<Candidate>& candidates, int n) const;
+	void connect(int node, int neighbour, int level);
+	void lock(int node) const;
+	void unlock(int node) const;
+
+	size_t capacity;
+	int count;					// slots claimed
+	int entry;					// a node on the top level, -1 while empty
+	int toplevel;
+	pthread_mutex_t mutex;		// held by inserts that raise the top level
+	std::vector<int> ids;
+	std::vector<int> levels;
+	std::vector<float> vectors;	// capacity x dimension
+	std::vector<int> links0;	// 1 + 2 m per node: a count, then node numbers
+	std::vector<int*> upper;	// 1 + m per level above 0, or NULL
+	mutable std::vector<int> locks;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_INDEX_H
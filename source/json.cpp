@@ -0,0 +1,366 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "json.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* deepest nesting of arrays and objects read */
+static const int MAX_DEPTH = 64;
+
+static void
+skip_space(const std::string& s, size_t& pos);
+
+static bool
+parse_value(const std::string& s, size_t& pos, Json& value, int depth);
+
+static bool
+parse_string(const std::string& s, size_t& pos, std::string& text);
+
+static bool
+parse_number(const std::string& s, size_t& pos, std::string& text);
+
+static void
+append_utf8(std::string& text, unsigned long code);
+
+static void
+write_string(std::ostream& outs, const std::string& text);
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+Json::Json(Type type)
+  : type(type)
+{
+}
+
+Json::Json(const std::string& s)
+  : type(STRING), text(s)
+{
+}
+
+bool
+Json::parse(const std::string& text, Json& value)
+{
+	size_t pos = 0;
+	value = Json();
+	if (!parse_value(text, pos, value, 0)) {
+		return false;
+	}
+	skip_space(text, pos);
+	return pos == text.size();
+}
+
+void
+Json::write(std::ostream& outs) const
+{
+	switch (type) {
+	case NUL:
+		outs << "null";
+		break;
+	case BOOLEAN:
+	case NUMBER:
+		outs << text;
+		break;
+	case STRING:
+		write_string(outs, text);
+		break;
+	case ARRAY:
+		outs << "[";
+		for (size_t i=0;  i<items.size();  ++i) {
+			if (i > 0) {
+				outs << ", ";
+			}
+			items[i].write(outs);
+		}
+		outs << "]";
+		break;
+	case OBJECT:
+		outs << "{";
+		for (size_t i=0;  i<members.size();  ++i) {
+			if (i > 0) {
+				outs << ", ";
+			}
+			write_string(outs, members[i].first);
+			outs << ": ";
+			members[i].second.write(outs);
+		}
+		outs << "}";
+		break;
+	}
+}
+
+const Json *
+Json::get(const std::string& name) const
+{
+	for (size_t i=0;  i<members.size();  ++i) {
+		if (members[i].first == name) {
+			return &members[i].second;
+		}
+	}
+	return NULL;
+}
+
+void
+Json::set(const std::string& name, const Json& value)
+{
+	for (size_t i=0;  i<members.size();  ++i) {
+		if (members[i].first == name) {
+			members[i].second = value;
+			return;
+		}
+	}
+	members.push_back(std::make_pair(name, value));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static void
+skip_space(const std::string& s, size_t& pos)
+{
+	while (pos < s.size() && (s[pos] == ' ' || s[pos] == '\t'
+			|| s[pos] == '\n' || s[pos] == '\r')) {
+		++pos;
+	}
+}
+
+static bool
+parse_value(const std::string& s, size_t& pos, Json& value, int depth)
+{
+	skip_space(s, pos);
+	if (pos >= s.size() || depth > MAX_DEPTH) {
+		return false;
+	}
+	char c = s[pos];
+	if (c == '{') {
+		value.type = Json::OBJECT;
+		++pos;
+		skip_space(s, pos);
+		if (pos < s.size() && s[pos] == '}') {
+			++pos;
+			return true;
+		}
+		while (true) {
+			skip_space(s, pos);
+			std::string name;
+			if (!parse_string(s, pos, name)) {
+				return false;
+			}
+			skip_space(s, pos);
+			if (pos >= s.size() || s[pos] != ':') {
+				return false;
+			}
+			++pos;
+			Json member;
+			if (!parse_value(s, pos, member, depth + 1)) {
+				return false;
+			}
+			value.members.push_back(std::make_pair(name, member));
+			skip_space(s, pos);
+			if (pos < s.size() && s[pos] == ',') {
+				++pos;
+			} else if (pos < s.size() && s[pos] == '}') {
+				++pos;
+				return true;
+			} else {
+				return false;
+			}
+		}
+	} else if (c == '[') {
+		value.type = Json::ARRAY;
+		++pos;
+		skip_space(s, pos);
+		if (pos < s.size() && s[pos] == ']') {
+			++pos;
+			return true;
+		}
+		while (true) {
+			Json item;
+			if (!parse_value(s, pos, item, depth + 1)) {
+				return false;
+			}
+			value.items.push_back(item);
+			skip_space(s, pos);
+			if (pos < s.size() && s[pos] == ',') {
+				++pos;
+			} else if (pos < s.size() && s[pos] == ']') {
+				++pos;
+				return true;
+			} else {
+				return false;
+			}
+		}
+	} else if (c == '"') {
+		value.type = Json::STRING;
+		return parse_string(s, pos, value.text);
+	} else if (c == '-' || isdigit((unsigned char)c)) {
+		value.type = Json::NUMBER;
+		return parse_number(s, pos, value.text);
+	}
+
+	const char *literals[] = { "true", "false", "null", NULL };
+	for (const char **literal=literals;  *literal!=NULL;  ++literal) {
+		size_t len = strlen(*literal);
+		if (s.compare(pos, len, *literal) == 0) {
+			value.type = (**literal == 'n') ? Json::NUL : Json::BOOLEAN;
+			value.text = (**literal == 'n') ? "" : *literal;
+			pos += len;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool
+parse_string(const std::string& s, size_t& pos, std::string& text)
+{
+	if (pos >= s.size() || s[pos] != '"') {
+		return false;
+	}
+	++pos;
+	text.clear();
+	while (pos < s.size()) {
+		unsigned char c = s[pos++];
+		if (c == '"') {
+			return true;
+		} else if (c < 0x20) {
+			return false;
+		} else if (c != '\\') {
+			text += c;
+			continue;
+		}
+		if (pos >= s.size()) {
+			return false;
+		}
+		c = s[pos++];
+		switch (c) {
+		case '"':  text += '"';  break;
+		case '\\': text += '\\'; break;
+		case '/':  text += '/';  break;
+		case 'b':  text += '\b'; break;
+		case 'f':  text += '\f'; break;
+		case 'n':  text += '\n'; break;
+		case 'r':  text += '\r'; break;
+		case 't':  text += '\t'; break;
+		case 'u': {
+			if (pos + 4 > s.size()) {
+				return false;
+			}
+			std::string hex(s, pos, 4);
+			if (hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+				return false;
+			}
+			unsigned long code = strtoul(hex.c_str(), NULL, 16);
+			pos += 4;
+			// a surrogate pair is one character
+			if (code >= 0xd800 && code < 0xdc00 && pos + 6 <= s.size()
+					&& s[pos] == '\\' && s[pos+1] == 'u') {
+				unsigned long low = strtoul(std::string(s, pos + 2, 4).c_str(), NULL, 16);
+				if (low >= 0xdc00 && low < 0xe000) {
+					code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+					pos += 6;
+				}
+			}
+			append_utf8(text, code);
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+	return false;
+}
+
+static bool
+parse_number(const std::string& s, size_t& pos, std::string& text)
+{
+	size_t start = pos;
+	if (pos < s.size() && s[pos] == '-') {
+		++pos;
+	}
+	size_t digits = pos;
+	while (pos < s.size() && isdigit((unsigned char)s[pos])) {
+		++pos;
+	}
+	if (pos == digits) {
+		return false;
+	}
+	if (pos < s.size() && s[pos] == '.') {
+		++pos;
+		digits = pos;
+		while (pos < s.size() && isdigit((unsigned char)s[pos])) {
+			++pos;
+		}
+		if (pos == digits) {
+			return false;
+		}
+	}
+	if (pos < s.size() && (s[pos] == 'e' || s[pos] == 'E')) {
+		++pos;
+		if (pos < s.size() && (s[pos] == '+' || s[pos] == '-')) {
+			++pos;
+		}
+		digits = pos;
+		while (pos < s.size() && isdigit((unsigned char)s[pos])) {
+			++pos;
+		}
+		if (pos == digits) {
+			return false;
+		}
+	}
+	text.assign(s, start, pos - start);
+	return true;
+}
+
+static void
+append_utf8(std::string& text, unsigned long code)
+{
+	if (code < 0x80) {
+		text += (char)code;
+	} else if (code < 0x800) {
+		text += (char)(0xc0 | (code >> 6));
+		text += (char)(0x80 | (code & 0x3f));
+	} else if (code < 0x10000) {
+		text += (char)(0xe0 | (code >> 12));
+		text += (char)(0x80 | ((code >> 6) & 0x3f));
+		text += (char)(0x80 | (code & 0x3f));
+	} else {
+		text += (char)(0xf0 | (code >> 18));
+		text += (char)(0x80 | ((code >> 12) & 0x3f));
+		text += (char)(0x80 | ((code >> 6) & 0x3f));
+		text += (char)(0x80 | (code & 0x3f));
+	}
+}
+
+static void
+write_string(std::ostream& outs, const std::string& text)
+{
+	outs << '"';
+	for (size_t i=0;  i<text.size();  ++i) {
+		unsigned char c = text[i];
+		if (c == '"' || c == '\\') {
+			outs << '\\' << c;
+		} else if (c == '\n') {
+			outs << "\\n";
+		} else if (c == '\t') {
+			outs << "\\t";
+		} else if (c < 0x20) {
+			char buf[8];
+			sprintf(buf, "\\u%04x", c);
+			outs << buf;
+		} else {
+			outs << c;
+		}
+	}
+	outs << '"';
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,54 @@
+/****************************************************************************
+ *
+ * Just enough JSON for the messages of distributed runs (see worker.h).
+ *
+ * Values keep numbers as their literal text, and object members in the
+ * order they came, so a message read and written again only differs in
+ * its spacing. Strings hold UTF-8; \u escapes are decoded on reading,
+ * and only quotes, backslashes and control characters are escaped on
+ * writing.
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_JSON_H
+#define CLOUDVISION_JSON_H
+
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <ostream>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+class Json
+{
+public:
+	enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+	Json(Type type=NUL);
+	Json(const std::string& s);
+
+	/* Parses a whole document, returns false if it is not valid JSON */
+	static bool parse(const std::string& text, Json& value);
+
+	void write(std::ostream& outs) const;
+
+	/* The member of an object with the given name, or NULL */
+	const Json *get(const std::string& name) const;
+
+	/* Adds a member to an object, or replaces the one of that name */
+	void set(const std::string& name, const Json& value);
+
+	Type type;
+	std::string text;		// of a string, or the literal of a number or boolean
+	std::vector<Json> items;	// of an array
+	std::vector< std::pair<std::string, Json> > members;	// of an object
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_JSON_H
@@ -3,18 +3,52 @@
  * Command line arguments:
  *
  * upload TABLEID PREFIX
- * train TABLEID RESOLUTION START STOP
- * learn TABLEID START STOP
- * query TABLEID IMAGEID START STOP
+ * train TABLEID RESOLUTION START STOP [--window N] [--components K]
+ *		[--variance FRACTION] [--passes 1|2]
+ * train-partial TABLEID RESOLUTION START STOP --components K [--window N]
+ * train-merge TABLEID PARTIAL... [--variance FRACTION]
+ * update TABLEID START STOP [--window N] [--components K]
+ *		[--variance FRACTION]
+ * reproject TABLEID START STOP [--from VERSION] [--window N]
+ * learn TABLEID START STOP [--shard SIZE] [--window N] [--threads N]
+ *		[--encoding f32|f16|i8] [--graph 1] [--batch N]
+ * index TABLEID [--lists N] [--subspaces M] [--sample N]
+ * graph TABLEID [--m M] [--ef-construction N] [--threads N]
+ * query TABLEID IMAGEID START STOP [--k K] [--threshold DIST]
+ *		[--nprobe N [--shortlist N] | --ef N]
+ * serve TABLEID START STOP [--socket PATH] [--ef N]
+ * client PATH REQUEST...
+ * worker [--tasks N] [--idle SECONDS]
+ *
+ * Options of the form --NAME VALUE may appear anywhere after the command.
+ * Every command accepts --pool SIZE (idle connections kept per service)
+ * and --stats 1 (print connection pool and object cache hits and misses
+ * on exit).
+ *
+ * A worker runs the learn, reproject, train-partial and query tasks of
+ * cvdb.py master from the queue named by CVDB_QUEUE (see task_queue), in
+ * process, until N tasks are taken or none comes for SECONDS (by default
+ * it runs until killed).
+ *
+ * Images, features and metadata live in S3 and SimpleDB, or with
+ * CVDB_STORAGE=local:DIR in a local directory, or with
+ * CVDB_STORAGE=memory only for the life of the process (see
+ * object_store).
  *
  ****************************************************************************/
 
 
 #include "aws.h"
 #include "yale.h"
+#include "server.h"
+#include "worker.h"
 
 #include <iostream>
 #include <cstdlib>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <unistd.h>
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -22,39 +56,150 @@
 
 static const char *UPLOAD_CMD = "upload";
 static const char *TRAIN_CMD = "train";
+static const char *TRAIN_PARTIAL_CMD = "train-partial";
+static const char *TRAIN_MERGE_CMD = "train-merge";
+static const char *UPDATE_CMD = "update";
+static const char *REPROJECT_CMD = "reproject";
 static const char *LEARN_CMD = "learn";
+static const char *INDEX_CMD = "index";
+static const char *GRAPH_CMD = "graph";
 static const char *QUERY_CMD = "query";
+static const char *SERVE_CMD = "serve";
+static const char *CLIENT_CMD = "client";
+static const char *WORKER_CMD = "worker";
+
+static const char *SHARD_OPT = "shard";
+static const char *WINDOW_OPT = "window";
+static const char *THREADS_OPT = "threads";
+static const char *ENCODING_OPT = "encoding";
+static const char *COMPONENTS_OPT = "components";
+static const char *VARIANCE_OPT = "variance";
+static const char *PASSES_OPT = "passes";
+static const char *FROM_OPT = "from";
+static const char *K_OPT = "k";
+static const char *THRESHOLD_OPT = "threshold";
+static const char *LISTS_OPT = "lists";
+static const char *SUBSPACES_OPT = "subspaces";
+static const char *SAMPLE_OPT = "sample";
+static const char *NPROBE_OPT = "nprobe";
+static const char *SHORTLIST_OPT = "shortlist";
+static const char *GRAPH_OPT = "graph";
+static const char *BATCH_OPT = "batch";
+static const char *M_OPT = "m";
+static const char *EF_CONSTRUCTION_OPT = "ef-construction";
+static const char *EF_OPT = "ef";
+static const char *SOCKET_OPT = "socket";
+static const char *POOL_OPT = "pool";
+static const char *STATS_OPT = "stats";
+static const char *TASKS_OPT = "tasks";
+static const char *IDLE_OPT = "idle";
+
+static const char *SOCKET_FORMAT = "/tmp/faces-%d.sock";
+
+/* of the host in a worker id, so that its queue tasks-HOST-PID keeps
+ * within the 80 characters SQS allows */
+static const int MAX_WORKER_HOST = 60;
 
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
-int
-main(const int argc, const char **argv)
+/* Splits the arguments into positional arguments and --NAME VALUE options */
+static bool
+parse_options(const int argc, const char **argv,
+		std::vector<const char*>& args,
+		std::map<std::string, std::string>& options)
 {
-	if (argc < 2) {
-		std::cerr << "Usage error";
-		return EXIT_FAILURE;
+	for (int i=0;  i<argc;  ++i) {
+		if (!strncmp(argv[i], "--", 2)) {
+			if (i + 1 >= argc) {
+				return false;
+			}
+			options[argv[i] + 2] = argv[i + 1];
+			++i;
+		} else {
+			args.push_back(argv[i]);
+		}
 	}
+	return true;
+}
 
-	int rc = EXIT_SUCCESS;
-	const char *cmd = argv[1];
+static int
+int_option(std::map<std::string, std::string>& options, const char *name, int value)
+{
+	std::map<std::string, std::string>::iterator it = options.find(name);
+	if (it != options.end()) {
+		sscanf(it->second.c_str(), "%d", &value);
+	}
+	return value;
+}
+
+static double
+float_option(std::map<std::string, std::string>& options, const char *name, double value)
+{
+	std::map<std::string, std::string>::iterator it = options.find(name);
+	if (it != options.end()) {
+		sscanf(it->second.c_str(), "%lf", &value);
+	}
+	return value;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Runs one command line, whose command is args[1], writing its output to
+ * outs */
+static int
+run_command(CVDB& cvdb, const std::vector<const char*>& args,
+		std::map<std::string, std::string>& options, std::ostream& outs)
+{
+	const char *cmd = args[1];
 	if (!strcmp(cmd, UPLOAD_CMD)) {
-		if (argc < 4) {
+		if (args.size() < 4) {
 			std::cerr << "Usage error: wrong number of arguments" << std::endl;
 			return EXIT_FAILURE;
 		}
 	} else if (!strcmp(cmd, TRAIN_CMD)) {
-		if (argc < 6) {
+		if (args.size() < 6) {
+			std::cerr << "Usage error: wrong number of arguments" << std::endl;
+			return EXIT_FAILURE;
+		}
+	} else if (!strcmp(cmd, TRAIN_PARTIAL_CMD)) {
+		if (args.size() < 6) {
+			std::cerr << "Usage error: wrong number of arguments" << std::endl;
+			return EXIT_FAILURE;
+		}
+	} else if (!strcmp(cmd, TRAIN_MERGE_CMD)) {
+		if (args.size() < 4) {
+			std::cerr << "Usage error: wrong number of arguments" << std::endl;
+			return EXIT_FAILURE;
+		}
+	} else if (!strcmp(cmd, UPDATE_CMD) || !strcmp(cmd, REPROJECT_CMD)) {
+		if (args.size() < 5) {
 			std::cerr << "Usage error: wrong number of arguments" << std::endl;
 			return EXIT_FAILURE;
 		}
 	} else if (!strcmp(cmd, LEARN_CMD)) {
-		if (argc < 5) {
+		if (args.size() < 5) {
+			std::cerr << "Usage error: wrong number of arguments" << std::endl;
+			return EXIT_FAILURE;
+		}
+	} else if (!strcmp(cmd, INDEX_CMD) || !strcmp(cmd, GRAPH_CMD)) {
+		if (args.size() < 3) {
 			std::cerr << "Usage error: wrong number of arguments" << std::endl;
 			return EXIT_FAILURE;
 		}
 	} else if (!strcmp(cmd, QUERY_CMD)) {
-		if (argc < 6) {
+		if (args.size() < 6) {
+			std::cerr << "Usage error: wrong number of arguments" << std::endl;
+			return EXIT_FAILURE;
+		}
+	} else if (!strcmp(cmd, SERVE_CMD)) {
+		if (args.size() < 5) {
+			std::cerr << "Usage error: wrong number of arguments" << std::endl;
+			return EXIT_FAILURE;
+		}
+	} else if (!strcmp(cmd, CLIENT_CMD)) {
+		if (args.size() < 4) {
 			std::cerr << "Usage error: wrong number of arguments" << std::endl;
 			return EXIT_FAILURE;
 		}
@@ -64,37 +209,180 @@ main(const int argc, const char **argv)
 		return EXIT_FAILURE;
 	}
 
-	CVDB cvdb;
-
+	int rc = EXIT_SUCCESS;
 	if (!strcmp(cmd, UPLOAD_CMD)) {
 		int table;
-		sscanf(argv[2], "%d", &table);
-		const std::string prefix(argv[3]);
+		sscanf(args[2], "%d", &table);
+		const std::string prefix(args[3]);
 		ImageScanner *scanner = new YaleS3Scanner(prefix);
 		rc = cvdb.upload(scanner, table, prefix);
 	} else if (!strcmp(cmd, TRAIN_CMD)) {
 		int table, start, stop, resolution;
-		sscanf(argv[2], "%d", &table);
-		sscanf(argv[3], "%d", &resolution);
-		sscanf(argv[4], "%d", &start);
-		sscanf(argv[5], "%d", &stop);
+		sscanf(args[2], "%d", &table);
+		sscanf(args[3], "%d", &resolution);
+		sscanf(args[4], "%d", &start);
+		sscanf(args[5], "%d", &stop);
+		std::pair<int, int> range(start, stop);
+		int window = int_option(options, WINDOW_OPT, CVDB::WINDOW);
+		int ncomponents = int_option(options, COMPONENTS_OPT, 0);
+		double variance = float_option(options, VARIANCE_OPT, 0);
+		if (variance < 0 || variance > 1) {
+			std::cerr << "Usage error: variance must be between 0 and 1" << std::endl;
+			return EXIT_FAILURE;
+		}
+		int passes = int_option(options, PASSES_OPT, 0);
+		if (passes < 0 || passes > 2 || (passes > 0 && ncomponents < 1)) {
+			std::cerr << "Usage error: --passes must be 1 or 2, with --components"
+					<< std::endl;
+			return EXIT_FAILURE;
+		}
+		rc = cvdb.train(table, resolution, range, std::max(window, 1),
+				ncomponents, variance, passes);
+	} else if (!strcmp(cmd, TRAIN_PARTIAL_CMD)) {
+		int table, start, stop, resolution;
+		sscanf(args[2], "%d", &table);
+		sscanf(args[3], "%d", &resolution);
+		sscanf(args[4], "%d", &start);
+		sscanf(args[5], "%d", &stop);
 		std::pair<int, int> range(start, stop);
-		rc = cvdb.train(table, resolution, range);
+		int window = int_option(options, WINDOW_OPT, CVDB::WINDOW);
+		int ncomponents = int_option(options, COMPONENTS_OPT, 0);
+		if (ncomponents < 1) {
+			std::cerr << "Usage error: --components must be positive" << std::endl;
+			return EXIT_FAILURE;
+		}
+		rc = cvdb.train_partial(table, resolution, range, outs,
+				std::max(window, 1), ncomponents);
+	} else if (!strcmp(cmd, TRAIN_MERGE_CMD)) {
+		int table;
+		sscanf(args[2], "%d", &table);
+		std::vector<std::string> partials(args.begin() + 3, args.end());
+		double variance = float_option(options, VARIANCE_OPT, 0);
+		if (variance < 0 || variance > 1) {
+			std::cerr << "Usage error: variance must be between 0 and 1" << std::endl;
+			return EXIT_FAILURE;
+		}
+		rc = cvdb.train_merge(table, partials, variance);
+	} else if (!strcmp(cmd, UPDATE_CMD)) {
+		int table, start, stop;
+		sscanf(args[2], "%d", &table);
+		sscanf(args[3], "%d", &start);
+		sscanf(args[4], "%d", &stop);
+		std::pair<int, int> range(start, stop);
+		int window = int_option(options, WINDOW_OPT, CVDB::WINDOW);
+		int ncomponents = int_option(options, COMPONENTS_OPT, 0);
+		double variance = float_option(options, VARIANCE_OPT, 0);
+		if (variance < 0 || variance > 1) {
+			std::cerr << "Usage error: variance must be between 0 and 1" << std::endl;
+			return EXIT_FAILURE;
+		}
+		rc = cvdb.update(table, range, std::max(window, 1), ncomponents, variance);
+	} else if (!strcmp(cmd, REPROJECT_CMD)) {
+		int table, start, stop;
+		sscanf(args[2], "%d", &table);
+		sscanf(args[3], "%d", &start);
+		sscanf(args[4], "%d", &stop);
+		std::pair<int, int> range(start, stop);
+		int from = int_option(options, FROM_OPT, 0);
+		int window = int_option(options, WINDOW_OPT, CVDB::WINDOW);
+		rc = cvdb.reproject(table, range, from, std::max(window, 1));
 	} else if (!strcmp(cmd, LEARN_CMD)) {
 		int table, start, stop;
-		sscanf(argv[2], "%d", &table);
-		sscanf(argv[3], "%d", &start);
-		sscanf(argv[4], "%d", &stop);
+		sscanf(args[2], "%d", &table);
+		sscanf(args[3], "%d", &start);
+		sscanf(args[4], "%d", &stop);
 		std::pair<int, int> range(start, stop);
-		rc = cvdb.learn(table, range);
+		int shardsize = int_option(options, SHARD_OPT, 0);
+		int window = int_option(options, WINDOW_OPT, CVDB::WINDOW);
+		int nthreads = int_option(options, THREADS_OPT, 1);
+		int encoding = -1;
+		if (options.count(ENCODING_OPT) > 0) {
+			encoding = encoding_from_name(options[ENCODING_OPT].c_str());
+			if (encoding < 0) {
+				std::cerr << "Usage error: encoding must be f32, f16 or i8" << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+		bool graph = int_option(options, GRAPH_OPT, 0) != 0;
+		int batch = int_option(options, BATCH_OPT, CVDB::BATCH);
+		rc = cvdb.learn(table, range, shardsize, std::max(window, 1),
+				std::max(nthreads, 1), encoding, graph, std::max(batch, 1));
+	} else if (!strcmp(cmd, INDEX_CMD)) {
+		int table;
+		sscanf(args[2], "%d", &table);
+		int nlists = int_option(options, LISTS_OPT, 0);
+		int nsubspaces = int_option(options, SUBSPACES_OPT, 0);
+		int nsample = int_option(options, SAMPLE_OPT, 0);
+		rc = cvdb.index(table, std::max(nlists, 0), std::max(nsubspaces, 0),
+				std::max(nsample, 0));
+	} else if (!strcmp(cmd, GRAPH_CMD)) {
+		int table;
+		sscanf(args[2], "%d", &table);
+		int m = int_option(options, M_OPT, GRAPH_M);
+		int efconstruction = int_option(options, EF_CONSTRUCTION_OPT,
+				GRAPH_EF_CONSTRUCTION);
+		int nthreads = int_option(options, THREADS_OPT, 1);
+		if (m < 2 || efconstruction < 1) {
+			std::cerr << "Usage error: m must be at least 2, ef-construction positive"
+					<< std::endl;
+			return EXIT_FAILURE;
+		}
+		rc = cvdb.graph(table, m, efconstruction, std::max(nthreads, 1));
 	} else if (!strcmp(cmd, QUERY_CMD)) {
 		int table, image, start, stop;
-		sscanf(argv[2], "%d", &table);
-		sscanf(argv[3], "%d", &image);
-		sscanf(argv[4], "%d", &start);
-		sscanf(argv[5], "%d", &stop);
+		sscanf(args[2], "%d", &table);
+		sscanf(args[3], "%d", &image);
+		sscanf(args[4], "%d", &start);
+		sscanf(args[5], "%d", &stop);
+		std::pair<int, int> range(start, stop);
+		int k = int_option(options, K_OPT, 1);
+		double threshold = float_option(options, THRESHOLD_OPT, -1);
+		if (k < 1) {
+			std::cerr << "Usage error: k must be positive" << std::endl;
+			return EXIT_FAILURE;
+		}
+		int nprobe = int_option(options, NPROBE_OPT, 0);
+		int shortlist = int_option(options, SHORTLIST_OPT, 0);
+		if (shortlist > 0 && shortlist < k) {
+			std::cerr << "Usage error: shortlist must be at least k" << std::endl;
+			return EXIT_FAILURE;
+		}
+		int ef = int_option(options, EF_OPT, 0);
+		if (ef > 0 && nprobe > 0) {
+			std::cerr << "Usage error: --ef and --nprobe exclude each other" << std::endl;
+			return EXIT_FAILURE;
+		}
+		rc = cvdb.query(table, image, range, outs, k, threshold,
+				std::max(nprobe, 0), std::max(shortlist, 0), std::max(ef, 0));
+	} else if (!strcmp(cmd, SERVE_CMD)) {
+		int table, start, stop;
+		sscanf(args[2], "%d", &table);
+		sscanf(args[3], "%d", &start);
+		sscanf(args[4], "%d", &stop);
 		std::pair<int, int> range(start, stop);
-		rc = cvdb.query(table, image, range, std::cout);
+		char buf[128];
+		sprintf(buf, SOCKET_FORMAT, table);
+		std::string path(buf);
+		if (options.count(SOCKET_OPT) > 0) {
+			path = options[SOCKET_OPT];
+		}
+		int ef = int_option(options, EF_OPT, 0);
+		rc = cvdb.serve(table, range, path, std::max(ef, 0));
+	} else if (!strcmp(cmd, CLIENT_CMD)) {
+		std::string request;
+		for (size_t i=3;  i<args.size();  ++i) {
+			if (i > 3) {
+				request += " ";
+			}
+			request += args[i];
+		}
+		std::string response;
+		if (request_frame(args[2], request, response)) {
+			outs << response << std::endl;
+		} else {
+			std::cerr << "Request failed: " << args[2] << std::endl;
+			rc = EXIT_FAILURE;
+		}
 	} else {
 		rc = EXIT_FAILURE;
 	}
@@ -102,5 +390,93 @@ main(const int argc, const char **argv)
 	return rc;
 }
 
+/* Runs a task of a worker as its command line, if it is one a worker may
+ * run */
+static int
+run_task(const std::vector<std::string>& taskargs, std::ostream& outs, void *arg)
+{
+	std::vector<const char*> argv;
+	argv.push_back("faces");
+	for (size_t i=0;  i<taskargs.size();  ++i) {
+		argv.push_back(taskargs[i].c_str());
+	}
+	std::vector<const char*> args;
+	std::map<std::string, std::string> options;
+	if (!parse_options(argv.size(), &argv[0], args, options) || args.size() < 2) {
+		std::cerr << "Usage error" << std::endl;
+		return EXIT_FAILURE;
+	}
+	const char *cmds[] = { LEARN_CMD, REPROJECT_CMD, TRAIN_PARTIAL_CMD, QUERY_CMD, NULL };
+	const char **cmd = cmds;
+	while (*cmd != NULL && strcmp(*cmd, args[1]) != 0) {
+		++cmd;
+	}
+	if (*cmd == NULL) {
+		std::cerr << "Usage error: a worker does not run " << args[1] << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// every task shares the profiler, and one that threw may have left
+	// events started on this thread
+	CVDB& cvdb = *(CVDB*)arg;
+	cvdb.abandon_events();
+	return run_command(cvdb, args, options, outs);
+}
+
+int
+main(const int argc, const char **argv)
+{
+	std::vector<const char*> args;
+	std::map<std::string, std::string> options;
+	if (!parse_options(argc, argv, args, options) || args.size() < 2) {
+		std::cerr << "Usage error";
+		return EXIT_FAILURE;
+	}
+
+	int poolsize = int_option(options, POOL_OPT, 0);
+	if (poolsize > 0) {
+		set_pool_size(poolsize);
+	}
+
+	CVDB cvdb;
+
+	int rc;
+	if (!strcmp(args[1], WORKER_CMD)) {
+		// one worker per process, named as cvdb.py master counts them
+		char host[256];
+		if (gethostname(host, sizeof(host)) < 0) {
+			strcpy(host, "localhost");
+		}
+		host[sizeof(host) - 1] = '\0';
+		char buf[320];
+		sprintf(buf, "%.*s-%d", MAX_WORKER_HOST, host, (int)getpid());
+		// it names the worker's own queue, which may not hold dots
+		for (char *c=buf;  *c!='\0';  ++c) {
+			if (!isalnum((unsigned char)*c) && *c != '-' && *c != '_') {
+				*c = '_';
+			}
+		}
+		int ntasks = int_option(options, TASKS_OPT, 0);
+		double idle = float_option(options, IDLE_OPT, 0);
+		cvdb.keep_warm();
+		rc = run_worker(task_queue(), buf, run_task, &cvdb, ntasks, idle);
+	} else {
+		// commands throw what stops them, such as a learn thread's error
+		try {
+			rc = run_command(cvdb, args, options, std::cout);
+		} catch (std::exception& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			rc = EXIT_FAILURE;
+		}
+	}
+
+	if (int_option(options, STATS_OPT, 0)) {
+		write_pool_stats(std::cerr);
+		object_cache().write_stats(std::cerr);
+	}
+
+	return rc;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
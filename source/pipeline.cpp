@@ -0,0 +1,241 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "pipeline.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+enum { SLOT_PENDING, SLOT_READY, SLOT_FAILED };
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+ImagePrefetcher::ImagePrefetcher(const std::vector<ImageMetadata*>& metas,
+		ImageLoader loader,
+		size_t window,
+		size_t resolution)
+  : metas(metas), loader(loader), window(window > 0 ? window : 1),
+    resolution(resolution),
+    images(metas.size(), (IplImage*)NULL), sizes(metas.size(), 0),
+    states(metas.size(), SLOT_PENDING),
+    nextfetch(0), nextconsume(0), stopping(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+
+	// one thread per image in flight, since every fetch blocks
+	size_t nthreads = std::min(this->window, metas.size());
+	threads.resize(nthreads);
+	for (size_t i=0;  i<nthreads;  ++i) {
+		pthread_create(&threads[i], NULL, ImagePrefetcher::run, this);
+	}
+}
+
+ImagePrefetcher::~ImagePrefetcher()
+{
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+	for (size_t i=0;  i<threads.size();  ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// release anything fetched but never consumed
+	for (size_t i=0;  i<images.size();  ++i) {
+		if (images[i] != NULL) {
+			cvReleaseImage(&(images[i]));
+		}
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+IplImage *
+ImagePrefetcher::next(size_t& bytes)
+{
+	bytes = 0;
+	pthread_mutex_lock(&mutex);
+	if (nextconsume >= metas.size()) {
+		pthread_mutex_unlock(&mutex);
+		return NULL;
+	}
+	size_t i = nextconsume;
+	while (states[i] == SLOT_PENDING) {
+		pthread_cond_wait(&cond, &mutex);
+	}
+	IplImage *image = images[i];
+	images[i] = NULL;
+	bytes = sizes[i];
+	bool failed = (states[i] == SLOT_FAILED);
+	std::string error;
+	if (failed && errors.count(i) > 0) {
+		error = ": " + errors[i];
+		errors.erase(i);
+	}
+	++nextconsume;
+	// a slot in the window has opened up
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+
+	if (failed) {
+		throw std::runtime_error("failed to load image " + metas[i]->name + error);
+	}
+	return image;
+}
+
+void *
+ImagePrefetcher::run(void *arg)
+{
+	((ImagePrefetcher*)arg)->fetch();
+	return NULL;
+}
+
+void
+ImagePrefetcher::fetch()
+{
+	pthread_mutex_lock(&mutex);
+	while (true) {
+		while (!stopping && nextfetch < metas.size()
+				&& nextfetch >= nextconsume + window) {
+			pthread_cond_wait(&cond, &mutex);
+		}
+		if (stopping || nextfetch >= metas.size()) {
+			break;
+		}
+		size_t i = nextfetch++;
+		pthread_mutex_unlock(&mutex);
+
+		IplImage *image = NULL;
+		size_t size = 0;
+		char state = SLOT_READY;
+		std::string error;
+		try {
+			image = loader(metas[i], resolution, size);
+		} catch (std::exception& e) {
+			state = SLOT_FAILED;
+			error = e.what();
+		} catch (...) {
+			state = SLOT_FAILED;
+		}
+
+		pthread_mutex_lock(&mutex);
+		images[i] = image;
+		sizes[i] = size;
+		states[i] = state;
+		if (state == SLOT_FAILED && !error.empty()) {
+			errors[i] = error;
+		}
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+Job::Job() { }
+
+Job::~Job() { }
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+BackgroundQueue::BackgroundQueue(size_t nthreads, size_t depth)
+  : depth(depth > 0 ? depth : 1), active(0), failures(0), stopping(false)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	threads.resize(nthreads > 0 ? nthreads : 1);
+	for (size_t i=0;  i<threads.size();  ++i) {
+		pthread_create(&threads[i], NULL, BackgroundQueue::run, this);
+	}
+}
+
+BackgroundQueue::~BackgroundQueue()
+{
+	drain();
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+	for (size_t i=0;  i<threads.size();  ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void
+BackgroundQueue::submit(Job *job)
+{
+	pthread_mutex_lock(&mutex);
+	while (jobs.size() + active >= depth) {
+		pthread_cond_wait(&cond, &mutex);
+	}
+	jobs.push_back(job);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+long
+BackgroundQueue::drain()
+{
+	pthread_mutex_lock(&mutex);
+	while (!jobs.empty() || active > 0) {
+		pthread_cond_wait(&cond, &mutex);
+	}
+	long n = failures;
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+void *
+BackgroundQueue::run(void *arg)
+{
+	((BackgroundQueue*)arg)->work();
+	return NULL;
+}
+
+void
+BackgroundQueue::work()
+{
+	pthread_mutex_lock(&mutex);
+	while (true) {
+		while (!stopping && jobs.empty()) {
+			pthread_cond_wait(&cond, &mutex);
+		}
+		if (jobs.empty()) {
+			break;
+		}
+		Job *job = jobs.front();
+		jobs.pop_front();
+		++active;
+		pthread_mutex_unlock(&mutex);
+
+		bool failed = false;
+		try {
+			job->run();
+		} catch (...) {
+			failed = true;
+		}
+		delete job;
+
+		pthread_mutex_lock(&mutex);
+		--active;
+		if (failed) {
+			++failures;
+		}
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
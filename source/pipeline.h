@@ -0,0 +1,115 @@
+/****************************************************************************
+ *
+ * Background stages for overlapping storage round trips with compute.
+ *
+ * ImagePrefetcher fetches and decodes images on its own threads, at most
+ * window images ahead of the consumer, and hands them out in order.
+ * BackgroundQueue runs jobs (e.g. uploads) on its own threads and blocks
+ * submitters once depth jobs are pending. Both bound the memory held in
+ * flight by their window, whatever the number of images.
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_PIPELINE_H
+#define CLOUDVISION_PIPELINE_H
+
+
+#include "image.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Fetches and decodes one image, resampled to resolution x resolution
+ * if that is positive, setting bytes to the size of the object it was
+ * read from; may throw */
+typedef IplImage *(*ImageLoader)(ImageMetadata *meta, size_t resolution,
+		size_t& bytes);
+
+class ImagePrefetcher
+{
+public:
+	ImagePrefetcher(const std::vector<ImageMetadata*>& metas,
+			ImageLoader loader, size_t window, size_t resolution=0);
+	~ImagePrefetcher();
+
+	/* Returns the next image in order (the caller releases it), or NULL
+	 * once every image has been returned, and the bytes it was read from.
+	 * Throws std::runtime_error if the image could not be loaded. */
+	IplImage *next(size_t& bytes);
+
+private:
+	ImagePrefetcher(const ImagePrefetcher&);
+	ImagePrefetcher& operator=(const ImagePrefetcher&);
+
+	static void *run(void *arg);
+	void fetch();
+
+	const std::vector<ImageMetadata*>& metas;
+	ImageLoader loader;
+	size_t window;
+	size_t resolution;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	std::vector<pthread_t> threads;
+	std::vector<IplImage*> images;
+	std::vector<size_t> sizes;				// of the objects read
+	std::vector<char> states;
+	std::map<size_t, std::string> errors;	// of the failed slots
+	size_t nextfetch;
+	size_t nextconsume;
+	bool stopping;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+class Job
+{
+public:
+	virtual ~Job();
+	virtual void run() = 0;
+protected:
+	Job();
+};
+
+class BackgroundQueue
+{
+public:
+	BackgroundQueue(size_t nthreads, size_t depth);
+	~BackgroundQueue();
+
+	/* Takes ownership of the job, blocks while depth jobs are pending */
+	void submit(Job *job);
+
+	/* Waits for every submitted job, returns the number that threw */
+	long drain();
+
+private:
+	BackgroundQueue(const BackgroundQueue&);
+	BackgroundQueue& operator=(const BackgroundQueue&);
+
+	static void *run(void *arg);
+	void work();
+
+	size_t depth;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	std::vector<pthread_t> threads;
+	std::deque<Job*> jobs;
+	size_t active;
+	long failures;
+	bool stopping;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_PIPELINE_H
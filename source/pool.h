@@ -0,0 +1,149 @@
+/****************************************************************************
+ *
+ * A thread-safe pool of reusable connections.
+ *
+ * acquire() hands out an idle connection (a hit) or creates a new one
+ * (a miss); release() returns it to the pool, which keeps at most size
+ * idle connections and drops the rest. PooledConnection acquires for the
+ * lifetime of a scope.
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_POOL_H
+#define CLOUDVISION_POOL_H
+
+
+#include <algorithm>
+#include <vector>
+#include <pthread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+template <class Connection>
+class ConnectionPool
+{
+public:
+	typedef Connection (*Factory)();
+
+	ConnectionPool(Factory factory, size_t size)
+	  : factory(factory), size(size), nhits(0), nmisses(0)
+	{
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	~ConnectionPool()
+	{
+		pthread_mutex_destroy(&mutex);
+	}
+
+	Connection acquire()
+	{
+		pthread_mutex_lock(&mutex);
+		Connection conn;
+		if (idle.empty()) {
+			// connection factories are not known to be thread-safe
+			++nmisses;
+			conn = factory();
+		} else {
+			++nhits;
+			conn = idle.back();
+			idle.pop_back();
+		}
+		pthread_mutex_unlock(&mutex);
+		return conn;
+	}
+
+	void release(Connection conn)
+	{
+		pthread_mutex_lock(&mutex);
+		if (idle.size() < size) {
+			idle.push_back(conn);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+
+	void resize(size_t newsize)
+	{
+		pthread_mutex_lock(&mutex);
+		size = newsize;
+		if (idle.size() > size) {
+			idle.resize(size);
+		}
+		pthread_mutex_unlock(&mutex);
+	}
+
+	/* Raises the number of idle connections kept to at least newsize */
+	void grow(size_t newsize)
+	{
+		pthread_mutex_lock(&mutex);
+		size = std::max(size, newsize);
+		pthread_mutex_unlock(&mutex);
+	}
+
+	long hits()
+	{
+		pthread_mutex_lock(&mutex);
+		long n = nhits;
+		pthread_mutex_unlock(&mutex);
+		return n;
+	}
+
+	long misses()
+	{
+		pthread_mutex_lock(&mutex);
+		long n = nmisses;
+		pthread_mutex_unlock(&mutex);
+		return n;
+	}
+
+private:
+	ConnectionPool(const ConnectionPool&);
+	ConnectionPool& operator=(const ConnectionPool&);
+
+	pthread_mutex_t mutex;
+	Factory factory;
+	size_t size;
+	std::vector<Connection> idle;
+	long nhits;
+	long nmisses;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+template <class Connection>
+class PooledConnection
+{
+public:
+	PooledConnection(ConnectionPool<Connection>& pool)
+	  : pool(pool), conn(pool.acquire()) { }
+
+	~PooledConnection()
+	{
+		pool.release(conn);
+	}
+
+	Connection operator->() const
+	{
+		return conn;
+	}
+
+	operator Connection() const
+	{
+		return conn;
+	}
+
+private:
+	PooledConnection(const PooledConnection&);
+	PooledConnection& operator=(const PooledConnection&);
+
+	ConnectionPool<Connection>& pool;
+	Connection conn;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_POOL_H
@@ -0,0 +1,345 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "profiler.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+
+#include <sys/time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define NSECS_PER_SEC 1000000000ULL
+
+/* deepest nesting of events on one thread */
+static const int MAX_DEPTH = 16;
+
+/* each power of two of nanoseconds is split into 2^SUB_BITS buckets, up
+ * to 2^MAX_BITS nanoseconds (over an hour), beyond which events share
+ * the last bucket */
+static const int SUB_BITS = 5;
+static const int SUB_BUCKETS = 1 << SUB_BITS;
+static const int MAX_BITS = 42;
+static const int BUCKETS = (MAX_BITS - SUB_BITS + 1)*SUB_BUCKETS;
+
+/* Events of one type on one thread, written by it with atomic adds and
+ * read and reset by flushes with atomic swaps */
+typedef struct EventHistogram
+{
+	unsigned long long counts[BUCKETS];
+	unsigned long long nsecs;
+	unsigned long long amount;
+	unsigned long long max;
+} EventHistogram;
+
+/* Everything one thread has recorded into a profiler */
+struct ProfileBuffer
+{
+	Profiler *profiler;
+	unsigned long long starts[MAX_DEPTH];
+	int depth;
+	EventHistogram * volatile histograms[Profiler::MAX_EVENTS];
+};
+
+/* interned event types, never removed */
+static pthread_mutex_t EVENTS_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static const char *EVENT_NAMES[Profiler::MAX_EVENTS];
+static const char *EVENT_UNITS[Profiler::MAX_EVENTS];
+static int NEVENTS = 0;
+
+static inline unsigned long long
+now_ns();
+
+static inline int
+bucket_index(unsigned long long nsecs);
+
+static double
+bucket_seconds(int index);
+
+static double
+percentile_seconds(const std::vector<unsigned long long>& counts,
+		unsigned long long count, double fraction);
+
+static inline unsigned long long
+swap_zero(unsigned long long *value);
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+const char *Profiler::DELIM = " ";
+
+int
+Profiler::event(const char *name, const char *unit)
+{
+	pthread_mutex_lock(&EVENTS_MUTEX);
+	int id = 0;
+	while (id < NEVENTS && strcmp(EVENT_NAMES[id], name) != 0) {
+		++id;
+	}
+	if (id == NEVENTS) {
+		assert(NEVENTS < MAX_EVENTS);
+		EVENT_NAMES[id] = strdup(name);
+		EVENT_UNITS[id] = strdup(unit[0] != '\0' ? unit : "-");
+		++NEVENTS;
+	}
+	pthread_mutex_unlock(&EVENTS_MUTEX);
+	return id;
+}
+
+Profiler::Profiler()
+{
+	// create a profile filename with a timestamp
+	time_t rawtime;
+	time (&rawtime);
+	struct tm * timeinfo = localtime(&rawtime);
+	char buf[128];
+	strftime(buf, 128, "%Y-%j_%H-%M-%S.prof", timeinfo);
+	filename.assign(buf);
+
+	pthread_key_create(&key, Profiler::retire);
+	pthread_mutex_init(&mutex, NULL);
+	retired = new ProfileBuffer();
+	retired->profiler = this;
+	buffers.push_back(retired);
+}
+
+Profiler::~Profiler()
+{
+	// no thread exiting from here on retires its buffer into this one
+	pthread_key_delete(key);
+	flush();
+	for (size_t i=0;  i<buffers.size();  ++i) {
+		for (int j=0;  j<MAX_EVENTS;  ++j) {
+			delete buffers[i]->histograms[j];
+		}
+		delete buffers[i];
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+ProfileBuffer *
+Profiler::buffer()
+{
+	ProfileBuffer *buffer = (ProfileBuffer*)pthread_getspecific(key);
+	if (buffer == NULL) {
+		buffer = new ProfileBuffer();
+		buffer->profiler = this;
+		pthread_mutex_lock(&mutex);
+		buffers.push_back(buffer);
+		pthread_mutex_unlock(&mutex);
+		pthread_setspecific(key, buffer);
+	}
+	return buffer;
+}
+
+/* Run as a thread exits: its histograms are added to the retired ones,
+ * still to be flushed, and its buffer is freed */
+void
+Profiler::retire(void *arg)
+{
+	ProfileBuffer *buffer = (ProfileBuffer*)arg;
+	Profiler *profiler = buffer->profiler;
+	pthread_mutex_lock(&profiler->mutex);
+	ProfileBuffer *retired = profiler->retired;
+	for (int i=0;  i<MAX_EVENTS;  ++i) {
+		EventHistogram *histogram = buffer->histograms[i];
+		if (histogram == NULL) {
+			continue;
+		}
+		if (retired->histograms[i] == NULL) {
+			retired->histograms[i] = new EventHistogram();
+		}
+		EventHistogram *total = retired->histograms[i];
+		for (int b=0;  b<BUCKETS;  ++b) {
+			total->counts[b] += histogram->counts[b];
+		}
+		total->nsecs += histogram->nsecs;
+		total->amount += histogram->amount;
+		total->max = std::max(total->max, histogram->max);
+		delete histogram;
+	}
+	std::vector<ProfileBuffer*>& buffers = profiler->buffers;
+	buffers.erase(std::find(buffers.begin(), buffers.end(), buffer));
+	pthread_mutex_unlock(&profiler->mutex);
+	delete buffer;
+}
+
+void
+Profiler::start()
+{
+	ProfileBuffer *buffer = this->buffer();
+	assert(buffer->depth < MAX_DEPTH);
+	buffer->starts[buffer->depth++] = now_ns();
+}
+
+void
+Profiler::stop(int event, unsigned long long amount)
+{
+	unsigned long long stop = now_ns();
+	ProfileBuffer *buffer = this->buffer();
+	assert(buffer->depth > 0);
+	assert(event >= 0 && event < MAX_EVENTS);
+	unsigned long long nsecs = stop - buffer->starts[--buffer->depth];
+
+	EventHistogram *histogram = buffer->histograms[event];
+	if (histogram == NULL) {
+		// publish it zeroed, flushes may read it from now on
+		histogram = new EventHistogram();
+		__sync_synchronize();
+		buffer->histograms[event] = histogram;
+	}
+	__sync_fetch_and_add(&histogram->counts[bucket_index(nsecs)], 1ULL);
+	__sync_fetch_and_add(&histogram->nsecs, nsecs);
+	if (amount > 0) {
+		__sync_fetch_and_add(&histogram->amount, amount);
+	}
+	unsigned long long max = histogram->max;
+	while (nsecs > max) {
+		unsigned long long seen = __sync_val_compare_and_swap(&histogram->max, max, nsecs);
+		if (seen == max) {
+			break;
+		}
+		max = seen;
+	}
+}
+
+void
+Profiler::abandon()
+{
+	buffer()->depth = 0;
+}
+
+void
+Profiler::flush()
+{
+	pthread_mutex_lock(&EVENTS_MUTEX);
+	int nevents = NEVENTS;
+	pthread_mutex_unlock(&EVENTS_MUTEX);
+
+	pthread_mutex_lock(&mutex);
+	std::ofstream outs;
+	std::vector<unsigned long long> counts(BUCKETS);
+	for (int i=0;  i<nevents;  ++i) {
+		// sum this event over every thread
+		std::fill(counts.begin(), counts.end(), 0ULL);
+		unsigned long long count = 0;
+		unsigned long long nsecs = 0;
+		unsigned long long amount = 0;
+		unsigned long long max = 0;
+		for (size_t j=0;  j<buffers.size();  ++j) {
+			EventHistogram *histogram = buffers[j]->histograms[i];
+			if (histogram == NULL) {
+				continue;
+			}
+			__sync_synchronize();
+			for (int b=0;  b<BUCKETS;  ++b) {
+				if (histogram->counts[b] > 0) {
+					unsigned long long n = swap_zero(&histogram->counts[b]);
+					counts[b] += n;
+					count += n;
+				}
+			}
+			nsecs += swap_zero(&histogram->nsecs);
+			amount += swap_zero(&histogram->amount);
+			max = std::max(max, swap_zero(&histogram->max));
+		}
+		if (count == 0) {
+			continue;
+		}
+
+		if (!outs.is_open()) {
+			outs.open(filename.c_str(), std::fstream::out | std::fstream::app);
+		}
+		// a bucket's middle may lie past the slowest event in it
+		double secs = (double)nsecs/NSECS_PER_SEC;
+		double maxsecs = (double)max/NSECS_PER_SEC;
+		char buf[256];
+		sprintf(buf, "%s%s%llu%s%.9f%s%.9f%s%.9f%s%.9f%s%.9f%s%llu%s%s%s%.0f",
+				EVENT_NAMES[i], DELIM, count, DELIM, secs, DELIM,
+				std::min(percentile_seconds(counts, count, 0.5), maxsecs), DELIM,
+				std::min(percentile_seconds(counts, count, 0.99), maxsecs), DELIM,
+				std::min(percentile_seconds(counts, count, 0.999), maxsecs), DELIM,
+				maxsecs, DELIM, amount, DELIM,
+				EVENT_UNITS[i], DELIM, secs > 0 ? amount/secs : 0.0);
+		outs << buf << std::endl;
+	}
+	if (outs.is_open()) {
+		outs.close();
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static inline unsigned long long
+now_ns()
+{
+#ifdef CLOCK_MONOTONIC
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (unsigned long long)t.tv_sec*NSECS_PER_SEC + t.tv_nsec;
+#else
+	timeval t;
+	gettimeofday(&t, NULL);
+	return (unsigned long long)t.tv_sec*NSECS_PER_SEC + t.tv_usec*1000ULL;
+#endif
+}
+
+/* Durations under SUB_BUCKETS nanoseconds have a bucket each, then every
+ * power of two has SUB_BUCKETS buckets of equal width */
+static inline int
+bucket_index(unsigned long long nsecs)
+{
+	if (nsecs < (unsigned long long)SUB_BUCKETS) {
+		return (int)nsecs;
+	}
+	int msb = 63 - __builtin_clzll(nsecs);
+	int shift = msb - SUB_BITS;
+	int index = ((shift + 1) << SUB_BITS) + (int)((nsecs >> shift) - SUB_BUCKETS);
+	return std::min(index, BUCKETS - 1);
+}
+
+/* The middle of a bucket */
+static double
+bucket_seconds(int index)
+{
+	if (index < SUB_BUCKETS) {
+		return (double)index/NSECS_PER_SEC;
+	}
+	int shift = (index >> SUB_BITS) - 1;
+	unsigned long long low = (unsigned long long)((index & (SUB_BUCKETS - 1)) + SUB_BUCKETS) << shift;
+	return (low + ((1ULL << shift) - 1)/2.0)/NSECS_PER_SEC;
+}
+
+/* The bucket below which the given fraction of count events fall */
+static double
+percentile_seconds(const std::vector<unsigned long long>& counts,
+		unsigned long long count, double fraction)
+{
+	unsigned long long rank = (unsigned long long)(fraction*count + 0.5);
+	rank = std::max(rank, 1ULL);
+	unsigned long long seen = 0;
+	for (int b=0;  b<BUCKETS;  ++b) {
+		seen += counts[b];
+		if (seen >= rank) {
+			return bucket_seconds(b);
+		}
+	}
+	return bucket_seconds(BUCKETS - 1);
+}
+
+static inline unsigned long long
+swap_zero(unsigned long long *value)
+{
+	return __sync_fetch_and_and(value, 0ULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,90 @@
+/****************************************************************************
+ *
+ * Timing of the events of a command (requests, training, searches), cheap
+ * enough to leave on.
+ *
+ * Event types are interned once, by name, into small ids. Every thread
+ * that records into a Profiler gets its own buffer of histograms, one per
+ * event type, which only it writes and only with atomic adds, so threads
+ * never wait for each other or for a flush. When a thread exits, its
+ * histograms are merged into those of exited threads and its buffer is
+ * freed, so threads that come and go do not pile up buffers. Durations
+ * come from the monotonic clock and go into log-linear buckets, as HDR
+ * histograms do: each power of two of nanoseconds is split into 32
+ * buckets, so any percentile is within about 3% of the true one, in
+ * constant memory.
+ *
+ * A flush appends one line per event type recorded since the previous
+ * flush to the profile file, with columns separated by Profiler::DELIM:
+ *
+ *   EVENT COUNT SECONDS P50 P99 P999 MAX AMOUNT UNIT PER_SECOND
+ *
+ * SECONDS is the total time spent in the event and P50 to MAX are single
+ * events, in seconds. AMOUNT sums what the events moved or processed, in
+ * the unit of their type (bytes for requests, images or vectors for
+ * computations), and PER_SECOND is AMOUNT over SECONDS.
+ *
+ * A start and stop pair costs about two reads of the clock (faces_bench
+ * reports it as profiler_event).
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_PROFILER_H
+#define CLOUDVISION_PROFILER_H
+
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct ProfileBuffer;
+
+class Profiler
+{
+public:
+	static const char *DELIM;
+	static const int MAX_EVENTS = 32;
+
+	/* Returns the id of the event type of the given name, interning it
+	 * the first time with the unit its amounts are counted in */
+	static int event(const char *name, const char *unit="");
+
+	/* Records into a new file named by the current time */
+	Profiler();
+	~Profiler();
+
+	/* Starts timing an event on the calling thread; events on one thread
+	 * nest, and each stop ends the latest one started */
+	void start();
+	void stop(int event, unsigned long long amount=0);
+
+	/* Drops the events started on the calling thread and not stopped, as
+	 * a command that threw leaves them */
+	void abandon();
+
+	/* Writes and resets the histograms of every thread. Events that stop
+	 * during a flush are counted by it or by the next. */
+	void flush();
+
+private:
+	Profiler(const Profiler&);
+	Profiler& operator=(const Profiler&);
+
+	ProfileBuffer *buffer();
+	static void retire(void *buffer);
+
+	std::string filename;
+	pthread_key_t key;		// the calling thread's buffer
+	pthread_mutex_t mutex;	// held to add or retire a buffer and to flush
+	std::vector<ProfileBuffer*> buffers;
+	ProfileBuffer *retired;	// what exited threads recorded, first of buffers
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_PROFILER_H
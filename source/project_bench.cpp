@@ -0,0 +1,103 @@
+/****************************************************************************
+ *
+ * Measures how projecting images onto an eigenspace scales with the
+ * batch size (see Projector).
+ *
+ * project_bench [RESOLUTION [DIMENSION [IMAGES]]]
+ *
+ * Projects IMAGES random centred RESOLUTION x RESOLUTION images onto
+ * DIMENSION random eigenfaces, one batch size at a time. The first line
+ * is the one image at a time reference, a dot product per eigenface as
+ * cvEigenDecomposite takes; then one line is written per batch size:
+ *
+ * BATCH ISA IMAGES_PER_SECOND SPEEDUP
+ *
+ ****************************************************************************/
+
+#include "distance.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include <sys/time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static const size_t BATCHES[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static double
+elapsed_s(timeval& start, timeval& stop)
+{
+	return (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec)/1e6;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+int
+main(const int argc, const char **argv)
+{
+	size_t resolution = (argc > 1) ? atoi(argv[1]) : 100;
+	size_t dimension = (argc > 2) ? atoi(argv[2]) : 100;
+	size_t nimages = (argc > 3) ? atoi(argv[3]) : 2048;
+	if (resolution < 1 || dimension < 1 || nimages < 1) {
+		std::cerr << "Usage error" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	size_t npixels = resolution*resolution;
+	std::vector<float> components(dimension*npixels);
+	for (size_t i=0;  i<components.size();  ++i) {
+		components[i] = (rand() - RAND_MAX/2.0) / RAND_MAX / resolution;
+	}
+	std::vector<float> images(nimages*npixels);
+	for (size_t i=0;  i<images.size();  ++i) {
+		images[i] = rand() % 256 - 128.0f;
+	}
+	std::vector<float> features(nimages*dimension);
+
+	// the reference, one eigenface at a time
+	char buf[256];
+	timeval start, stop;
+	gettimeofday(&start, NULL);
+	for (size_t j=0;  j<nimages;  ++j) {
+		const float *image = &images[j*npixels];
+		for (size_t i=0;  i<dimension;  ++i) {
+			const float *face = &components[i*npixels];
+			double dot = 0;
+			for (size_t p=0;  p<npixels;  ++p) {
+				dot += (double)face[p]*image[p];
+			}
+			features[j*dimension + i] = dot;
+		}
+	}
+	gettimeofday(&stop, NULL);
+	double reference = nimages / elapsed_s(start, stop);
+	sprintf(buf, "0 scalar %.0f 1.00", reference);
+	std::cout << buf << std::endl;
+
+	for (size_t b=0;  b<sizeof(BATCHES)/sizeof(BATCHES[0]);  ++b) {
+		size_t batch = BATCHES[b];
+		gettimeofday(&start, NULL);
+		for (size_t j=0;  j<nimages;  j+=batch) {
+			size_t n = std::min(batch, nimages - j);
+			dot_products(npixels, &images[j*npixels], n, &components[0],
+					dimension, &features[j*dimension]);
+		}
+		gettimeofday(&stop, NULL);
+		double rate = nimages / elapsed_s(start, stop);
+		sprintf(buf, "%lu %s %.0f %.2f", (unsigned long)batch, distance_isa(),
+				rate, rate / reference);
+		std::cout << buf << std::endl;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+/****************************************************************************
+ *
+ * Compares scanning quantized feature vectors with scanning floats.
+ *
+ * quantize_bench [N [DIMENSION [QUERIES [K]]]]
+ *
+ * Draws N gaussian feature vectors whose variances fall off as 1/i, like
+ * those of an eigenspace, and QUERIES more from the same distribution.
+ * Every query scans all N vectors in each encoding for its K nearest.
+ * One line is written per encoding:
+ *
+ * ENCODING ISA BYTES MS_PER_QUERY RECALL
+ *
+ * where RECALL is the fraction of the float32 K nearest also found with
+ * the encoding.
+ *
+ ****************************************************************************/
+
+#include "distance.h"
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include <sys/time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static const size_t SCAN_BLOCK = 1024;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static double
+gaussian()
+{
+	double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+	return sqrt(-2*log(u1))*cos(2*M_PI*u2);
+}
+
+static double
+elapsed_ms(timeval& start, timeval& stop)
+{
+	return (stop.tv_sec - start.tv_sec)*1000.0
+			+ (stop.tv_usec - start.tv_usec)/1000.0;
+}
+
+/* The k nearest rows to the query, in one encoding */
+static void
+scan(int encoding, size_t dimension, const float *query, size_t n,
+		const std::vector<float>& floats,
+		const std::vector<unsigned short>& halves,
+		const std::vector<unsigned char>& bytes,
+		const std::vector<float>& scale, const std::vector<float>& offset,
+		size_t k, std::vector<int>& nearest)
+{
+	Neighbors neighbors(k);
+	double dists[SCAN_BLOCK];
+	for (size_t i=0;  i<n;  i+=SCAN_BLOCK) {
+		size_t m = std::min(SCAN_BLOCK, n - i);
+		if (encoding == ENCODING_F16) {
+			vector_distances_f16(dimension, query, &halves[i*dimension], m, dists);
+		} else if (encoding == ENCODING_I8) {
+			vector_distances_i8(dimension, query, &bytes[i*dimension],
+					&scale[0], &offset[0], m, dists);
+		} else {
+			vector_distances(dimension, query, &floats[i*dimension], m, dists);
+		}
+		for (size_t j=0;  j<m;  ++j) {
+			neighbors.offer(i + j, dists[j]);
+		}
+	}
+	std::vector<Neighbors::Neighbor> sorted;
+	neighbors.sorted(sorted);
+	nearest.clear();
+	for (size_t j=0;  j<sorted.size();  ++j) {
+		nearest.push_back(sorted[j].second);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+int
+main(const int argc, const char **argv)
+{
+	size_t n = (argc > 1) ? atoi(argv[1]) : 100000;
+	size_t dimension = (argc > 2) ? atoi(argv[2]) : 100;
+	size_t nqueries = (argc > 3) ? atoi(argv[3]) : 100;
+	size_t k = (argc > 4) ? atoi(argv[4]) : 10;
+	if (n < 1 || dimension < 1 || nqueries < 1 || k < 1) {
+		std::cerr << "Usage error" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// features and queries
+	srand(1);
+	std::vector<float> variances(dimension);
+	for (size_t i=0;  i<dimension;  ++i) {
+		variances[i] = 1.0 / (i + 1);
+	}
+	std::vector<float> floats(n*dimension);
+	for (size_t j=0;  j<n;  ++j) {
+		for (size_t i=0;  i<dimension;  ++i) {
+			floats[j*dimension + i] = gaussian()*sqrt(variances[i]);
+		}
+	}
+	std::vector<float> queries(nqueries*dimension);
+	for (size_t j=0;  j<nqueries;  ++j) {
+		for (size_t i=0;  i<dimension;  ++i) {
+			queries[j*dimension + i] = gaussian()*sqrt(variances[i]);
+		}
+	}
+
+	// encode them
+	std::vector<unsigned short> halves(n*dimension);
+	for (size_t i=0;  i<n*dimension;  ++i) {
+		halves[i] = float_to_half(floats[i]);
+	}
+	std::vector<float> scale(dimension);
+	std::vector<float> offset(dimension);
+	calibrate_i8(dimension, &variances[0], &scale[0], &offset[0]);
+	std::vector<unsigned char> bytes(n*dimension);
+	for (size_t j=0;  j<n;  ++j) {
+		encode_i8(dimension, &floats[j*dimension], &scale[0], &offset[0],
+				&bytes[j*dimension]);
+	}
+
+	// the float32 answers, against which the others are scored
+	std::vector< std::vector<int> > exact(nqueries);
+	for (size_t q=0;  q<nqueries;  ++q) {
+		scan(ENCODING_F32, dimension, &queries[q*dimension], n, floats, halves,
+				bytes, scale, offset, k, exact[q]);
+	}
+
+	char buf[256];
+	for (int encoding=0;  encoding<NENCODINGS;  ++encoding) {
+		std::vector<int> nearest;
+		size_t found = 0;
+		timeval start, stop;
+		gettimeofday(&start, NULL);
+		for (size_t q=0;  q<nqueries;  ++q) {
+			scan(encoding, dimension, &queries[q*dimension], n, floats, halves,
+					bytes, scale, offset, k, nearest);
+			for (size_t j=0;  j<nearest.size();  ++j) {
+				if (std::find(exact[q].begin(), exact[q].end(), nearest[j])
+						!= exact[q].end()) {
+					++found;
+				}
+			}
+		}
+		gettimeofday(&stop, NULL);
+		sprintf(buf, "%s %s %lu %.3f %.4f", encoding_name(encoding),
+				distance_isa(), (unsigned long)(encoding_size(encoding)*n*dimension),
+				elapsed_ms(start, stop) / nqueries,
+				(double)found / (exact.size()*k));
+		std::cout << buf << std::endl;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -3,9 +3,23 @@
 # AWS_ACCESS_KEY_ID
 # AWS_SECRET_ACCESS_KEY
 #
+# unless CVDB_QUEUE=spool:DIR, which passes tasks and results through files
+# under DIR instead of SQS, as faces worker does with the same setting.
+#
+# Workers ask for work by registering and by posting each result, and the
+# master answers with a task on the asking worker's own queue (see
+# TaskMaster and GuidedSchedule).
+#
 
+import itertools
+import math
+import os
+import tempfile
 import time
 
+import simplejson as json
+
+from boto.exception import SQSError
 from boto.sqs.connection import SQSConnection
 from boto.sqs.jsonmessage import JSONMessage
 
@@ -13,52 +27,82 @@ from boto.sqs.jsonmessage import JSONMessage
 class TaskSQS:
 
     TASK_QUEUE = "tasks"
-    RESULT_QUEUE = "results" 
+    RESULT_QUEUE = "results"
     VISIBILITY_TIMEOUT = 120
-    
+    MAX_QUEUE_NAME = 80 # characters, as SQS allows
+
     def __init__(self):
         self.conn = None
         self.taskq = None
         self.resultq = None
+        self.workerqs = { }
+        self.listening = [ ]
 
     def connect(self):
         # open connection
         self.conn = SQSConnection()
-        
+
         # initialize queues
         self.taskq = self.conn.create_queue(self.TASK_QUEUE, self.VISIBILITY_TIMEOUT)
         self.taskq.set_message_class(JSONMessage)
         self.resultq = self.conn.create_queue(self.RESULT_QUEUE, self.VISIBILITY_TIMEOUT)
         self.resultq.set_message_class(JSONMessage)
-    
+        self.listening = [self.taskq]
+
     def clear(self):
         self.taskq.clear()
         self.resultq.clear()
+        # the workers registered with this master only, and a worker
+        # deletes its own queue if it stops first
+        for workerq in self.workerqs.values():
+            try:
+                self.conn.delete_queue(workerq)
+            except SQSError:
+                pass
 #        self.conn.delete_queue(self.taskq)
 #        self.conn.delete_queue(self.resultq)
         self.taskq = None
         self.resultq = None
-    
+        self.workerqs = { }
+        self.listening = [ ]
+
+    def listen(self, worker):
+        self.listening.insert(0, self.worker_queue(worker))
+
+    def worker_queue(self, worker):
+        if worker not in self.workerqs:
+            name = self.TASK_QUEUE + '-' + worker
+            if len(name) > self.MAX_QUEUE_NAME:
+                raise ValueError('worker id too long for a queue: ' + worker)
+            workerq = self.conn.create_queue(name, self.VISIBILITY_TIMEOUT)
+            workerq.set_message_class(JSONMessage)
+            self.workerqs[worker] = workerq
+        return self.workerqs[worker]
+
     def new_task(self, task):
         return JSONMessage(self.taskq, task)
-    
+
     def new_result(self, result):
         return JSONMessage(self.resultq, result)
 
-    def put_task(self, task):
-        self.taskq.write(task)
-        
+    def put_task(self, task, worker=None):
+        if worker is None:
+            self.taskq.write(task)
+        else:
+            self.worker_queue(worker).write(task)
+
     def next_task(self):
-        next = None
-        while next is None:
-            next = self.taskq.read()
-        return next
-    
+        while True:
+            for queue in self.listening:
+                next = queue.read()
+                if next is not None:
+                    return next
+
     def complete(self, task, result=None):
-        self.taskq.delete_message(task)
+        task.queue.delete_message(task)
         if result is not None:
             self.put_result(result)
-    
+
     def put_result(self, result):
         self.resultq.write(result)
 
@@ -67,54 +111,443 @@ class TaskSQS:
         if result is not None:
             self.resultq.delete_message(result)
         return result
-    
+
+
+class TaskMessage(dict):
+    """A task or result of a TaskSpool, read like a JSONMessage"""
+
+    def __init__(self, body, handle=None):
+        dict.__init__(self, body)
+        self.handle = handle
+
+    def get_body(self):
+        return dict(self)
+
+
+class TaskSpool:
+    """The queues of TaskSQS as files under a directory, laid out as
+    SpoolTaskQueue in store.h lays them out"""
+
+    TASKS_DIR, TAKEN_DIR, RESULTS_DIR = 'tasks', 'taken', 'results'
+    VISIBILITY_TIMEOUT = 120
+    POLL = 0.1 # seconds
+
+    # of the puts of this process, whichever spool or thread they are from
+    SEQUENCE = itertools.count()
+
+    def __init__(self, dir):
+        self.dir = dir
+        self.suffixes = [ '' ]
+
+    def connect(self):
+        for subdir in (self.TASKS_DIR, self.TAKEN_DIR, self.RESULTS_DIR):
+            self._make_dir(subdir)
+
+    def clear(self):
+        for subdir in self._names(''):
+            if subdir.split('-')[0] in (self.TASKS_DIR, self.TAKEN_DIR, self.RESULTS_DIR):
+                for name in self._names(subdir):
+                    self._unlink(os.path.join(self.dir, subdir, name))
+                # and each worker's own dirs, as TaskSQS deletes its queue
+                if '-' in subdir:
+                    try:
+                        os.rmdir(os.path.join(self.dir, subdir))
+                    except OSError:
+                        pass
+
+    def listen(self, worker):
+        for subdir in (self.TASKS_DIR, self.TAKEN_DIR):
+            self._make_dir(subdir + '-' + worker)
+        self.suffixes.insert(0, '-' + worker)
+
+    def new_task(self, task):
+        return TaskMessage(task)
+
+    def new_result(self, result):
+        return TaskMessage(result)
+
+    def put_task(self, task, worker=None):
+        if worker is None:
+            self._put(self.TASKS_DIR, task)
+        else:
+            self._make_dir(self.TASKS_DIR + '-' + worker)
+            self._put(self.TASKS_DIR + '-' + worker, task)
+
+    def next_task(self):
+        while True:
+            self._requeue_expired()
+            for suffix in self.suffixes:
+                tasks = self.TASKS_DIR + suffix
+                for name in self._names(tasks):
+                    # whoever renames it first has taken it
+                    handle = os.path.join(self.TAKEN_DIR + suffix,
+                                          '%s@%016d' % (name, self._now_us()))
+                    taken = os.path.join(self.dir, handle)
+                    try:
+                        os.rename(os.path.join(self.dir, tasks, name), taken)
+                    except OSError:
+                        continue
+                    body = self._read(taken)
+                    if body is not None:
+                        return TaskMessage(body, handle)
+            time.sleep(self.POLL)
+
+    def complete(self, task, result=None):
+        if result is not None:
+            self.put_result(result)
+        self._unlink(os.path.join(self.dir, task.handle))
+
+    def put_result(self, result):
+        self._put(self.RESULTS_DIR, result)
+
+    def get_result(self):
+        for name in self._names(self.RESULTS_DIR):
+            path = os.path.join(self.dir, self.RESULTS_DIR, name)
+            body = self._read(path)
+            self._unlink(path)
+            if body is not None:
+                return TaskMessage(body)
+        return None
+
+    def _put(self, subdir, message):
+        name = '%016d-%d-%d' % (self._now_us(), os.getpid(), next(self.SEQUENCE))
+        # written aside, so readers never see part of it
+        fd, tmppath = tempfile.mkstemp(prefix='.', dir=os.path.join(self.dir, subdir))
+        f = os.fdopen(fd, 'w')
+        f.write(json.dumps(dict(message)))
+        f.close()
+        os.rename(tmppath, os.path.join(self.dir, subdir, name))
+
+    def _requeue_expired(self):
+        expired = self._now_us() - int(self.VISIBILITY_TIMEOUT*1000000)
+        for suffix in self.suffixes:
+            for handle in self._names(self.TAKEN_DIR + suffix):
+                name, _, taken = handle.rpartition('@')
+                if not name or int(taken) > expired:
+                    continue
+                try:
+                    os.rename(os.path.join(self.dir, self.TAKEN_DIR + suffix, handle),
+                              os.path.join(self.dir, self.TASKS_DIR + suffix, name))
+                except OSError:
+                    pass
+
+    def _make_dir(self, subdir):
+        path = os.path.join(self.dir, subdir)
+        try:
+            os.makedirs(path)
+        except OSError:
+            # or another process made it first
+            if not os.path.isdir(path):
+                raise
+
+    def _names(self, subdir):
+        try:
+            names = os.listdir(os.path.join(self.dir, subdir))
+        except OSError:
+            return [ ]
+        return sorted(name for name in names if not name.startswith('.'))
+
+    def _read(self, path):
+        try:
+            with open(path) as f:
+                return json.loads(f.read())
+        except (IOError, ValueError):
+            return None
+
+    def _unlink(self, path):
+        try:
+            os.unlink(path)
+        except OSError:
+            pass
+
+    def _now_us(self):
+        return int(time.time()*1000000)
+
+
+def task_queue():
+    """The queues named by CVDB_QUEUE: 'sqs' (the default) or 'spool:DIR'"""
+    spec = os.environ.get('CVDB_QUEUE', 'sqs')
+    if spec == 'sqs':
+        return TaskSQS()
+    elif spec.startswith('spool:'):
+        return TaskSpool(spec[len('spool:'):])
+    raise ValueError('unknown queue ' + spec)
+
+
+class GuidedSchedule:
+    """Deals out the range START..STOP to workers as they ask for work.
+
+    A worker without work is allotted the next part of the range, its
+    share of what is left by the rates seen so far, as in guided
+    self-scheduling weighted by speed. It is handed its allotment in
+    pieces of what it should run in 1/FACTOR of the time the whole job
+    has left, or a grain until its rate is known, so pieces shrink as the
+    job nears its end. Once the range is all allotted, a worker without
+    work steals the unstarted back of the allotment expected to finish
+    last, as much of it as lets both finish together. Without guided,
+    every allotment and piece is one grain and nothing is stolen, which is
+    how the master used to deal out chunks.
+
+    With a UNIT, such as the shard size of a learn, grains are whole units
+    and every allotment, piece and steal ends on a multiple of the unit
+    (or at STOP), so that pieces cover whole shards, which CVDB::learn
+    writes whole, rather than leaving ends it writes an image at a time."""
+
+    FACTOR = 2
+
+    def __init__(self, start, stop, grain, nworkers, guided=True, unit=1):
+        self.start, self.stop = start, stop     # not yet allotted
+        self.unit = max(1, unit)
+        self.grain = self._align(max(1, grain))
+        self.nworkers = max(1, nworkers)
+        self.guided = guided
+        self.allotted = { }     # worker: [start, stop] not yet handed out
+        self.running = { }      # worker: [images of each piece handed out]
+        self.since = { }        # worker: time it started its first piece
+        self.rates = { }        # worker: images per second, smoothed
+        self.steals = 0
+
+    def remaining(self):
+        """Images not yet handed out"""
+        remaining = max(0, self.stop - self.start + 1)
+        for allotted in self.allotted.values():
+            remaining += allotted[1] - allotted[0] + 1
+        return remaining
+
+    def next(self, worker):
+        """The next piece [start, stop] for a worker, or None if there is
+        none worth giving it now"""
+        allotted = self.allotted.get(worker)
+        if allotted is None:
+            allotted = self._allot(worker)
+            if allotted is None:
+                return None
+            self.allotted[worker] = allotted
+        size = self.grain
+        if self.guided and worker in self.rates:
+            rate = self.rates[worker]
+            left = float(self.remaining()) / self._total_rate()
+            size = max(size, int(math.ceil(rate * left / self.FACTOR)))
+        piece = [allotted[0], min(self._align(allotted[0] + size - 1), allotted[1])]
+        if (self.guided and worker in self.rates and self.running.get(worker)
+                and self._busy(worker) + (piece[1] - piece[0] + 1) / rate > left):
+            # it would finish after the rest, who can steal the piece instead
+            return None
+        allotted[0] = piece[1] + 1
+        if allotted[0] > allotted[1]:
+            del self.allotted[worker]
+        if not self.running.get(worker):
+            self.running[worker] = [ ]
+            self.since[worker] = time.time()
+        self.running[worker].append(piece[1] - piece[0] + 1)
+        return piece
+
+    def finished(self, worker, piece):
+        """Records that a worker ran a piece it was handed, its pieces
+        running in the order they were handed out"""
+        now = time.time()
+        images = piece[1] - piece[0] + 1
+        if self.running.get(worker):
+            self.running[worker].pop(0)
+        rate = images / max(now - self.since.get(worker, now), 1e-6)
+        if worker in self.rates:
+            rate = (self.rates[worker] + rate) / 2
+        self.rates[worker] = rate
+        self.since[worker] = now
+
+    def expected(self, piece):
+        """Seconds a piece is expected to take, at the average rate"""
+        return (piece[1] - piece[0] + 1) / self._rate(None)
+
+    def _allot(self, worker):
+        if self.start <= self.stop:
+            size = self.grain
+            if self.guided:
+                left = self.stop - self.start + 1
+                share = self._rate(worker) / self._total_rate()
+                size = max(size, int(math.ceil(left * share)))
+            allotted = [self.start, min(self._align(self.start + size - 1), self.stop)]
+            self.start = allotted[1] + 1
+            return allotted
+        if self.guided:
+            return self._steal(worker)
+        return None
+
+    def _steal(self, thief):
+        # the victim is whoever is expected to finish last
+        victim, finish = None, 0.0
+        for worker in self.allotted:
+            if worker != thief and self._finish(worker) > finish:
+                victim, finish = worker, self._finish(worker)
+        if victim is None:
+            return None
+        allotted = self.allotted[victim]
+        images = allotted[1] - allotted[0] + 1
+        rate, victimrate = self._rate(thief), self._rate(victim)
+        stolen = int(math.ceil(images * rate / (rate + victimrate)))
+        # the victim keeps whole units, whichever number is nearest
+        cut = allotted[1] - stolen
+        down = max(cut // self.unit * self.unit, allotted[0] - 1)
+        up = self._align(cut)
+        stolen = allotted[1] - (down if cut - down < up - cut else up)
+        if stolen <= 0 or self._finish(thief) + stolen / rate >= finish:
+            # the victim gets there first anyway
+            return None
+        allotted[1] -= stolen
+        if allotted[0] > allotted[1]:
+            del self.allotted[victim]
+        self.steals += 1
+        return [allotted[1] + 1, allotted[1] + stolen]
+
+    def _align(self, end):
+        """The least multiple of the unit from end on"""
+        return -(-end // self.unit) * self.unit
+
+    def _finish(self, worker):
+        """Seconds until a worker is expected to be done with what it has
+        been handed and allotted. One whose piece runs longer than
+        expected is taken to be as slow as it has been on it, so a worker
+        that dies is soon robbed of all it was allotted."""
+        busy, rate = self._busy(worker), self._rate(worker)
+        running = self.running.get(worker)
+        if running:
+            elapsed = time.time() - self.since[worker]
+            if elapsed * rate > running[0]:
+                rate = running[0] / elapsed
+        allotted = self.allotted.get(worker)
+        if allotted is not None:
+            busy += (allotted[1] - allotted[0] + 1) / rate
+        return busy
+
+    def _busy(self, worker):
+        """Seconds until a worker is expected to be done with the pieces
+        it has been handed, as _finish takes it"""
+        rate = self._rate(worker)
+        running = self.running.get(worker)
+        if not running:
+            return 0.0
+        elapsed = time.time() - self.since[worker]
+        if elapsed * rate > running[0]:
+            return sum(running[1:]) * elapsed / running[0]
+        return sum(running) / rate - elapsed
+
+    def _rate(self, worker):
+        # until a worker has finished a piece, it is taken to be average
+        if worker in self.rates:
+            return self.rates[worker]
+        if self.rates:
+            return sum(self.rates.values()) / len(self.rates)
+        return 1.0
+
+    def _total_rate(self):
+        known = sum(self.rates.values())
+        return known + self._rate(None) * max(0, self.nworkers - len(self.rates))
+
 
 class TaskMaster:
-    
-    RESCHEDULE = 300.0 # seconds
 
-    def __init__(self):
-        self.sqs = TaskSQS()
+    # tasks a worker is given ahead, so it never waits on the master
+    DEPTH = 2
+
+    # a task is given to an idle worker as well once it has run this many
+    # times longer than expected, and at least MIN_RESCHEDULE seconds
+    RESCHEDULE = 4.0
+    MIN_RESCHEDULE = 10.0 # seconds
+
+    IDLE_POLL = 1.0 # seconds between offers of work to idle workers
+
+    def __init__(self, schedule, make_task):
+        self.sqs = task_queue()
+        self.schedule = schedule
+        self.make_task = make_task      # (taskid, chunk) -> task
         self.tasks = { }
         self.results = { }
         self.incomplete = set()
-        self.reschedule_time = None
-
-    def new_task(self, task):
-        return self.sqs.new_task(task)
+        self.owners = { }       # taskid: worker the schedule gave it to
+        self.running = { }      # taskid: { worker: time given }
+        self.given = { }        # worker: tasks given and not yet done
+        self.idle_time = 0.0
 
-    def start(self, tasks):
+    def start(self):
         self.sqs.connect()
-        for task in tasks:
-            self.tasks[task['id']] = task
-            self.incomplete.add(task['id'])
-            self.results[task['id']] = None
-    
-    def poll(self):
-        return self.sqs.get_result()
 
     def next(self):
+        """The next registration or task result, or None. Duplicate
+        results of a task that was run twice are None."""
         result = self.sqs.get_result()
-        if result is not None and result['tag'] == 'task':
-            if result['id'] in self.incomplete:
-                self.results[result['id']] = result
-                self.incomplete.remove(result['id'])
+        if result is not None and result['tag'] == 'reg':
+            self.given.setdefault(result['id'], 0)
+            self.fill(result['id'])
+        elif result is not None and result['tag'] == 'task':
+            worker = result.get('worker')
+            taskid = result['id']
+            if worker in self.given:
+                self.given[worker] -= 1
+            if worker is not None and worker == self.owners.get(taskid):
+                self.schedule.finished(worker, self.tasks[taskid]['chunk'])
+            if taskid in self.incomplete:
+                self.results[taskid] = result
+                self.incomplete.remove(taskid)
+                self.running.pop(taskid, None)
             else:
                 result = None
-        
-        if self.reschedule_time is None or time.time() >= self.reschedule_time:
-            self.schedule()
-        
+            if worker in self.given:
+                self.fill(worker)
+
+        if time.time() >= self.idle_time:
+            for worker in self.given:
+                self.fill(worker)
+            self.idle_time = time.time() + self.IDLE_POLL
+
         return result
-    
+
     def done(self):
-        return len(self.incomplete) == 0
-    
-    def schedule(self):
+        return self.schedule.remaining() == 0 and len(self.incomplete) == 0
+
+    def fill(self, worker):
+        """Gives a worker tasks until it has DEPTH of them, or there are
+        none for it"""
+        while self.given[worker] < self.DEPTH and self.give(worker):
+            pass
+
+    def give(self, worker):
+        """Puts the next task for a worker on its queue, returns False if
+        there is none"""
+        chunk = self.schedule.next(worker)
+        if chunk is not None:
+            taskid = len(self.tasks)
+            self.tasks[taskid] = self.make_task(taskid, chunk)
+            self.incomplete.add(taskid)
+            self.owners[taskid] = worker
+            self.results[taskid] = None
+        elif self.given[worker] == 0:
+            taskid = self.overdue(worker)
+        else:
+            taskid = None
+        if taskid is None:
+            return False
+        self.given[worker] += 1
+        self.running.setdefault(taskid, { })[worker] = time.time()
+        self.sqs.put_task(self.sqs.new_task(self.tasks[taskid]), worker)
+        return True
+
+    def overdue(self, worker):
+        """The task given longest ago among those overdue, and not given
+        to this worker, or None"""
+        now = time.time()
+        oldest = None
         for taskid in self.incomplete:
-            self.sqs.put_task(self.tasks[taskid])
-        self.reschedule_time = time.time() + self.RESCHEDULE
-    
+            given = self.running.get(taskid, { })
+            if not given or worker in given:
+                continue
+            expected = self.schedule.expected(self.tasks[taskid]['chunk'])
+            first = min(given.values())
+            if now - first < max(self.RESCHEDULE * expected, self.MIN_RESCHEDULE):
+                continue
+            if oldest is None or first < oldest[0]:
+                oldest = (first, taskid)
+        return oldest[1] if oldest is not None else None
+
     def stop(self):
         self.sqs.clear()
 
@@ -122,20 +555,21 @@ class TaskMaster:
 class TaskWorker:
 
     def __init__(self):
-        self.sqs = TaskSQS()
+        self.sqs = task_queue()
 
     def new_result(self, result):
         return self.sqs.new_result(result)
-    
-    def start(self):
+
+    def start(self, workerid):
         self.sqs.connect()
-    
+        self.sqs.listen(workerid)
+
     def next(self):
         return self.sqs.next_task()
-    
+
     def complete(self, task, result=None):
         self.sqs.complete(task, result)
 
     def put_result(self, result):
         self.sqs.put_result(result)
-        
+
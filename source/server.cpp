@@ -0,0 +1,210 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "server.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* refuse frames larger than this */
+static const size_t MAX_FRAME = 64*1024*1024;
+
+static const int BACKLOG = 16;
+
+/* seconds a frame may take to arrive or leave once it is started, so that
+ * a stalled client cannot hold up the others for long */
+static const int FRAME_TIMEOUT = 10;
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+FrameHandler::FrameHandler() { }
+
+FrameHandler::~FrameHandler() { }
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool
+read_all(int fd, char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool
+socket_address(const std::string& path, sockaddr_un& addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		return false;
+	}
+	strcpy(addr.sun_path, path.c_str());
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+bool
+write_frame(int fd, const std::string& payload)
+{
+	uint32_t len = htonl((uint32_t)payload.size());
+	return write_all(fd, (const char*)&len, sizeof(len))
+			&& write_all(fd, payload.data(), payload.size());
+}
+
+bool
+read_frame(int fd, std::string& payload)
+{
+	uint32_t len;
+	if (!read_all(fd, (char*)&len, sizeof(len))) {
+		return false;
+	}
+	len = ntohl(len);
+	if (len > MAX_FRAME) {
+		return false;
+	}
+	payload.resize(len);
+	return len == 0 || read_all(fd, &payload[0], len);
+}
+
+int
+serve_frames(const std::string& path, FrameHandler *handler)
+{
+	sockaddr_un addr;
+	if (!socket_address(path, addr)) {
+		std::cerr << "Socket path too long: " << path << std::endl;
+		return EXIT_FAILURE;
+	}
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	unlink(path.c_str());
+	if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0
+			|| listen(sock, BACKLOG) < 0) {
+		perror("bind");
+		close(sock);
+		return EXIT_FAILURE;
+	}
+
+	// connections are polled together, so that one left open and idle
+	// holds up no other, and their requests are answered one at a time
+	std::vector<pollfd> fds(1);
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+	bool running = true;
+	while (running) {
+		if (poll(&fds[0], fds.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+		for (size_t i=fds.size() - 1;  i>0 && running;  --i) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			std::string request, response;
+			bool open = (fds[i].revents & POLLIN) && read_frame(fds[i].fd, request);
+			if (open) {
+				running = handler->handle(request, response);
+				open = write_frame(fds[i].fd, response);
+			}
+			if (!open) {
+				close(fds[i].fd);
+				fds.erase(fds.begin() + i);
+			}
+		}
+		if (running && (fds[0].revents & POLLIN)) {
+			int fd = accept(sock, NULL, NULL);
+			if (fd < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				perror("accept");
+				break;
+			}
+			timeval timeout = { FRAME_TIMEOUT, 0 };
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+			pollfd conn = { fd, POLLIN, 0 };
+			fds.push_back(conn);
+		}
+	}
+	for (size_t i=1;  i<fds.size();  ++i) {
+		close(fds[i].fd);
+	}
+
+	close(sock);
+	unlink(path.c_str());
+	return running ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+bool
+request_frame(const std::string& path, const std::string& request,
+		std::string& response)
+{
+	sockaddr_un addr;
+	if (!socket_address(path, addr)) {
+		return false;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return false;
+	}
+	bool ok = connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0
+			&& write_frame(fd, request)
+			&& read_frame(fd, response);
+	close(fd);
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,55 @@
+/****************************************************************************
+ *
+ * A minimal request/response server over a local (unix domain) socket.
+ *
+ * Every message is a frame: a 4 byte big-endian payload length followed
+ * by the payload. A client sends one request frame and reads one response
+ * frame, and may reuse the connection for further requests. Connections
+ * are served together, one request at a time, and one whose frame stalls
+ * part way for more than a few seconds is closed.
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_SERVER_H
+#define CLOUDVISION_SERVER_H
+
+
+#include <string>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+class FrameHandler
+{
+public:
+	virtual ~FrameHandler();
+
+	/* Answers one request, returns false to stop the server */
+	virtual bool handle(const std::string& request, std::string& response) = 0;
+protected:
+	FrameHandler();
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Serves requests on a socket at path until a handler stops it */
+int
+serve_frames(const std::string& path, FrameHandler *handler);
+
+/* Sends one request to the server at path and waits for its response */
+bool
+request_frame(const std::string& path, const std::string& request,
+		std::string& response);
+
+bool
+write_frame(int fd, const std::string& payload);
+
+bool
+read_frame(int fd, std::string& payload);
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_SERVER_H
@@ -0,0 +1,144 @@
+#
+# Usage:
+#
+# simulate NWORKERS NCHUNKS START STOP [--speeds S,...] [--cost SECONDS]
+#          [--overhead SECONDS] [--shard SIZE] [--static 1] [--check 1]
+#
+# Measures how the master deals out a range, with simulated workers and a
+# spool queue (see scheduler.TaskSpool) in a temporary directory instead
+# of faces workers and SQS. A worker of speed S takes OVERHEAD seconds per
+# task plus COST/S seconds per image (0 and 0.01 by default), and the
+# SPEEDS given are cycled over the workers, so --speeds 0.25,1,1,1 makes
+# every fourth worker four times slower than the rest. Prints how long
+# the range took against the ideal, the tasks, the steals and how many
+# images each worker ran. With --shard SIZE tasks are whole shards, as
+# for a sharded learn, and the tasks that cut a shard are counted as
+# unaligned. With --static 1 the master deals out NCHUNKS equal chunks
+# and nothing is stolen, as it used to. With --check 1 the range is dealt
+# out both ways, and the exit status is 1 if guided is the slower, as a
+# check that
+#
+# simulate 4 64 1 800 --speeds 0.25,1,1,1 --cost 0.005 --overhead 0.05 --check 1
+#
+# still gains from stealing when one worker in four is four times slower.
+#
+
+
+import cvdb
+import scheduler
+
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import time
+
+#############################################################################
+#############################################################################
+
+def simulate(argv):
+    if int(cvdb.get_option(argv, 'check', 0)) == 0:
+        run(argv, int(cvdb.get_option(argv, 'static', 0)) != 0)
+        return
+
+    guided = run(argv, False)
+    static = run(argv, True)
+    if guided > static:
+        print "Guided is slower than static: %.3f > %.3f" % (guided, static)
+        sys.exit(1)
+
+
+def run(argv, static):
+    """Deals out the range once, prints how it went and returns the seconds
+    it took"""
+    args = cvdb.positional_args(argv)
+    nworkers = int(args[0])
+    nchunks = int(args[1])
+    partition = (int(args[2]), int(args[3]))
+    speeds = [float(s) for s in cvdb.get_option(argv, 'speeds', '1').split(',')]
+    cost = float(cvdb.get_option(argv, 'cost', 0.01))
+    overhead = float(cvdb.get_option(argv, 'overhead', 0))
+    shard = int(cvdb.get_option(argv, 'shard', 1))
+
+    spool = tempfile.mkdtemp(prefix='cvdb-simulate-')
+    os.environ['CVDB_QUEUE'] = 'spool:' + spool
+
+    grain = (partition[1] - partition[0] + nchunks) // nchunks
+    schedule = scheduler.GuidedSchedule(partition[0], partition[1], grain,
+                                        nworkers, guided=not static, unit=shard)
+
+    def make_task(taskid, chunk):
+        return { 'id' : taskid,
+                 'tag' : cvdb.TASK_TAG,
+                 'command' : 'simulate',
+                 'command_args' : [ ],
+                 'chunk' : chunk }
+
+    master = scheduler.TaskMaster(schedule, make_task)
+    master.start()
+
+    images = { }
+    for i in range(nworkers):
+        workerid = 'sim-%d' % i
+        speed = speeds[i % len(speeds)]
+        images[workerid] = 0
+        worker = threading.Thread(target=simulated_worker,
+                                  args=(workerid, speed, cost, overhead, images))
+        worker.daemon = True
+        worker.start()
+
+    start = time.time()
+    while not master.done():
+        if master.next() is None:
+            time.sleep(0.001)
+    elapsed = time.time() - start
+    master.stop()
+    shutil.rmtree(spool, True)
+
+    # no schedule beats every worker running flat out to the end
+    total = partition[1] - partition[0] + 1
+    ideal = total * cost / sum(speeds[i % len(speeds)] for i in range(nworkers))
+    print "Elapsed: %.3f" % elapsed
+    print "Ideal: %.3f" % ideal
+    # a shard is cut where a task other than the last ends inside it
+    unaligned = [t for t in master.tasks.values()
+                 if t['chunk'][1] % shard != 0 and t['chunk'][1] != partition[1]]
+    print "Tasks: %d" % len(master.tasks)
+    print "Unaligned: %d" % len(unaligned)
+    print "Steals: %d" % schedule.steals
+    for i in range(nworkers):
+        workerid = 'sim-%d' % i
+        print "Worker: %s %.2f %d" % (workerid, speeds[i % len(speeds)], images[workerid])
+    return elapsed
+
+
+def simulated_worker(workerid, speed, cost, overhead, images):
+    worker = scheduler.TaskWorker()
+    worker.start(workerid)
+
+    # register
+    msg = worker.new_result({ 'tag' : cvdb.REGISTER_TAG, 'id' : workerid })
+    worker.put_result(msg)
+
+    # run each task by sleeping as long as its images would take
+    while True:
+        task = worker.next()
+        chunk = task['chunk']
+        time.sleep(overhead + (chunk[1] - chunk[0] + 1) * cost / speed)
+        images[workerid] += chunk[1] - chunk[0] + 1
+        result = { }
+        result.update(task.get_body())
+        result['worker'] = workerid
+        result['output'] = ''
+        result['status'] = 0
+        worker.complete(task, worker.new_result(result))
+
+#############################################################################
+#############################################################################
+
+if __name__ == "__main__":
+    simulate(sys.argv[1:])
+
+#############################################################################
+#############################################################################
@@ -0,0 +1,845 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "store.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static const char *OBJECTS_DIR = "objects";
+static const char *METADATA_DIR = "metadata";
+
+static const char *TASKS_DIR = "tasks";
+static const char *TAKEN_DIR = "taken";
+static const char *RESULTS_DIR = "results";
+
+/* spooled files are NAME, and taken tasks NAME@TIME, where NAME is the
+ * time put, the process and a count, and times are in microseconds */
+static const char *SPOOL_FORMAT = "%016lld-%d-%lu";
+static const char *TAKEN_FORMAT = "%s@%016lld";
+static const char TAKEN_SEPARATOR = '@';
+
+/* seconds between looks for a task */
+static const double SPOOL_POLL = 0.1;
+
+/* escaped names never start with a dot, so these never collide */
+static const char *TEMP_PREFIX = ".tmp.";
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Escapes the characters a file name (or, unless filename, a line of
+ * "NAME\tVALUE") may not hold as %XX */
+static std::string
+escape(const std::string& s, bool filename)
+{
+	static const char *HEX = "0123456789ABCDEF";
+	std::string escaped;
+	escaped.reserve(s.size());
+	for (size_t i=0;  i<s.size();  ++i) {
+		unsigned char c = s[i];
+		bool plain;
+		if (filename) {
+			plain = isalnum(c) || c == '-' || c == '_' || (c == '.' && i > 0);
+		} else {
+			plain = c != '%' && c != '\t' && c != '\n' && c != '\r';
+		}
+		if (plain) {
+			escaped += c;
+		} else {
+			escaped += '%';
+			escaped += HEX[c >> 4];
+			escaped += HEX[c & 0xf];
+		}
+	}
+	return escaped;
+}
+
+static std::string
+unescape(const std::string& s)
+{
+	std::string unescaped;
+	unescaped.reserve(s.size());
+	for (size_t i=0;  i<s.size();  ++i) {
+		if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i+1])
+				&& isxdigit(s[i+2])) {
+			char hex[3] = { s[i+1], s[i+2], '\0' };
+			unescaped += (char)strtol(hex, NULL, 16);
+			i += 2;
+		} else {
+			unescaped += s[i];
+		}
+	}
+	return unescaped;
+}
+
+/* Creates every missing directory on the way to path */
+static bool
+make_dirs(const std::string& path)
+{
+	for (size_t i=1;  i<=path.size();  ++i) {
+		if (i == path.size() || path[i] == '/') {
+			std::string dir(path, 0, i);
+			if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool
+read_file(const std::string& path, std::string& data)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
+	}
+	data.resize(st.st_size);
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t n = read(fd, &data[done], data.size() - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	close(fd);
+	return done == data.size();
+}
+
+/* Writes a file whole, through a temporary file in its directory, so
+ * readers never see part of it */
+static bool
+write_file(const std::string& path, const std::string& data)
+{
+	size_t slash = path.rfind('/');
+	std::string tmppath(path, 0, slash + 1);
+	if (!make_dirs(tmppath.substr(0, slash))) {
+		return false;
+	}
+	tmppath += TEMP_PREFIX;
+	tmppath += "XXXXXX";
+	std::vector<char> tmpname(tmppath.begin(), tmppath.end());
+	tmpname.push_back('\0');
+	int fd = mkstemp(&tmpname[0]);
+	if (fd < 0) {
+		return false;
+	}
+	const char *buf = data.data();
+	size_t len = data.size();
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		buf += n;
+		len -= n;
+	}
+	close(fd);
+	if (len > 0 || rename(&tmpname[0], path.c_str()) < 0) {
+		unlink(&tmpname[0]);
+		return false;
+	}
+	return true;
+}
+
+static size_t
+attributes_size(const Attributes& attrs)
+{
+	size_t size = 0;
+	for (size_t i=0;  i<attrs.size();  ++i) {
+		size += attrs[i].first.size() + attrs[i].second.size();
+	}
+	return size;
+}
+
+static size_t
+items_size(const Items& items, size_t from)
+{
+	size_t size = 0;
+	for (size_t i=from;  i<items.size();  ++i) {
+		size += items[i].first.size() + attributes_size(items[i].second);
+	}
+	return size;
+}
+
+/* Sets attrs over those of an item, replacing values of the same name */
+static void
+merge_attributes(std::map<std::string, std::string>& item, const Attributes& attrs)
+{
+	for (size_t i=0;  i<attrs.size();  ++i) {
+		item[attrs[i].first] = attrs[i].second;
+	}
+}
+
+static void
+sleep_ms(double ms)
+{
+	timespec delay;
+	delay.tv_sec = (time_t)(ms/1000);
+	delay.tv_nsec = (long)((ms - delay.tv_sec*1000.0)*1000000);
+	while (nanosleep(&delay, &delay) < 0 && errno == EINTR);
+}
+
+static void
+throttle(double latency, double bandwidth, size_t bytes)
+{
+	double ms = latency;
+	if (bandwidth > 0) {
+		ms += bytes/(bandwidth*1000.0);
+	}
+	if (ms <= 0) {
+		return;
+	}
+	sleep_ms(ms);
+}
+
+static long long
+now_us()
+{
+	timeval t;
+	gettimeofday(&t, NULL);
+	return (long long)t.tv_sec*1000000 + t.tv_usec;
+}
+
+/* The files of a directory, in order, leaving out temporary ones */
+static void
+list_files(const std::string& path, std::vector<std::string>& names)
+{
+	names.clear();
+	DIR *d = opendir(path.c_str());
+	if (d == NULL) {
+		return;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] != '.') {
+			names.push_back(ent->d_name);
+		}
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+ObjectStore::~ObjectStore()
+{
+}
+
+char *
+ObjectStore::get_buffer(const std::string& bucket, const std::string& key,
+		void *(*alloc)(size_t), size_t& size)
+{
+	std::string data;
+	get(bucket, key, data);
+	size = data.size();
+	char *buffer = (char*)alloc(std::max(size, (size_t)1));
+	memcpy(buffer, data.data(), size);
+	return buffer;
+}
+
+MetadataStore::~MetadataStore()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+LocalObjectStore::LocalObjectStore(const std::string& dir)
+  : dir(dir)
+{
+}
+
+void
+LocalObjectStore::get(const std::string& bucket, const std::string& key,
+		std::string& data)
+{
+	std::string path;
+	object_path(bucket, key, path);
+	if (!read_file(path, data)) {
+		throw ObjectNotFound(bucket, key);
+	}
+}
+
+void
+LocalObjectStore::put(const std::string& bucket, const std::string& key,
+		const std::string& data)
+{
+	std::string path;
+	object_path(bucket, key, path);
+	if (!write_file(path, data)) {
+		throw std::runtime_error("could not write " + path);
+	}
+}
+
+void
+LocalObjectStore::del(const std::string& bucket, const std::string& key)
+{
+	std::string path;
+	object_path(bucket, key, path);
+	unlink(path.c_str());
+}
+
+/* Every part of the key between slashes is a directory, or the file */
+void
+LocalObjectStore::object_path(const std::string& bucket, const std::string& key,
+		std::string& path) const
+{
+	path.assign(dir);
+	path += "/";
+	path += OBJECTS_DIR;
+	path += "/";
+	path += escape(bucket, true);
+	size_t start = 0;
+	while (start <= key.size()) {
+		size_t end = key.find('/', start);
+		if (end == std::string::npos) {
+			end = key.size();
+		}
+		path += "/";
+		path += escape(key.substr(start, end - start), true);
+		start = end + 1;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+LocalMetadataStore::LocalMetadataStore(const std::string& dir)
+  : dir(dir)
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+LocalMetadataStore::~LocalMetadataStore()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void
+LocalMetadataStore::create_domain(const std::string& domain)
+{
+	std::string path(domain_path(domain));
+	if (!make_dirs(path)) {
+		throw std::runtime_error("could not create " + path);
+	}
+}
+
+void
+LocalMetadataStore::put_attributes(const std::string& domain,
+		const std::string& item, const Attributes& attrs)
+{
+	pthread_mutex_lock(&mutex);
+	Attributes old;
+	read_item(domain, item, old);
+	std::map<std::string, std::string> merged(old.begin(), old.end());
+	merge_attributes(merged, attrs);
+	std::string data;
+	std::map<std::string, std::string>::iterator it;
+	for (it=merged.begin();  it!=merged.end();  ++it) {
+		data += escape(it->first, false);
+		data += '\t';
+		data += escape(it->second, false);
+		data += '\n';
+	}
+	std::string path(domain_path(domain) + "/" + escape(item, true));
+	bool written = write_file(path, data);
+	pthread_mutex_unlock(&mutex);
+	if (!written) {
+		throw std::runtime_error("could not write " + path);
+	}
+}
+
+void
+LocalMetadataStore::get_attributes(const std::string& domain,
+		const std::string& item, Attributes& attrs)
+{
+	attrs.clear();
+	read_item(domain, item, attrs);
+}
+
+bool
+LocalMetadataStore::select_between(const std::string& domain,
+		const std::string& first, const std::string& last, Items& items)
+{
+	DIR *d = opendir(domain_path(domain).c_str());
+	if (d == NULL) {
+		return true;
+	}
+	std::vector<std::string> names;
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		std::string name(unescape(ent->d_name));
+		if (name >= first && name <= last) {
+			names.push_back(name);
+		}
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+	return select_in(domain, names, items);
+}
+
+bool
+LocalMetadataStore::select_in(const std::string& domain,
+		const std::vector<std::string>& names, Items& items)
+{
+	for (size_t i=0;  i<names.size();  ++i) {
+		Attributes attrs;
+		if (read_item(domain, names[i], attrs)) {
+			items.push_back(std::make_pair(names[i], attrs));
+		}
+	}
+	return true;
+}
+
+std::string
+LocalMetadataStore::domain_path(const std::string& domain) const
+{
+	return dir + "/" + METADATA_DIR + "/" + escape(domain, true);
+}
+
+bool
+LocalMetadataStore::read_item(const std::string& domain,
+		const std::string& item, Attributes& attrs) const
+{
+	std::string data;
+	if (!read_file(domain_path(domain) + "/" + escape(item, true), data)) {
+		return false;
+	}
+	size_t start = 0;
+	while (start < data.size()) {
+		size_t end = data.find('\n', start);
+		if (end == std::string::npos) {
+			end = data.size();
+		}
+		size_t tab = data.find('\t', start);
+		if (tab < end) {
+			attrs.push_back(std::make_pair(
+					unescape(data.substr(start, tab - start)),
+					unescape(data.substr(tab + 1, end - tab - 1))));
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+MemoryObjectStore::MemoryObjectStore()
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+MemoryObjectStore::~MemoryObjectStore()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void
+MemoryObjectStore::get(const std::string& bucket, const std::string& key,
+		std::string& data)
+{
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, std::string>::const_iterator it
+			= objects.find(bucket + "/" + key);
+	bool found = it != objects.end();
+	if (found) {
+		data = it->second;
+	}
+	pthread_mutex_unlock(&mutex);
+	if (!found) {
+		throw ObjectNotFound(bucket, key);
+	}
+}
+
+void
+MemoryObjectStore::put(const std::string& bucket, const std::string& key,
+		const std::string& data)
+{
+	pthread_mutex_lock(&mutex);
+	objects[bucket + "/" + key] = data;
+	pthread_mutex_unlock(&mutex);
+}
+
+void
+MemoryObjectStore::del(const std::string& bucket, const std::string& key)
+{
+	pthread_mutex_lock(&mutex);
+	objects.erase(bucket + "/" + key);
+	pthread_mutex_unlock(&mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+MemoryMetadataStore::MemoryMetadataStore()
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+MemoryMetadataStore::~MemoryMetadataStore()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void
+MemoryMetadataStore::create_domain(const std::string& domain)
+{
+	pthread_mutex_lock(&mutex);
+	domains[domain];
+	pthread_mutex_unlock(&mutex);
+}
+
+void
+MemoryMetadataStore::put_attributes(const std::string& domain,
+		const std::string& item, const Attributes& attrs)
+{
+	pthread_mutex_lock(&mutex);
+	merge_attributes(domains[domain][item], attrs);
+	pthread_mutex_unlock(&mutex);
+}
+
+void
+MemoryMetadataStore::get_attributes(const std::string& domain,
+		const std::string& item, Attributes& attrs)
+{
+	attrs.clear();
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, Domain>::const_iterator d = domains.find(domain);
+	if (d != domains.end()) {
+		Domain::const_iterator it = d->second.find(item);
+		if (it != d->second.end()) {
+			attrs.assign(it->second.begin(), it->second.end());
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool
+MemoryMetadataStore::select_between(const std::string& domain,
+		const std::string& first, const std::string& last, Items& items)
+{
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, Domain>::const_iterator d = domains.find(domain);
+	if (d != domains.end()) {
+		Domain::const_iterator it = d->second.lower_bound(first);
+		Domain::const_iterator end = d->second.upper_bound(last);
+		for (;  it!=end;  ++it) {
+			items.push_back(std::make_pair(it->first,
+					Attributes(it->second.begin(), it->second.end())));
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+bool
+MemoryMetadataStore::select_in(const std::string& domain,
+		const std::vector<std::string>& names, Items& items)
+{
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, Domain>::const_iterator d = domains.find(domain);
+	if (d != domains.end()) {
+		for (size_t i=0;  i<names.size();  ++i) {
+			Domain::const_iterator it = d->second.find(names[i]);
+			if (it != d->second.end()) {
+				items.push_back(std::make_pair(it->first,
+						Attributes(it->second.begin(), it->second.end())));
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+ThrottledObjectStore::ThrottledObjectStore(ObjectStore *store, double latency,
+		double bandwidth)
+  : store(store), latency(latency), bandwidth(bandwidth)
+{
+}
+
+ThrottledObjectStore::~ThrottledObjectStore()
+{
+	delete store;
+}
+
+void
+ThrottledObjectStore::get(const std::string& bucket, const std::string& key,
+		std::string& data)
+{
+	try {
+		store->get(bucket, key, data);
+	} catch (ObjectNotFound& e) {
+		throttle(latency, bandwidth, 0);
+		throw;
+	}
+	throttle(latency, bandwidth, data.size());
+}
+
+void
+ThrottledObjectStore::put(const std::string& bucket, const std::string& key,
+		const std::string& data)
+{
+	throttle(latency, bandwidth, data.size());
+	store->put(bucket, key, data);
+}
+
+void
+ThrottledObjectStore::del(const std::string& bucket, const std::string& key)
+{
+	throttle(latency, bandwidth, 0);
+	store->del(bucket, key);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+ThrottledMetadataStore::ThrottledMetadataStore(MetadataStore *store,
+		double latency, double bandwidth)
+  : store(store), latency(latency), bandwidth(bandwidth)
+{
+}
+
+ThrottledMetadataStore::~ThrottledMetadataStore()
+{
+	delete store;
+}
+
+void
+ThrottledMetadataStore::create_domain(const std::string& domain)
+{
+	throttle(latency, bandwidth, 0);
+	store->create_domain(domain);
+}
+
+void
+ThrottledMetadataStore::put_attributes(const std::string& domain,
+		const std::string& item, const Attributes& attrs)
+{
+	throttle(latency, bandwidth, attributes_size(attrs));
+	store->put_attributes(domain, item, attrs);
+}
+
+void
+ThrottledMetadataStore::get_attributes(const std::string& domain,
+		const std::string& item, Attributes& attrs)
+{
+	store->get_attributes(domain, item, attrs);
+	throttle(latency, bandwidth, attributes_size(attrs));
+}
+
+bool
+ThrottledMetadataStore::select_between(const std::string& domain,
+		const std::string& first, const std::string& last, Items& items)
+{
+	size_t from = items.size();
+	bool selected = store->select_between(domain, first, last, items);
+	throttle(latency, bandwidth, items_size(items, from));
+	return selected;
+}
+
+bool
+ThrottledMetadataStore::select_in(const std::string& domain,
+		const std::vector<std::string>& names, Items& items)
+{
+	size_t from = items.size();
+	bool selected = store->select_in(domain, names, items);
+	throttle(latency, bandwidth, items_size(items, from));
+	return selected;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+TaskQueue::~TaskQueue()
+{
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+SpoolTaskQueue::SpoolTaskQueue(const std::string& dir, double visibility)
+  : dir(dir), visibility(visibility), sequence(0), suffixes(1)
+{
+	const char *subdirs[] = { TASKS_DIR, TAKEN_DIR, RESULTS_DIR, NULL };
+	for (const char **subdir=subdirs;  *subdir!=NULL;  ++subdir) {
+		std::string path(dir + "/" + *subdir);
+		if (!make_dirs(path)) {
+			throw std::runtime_error("could not create " + path);
+		}
+	}
+}
+
+void
+SpoolTaskQueue::put_task(const std::string& body)
+{
+	put(TASKS_DIR, body);
+}
+
+void
+SpoolTaskQueue::listen(const std::string& worker)
+{
+	const std::string suffix("-" + worker);
+	const char *subdirs[] = { TASKS_DIR, TAKEN_DIR, NULL };
+	for (const char **subdir=subdirs;  *subdir!=NULL;  ++subdir) {
+		std::string path(dir + "/" + *subdir + suffix);
+		if (!make_dirs(path)) {
+			throw std::runtime_error("could not create " + path);
+		}
+	}
+	suffixes.insert(suffixes.begin(), suffix);
+}
+
+void
+SpoolTaskQueue::stop()
+{
+	if (suffixes.size() < 2) {
+		return;
+	}
+	std::vector<std::string> names;
+	const char *subdirs[] = { TASKS_DIR, TAKEN_DIR, NULL };
+	for (const char **subdir=subdirs;  *subdir!=NULL;  ++subdir) {
+		std::string path(dir + "/" + *subdir + suffixes[0]);
+		list_files(path, names);
+		for (size_t j=0;  j<names.size();  ++j) {
+			unlink((path + "/" + names[j]).c_str());
+		}
+		rmdir(path.c_str());
+	}
+	suffixes.erase(suffixes.begin());
+}
+
+/* The handle of a task is its path under DIR/taken or DIR/taken-W */
+bool
+SpoolTaskQueue::next_task(std::string& body, std::string& handle,
+		double timeout)
+{
+	long long deadline = now_us() + (long long)(timeout*1000000);
+	std::vector<std::string> names;
+	while (true) {
+		requeue_expired();
+		for (size_t s=0;  s<suffixes.size();  ++s) {
+			std::string tasks(dir + "/" + TASKS_DIR + suffixes[s]);
+			std::string taken(TAKEN_DIR + suffixes[s]);
+			list_files(tasks, names);
+			for (size_t i=0;  i<names.size();  ++i) {
+				// whoever renames it first has it
+				char buf[256];
+				snprintf(buf, sizeof(buf), TAKEN_FORMAT, names[i].c_str(), now_us());
+				std::string path(tasks + "/" + names[i]);
+				std::string takenpath(taken + "/" + buf);
+				if (rename(path.c_str(), (dir + "/" + takenpath).c_str()) == 0
+						&& read_file(dir + "/" + takenpath, body)) {
+					handle = takenpath;
+					return true;
+				}
+			}
+		}
+		if (now_us() >= deadline) {
+			return false;
+		}
+		sleep_ms(SPOOL_POLL*1000);
+	}
+}
+
+void
+SpoolTaskQueue::complete(const std::string& handle, const std::string& result)
+{
+	if (!result.empty()) {
+		put_result(result);
+	}
+	unlink((dir + "/" + handle).c_str());
+}
+
+void
+SpoolTaskQueue::put_result(const std::string& body)
+{
+	put(RESULTS_DIR, body);
+}
+
+bool
+SpoolTaskQueue::get_result(std::string& body)
+{
+	std::vector<std::string> names;
+	list_files(dir + "/" + RESULTS_DIR, names);
+	for (size_t i=0;  i<names.size();  ++i) {
+		std::string path(dir + "/" + RESULTS_DIR + "/" + names[i]);
+		if (read_file(path, body) && unlink(path.c_str()) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+SpoolTaskQueue::put(const char *subdir, const std::string& body)
+{
+	char buf[128];
+	snprintf(buf, sizeof(buf), SPOOL_FORMAT, now_us(), (int)getpid(), sequence++);
+	std::string path(dir + "/" + subdir + "/" + buf);
+	if (!write_file(path, body)) {
+		throw std::runtime_error("could not write " + path);
+	}
+}
+
+/* Tasks taken longer ago than the visibility timeout go back under their
+ * original names, and so to the front of the queue */
+void
+SpoolTaskQueue::requeue_expired()
+{
+	long long expired = now_us() - (long long)(visibility*1000000);
+	std::vector<std::string> names;
+	for (size_t s=0;  s<suffixes.size();  ++s) {
+		std::string taken(dir + "/" + TAKEN_DIR + suffixes[s]);
+		list_files(taken, names);
+		for (size_t i=0;  i<names.size();  ++i) {
+			size_t separator = names[i].rfind(TAKEN_SEPARATOR);
+			if (separator == std::string::npos
+					|| atoll(names[i].c_str() + separator + 1) > expired) {
+				continue;
+			}
+			std::string path(taken + "/" + names[i]);
+			std::string requeued(dir + "/" + TASKS_DIR + suffixes[s] + "/"
+					+ names[i].substr(0, separator));
+			rename(path.c_str(), requeued.c_str());
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
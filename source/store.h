@@ -0,0 +1,342 @@
+/****************************************************************************
+ *
+ * Storage backends for images, features and their metadata, and for
+ * the tasks of distributed runs.
+ *
+ * An ObjectStore holds opaque objects by bucket and key (as S3 does), and
+ * a MetadataStore holds items of named attributes in domains (as SimpleDB
+ * does). Every store is safe to use from any number of threads at once.
+ *
+ * Besides the AWS stores (see aws.h) there are two local backends, for
+ * running without credentials or a network:
+ *
+ * LocalObjectStore keeps each object in DIR/objects/BUCKET/KEY, written
+ * to a temporary file and renamed into place, and LocalMetadataStore
+ * keeps each item in DIR/metadata/DOMAIN/ITEM as "NAME\tVALUE" lines.
+ * Processes sharing a directory see each other's writes, but concurrent
+ * updates of one item from several processes may lose attributes.
+ *
+ * MemoryObjectStore and MemoryMetadataStore keep everything in maps, and
+ * last only as long as the process.
+ *
+ * The throttled stores wrap another store and delay every request by a
+ * fixed latency plus its bytes over a bandwidth, to model a remote store
+ * with local data.
+ *
+ * A TaskQueue carries the tasks of a distributed run to workers and
+ * their results back, as the SQS queues of scheduler.py do. Its local
+ * stand-in, SpoolTaskQueue, is a directory of files.
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_STORE_H
+#define CLOUDVISION_STORE_H
+
+
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <pthread.h>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Thrown by ObjectStore::get for a missing object */
+class ObjectNotFound : public std::runtime_error
+{
+public:
+	ObjectNotFound(const std::string& bucket, const std::string& key)
+	  : std::runtime_error("no object " + bucket + "/" + key) {}
+};
+
+class ObjectStore
+{
+public:
+	virtual ~ObjectStore();
+
+	/* Reads a whole object, throws ObjectNotFound if it does not exist */
+	virtual void get(const std::string& bucket, const std::string& key,
+			std::string& data) = 0;
+
+	/* As get, into a buffer of size bytes (and at least one) from alloc,
+	 * which the caller frees. By default the object is read by get and
+	 * copied into the buffer. */
+	virtual char *get_buffer(const std::string& bucket, const std::string& key,
+			void *(*alloc)(size_t), size_t& size);
+
+	/* Adds or replaces an object */
+	virtual void put(const std::string& bucket, const std::string& key,
+			const std::string& data) = 0;
+
+	/* Removes an object, if it exists */
+	virtual void del(const std::string& bucket, const std::string& key) = 0;
+};
+
+/* Attributes of an item, by name; an item has at most one value per name */
+typedef std::vector< std::pair<std::string, std::string> > Attributes;
+
+/* Items returned by a select, by name */
+typedef std::vector< std::pair<std::string, Attributes> > Items;
+
+class MetadataStore
+{
+public:
+	virtual ~MetadataStore();
+
+	virtual void create_domain(const std::string& domain) = 0;
+
+	/* Sets the given attributes of an item, creating it if needed and
+	 * replacing their previous values */
+	virtual void put_attributes(const std::string& domain,
+			const std::string& item, const Attributes& attrs) = 0;
+
+	/* Reads every attribute of an item, none if it does not exist */
+	virtual void get_attributes(const std::string& domain,
+			const std::string& item, Attributes& attrs) = 0;
+
+	/* Appends the items whose names fall between first and last (as
+	 * strings, inclusive) to items. Returns false if the store rejected
+	 * the request, in which case items may hold some of them. */
+	virtual bool select_between(const std::string& domain,
+			const std::string& first, const std::string& last,
+			Items& items) = 0;
+
+	/* Appends the items among the given names to items, returning false
+	 * as select_between does */
+	virtual bool select_in(const std::string& domain,
+			const std::vector<std::string>& names, Items& items) = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+class LocalObjectStore : public ObjectStore
+{
+public:
+	LocalObjectStore(const std::string& dir);
+
+	virtual void get(const std::string& bucket, const std::string& key,
+			std::string& data);
+	virtual void put(const std::string& bucket, const std::string& key,
+			const std::string& data);
+	virtual void del(const std::string& bucket, const std::string& key);
+
+private:
+	void object_path(const std::string& bucket, const std::string& key,
+			std::string& path) const;
+
+	std::string dir;
+};
+
+class LocalMetadataStore : public MetadataStore
+{
+public:
+	LocalMetadataStore(const std::string& dir);
+	virtual ~LocalMetadataStore();
+
+	virtual void create_domain(const std::string& domain);
+	virtual void put_attributes(const std::string& domain,
+			const std::string& item, const Attributes& attrs);
+	virtual void get_attributes(const std::string& domain,
+			const std::string& item, Attributes& attrs);
+	virtual bool select_between(const std::string& domain,
+			const std::string& first, const std::string& last,
+			Items& items);
+	virtual bool select_in(const std::string& domain,
+			const std::vector<std::string>& names, Items& items);
+
+private:
+	LocalMetadataStore(const LocalMetadataStore&);
+	LocalMetadataStore& operator=(const LocalMetadataStore&);
+
+	std::string domain_path(const std::string& domain) const;
+	bool read_item(const std::string& domain, const std::string& item,
+			Attributes& attrs) const;
+
+	std::string dir;
+	pthread_mutex_t mutex;	// held by put_attributes
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+class MemoryObjectStore : public ObjectStore
+{
+public:
+	MemoryObjectStore();
+	virtual ~MemoryObjectStore();
+
+	virtual void get(const std::string& bucket, const std::string& key,
+			std::string& data);
+	virtual void put(const std::string& bucket, const std::string& key,
+			const std::string& data);
+	virtual void del(const std::string& bucket, const std::string& key);
+
+private:
+	MemoryObjectStore(const MemoryObjectStore&);
+	MemoryObjectStore& operator=(const MemoryObjectStore&);
+
+	pthread_mutex_t mutex;
+	std::map<std::string, std::string> objects;	// by bucket/key
+};
+
+class MemoryMetadataStore : public MetadataStore
+{
+public:
+	MemoryMetadataStore();
+	virtual ~MemoryMetadataStore();
+
+	virtual void create_domain(const std::string& domain);
+	virtual void put_attributes(const std::string& domain,
+			const std::string& item, const Attributes& attrs);
+	virtual void get_attributes(const std::string& domain,
+			const std::string& item, Attributes& attrs);
+	virtual bool select_between(const std::string& domain,
+			const std::string& first, const std::string& last,
+			Items& items);
+	virtual bool select_in(const std::string& domain,
+			const std::vector<std::string>& names, Items& items);
+
+private:
+	typedef std::map<std::string, std::map<std::string, std::string> > Domain;
+
+	MemoryMetadataStore(const MemoryMetadataStore&);
+	MemoryMetadataStore& operator=(const MemoryMetadataStore&);
+
+	pthread_mutex_t mutex;
+	std::map<std::string, Domain> domains;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Delays requests by latency milliseconds each, plus the bytes read or
+ * written at bandwidth megabytes per second (if positive). The wrapped
+ * store is deleted with the throttled one. */
+class ThrottledObjectStore : public ObjectStore
+{
+public:
+	ThrottledObjectStore(ObjectStore *store, double latency, double bandwidth);
+	virtual ~ThrottledObjectStore();
+
+	virtual void get(const std::string& bucket, const std::string& key,
+			std::string& data);
+	virtual void put(const std::string& bucket, const std::string& key,
+			const std::string& data);
+	virtual void del(const std::string& bucket, const std::string& key);
+
+private:
+	ThrottledObjectStore(const ThrottledObjectStore&);
+	ThrottledObjectStore& operator=(const ThrottledObjectStore&);
+
+	ObjectStore *store;
+	double latency;
+	double bandwidth;
+};
+
+class ThrottledMetadataStore : public MetadataStore
+{
+public:
+	ThrottledMetadataStore(MetadataStore *store, double latency, double bandwidth);
+	virtual ~ThrottledMetadataStore();
+
+	virtual void create_domain(const std::string& domain);
+	virtual void put_attributes(const std::string& domain,
+			const std::string& item, const Attributes& attrs);
+	virtual void get_attributes(const std::string& domain,
+			const std::string& item, Attributes& attrs);
+	virtual bool select_between(const std::string& domain,
+			const std::string& first, const std::string& last,
+			Items& items);
+	virtual bool select_in(const std::string& domain,
+			const std::vector<std::string>& names, Items& items);
+
+private:
+	ThrottledMetadataStore(const ThrottledMetadataStore&);
+	ThrottledMetadataStore& operator=(const ThrottledMetadataStore&);
+
+	MetadataStore *store;
+	double latency;
+	double bandwidth;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Tasks and results are opaque bodies (JSON, see worker.h). A queue is
+ * used by one thread at a time, but any number of processes may share
+ * one. */
+class TaskQueue
+{
+public:
+	/* seconds a taken task stays hidden from other workers, as in
+	 * scheduler.py */
+	static const int VISIBILITY = 120;
+
+	virtual ~TaskQueue();
+
+	virtual void put_task(const std::string& body) = 0;
+
+	/* Takes the tasks put for the named worker from now on, ahead of
+	 * those put for any worker */
+	virtual void listen(const std::string& worker) = 0;
+
+	/* Stops taking the tasks put for the worker named to listen, and
+	 * removes its queue with any of them not yet taken. The master gives
+	 * those out again once they are overdue. */
+	virtual void stop() = 0;
+
+	/* Takes the next task, waiting up to timeout seconds for one, and
+	 * returns false if none came. The task is offered again once the
+	 * visibility timeout passes unless it is completed first, so a task
+	 * may run more than once. */
+	virtual bool next_task(std::string& body, std::string& handle,
+			double timeout) = 0;
+
+	/* Removes a task taken by next_task, first posting its result unless
+	 * that is empty */
+	virtual void complete(const std::string& handle, const std::string& result) = 0;
+
+	virtual void put_result(const std::string& body) = 0;
+
+	/* Takes the next result, returns false if there is none */
+	virtual bool get_result(std::string& body) = 0;
+};
+
+/* Keeps each task in DIR/tasks and each result in DIR/results, in files
+ * named to sort in the order they were put. A task is taken by renaming
+ * it into DIR/taken with the time it was taken, and workers rename taken
+ * tasks back once they are older than the visibility timeout. Tasks for
+ * worker W are in DIR/tasks-W and DIR/taken-W. scheduler.py reads and
+ * writes the same layout. */
+class SpoolTaskQueue : public TaskQueue
+{
+public:
+	SpoolTaskQueue(const std::string& dir, double visibility=VISIBILITY);
+
+	virtual void put_task(const std::string& body);
+	virtual void listen(const std::string& worker);
+	virtual void stop();
+	virtual bool next_task(std::string& body, std::string& handle,
+			double timeout);
+	virtual void complete(const std::string& handle, const std::string& result);
+	virtual void put_result(const std::string& body);
+	virtual bool get_result(std::string& body);
+
+private:
+	void put(const char *subdir, const std::string& body);
+	void requeue_expired();
+
+	std::string dir;
+	double visibility;
+	unsigned long sequence;		// of this queue's puts
+	std::vector<std::string> suffixes;	// of the task dirs taken from, in order
+};
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_STORE_H
@@ -0,0 +1,139 @@
+/****************************************************************************
+ ****************************************************************************/
+
+#include "worker.h"
+#include "json.h"
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <stdexcept>
+#include <cstdlib>
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+static const char *REGISTER_TAG = "reg";
+static const char *TASK_TAG = "task";
+
+/* seconds to wait for a task before looking again */
+static const double TASK_WAIT = 1;
+
+/* times a worker runs a task that throws before it reports it failed */
+static const int TASK_ATTEMPTS = 3;
+
+static bool
+task_args(const Json& task, std::vector<std::string>& args);
+
+static std::string
+write_json(const Json& value);
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+int
+run_worker(TaskQueue& queue, const std::string& workerid, TaskRunner runner,
+		void *arg, int ntasks, double idle)
+{
+	queue.listen(workerid);
+	Json registration(Json::OBJECT);
+	registration.set("tag", Json(REGISTER_TAG));
+	registration.set("id", Json(workerid));
+	queue.put_result(write_json(registration));
+	std::cerr << "Worker " << workerid << " registered" << std::endl;
+
+	int taken = 0;
+	double waited = 0;
+	std::map<std::string, int> failures;	// by task
+	while (ntasks <= 0 || taken < ntasks) {
+		std::string body, handle;
+		if (!queue.next_task(body, handle, TASK_WAIT)) {
+			waited += TASK_WAIT;
+			if (idle > 0 && waited >= idle) {
+				break;
+			}
+			continue;
+		}
+		waited = 0;
+		++taken;
+
+		Json task;
+		std::vector<std::string> args;
+		if (!Json::parse(body, task) || !task_args(task, args)) {
+			// no worker could run it, so drop it
+			std::cerr << "Invalid task: " << body << std::endl;
+			queue.complete(handle, "");
+			continue;
+		}
+
+		std::ostringstream outs;
+		int rc;
+		try {
+			rc = runner(args, outs, arg);
+		} catch (std::exception& e) {
+			std::cerr << "Task failed: " << body << ": " << e.what() << std::endl;
+			if (++failures[body] < TASK_ATTEMPTS) {
+				continue;
+			}
+			// give up on it, with the error as its output
+			outs.str(e.what());
+			rc = EXIT_FAILURE;
+		}
+		failures.erase(body);
+
+		std::string output(outs.str());
+		if (!output.empty() && output[output.size() - 1] == '\n') {
+			output.erase(output.size() - 1);
+		}
+		Json result(task);
+		result.set("worker", Json(workerid));
+		result.set("output", Json(output));
+		Json status(Json::NUMBER);
+		std::ostringstream rcs;
+		rcs << rc;
+		status.text = rcs.str();
+		result.set("status", status);
+		queue.complete(handle, write_json(result));
+	}
+	queue.stop();
+	return EXIT_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* The command line COMMAND ARG... START STOP of a task */
+static bool
+task_args(const Json& task, std::vector<std::string>& args)
+{
+	const Json *tag = task.get("tag");
+	const Json *command = task.get("command");
+	const Json *commandargs = task.get("command_args");
+	const Json *chunk = task.get("chunk");
+	if (tag == NULL || tag->text != TASK_TAG
+			|| command == NULL || command->type != Json::STRING
+			|| commandargs == NULL || commandargs->type != Json::ARRAY
+			|| chunk == NULL || chunk->type != Json::ARRAY) {
+		return false;
+	}
+	args.clear();
+	args.push_back(command->text);
+	for (size_t i=0;  i<commandargs->items.size();  ++i) {
+		args.push_back(commandargs->items[i].text);
+	}
+	for (size_t i=0;  i<chunk->items.size();  ++i) {
+		args.push_back(chunk->items[i].text);
+	}
+	return true;
+}
+
+static std::string
+write_json(const Json& value)
+{
+	std::ostringstream outs;
+	value.write(outs);
+	return outs.str();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,55 @@
+/****************************************************************************
+ *
+ * A worker of a distributed run (see cvdb.py), which takes tasks from a
+ * TaskQueue and runs them in process, one after another, so connections
+ * and anything else a command keeps warm serve every task.
+ *
+ * Messages are JSON objects tagged as cvdb.py tags them. A worker first
+ * posts {"tag": "reg", "id": WORKER} as a result, then takes the tasks
+ * the master puts for WORKER (see scheduler.py), and any put for every
+ * worker. A task is
+ *
+ *   {"tag": "task", "id": N, "command": COMMAND,
+ *    "command_args": [ARG, ...], "chunk": [START, STOP]}
+ *
+ * and is run as the command line COMMAND ARG... START STOP. Its result is
+ * the task with "worker" set to WORKER, "output" to what the command
+ * wrote (less the final newline) and "status" to its exit status. Each
+ * result asks the master for more work. A task that fails with an
+ * exception is left on the queue, to be offered again once its
+ * visibility timeout passes, until it has failed three times on one
+ * worker. Then its result has the exception's message as its output and
+ * a status of 1.
+ *
+ ****************************************************************************/
+
+#ifndef CLOUDVISION_WORKER_H
+#define CLOUDVISION_WORKER_H
+
+
+#include "store.h"
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/* Runs the command line of a task, writing its output to outs, and
+ * returns its exit status */
+typedef int (*TaskRunner)(const std::vector<std::string>& args,
+		std::ostream& outs, void *arg);
+
+/* Registers as workerid, then runs tasks until ntasks have been taken
+ * (if positive) or none has come for idle seconds (if positive), and
+ * removes the worker's own queue */
+int
+run_worker(TaskQueue& queue, const std::string& workerid, TaskRunner runner,
+		void *arg, int ntasks=0, double idle=0);
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#endif // CLOUDVISION_WORKER_H
@@ -4,6 +4,7 @@
 #include "yale.h"
 
 #include <cstdio>
+#include <stdexcept>
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -23,10 +24,14 @@ YaleS3Scanner::YaleS3Scanner(const std::string& prefix)
 void
 YaleS3Scanner::open()
 {
-	// open top level info
+	// info files are read whole and scanned from memory, so no response
+	// (nor the connection it reads from) is held between calls to next
 	std::string key(s3prefix);
 	key += "/" + INFO;
-	root = s3connect()->get(CVDB::BUCKET, key);
+	std::string data;
+	get_object(object_store(), CVDB::BUCKET, key, data);
+	root.clear();
+	root.str(data);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -34,16 +39,17 @@ YaleS3Scanner::open()
 bool
 YaleS3Scanner::next(ImageMetadata &meta)
 {
-	GetResponsePtr res;
+	std::string data;
 	std::string filename;
 
 	// Get next info file
 	while (1) {
 		if (sid == -1) {
-			if (root->getInputStream().eof()) {
+			if (root.eof()) {
 				return false;
 			}
-			root->getInputStream() >> filename;
+			filename.clear();
+			root >> filename;
 			if (filename.size() == 0) {
 				return false;
 			}
@@ -55,15 +61,18 @@ YaleS3Scanner::next(ImageMetadata &meta)
 			sscanf(suffix.c_str(), "yaleB%02d_P%02d.info", &sid, &pid);
 			std::string key(s3prefix);
 			key += "/" + filename;
-			info = s3connect()->get(CVDB::BUCKET, key);
+			get_object(object_store(), CVDB::BUCKET, key, data);
+			info.clear();
+			info.str(data);
 
 			// ignore background image
-			info->getInputStream() >> filename;
+			info >> filename;
 		}
 
 		// Get next image from info file
-		if (!info->getInputStream().eof()) {
-			info->getInputStream() >> filename;
+		if (!info.eof()) {
+			filename.clear();
+			info >> filename;
 			if (filename.size() != 0) {
 				// skip any nonexisting files
 				std::string key(s3prefix);
@@ -72,8 +81,8 @@ YaleS3Scanner::next(ImageMetadata &meta)
 				key += "/";
 				key += filename;
 				try {
-					res = s3connect()->get(CVDB::BUCKET, key);
-				} catch (GetException &e) {
+					get_object(object_store(), CVDB::BUCKET, key, data);
+				} catch (ObjectNotFound& e) {
 					continue;
 				}
 
@@ -84,12 +93,17 @@ YaleS3Scanner::next(ImageMetadata &meta)
 		pid = -1;
 	}
 
-	meta.name += cwd + "/" + filename;
+	meta.name = cwd + "/" + filename;
 	meta.subjectid = sid;
 	meta.poseid = pid;
 
 	// read image header for remaining metadata
-	read_header(res->getInputStream(), meta.dimensions, meta.format);
+	size_t offset;
+	int error = parse_header(data.data(), data.size(), meta.dimensions,
+			meta.format, offset);
+	if (error != IMAGE_OK) {
+		throw std::runtime_error(meta.name + ": " + image_error(error));
+	}
 
 	return true;
 }
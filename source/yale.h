@@ -15,6 +15,7 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <sstream>
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -32,8 +33,8 @@ public:
 private:
 	std::string s3prefix;
 	std::string cwd;
-	GetResponsePtr root;
-	GetResponsePtr info;
+	std::istringstream root;
+	std::istringstream info;
 	int sid;
 	int pid;
 };